@@ -0,0 +1,787 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "lpmain.h"
+
+LUNARPROBE_NS_USE
+
+// How the stack is debugged while a workload runs
+enum BenchMode
+{
+    MODE_DETACHED,          // not attached at all
+    MODE_NO_CLIENT,         // attached but no client connected
+    MODE_BREAKPOINTS,       // client connected with line breakpoints
+    MODE_STEPPING,          // client connected and an "until" in progress
+    MODE_SAMPLING,          // sampling profiler by instruction count
+    MODE_TRACING,           // tracing profiler
+    MODE_COVERAGE           // line coverage
+};
+
+// A configuration the workloads are run in
+struct BenchConfig
+{
+    const char *    name;
+    BenchMode       mode;
+    int             breakpoints;
+};
+
+// A function in workloads.lua and the number of iterations it is run with
+struct Workload
+{
+    const char *    name;
+    const char *    function;
+    int             iterations;
+};
+
+// The result of running a workload in a configuration
+struct BenchResult
+{
+    std::string     config;
+    std::string     workload;
+    int             iterations;
+    long long       instructions;
+    long long       events;
+    double          ns;
+    double          nsPerInstruction;
+    double          nsPerEvent;
+    double          overhead;
+
+    // What baselines are compared on - ns per instruction for workloads,
+    // ns per event for getinfo hooks and ns per reply for replies
+    double          nsPerOp;
+};
+
+static const BenchConfig benchConfigs[] =
+{
+    { "detached",           MODE_DETACHED,      0 },
+    { "attached",           MODE_NO_CLIENT,     0 },
+    { "client",             MODE_BREAKPOINTS,   0 },
+    { "client-10bp",        MODE_BREAKPOINTS,   10 },
+    { "client-1000bp",      MODE_BREAKPOINTS,   1000 },
+    { "stepping",           MODE_STEPPING,      0 },
+    { "sampling",           MODE_SAMPLING,      0 },
+    { "tracing",            MODE_TRACING,       0 },
+    { "coverage",           MODE_COVERAGE,      0 },
+};
+
+static const Workload benchWorkloads[] =
+{
+    { "loop",       "bench_loop",       2000000 },
+    { "calls",      "bench_calls",      2000 },
+    { "tables",     "bench_tables",     100000 },
+};
+
+// A reply of the bayeux channel timed while bench_pause is stopped - the
+// command is a format taking the file or the context address
+struct ReplyBench
+{
+    const char *    name;
+    const char *    command;
+    bool            aboutFile;
+    int             count;
+};
+
+static const ReplyBench benchReplies[] =
+{
+    { "file",   "{\"cmd\": \"file\", \"data\": {\"file\": \"%s\"}}",                             true,   50 },
+    { "locals", "{\"cmd\": \"locals\", \"data\": {\"context\": \"%s\"}}",                        false,  5000 },
+    { "local",  "{\"cmd\": \"local\", \"data\": {\"context\": \"%s\", \"lv\": 2, \"nlevels\": 3}}", false,  50 },
+};
+
+// Records in the table of bench_pause and lines in the file replied with
+static const int REPLY_ITEMS    = 2000;
+static const int REPLY_LINES    = 20000;
+
+static const int NUM_CONFIGS    = sizeof(benchConfigs) / sizeof(benchConfigs[0]);
+static const int NUM_WORKLOADS  = sizeof(benchWorkloads) / sizeof(benchWorkloads[0]);
+static const int NUM_REPLIES    = sizeof(benchReplies) / sizeof(benchReplies[0]);
+
+//*****************************************************************************
+/*!
+ *  \class  BenchClientIface
+ *
+ *  \brief  A client interface that counts hook events and whose client
+ *  can be switched on and off.  Nothing is ever sent anywhere.
+ *
+ *****************************************************************************/
+class BenchClientIface : public ClientIface
+{
+public:
+    BenchClientIface() : connected(false), events(0) { }
+
+    virtual bool ClientConnected() { return connected; }
+
+    virtual void HandleDebugHook(LuaStack pStack, LuaDebug pDebug)
+    {
+        events++;
+        ClientIface::HandleDebugHook(pStack, pDebug);
+    }
+
+public:
+    //! Whether a client is pretended to be connected
+    bool        connected;
+
+    //! Hook events seen since last reset
+    long long   events;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  BenchBayeuxIface
+ *
+ *  \brief  A bayeux channel that pretends a client is connected without
+ *  being registered with a bayeux module, so events go nowhere and replies
+ *  are only built.
+ *
+ *****************************************************************************/
+class BenchBayeuxIface : public BayeuxClientIface
+{
+public:
+    BenchBayeuxIface() : BayeuxClientIface("/lunarprobe/bench") { }
+
+    virtual bool ClientConnected() { return true; }
+};
+
+// Number of instructions counted by CountInstruction
+static long long instructionCount = 0;
+
+static void CountInstruction(LuaStack pStack, LuaDebug pDebug)
+{
+    instructionCount++;
+}
+
+// Number of events seen by the getinfo hooks
+static long long hookEvents = 0;
+
+// A hook that fetches nothing - what the other two are measured against
+static void EmptyInfoHook(LuaStack pStack, LuaDebug pDebug)
+{
+    hookEvents++;
+}
+
+// Fetches everything on every event, as HandleDebugHook once did
+static void EagerInfoHook(LuaStack pStack, LuaDebug pDebug)
+{
+    hookEvents++;
+    lua_getinfo(pStack, "nSluf", pDebug);
+    lua_pop(pStack, 1);
+}
+
+// Fetches only what HandleDebugHook needs of each event before a stop
+static void LazyInfoHook(LuaStack pStack, LuaDebug pDebug)
+{
+    hookEvents++;
+    switch (pDebug->event)
+    {
+        case LUA_HOOKLINE:  lua_getinfo(pStack, "Sl", pDebug); break ;
+        case LUA_HOOKCALL:
+        case LUA_HOOKRET:   lua_getinfo(pStack, "S", pDebug); break ;
+        default: break ;
+    }
+}
+
+// A hook timed by RunGetinfo
+struct InfoHookBench
+{
+    const char *    name;
+    lua_Hook        hook;
+};
+
+static const InfoHookBench benchInfoHooks[] =
+{
+    { "empty",  EmptyInfoHook },
+    { "eager",  EagerInfoHook },
+    { "lazy",   LazyInfoHook },
+};
+
+static const int NUM_INFO_HOOKS = sizeof(benchInfoHooks) / sizeof(benchInfoHooks[0]);
+
+// Monotonic time in nano seconds
+static double NowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Runs a workload function with an iteration count
+static bool RunWorkload(LuaStack pStack, const Workload &workload, int iterations)
+{
+    lua_getglobal(pStack, workload.function);
+    lua_pushinteger(pStack, iterations);
+    if (lua_pcall(pStack, 1, 1, 0) != 0)
+    {
+        fprintf(stderr, "\n%s failed: %s\n", workload.function, lua_tostring(pStack, -1));
+        lua_pop(pStack, 1);
+        return false;
+    }
+    lua_pop(pStack, 1);
+    return true;
+}
+
+// Creates a stack with the workloads loaded
+static LuaStack NewWorkloadStack(const char *workloadsPath)
+{
+    LuaStack pStack = LuaUtils::NewLuaStack(true, false, "bench");
+    if (LuaUtils::RunLuaScript(pStack, workloadsPath) != 0)
+    {
+        lua_close(pStack);
+        return NULL;
+    }
+    return pStack;
+}
+
+// Counts the VM instructions of each workload on a stack of its own
+static bool CountInstructions(const char *workloadsPath, double scale, std::vector<long long> &instructions)
+{
+    LuaStack pStack = NewWorkloadStack(workloadsPath);
+    if (pStack == NULL)
+        return false;
+
+    lua_sethook(pStack, CountInstruction, LUA_MASKCOUNT, 1);
+    for (int i = 0;i < NUM_WORKLOADS;i++)
+    {
+        instructionCount = 0;
+        if (!RunWorkload(pStack, benchWorkloads[i], (int)(benchWorkloads[i].iterations * scale)))
+        {
+            lua_close(pStack);
+            return false;
+        }
+        instructions.push_back(instructionCount);
+    }
+    lua_sethook(pStack, NULL, 0, 0);
+    lua_close(pStack);
+    return true;
+}
+
+// Times the calls workload under a raw hook that fetches the debug info
+// eagerly ("nSluf") and one that fetches it lazily, so the saving per
+// event is seen apart from the rest of the debugger
+static bool RunGetinfo(const char *workloadsPath, double scale, int repeats, std::vector<BenchResult> &results)
+{
+    LuaStack pStack = NewWorkloadStack(workloadsPath);
+    if (pStack == NULL)
+        return false;
+
+    const Workload &workload    = benchWorkloads[1];
+    int             iterations  = (int)(workload.iterations * scale);
+    double          emptyNs     = 0;
+
+    printf("\n%-16s %-8s %14s %10s\n", "getinfo", "hook", "events", "ns/event");
+    for (int h = 0;h < NUM_INFO_HOOKS;h++)
+    {
+        lua_sethook(pStack, benchInfoHooks[h].hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 0);
+        RunWorkload(pStack, workload, iterations);
+
+        std::vector<double> times;
+        for (int r = 0;r < repeats;r++)
+        {
+            lua_gc(pStack, LUA_GCCOLLECT, 0);
+            hookEvents = 0;
+
+            double start = NowNs();
+            RunWorkload(pStack, workload, iterations);
+            times.push_back(NowNs() - start);
+        }
+        lua_sethook(pStack, NULL, 0, 0);
+        std::sort(times.begin(), times.end());
+
+        BenchResult result;
+        result.config           = "getinfo";
+        result.workload         = benchInfoHooks[h].name;
+        result.iterations       = iterations;
+        result.instructions     = 0;
+        result.events           = hookEvents;
+        result.ns               = times[times.size() / 2];
+        result.nsPerInstruction = 0;
+        if (h == 0)
+            emptyNs = result.ns;
+        result.nsPerEvent       = (result.ns - emptyNs) / std::max(1LL, result.events);
+        result.overhead         = emptyNs > 0 ? result.ns / emptyNs : 1;
+        result.nsPerOp          = result.ns / std::max(1LL, result.events);
+        results.push_back(result);
+
+        printf("%-16s %-8s %14lld %10.2f\n", result.config.c_str(), result.workload.c_str(),
+               result.events, result.nsPerEvent);
+    }
+
+    lua_close(pStack);
+    return true;
+}
+
+// Runs bench_pause on a thread of its own (it stops at its breakpoint)
+static void *RunPausedWorkload(void *pStack)
+{
+    static const Workload pause = { "pause", "bench_pause", REPLY_ITEMS };
+    RunWorkload((LuaStack)pStack, pause, pause.iterations);
+    return NULL;
+}
+
+// Parses a message the way the bayeux module would
+static JsonNodePtr ParseJson(const std::string &text)
+{
+    DefaultJsonInputStream<std::string::const_iterator> instream(text.begin(), text.end());
+    DefaultJsonBuilder jbuilder;
+    return jbuilder.Build(&instream);
+}
+
+// Writes a file of REPLY_LINES lines for the file reply
+static bool WriteReplyFile(char *path)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+
+    FILE *output = fdopen(fd, "w");
+    for (int i = 1;i <= REPLY_LINES;i++)
+        fprintf(output, "local line%d = \"the quick brown fox jumps over the lazy dog\" -- %d\n", i, i);
+    fclose(output);
+    return true;
+}
+
+// Times the replies of the bayeux channel while bench_pause is stopped at
+// its "bench:pause" line
+static bool RunReplies(const char *workloadsPath, int pauseLine, int repeats, std::vector<BenchResult> &results)
+{
+    char filePath[] = "/tmp/lpbench.XXXXXX";
+    if (!WriteReplyFile(filePath))
+    {
+        fprintf(stderr, "\nCannot write the reply file\n\n");
+        return false;
+    }
+
+    BenchBayeuxIface *pIface = new BenchBayeuxIface();
+    LunarProbe::GetInstance()->SetClientIface(pIface);
+
+    LuaStack pStack = NewWorkloadStack(workloadsPath);
+    if (pStack == NULL)
+        return false;
+
+    LunarProbe::GetInstance()->Attach(pStack, "replies");
+    DebugContext *pContext = pIface->GetDebugContext(pStack);
+    pIface->GetBreakpoints().SetLineBreakpoint(pIface->GetSources().GetFileId(workloadsPath), pauseLine);
+    LunarProbe::GetInstance()->UpdateHook(pStack);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, RunPausedWorkload, pStack);
+    for (int waited = 0;pContext->running && waited < 10000;waited++)
+        usleep(1000);
+
+    bool paused = !pContext->running;
+    if (!paused)
+        fprintf(stderr, "\nbench_pause did not stop at line %d\n\n", pauseLine);
+
+    char address[32];
+    snprintf(address, sizeof(address), "%p", pContext);
+
+    printf("\n%-16s %-8s %14s %14s\n", "channel", "reply", "replies", "ns/reply");
+    for (int i = 0;paused && i < NUM_REPLIES;i++)
+    {
+        const ReplyBench &reply = benchReplies[i];
+        char command[1024];
+        snprintf(command, sizeof(command), reply.command, reply.aboutFile ? filePath : address);
+        JsonNodePtr event = ParseJson(std::string("{\"command\": ") + command + "}");
+        JsonNodePtr output;
+
+        pIface->HandleEvent(event, output);
+
+        std::vector<double> times;
+        for (int r = 0;r < repeats;r++)
+        {
+            double start = NowNs();
+            for (int n = 0;n < reply.count;n++)
+                pIface->HandleEvent(event, output);
+            times.push_back(NowNs() - start);
+        }
+        std::sort(times.begin(), times.end());
+
+        BenchResult result;
+        result.config           = "bayeux";
+        result.workload         = reply.name;
+        result.iterations       = reply.count;
+        result.instructions     = 0;
+        result.events           = reply.count;
+        result.ns               = times[times.size() / 2];
+        result.nsPerInstruction = 0;
+        result.nsPerEvent       = result.ns / reply.count;
+        result.overhead         = 1;
+        result.nsPerOp          = result.nsPerEvent;
+        results.push_back(result);
+
+        printf("%-16s %-8s %14d %14.0f\n", result.config.c_str(), result.workload.c_str(),
+               reply.count, result.nsPerEvent);
+    }
+
+    if (paused)
+    {
+        char command[256];
+        snprintf(command, sizeof(command), "{\"command\": {\"cmd\": \"continue\", \"data\": {\"context\": \"%s\"}}}", address);
+        JsonNodePtr output;
+        pIface->HandleEvent(ParseJson(command), output);
+    }
+    else
+    {
+        pContext->Resume();
+    }
+    pthread_join(thread, NULL);
+
+    pIface->GetBreakpoints().Clear();
+    LunarProbe::GetInstance()->Detach(pStack);
+    lua_close(pStack);
+    unlink(filePath);
+    return paused;
+}
+
+// Gets the first line of a file containing a marker
+static int FindMarkedLine(const char *path, const char *marker, int &numLines)
+{
+    std::ifstream input(path);
+    std::string line;
+    int found = -1;
+    for (numLines = 0;std::getline(input, line);)
+    {
+        numLines++;
+        if (found < 0 && line.find(marker) != std::string::npos)
+            found = numLines;
+    }
+    return found;
+}
+
+// Sets up the debug state a configuration runs in
+static void SetupConfig(BenchClientIface *pIface, LuaStack pStack, const BenchConfig &config,
+                        int fileId, int deadLine, int numLines)
+{
+    if (config.mode == MODE_DETACHED)
+        return ;
+
+    pIface->connected = config.mode == MODE_BREAKPOINTS || config.mode == MODE_STEPPING;
+    LunarProbe::GetInstance()->Attach(pStack, "bench");
+
+    DebugContext *pContext = pIface->GetDebugContext(pStack);
+    switch (config.mode)
+    {
+        case MODE_BREAKPOINTS:
+        {
+            // the first breakpoint keeps the gate of bench_loop open, the
+            // rest are past the end of the file so never checked on a line
+            for (int i = 0;i < config.breakpoints;i++)
+                pIface->GetBreakpoints().SetLineBreakpoint(fileId, i == 0 ? deadLine : numLines + i);
+        } break ;
+        case MODE_STEPPING:
+        {
+            // an "until" a line that never runs gets every line event
+            // without ever stopping
+            pContext->SetStepMode(STEP_UNTIL, -1, -1);
+        } break ;
+        case MODE_SAMPLING:
+            pIface->StartSampling(pContext, SAMPLE_BY_COUNT, 0); break ;
+        case MODE_TRACING:
+            pIface->StartTracing(pContext); break ;
+        case MODE_COVERAGE:
+            pIface->StartCoverage(pContext); break ;
+        default: break ;
+    }
+
+    LunarProbe::GetInstance()->UpdateHook(pStack);
+}
+
+// Undoes SetupConfig
+static void TeardownConfig(BenchClientIface *pIface, LuaStack pStack, const BenchConfig &config)
+{
+    if (config.mode == MODE_DETACHED)
+        return ;
+
+    DebugContext *pContext = pIface->GetDebugContext(pStack);
+    switch (config.mode)
+    {
+        case MODE_BREAKPOINTS:  pIface->GetBreakpoints().Clear(); break ;
+        case MODE_STEPPING:     pContext->SetStepMode(STEP_NONE); break ;
+        case MODE_SAMPLING:     pIface->StopSampling(pContext); break ;
+        case MODE_TRACING:      pIface->StopTracing(pContext); break ;
+        case MODE_COVERAGE:     pIface->StopCoverage(pContext); break ;
+        default: break ;
+    }
+
+    LunarProbe::GetInstance()->Detach(pStack);
+    pIface->connected = false;
+}
+
+// Writes the results as json - one result per line so baselines can be
+// diffed and read back by ReadBaseline
+static void WriteJson(std::ostream &output, const std::vector<BenchResult> &results, double scale, int repeats)
+{
+    output << "{\"scale\": " << scale << ", \"repeats\": " << repeats << ", \"results\": [\n";
+    for (unsigned i = 0;i < results.size();i++)
+    {
+        const BenchResult &result = results[i];
+        output << "  {\"config\": \"" << result.config << "\", \"workload\": \"" << result.workload
+               << "\", \"iterations\": " << result.iterations
+               << ", \"instructions\": " << result.instructions
+               << ", \"events\": " << result.events
+               << ", \"ns\": " << (long long)result.ns
+               << ", \"ns_per_instruction\": " << result.nsPerInstruction
+               << ", \"ns_per_event\": " << result.nsPerEvent
+               << ", \"overhead\": " << result.overhead
+               << ", \"ns_per_op\": " << result.nsPerOp << "}"
+               << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    output << "]}\n";
+}
+
+// Gets the string value of a key in a line written by WriteJson
+static std::string JsonString(const std::string &line, const char *key)
+{
+    std::string quoted = std::string("\"") + key + "\": \"";
+    size_t start = line.find(quoted);
+    if (start == std::string::npos)
+        return "";
+    start += quoted.size();
+    return line.substr(start, line.find('"', start) - start);
+}
+
+// Gets the numeric value of a key in a line written by WriteJson
+static double JsonNumber(const std::string &line, const char *key)
+{
+    std::string quoted = std::string("\"") + key + "\": ";
+    size_t start = line.find(quoted);
+    return start == std::string::npos ? -1 : atof(line.c_str() + start + quoted.size());
+}
+
+// Reads the ns per op of each config/workload of a baseline (baselines
+// written before ns_per_op have ns_per_instruction for workloads only)
+static bool ReadBaseline(const char *path, std::map<std::string, double> &baseline)
+{
+    std::ifstream input(path);
+    if (!input)
+        return false;
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        std::string config = JsonString(line, "config");
+        if (config.empty())
+            continue ;
+
+        double nsPerOp = JsonNumber(line, "ns_per_op");
+        if (nsPerOp < 0)
+            nsPerOp = JsonNumber(line, "ns_per_instruction");
+        baseline[config + "/" + JsonString(line, "workload")] = nsPerOp;
+    }
+    return true;
+}
+
+void prog_usage()
+{
+    puts("\nUsage: lpbench options");
+    puts("    Options: \n");
+    puts("      -l | --lua          -   Load the lua files from a folder instead of the ones built into the library.");
+    puts("      -w | --workloads    -   The workloads file.  Default: ./bench/workloads.lua");
+    puts("      -r | --repeats      -   Timed runs of each workload (the median is reported).  Default: 5");
+    puts("      -x | --scale        -   Multiplies the iterations of each workload.  Default: 1");
+    puts("      -j | --json         -   Writes the results as json to a file.");
+    puts("      -b | --baseline     -   Compares ns per instruction (per event for getinfo hooks, per reply");
+    puts("                              for replies) against a json file written earlier.  Skipped if the");
+    puts("                              file does not exist.");
+    puts("      -t | --threshold    -   Fails if any result is slower than the baseline by more than this");
+    puts("                              percentage.  Default: 0 (only report)");
+    puts("");
+}
+
+int main(int argc, char *argv[])
+{
+    char pathBuff[1024];
+    const char *luaPath         = NULL;
+    const char *workloadsPath   = "./bench/workloads.lua";
+    const char *jsonPath        = NULL;
+    const char *baselinePath    = NULL;
+    int         repeats         = 5;
+    double      scale           = 1;
+    double      threshold       = 0;
+
+    for (int argCounter = 1;argCounter < argc;argCounter++)
+    {
+        const char *arg = argv[argCounter];
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-help") == 0 || strcmp(arg, "-h") == 0)
+        {
+            prog_usage();
+            return 0;
+        }
+        else if (argCounter + 1 >= argc)
+        {
+            prog_usage();
+            return 1;
+        }
+        else if (strcmp(arg, "--lua") == 0 || strcmp(arg, "-l") == 0)
+            luaPath = argv[++argCounter];
+        else if (strcmp(arg, "--workloads") == 0 || strcmp(arg, "-w") == 0)
+            workloadsPath = argv[++argCounter];
+        else if (strcmp(arg, "--repeats") == 0 || strcmp(arg, "-r") == 0)
+            repeats = std::max(1, atoi(argv[++argCounter]));
+        else if (strcmp(arg, "--scale") == 0 || strcmp(arg, "-x") == 0)
+            scale = atof(argv[++argCounter]);
+        else if (strcmp(arg, "--json") == 0 || strcmp(arg, "-j") == 0)
+            jsonPath = argv[++argCounter];
+        else if (strcmp(arg, "--baseline") == 0 || strcmp(arg, "-b") == 0)
+            baselinePath = argv[++argCounter];
+        else if (strcmp(arg, "--threshold") == 0 || strcmp(arg, "-t") == 0)
+            threshold = atof(argv[++argCounter]);
+        else
+        {
+            prog_usage();
+            return 1;
+        }
+    }
+
+    if (scale <= 0)
+    {
+        prog_usage();
+        return 1;
+    }
+
+    if (luaPath != NULL)
+        LuaBindings::LUA_SRC_LOCATION = realpath(luaPath, pathBuff);
+
+    BenchClientIface *pIface = new BenchClientIface();
+    LunarProbe::GetInstance()->SetClientIface(pIface);
+
+    int numLines = 0;
+    int deadLine = FindMarkedLine(workloadsPath, "bench:dead", numLines);
+    if (deadLine < 0)
+    {
+        fprintf(stderr, "\nNo 'bench:dead' line in %s\n\n", workloadsPath);
+        return 1;
+    }
+
+    std::vector<long long> instructions;
+    if (!CountInstructions(workloadsPath, scale, instructions))
+        return 1;
+
+    LuaStack pStack = NewWorkloadStack(workloadsPath);
+    if (pStack == NULL)
+        return 1;
+    int fileId = pIface->GetSources().GetFileId(workloadsPath);
+
+    std::vector<BenchResult> results;
+    std::vector<double> detachedNs(NUM_WORKLOADS, 0);
+
+    printf("%-16s %-8s %14s %14s %10s %10s %9s\n",
+           "config", "workload", "instructions", "events", "ns/instr", "ns/event", "overhead");
+    for (int c = 0;c < NUM_CONFIGS;c++)
+    {
+        const BenchConfig &config = benchConfigs[c];
+        SetupConfig(pIface, pStack, config, fileId, deadLine, numLines);
+
+        for (int w = 0;w < NUM_WORKLOADS;w++)
+        {
+            const Workload &workload = benchWorkloads[w];
+            int iterations = (int)(workload.iterations * scale);
+
+            // one untimed run so lazily built state (source ids, gate
+            // caches, coverage bitmaps) does not count against any repeat
+            RunWorkload(pStack, workload, iterations);
+
+            std::vector<double> times;
+            long long events = 0;
+            for (int r = 0;r < repeats;r++)
+            {
+                lua_gc(pStack, LUA_GCCOLLECT, 0);
+                pIface->events = 0;
+
+                double start = NowNs();
+                RunWorkload(pStack, workload, iterations);
+                times.push_back(NowNs() - start);
+                events = pIface->events;
+            }
+            std::sort(times.begin(), times.end());
+
+            BenchResult result;
+            result.config           = config.name;
+            result.workload         = workload.name;
+            result.iterations       = iterations;
+            result.instructions     = instructions[w];
+            result.events           = events;
+            result.ns               = times[times.size() / 2];
+            result.nsPerInstruction = result.ns / std::max(1LL, result.instructions);
+            if (config.mode == MODE_DETACHED)
+                detachedNs[w] = result.ns;
+            result.nsPerEvent       = events > 0 ? (result.ns - detachedNs[w]) / events : 0;
+            result.overhead         = detachedNs[w] > 0 ? result.ns / detachedNs[w] : 1;
+            result.nsPerOp          = result.nsPerInstruction;
+            results.push_back(result);
+
+            printf("%-16s %-8s %14lld %14lld %10.3f %10.2f %8.2fx\n",
+                   result.config.c_str(), result.workload.c_str(), result.instructions,
+                   result.events, result.nsPerInstruction, result.nsPerEvent, result.overhead);
+        }
+
+        TeardownConfig(pIface, pStack, config);
+    }
+
+    lua_close(pStack);
+
+    if (!RunGetinfo(workloadsPath, scale, repeats, results))
+        return 1;
+
+    int pauseLine = FindMarkedLine(workloadsPath, "bench:pause", numLines);
+    if (pauseLine < 0)
+    {
+        fprintf(stderr, "\nNo 'bench:pause' line in %s\n\n", workloadsPath);
+        return 1;
+    }
+
+    if (!RunReplies(workloadsPath, pauseLine, repeats, results))
+        return 1;
+
+    if (jsonPath != NULL)
+    {
+        std::ofstream output(jsonPath);
+        if (!output)
+        {
+            fprintf(stderr, "\nCannot write to: %s\n\n", jsonPath);
+            return 1;
+        }
+        WriteJson(output, results, scale, repeats);
+    }
+
+    int exitCode = 0;
+    if (baselinePath != NULL)
+    {
+        std::map<std::string, double> baseline;
+        if (!ReadBaseline(baselinePath, baseline))
+        {
+            // baselines are per machine so none may have been written yet
+            printf("\nNo baseline at %s - comparison skipped (make baseline writes one)\n", baselinePath);
+            return exitCode;
+        }
+
+        printf("\n%-16s %-8s %12s %12s %9s\n", "config", "workload", "baseline", "now", "change");
+        printf("(ns per instruction, per getinfo hook event or per reply)\n");
+        for (unsigned i = 0;i < results.size();i++)
+        {
+            const BenchResult &result = results[i];
+            std::map<std::string, double>::iterator iter = baseline.find(result.config + "/" + result.workload);
+            if (iter == baseline.end() || iter->second <= 0)
+                continue ;
+
+            double change = (result.nsPerOp / iter->second - 1) * 100;
+            bool regressed = threshold > 0 && change > threshold;
+            printf("%-16s %-8s %12.3f %12.3f %+8.1f%%%s\n",
+                   result.config.c_str(), result.workload.c_str(), iter->second,
+                   result.nsPerOp, change, regressed ? "  <== regression" : "");
+            if (regressed)
+                exitCode = 2;
+        }
+    }
+
+    return exitCode;
+}
@@ -0,0 +1,65 @@
+
+--[[------------------------------------------------------------------------------
+    Workloads run by the hook overhead benchmark (see bench.cpp).
+
+    Each workload is a global function taking an iteration count.  The
+    line marked "bench:dead" never runs - the benchmark puts its first
+    breakpoint there so that the line gate of the hot functions is open
+    without the debugger ever stopping.
+
+    bench_pause is not timed itself - it stops at the line marked
+    "bench:pause" so that replies about its locals can be timed.
+--------------------------------------------------------------------------------]]
+
+-- Straight line arithmetic in a loop - mostly line events
+function bench_loop(n)
+    local total = 0
+    for i = 1, n do
+        local x = i * 3
+        local y = x % 7
+        if y < 0 then
+            total = -total      -- bench:dead
+        end
+        total = total + x - y
+    end
+    return total
+end
+
+local function fib(n)
+    if n < 2 then
+        return n
+    end
+    return fib(n - 1) + fib(n - 2)
+end
+
+-- Small recursive calls - mostly call and return events
+function bench_calls(n)
+    local total = 0
+    for i = 1, n do
+        total = total + fib(12)
+    end
+    return total
+end
+
+-- Table and string churn - allocations and C calls
+function bench_tables(n)
+    local total = 0
+    for i = 1, n do
+        local t = {}
+        for j = 1, 16 do
+            t[#t + 1] = j
+        end
+        local s = table.concat(t, ",")
+        total = total + #s
+    end
+    return total
+end
+
+-- A large table of small records - stopped at by the reply benchmark
+function bench_pause(n)
+    local items = {}
+    for i = 1, n do
+        items[i] = {id = i, name = "item " .. i, tags = {"red", "green", i % 7}}
+    end
+    return #items       -- bench:pause
+end
@@ -71,6 +71,30 @@ Breakpoint = {
     funcname    = nil,
     linenum     = -1,
     enabled     = true,
+
+    -- expression that must be true for a line breakpoint to stop -
+    -- evaluated natively in the frame that hits it (a condition that does
+    -- not compile or raises an error stops and is reported in a
+    -- "ConditionError" event)
+    condition   = nil,
+
+    -- which hits stop: nil/"always", "equals" (the hitcount-th hit only),
+    -- "multiple" (every hitcount-th hit) or "after" (every hit once
+    -- hitcount hits have been ignored) - counted natively
+    hitmode     = nil,
+    hitcount    = 0,
+
+    -- hits so far (as of the last Debugger:RefreshHits)
+    hits        = 0,
+
+    -- message logged instead of stopping a line breakpoint - "{expr}" is
+    -- replaced by the value of expr and the messages reach the client in
+    -- batched "LogMessages" events
+    logmessage  = nil,
+
+    -- take a snapshot of the frames and variables (see "snapshots")
+    -- instead of stopping at a line
+    snapshot    = false,
 }
 
 --[[------------------------------------------------------------------------------
@@ -122,6 +146,10 @@ Debugger = {
     -- The contexts that will be passed down to us.
     contexts        = {},
 
+    -- The same contexts keyed by their cpp context (so the hook can find
+    -- them without building the address string)
+    contextsByPtr   = {},
+
     -- All breakpoints by name
     bpsByName       = {},
 
@@ -181,6 +209,15 @@ end
 --------------------------------------------------------------------------------]]
 function DebugContext:SetLastCommand(cmd_type, cmd_data)
     self.lastCommand = {["type"] = cmd_type, ["data"] = cmd_data}
+
+    -- let the cpp hook know which events can cause a stop
+    local line = nil
+    local file = nil
+    if cmd_data ~= nil then
+        line = cmd_data["line"]
+        file = cmd_data["file"]
+    end
+    DebugLib.SetLastCommand(self.cppContext, cmd_type, line, file)
 end
 
 --[[------------------------------------------------------------------------------
@@ -265,6 +302,46 @@ function DebugContext:GetUpValue(funcindex, uvindex, nlevels, frame)
     return DebugLib.GetUpValue(self.cppContext, funcindex, uvindex, nlevels, frame)
 end
 
+--[[------------------------------------------------------------------------------
+    \brief  The location table reused by each context (kept out of the
+    context itself so it is not sent along with it).
+--------------------------------------------------------------------------------]]
+local pausedLocations = setmetatable({}, {__mode = "k"})
+
+--[[------------------------------------------------------------------------------
+    \brief  Sets where the context has stopped from a hook event.
+
+    The location table of the context is reused so a stop only copies the
+    fields of the event.
+
+    \param  event   -   The event passed to HandleBreakpoint.
+--------------------------------------------------------------------------------]]
+function DebugContext:SetLocation(event)
+    local location = pausedLocations[self]
+    if location == nil then
+        location = {}
+        pausedLocations[self] = location
+    end
+
+    location["event"]           = event.event
+    location["name"]            = event.name
+    location["namewhat"]        = event.namewhat
+    location["what"]            = event.what
+    location["source"]          = event.source
+    location["currentline"]     = event.currentline
+    location["nups"]            = event.nups
+    location["linedefined"]     = event.linedefined
+    location["lastlinedefined"] = event.lastlinedefined
+
+    if event.watch > 0 then
+        location["watch"] = event.watch
+    else
+        location["watch"] = nil
+    end
+
+    self.location = location
+end
+
 --[[------------------------------------------------------------------------------
     \brief  Clears the last command.
 
@@ -274,6 +351,7 @@ end
 --------------------------------------------------------------------------------]]
 function DebugContext:ClearLastCommand()
     self.lastCommand = nil
+    DebugLib.SetLastCommand(self.cppContext, nil)
 end
 
 --[[------------------------------------------------------------------------------
@@ -301,6 +379,8 @@ function Debugger:New(cppDebugger)
     o.commandHandlers["breaks"]     = MsgFunc_GetBPs
     o.commandHandlers["clear"]      = MsgFunc_ClearBP
     o.commandHandlers["clearall"]   = MsgFunc_ClearBPs
+    o.commandHandlers["snapshots"]  = MsgFunc_Snapshots
+    o.commandHandlers["watch"]      = MsgFunc_Watch
 
     -- flow related messages
     o.commandHandlers["step"]       = MsgFunc_Step
@@ -323,6 +403,13 @@ function Debugger:New(cppDebugger)
     o.commandHandlers["file"]       = MsgFunc_File
     o.commandHandlers["files"]      = MsgFunc_Files
 
+    -- profiling related messages
+    o.commandHandlers["profile"]    = MsgFunc_Profile
+    o.commandHandlers["trace"]      = MsgFunc_Trace
+    o.commandHandlers["coverage"]   = MsgFunc_Coverage
+    o.commandHandlers["allocs"]     = MsgFunc_Allocs
+    o.commandHandlers["gc"]         = MsgFunc_Gc
+
     return o
 end
 
@@ -340,7 +427,8 @@ function Debugger:RemoveDebugContext(context)
     local dbgContext    = self.contexts[addr_str]
 
     if dbgContext ~= nil then
-        table.remove(self.contexts, addr_str)
+        self.contexts[addr_str] = nil
+        self.contextsByPtr[context] = nil
     end
 
     return dbgContext
@@ -364,6 +452,11 @@ function Debugger:GetDebugContext(context, name)
         self.contexts[addr_str] = dbgContext
     end
 
+    -- messages look contexts up by their address string
+    if type(context) == "userdata" then
+        self.contextsByPtr[context] = dbgContext
+    end
+
     return dbgContext
 end
 
@@ -381,7 +474,8 @@ function Debugger:RemoveDebugContext(context)
     local dbgContext    = self.contexts[addr_str]
 
     if dbgContext ~= nil then
-        table.remove(self.contexts, addr_str)
+        self.contexts[addr_str] = nil
+        self.contextsByPtr[context] = nil
     end
 
     return dbgContext
@@ -398,7 +492,6 @@ end
             - Initial version
 --------------------------------------------------------------------------------]]
 function Debugger:SendMessage(msg)
-    print("Sending Message: " .. msg)
     DebugLib.WriteString(self.cppDebugger, msg)
 end
 
@@ -413,9 +506,9 @@ end
             - Initial version
 --------------------------------------------------------------------------------]]
 function Debugger:SendEvent(evt_name, evt_data)
-    self:SendMessage(Json.Encode({["type"]      = "Event",
-                                  ["event"]     = evt_name,
-                                  ["data"]      = evt_data}))
+    self:SendMessage(DebugLib.EncodeJson({["type"]      = "Event",
+                                          ["event"]     = evt_name,
+                                          ["data"]      = evt_data}))
 end
 
 --[[------------------------------------------------------------------------------
@@ -431,10 +524,10 @@ end
             - Initial version
 --------------------------------------------------------------------------------]]
 function Debugger:SendReply(code, value, original_message)
-    self:SendMessage(Json.Encode({["type"]      = "Reply",
-                                  ["code"]        = code,
-                                  ["value"]       = value,
-                                  ["original"]    = original_message}))
+    self:SendMessage(DebugLib.EncodeJson({["type"]      = "Reply",
+                                          ["code"]        = code,
+                                          ["value"]       = value,
+                                          ["original"]    = original_message}))
 end
 
 --[[------------------------------------------------------------------------------
@@ -485,7 +578,7 @@ end
             - Initial version
 --------------------------------------------------------------------------------]]
 function Debugger:GetBPByFile(filename, linenum)
-    return self.bpsByName[bpToString(filename, linenum)]
+    return self.bpsByName[bpToString(DebugLib.NormalizePath(filename), linenum)]
 end
 
 --[[------------------------------------------------------------------------------
@@ -518,12 +611,14 @@ end
     \brief  Sets a BP at a given function
 
     \param  funcname    -   Name of the function where the BP is to be set.
+    \param  hitmode     -   Which hits stop (see Breakpoint.hitmode).
+    \param  hitcount    -   The N of hitmode.
 
     \version
             S Panyam 07/Nov/08
             - Initial version
 --------------------------------------------------------------------------------]]
-function Debugger:SetBPAtFunction(funcname)
+function Debugger:SetBPAtFunction(funcname, hitmode, hitcount)
     local bp = self:GetBPByFunction(funcname)
     
     if bp == nil then
@@ -532,6 +627,10 @@ function Debugger:SetBPAtFunction(funcname)
         self.bpsByName[funcname] = bp
         table.insert(self.bpsByIndex, bp)
     end
+
+    bp.hitmode  = hitmode
+    bp.hitcount = hitcount or 0
+    DebugLib.SetBreakpoint(self.cppDebugger, nil, nil, funcname, nil, hitmode, bp.hitcount)
         
     return bp
 end
@@ -541,12 +640,20 @@ end
 
     \param  filename    -   Name of the file where the BP is to be set.
     \param  linenum     -   Line on which the BP is to be set.
+    \param  condition   -   Expression that must be true to stop (or nil to
+                            always stop).  Replaces the condition of an
+                            existing BP.
+    \param  hitmode     -   Which hits stop (see Breakpoint.hitmode).
+    \param  hitcount    -   The N of hitmode.
+    \param  logmessage  -   Message to log instead of stopping (or nil to
+                            stop) - see Breakpoint.logmessage.
+    \param  snapshot    -   true to take a snapshot instead of stopping.
 
     \version
             S Panyam 07/Nov/08
             - Initial version
 --------------------------------------------------------------------------------]]
-function Debugger:SetBPAtFile(filename, linenum)
+function Debugger:SetBPAtFile(filename, linenum, condition, hitmode, hitcount, logmessage, snapshot)
     local bp = self:GetBPByFile(filename, linenum)
     
     if bp == nil then
@@ -556,15 +663,36 @@ function Debugger:SetBPAtFile(filename, linenum)
         if bp.linenum == nil then
             bp.linenum = -1
         end
-        local bpString = bpToString(filename, linenum)
+        local bpString = bpToString(DebugLib.NormalizePath(filename), linenum)
 
         self.bpsByName[bpString] = bp
         table.insert(self.bpsByIndex, bp)
     end
+
+    bp.condition    = condition
+    bp.hitmode      = hitmode
+    bp.hitcount     = hitcount or 0
+    bp.logmessage   = logmessage
+    bp.snapshot     = snapshot == true
+    DebugLib.SetBreakpoint(self.cppDebugger, filename, bp.linenum, nil, condition, hitmode, bp.hitcount,
+                           logmessage, bp.snapshot)
         
     return bp
 end
 
+--[[------------------------------------------------------------------------------
+    \brief  Copies the hit counts of all BPs from the native breakpoint table.
+--------------------------------------------------------------------------------]]
+function Debugger:RefreshHits()
+    for index, bp in ipairs(self.bpsByIndex) do
+        if bp.filename ~= nil then
+            bp.hits = DebugLib.GetBreakpointHits(self.cppDebugger, bp.filename, bp.linenum)
+        else
+            bp.hits = DebugLib.GetBreakpointHits(self.cppDebugger, nil, nil, bp.funcname)
+        end
+    end
+end
+
 --[[------------------------------------------------------------------------------
     \brief  Enable a BP at a given index.
 
@@ -592,9 +720,11 @@ function Debugger:RemoveBP(index)
     local bp = table.remove(self.bpsByIndex, index)
 
     if bp.filename ~= nil then
-        table.remove(self.bpsByName, bpToString(bp.filename, bp.linenum))
+        self.bpsByName[bpToString(DebugLib.NormalizePath(bp.filename), bp.linenum)] = nil
+        DebugLib.ClearBreakpoint(self.cppDebugger, bp.filename, bp.linenum)
     else
-        table.remove(self.bpsByName, bp.funcname)
+        self.bpsByName[bp.funcname] = nil
+        DebugLib.ClearBreakpoint(self.cppDebugger, nil, nil, bp.funcname)
     end
 end
 
@@ -608,5 +738,6 @@ end
 function Debugger:ClearBPs()
     self.bpsByName = {}
     self.bpsByIndex = {}
+    DebugLib.ClearBreakpoints(self.cppDebugger)
 end
 
@@ -28,8 +28,6 @@
 
 --------------------------------------------------------------------------------]]
 
-require "Json"
-
 function getContextFromMessageData(debugger, msg_data, not_running)
     local address   = msg_data["context"]
     if address == nil then
@@ -56,6 +54,41 @@ function getContextFromMessageData(debugger, msg_data, not_running)
     return 0, debugContext
 end
 
+--[[------------------------------------------------------------------------------
+    \brief  Gets the context and the action of a message to a context that
+    may be running (profiler, tracer, coverage, watches and the like).
+
+    \param  debugger        -   The debugger context.
+    \param  msg_data        -   Message data with 'context' and an optional
+                                'action'.
+    \param  default_action  -   Action used when there is none.
+
+    \return (0, debugContext, action) if successful, otherwise
+            (-1, error message) on error
+--------------------------------------------------------------------------------]]
+function getActionFromMessageData(debugger, msg_data, default_action)
+    if type(msg_data) ~= "table" then
+        return -1, "Message data must be a table!"
+    end
+
+    local address = msg_data["context"]
+    if address == nil then
+        return -1, "'context' parameter missing"
+    end
+
+    local debugContext = debugger.contexts[address]
+    if debugContext == nil then
+        return -1, "Invalid context address specified."
+    end
+
+    local action = msg_data["action"]
+    if action == nil then
+        action = default_action
+    end
+
+    return 0, debugContext, action
+end
+
 --[[------------------------------------------------------------------------------
     \brief  Resets the debugger causing a reload of the scripts.
 
@@ -104,6 +137,21 @@ end
     \param  msg_data    -   "filename"  if breakpoint is in a file
                             "linenum"   if brekapoint is in a file
                             "funcname"  if breakpoint is on a function
+                            "condition" optional expression (in the scope
+                                        of the line) that must be true for
+                                        a line breakpoint to stop
+                            "hitmode"   optional "equals", "multiple" or
+                                        "after" to stop on the hitcount-th
+                                        hit only, every hitcount-th hit or
+                                        once hitcount hits were ignored
+                            "hitcount"  the N of hitmode
+                            "logmessage" optional message to log (and
+                                        carry on) instead of stopping at
+                                        a line - "{expr}" is replaced by
+                                        the value of expr
+                            "snapshot"  optional true to take a snapshot
+                                        (see MsgFunc_Snapshots) and carry
+                                        on instead of stopping at a line
     
     \return (0, index) if breakpoint was set (or exists),
             otherwise (-1, error message) on error
@@ -117,14 +165,36 @@ function MsgFunc_SetBP(debugger, msg_data)
         return -1, "Message data must be a table!"
     end
 
+    local hitmode   = msg_data["hitmode"]
+    local hitcount  = msg_data["hitcount"]
+    if hitmode ~= nil and hitmode ~= "always" and hitmode ~= "equals" and
+       hitmode ~= "multiple" and hitmode ~= "after" then
+        return -1, "'hitmode' must be one of always, equals, multiple or after"
+    end
+    if hitcount ~= nil and type(hitcount) ~= "number" then
+        return -1, "'hitcount' must be a number"
+    end
+
     if msg_data["funcname"] ~= nil then
         local funcname  = msg_data["funcname"]
 
-        bp = debugger:SetBPAtFunction(funcname)
+        bp = debugger:SetBPAtFunction(funcname, hitmode, hitcount)
     elseif msg_data["filename"] ~= nil then
         local filename  = msg_data["filename"]
         local linenum   = msg_data["linenum"]
-        bp = debugger:SetBPAtFile(filename, linenum)
+        local condition = msg_data["condition"]
+        if condition ~= nil and type(condition) ~= "string" then
+            return -1, "'condition' must be a string"
+        end
+        local logmessage = msg_data["logmessage"]
+        if logmessage ~= nil and type(logmessage) ~= "string" then
+            return -1, "'logmessage' must be a string"
+        end
+        local snapshot = msg_data["snapshot"]
+        if snapshot ~= nil and type(snapshot) ~= "boolean" then
+            return -1, "'snapshot' must be a boolean"
+        end
+        bp = debugger:SetBPAtFile(filename, linenum, condition, hitmode, hitcount, logmessage, snapshot)
     else
         return -1, "Atleast one of funcname or filename/linenum must be specified"
     end
@@ -139,13 +209,15 @@ end
     \param  debugger    -   The debugger context to be modified.
     \param  msg_data    -   None
     
-    \return (0, bp_list)
+    \return (0, bp_list) - each bp has the number of times it was hit in
+            'hits'
 
     \version
             Sri Panyam 05/Dec/08
             - Initial version
 --------------------------------------------------------------------------------]]
 function MsgFunc_GetBPs(debugger, msg_data)
+    debugger:RefreshHits()
     return 0, debugger.bpsByIndex
 end
 
@@ -193,6 +265,117 @@ function MsgFunc_ClearBPs(debugger, msg_data)
     debugger:ClearBPs()
 end
 
+--[[------------------------------------------------------------------------------
+    \brief  Browses the snapshots taken by snapshot breakpoints.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'action'   -   "list", "get", "clear" or
+                                            "limits" (default "list"),
+                             'id'       -   Snapshot to "get",
+                             'frames'   -   Frames captured ("limits"),
+                             'depth'    -   Levels tables are expanded to
+                                            ("limits"),
+                             'budget'   -   Bytes a snapshot may take
+                                            ("limits"),
+                             'interval' -   Least ms between snapshots of a
+                                            breakpoint ("limits")
+                            }
+
+    \return (0, snapshots) for "list" with a summary of each snapshot kept,
+            (0, snapshot) for "get" with its 'frames' (each with its
+            'locals' and 'upvalues'), otherwise (-1, error message) on
+            error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Snapshots(debugger, msg_data)
+    if msg_data == nil then
+        msg_data = {}
+    end
+
+    if type(msg_data) ~= "table" then
+        return -1, "Message data must be a table!"
+    end
+
+    local action = msg_data["action"]
+    if action == nil then
+        action = "list"
+    end
+
+    if action == "list" then
+        return 0, DebugLib.GetSnapshots(debugger.cppDebugger)
+    elseif action == "get" then
+        if type(msg_data["id"]) ~= "number" then
+            return -1, "'id' must be a number"
+        end
+
+        local snapshot = DebugLib.GetSnapshot(debugger.cppDebugger, msg_data["id"])
+        if snapshot == nil then
+            return -1, "No such snapshot (it may have been overwritten)."
+        end
+        return 0, snapshot
+    elseif action == "clear" then
+        DebugLib.ClearSnapshots(debugger.cppDebugger)
+    elseif action == "limits" then
+        DebugLib.SetSnapshotLimits(debugger.cppDebugger, msg_data["frames"], msg_data["depth"],
+                                   msg_data["budget"], msg_data["interval"])
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+end
+
+--[[------------------------------------------------------------------------------
+    \brief  Controls the data watchpoints of a context.  A watched field
+    pauses the context (or logs its values) when it is written, without
+    any line hooks.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context the table belongs to,
+                             'action'   -   "set", "clear" or "list"
+                                            (default "list"),
+                             'table'    -   Expression giving the table for
+                                            "set", evaluated like "eval"
+                                            (default the globals),
+                             'key'      -   Key of the field for "set",
+                             'mode'     -   "break" or "log" for "set"
+                                            (default "break"),
+                             'id'       -   Watchpoint to "clear"
+                            }
+
+    \return (0, id) for "set", (0, watchpoints) for "list", otherwise
+            (-1, error message) on error.  "set" needs the context to be
+            paused.
+--------------------------------------------------------------------------------]]
+function MsgFunc_Watch(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "list")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    if action == "set" then
+        local key = msg_data["key"]
+        if type(key) ~= "string" and type(key) ~= "number" then
+            return -1, "'key' must be a string or a number"
+        end
+
+        local mode = msg_data["mode"]
+        if mode == nil then
+            mode = "break"
+        end
+        if mode ~= "break" and mode ~= "log" then
+            return -1, "'mode' must be one of break or log"
+        end
+
+        return DebugLib.SetWatchpoint(debugContext.cppContext, msg_data["table"], key, mode)
+    elseif action == "clear" then
+        if not DebugLib.ClearWatchpoint(debugContext.cppContext, msg_data["id"]) then
+            return -1, "Invalid watchpoint id."
+        end
+    elseif action == "list" then
+        return 0, DebugLib.GetWatchpoints(debugContext.cppContext)
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+end
+
 --[[------------------------------------------------------------------------------
     \brief  Sets the debugger context to step into the next line (entering a
     function if necessary).  If a step is not possible, this is similar to
@@ -578,23 +761,28 @@ end
             - Initial version
 --------------------------------------------------------------------------------]]
 function MsgFunc_Contexts(debugger, msg_data)
-    -- local contexts = debugger.contexts
+    -- contexts served by other shards are only known natively
     local contexts = DebugLib.GetContexts(debugger.cppDebugger)
     local out = {}
 
-    -- update existing context table
     for i, v in ipairs(contexts) do
-        local context   = debugger:GetDebugContext(v["context"])
-        context.name    = v["name"]
-        context.running = v["running"]
-    end
+        local address   = userdataToString(v["context"])
+        local location  = v["location"]
+
+        -- update existing context table
+        local context   = debugger.contexts[address]
+        if context ~= nil then
+            context.name    = v["name"]
+            context.running = v["running"]
+            if not v["running"] and context.location ~= nil then
+                location = context.location
+            end
+        end
 
-    -- send out the contexts
-    for k, v in pairs(debugger.contexts) do
-        table.insert(out, {["address"]  = v["address"],
+        table.insert(out, {["address"]  = address,
                            ["name"]     = v["name"],
                            ["running"]  = v["running"],
-                           ["location"] = v["location"]})
+                           ["location"] = location})
     end
 
     return 0, out
@@ -700,3 +888,220 @@ function MsgFunc_File(debugger, msg_data)
     return 0, lines
 end
 
+
+--[[------------------------------------------------------------------------------
+    \brief  Controls the sampling profiler of a context.  Contexts can be
+    profiled while running.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context to profile,
+                             'action'   -   "start", "stop", "clear" or
+                                            "get" (default "get"),
+                             'mode'     -   "count" to sample every 'period'
+                                            instructions or "interval" to
+                                            sample every 'period' ms
+                                            (default "count"),
+                             'period'   -   Instructions or ms between
+                                            samples (optional)
+                            }
+    
+    \return (0, profile) for "get" where the profile holds the samples as
+            folded stacks ('folded') along with 'samples', 'dropped' and
+            'running', otherwise (-1, error message) on error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Profile(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "get")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    if action == "start" then
+        local mode = msg_data["mode"]
+        if mode == nil then
+            mode = "count"
+        end
+
+        if mode ~= "count" and mode ~= "interval" then
+            return -1, "'mode' must be one of count or interval"
+        end
+
+        DebugLib.StartProfiler(debugContext.cppContext, mode, msg_data["period"])
+    elseif action == "stop" then
+        DebugLib.StopProfiler(debugContext.cppContext)
+    elseif action == "clear" then
+        DebugLib.ClearProfile(debugContext.cppContext)
+    elseif action == "get" then
+        return 0, DebugLib.GetProfile(debugContext.cppContext)
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+end
+
+
+--[[------------------------------------------------------------------------------
+    \brief  Controls the tracing profiler of a context.  Contexts can be
+    traced while running.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context to trace,
+                             'action'   -   "start", "stop", "clear" or
+                                            "get" (default "get")
+                            }
+    
+    \return (0, trace) for "get" where the trace holds the call tree
+            ('tree'), the totals of each function ('functions') along with
+            'dropped' and 'running', otherwise (-1, error message) on error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Trace(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "get")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    if action == "start" then
+        DebugLib.StartTracer(debugContext.cppContext)
+    elseif action == "stop" then
+        DebugLib.StopTracer(debugContext.cppContext)
+    elseif action == "clear" then
+        DebugLib.ClearTrace(debugContext.cppContext)
+    elseif action == "get" then
+        return 0, DebugLib.GetTrace(debugContext.cppContext)
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+end
+
+
+--[[------------------------------------------------------------------------------
+    \brief  Controls line coverage of a context.  Contexts can be covered
+    while running.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context to cover,
+                             'action'   -   "start", "stop", "clear" or
+                                            "get" (default "get"),
+                             'format'   -   "lcov" or "cobertura" for "get"
+                                            (default "lcov")
+                            }
+    
+    \return (0, report) for "get" where the report is the lcov tracefile
+            or cobertura xml as a string, otherwise (-1, error message) on
+            error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Coverage(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "get")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    if action == "start" then
+        DebugLib.StartCoverage(debugContext.cppContext)
+    elseif action == "stop" then
+        DebugLib.StopCoverage(debugContext.cppContext)
+    elseif action == "clear" then
+        DebugLib.ClearCoverage(debugContext.cppContext)
+    elseif action == "get" then
+        local format = msg_data["format"]
+        if format == nil then
+            format = "lcov"
+        end
+
+        if format ~= "lcov" and format ~= "cobertura" then
+            return -1, "'format' must be one of lcov or cobertura"
+        end
+
+        return 0, DebugLib.GetCoverage(debugContext.cppContext, format)
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+end
+
+
+--[[------------------------------------------------------------------------------
+    \brief  Controls the allocation profiler of a context.  Only works for
+    stacks created with a profiled allocator (see LuaUtils::NewLuaStack).
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context to profile,
+                             'action'   -   "start", "stop", "clear" or
+                                            "get" (default "get"),
+                             'bytes'    -   Bytes allocated between
+                                            samples for "start" (optional)
+                            }
+    
+    \return (0, allocs) for "get" where allocs holds the exact totals
+            ('live', 'allocated', 'allocations') and the sampled 'sites'
+            and 'functions', otherwise (-1, error message) on error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Allocs(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "get")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    local result = nil
+    if action == "start" then
+        result = DebugLib.StartAllocs(debugContext.cppContext, msg_data["bytes"])
+    elseif action == "stop" then
+        result = DebugLib.StopAllocs(debugContext.cppContext)
+    elseif action == "clear" then
+        result = DebugLib.ClearAllocs(debugContext.cppContext)
+    elseif action == "get" then
+        result = DebugLib.GetAllocs(debugContext.cppContext)
+    else
+        return -1, "Invalid action: " .. tostring(action)
+    end
+
+    if not result then
+        return -1, "Context was not created with a profiled allocator."
+    end
+
+    if action == "get" then
+        return 0, result
+    end
+end
+
+
+--[[------------------------------------------------------------------------------
+    \brief  Gets the collector stats of a context or changes its collector
+    policy.  Only works for stacks created by LuaUtils::NewLuaStack.
+
+    \param  debugger    -   The debugger context.
+    \param  msg_data    -   {'context'  -   Context to look at,
+                             'action'   -   "stats" or "policy" (default
+                                            "stats"),
+                             'mode'     -   "stw" or "incremental" for
+                                            "policy",
+                             'pause'    -   Collector pause (optional),
+                             'stepmul'  -   Step multiplier for incremental
+                                            collection (optional)
+                            }
+    
+    \return (0, stats) where stats holds the policy, totals and 'recent'
+            cycles, otherwise (-1, error message) on error
+--------------------------------------------------------------------------------]]
+function MsgFunc_Gc(debugger, msg_data)
+    local code, debugContext, action = getActionFromMessageData(debugger, msg_data, "stats")
+    if code ~= 0 then
+        return code, debugContext
+    end
+
+    if action == "policy" then
+        local mode = msg_data["mode"]
+        if mode ~= "stw" and mode ~= "incremental" then
+            return -1, "'mode' must be one of stw or incremental"
+        end
+
+        if not DebugLib.SetGcPolicy(debugContext.cppContext, mode, msg_data["pause"], msg_data["stepmul"]) then
+            return -1, "Context was not created by NewLuaStack."
+        end
+    elseif action ~= "stats" then
+        return -1, "Invalid action: " .. tostring(action)
+    end
+
+    local stats = DebugLib.GetGcStats(debugContext.cppContext)
+    if stats == nil then
+        return -1, "Context was not created by NewLuaStack."
+    end
+    return 0, stats
+end
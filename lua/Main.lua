@@ -33,7 +33,6 @@ if string.find(package.path, "libgameengine") == nil then
 end
 --------------------------------------------------------------------------------]]
 
-require "Json"
 require "Debugger"
 
 LUA_HOOKCALL	=   0
@@ -113,19 +112,24 @@ end
     \brief  Called when the debug function is hit.
 
     \param  pDebugger    -   The debug server that invoked this script.
-    \param  pDebug          -   The debug context of a lua context being debugged.
+    \param  pContext     -   The debug context of a lua context being debugged.
+    \param  event        -   The event - a native view whose fields ("event",
+                             "name", "currentline" etc as in a location,
+                             "is_breakpoint", "watch" and "context_name")
+                             are only valid during this call.  The strings
+                             are only read when the context stops.
 
     \version
             S Panyam 04/Nov/08
             - Initial version
 --------------------------------------------------------------------------------]]
-function HandleBreakpoint(pDebugger, pContextAddr, contextName, debug_event,
-                          debug_name, debug_namewhat, debug_what,
-                          debug_source, debug_currentline, debug_nups,
-                          debug_linedefined, debug_lastlinedefined)
+function HandleBreakpoint(pDebugger, pContext, event)
     -- initialise debugger if not already done
     local debugger      = GetDebugger(pDebugger)
-    local debugContext  = debugger:GetDebugContext(pContextAddr, contextName)
+    local debugContext  = debugger.contextsByPtr[pContext]
+    if debugContext == nil then
+        debugContext = debugger:GetDebugContext(pContext, event.context_name)
+    end
 
     --[[ So waht do we do here?
         1. Essentially we need to check whether we should wait here or not.
@@ -137,19 +141,23 @@ function HandleBreakpoint(pDebugger, pContextAddr, contextName, debug_event,
         the flow - eg step, next, continue, until, return and so on.
 
         So we have to check for implicit and explicit breakpoints.
+
+        Explicit ones have already been looked up by the cpp hook (which
+        only calls us if one matched or a flow command is in progress).
     --]]
 
+    local debug_event   = event.event
     local lastCommand   = debugContext.lastCommand
     local handled       = true
-    local bp            = nil
 
-    if debug_event == LUA_HOOKCALL then
+    if event.watch > 0 then
+        -- a watched field was written - always stops
+        handled = false
+    elseif debug_event == LUA_HOOKCALL then
         -- A function was entered so only stop here if:
         -- A BP exists in the function, or last command was step (but not next)
 
-        bp = debugger:GetBPByFunction(debug_name)
-
-        if bp ~= nil or (lastCommand ~= nil and lastCommand["type"] == "step") then
+        if event.is_breakpoint or (lastCommand ~= nil and lastCommand["type"] == "step") then
             handled = false
         end
 
@@ -160,16 +168,13 @@ function HandleBreakpoint(pDebugger, pContextAddr, contextName, debug_event,
         local cmd_type  = lastCommand["type"]
         local cmd_data  = lastCommand["data"]
 
-        if cmd_type == "finish" and cmd_data["function"] == debug_name then
+        if cmd_type == "finish" and cmd_data["function"] == event.name then
             handled = false
         end
     elseif debug_event == LUA_HOOKLINE then
 
         -- is there an explicit breakpoint?
-        bp = debugger:GetBPByFile(debug_source, debug_currentline)
-
-        -- print("Debugger, Context, BP: " .. tostring(debugger) .. ", " ..  tostring(debugContext) .. ", " .. tostring(bp))
-        if bp ~= nil then
+        if event.is_breakpoint then
 
             handled = false
 
@@ -182,39 +187,20 @@ function HandleBreakpoint(pDebugger, pContextAddr, contextName, debug_event,
             local cmd_type  = lastCommand["type"]
             local cmd_data  = lastCommand["data"]
 
+            -- the hook has already matched the "until" line and file (by
+            -- canonical file id, so chunk names and client paths match)
             if cmd_type == "step" or 
-               (cmd_type == "until" and cmd_data["line"] == debug_currentline and cmd_data["file"] == debug_source) or
-               (cmd_type == "next" and cmd_data["function"] == debug_name) then
+               (cmd_type == "until" and cmd_data["line"] == event.currentline) or
+               (cmd_type == "next" and cmd_data["function"] == event.name) then
                 handled = false
             end
         end
     end
 
     if not handled then
-        --[[--
-        print("===============================================================")
-        print("=======     BreakPoint: " .. tostring(bp))
-        if bp ~= nil then
-            print("=======         FileName: " .. tostring(bp.filename))
-            print("=======         Linenum: " .. tostring(bp.linenum))
-            print("=======         Function: " .. tostring(bp.funcname))
-            print("=======         Enabled: " .. tostring(bp.enabled))
-        end
-        print("===============================================================")
-        --]]--
         debugContext:Pause()
         debugContext:ClearLastCommand()
-        debugContext.location  = {
-            ["event"]           = debug_event,
-            ["name"]            = debug_name,
-            ["namewhat"]        = debug_namewhat,
-            ["what"]            = debug_what,
-            ["source"]          = debug_source,
-            ["currentline"]     = debug_currentline,
-            ["nups"]            = debug_nups,
-            ["linedefined"]     = debug_linedefined,
-            ["lastlinedefined"] = debug_lastlinedefined,
-        }
+        debugContext:SetLocation(event)
 
         -- tell the client we have stopped!
         debugger:SendEvent("ContextPaused", debugContext);
@@ -230,9 +216,10 @@ end
     \brief  Called when the debug client sends the server a message 
             (ie run, break, step etc).
 
-    \param  pMessage    -   The string representing a message.  It is
-                            completely our (this script's) responsibility
-                            to decode the message.
+    \param  pMessage    -   The message as a table (decoded by the debugger
+                            from whichever transport it came over).
+
+    \return The reply (a table - it is converted to json by the caller).
 
     \version
             S Panyam 04/Nov/08
@@ -240,7 +227,6 @@ end
 --------------------------------------------------------------------------------]]
 function HandleMessage(pDebugger, pMessage)
     local debugger      = GetDebugger(pDebugger)
-    -- local message       = Json.Decode(pMessage)
     local message       = pMessage
     local msg_id        = message["id"]
     local msg_cmd       = message["cmd"]
@@ -260,10 +246,10 @@ function HandleMessage(pDebugger, pMessage)
     -- simply send back the message along with the type, 
     -- code and value of the response
     -- debugger:SendReply(code, value, message)
-    return Json.Encode({["type"]        = "Reply",
-                        ["code"]        = code,
-                        ["value"]       = value,
-                        ["original"]    = pMessage})
+    return {["type"]        = "Reply",
+            ["code"]        = code,
+            ["value"]       = value,
+            ["original"]    = pMessage}
     ---[[
     --]]
 end
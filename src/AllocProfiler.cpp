@@ -0,0 +1,553 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   AllocProfiler.cpp
+ *
+ *  \brief  Implementation of the allocation profiler.
+ */
+//*****************************************************************************
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "AllocProfiler.h"
+#include "GcMonitor.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Orders sites (or functions) by live bytes and then by bytes
+ *  allocated, largest first.
+ */
+//*****************************************************************************
+template <typename T>
+static bool MoreLiveBytes(const T &a, const T &b)
+{
+    if (a.liveBytes != b.liveBytes)
+        return a.liveBytes > b.liveBytes;
+    return a.bytes > b.bytes;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a lua stack whose allocations are profiled.
+ *
+ *  \return The new stack or NULL if there was no memory for it.
+ */
+//*****************************************************************************
+LuaStack AllocProfiler::NewState()
+{
+    AllocProfiler * pProfiler   = new AllocProfiler();
+    LuaStack        pStack      = lua_newstate(Alloc, pProfiler);
+
+    if (pStack == NULL)
+    {
+        delete pProfiler;
+        return NULL;
+    }
+
+    // from now on freeing the state block frees the profiler
+    pProfiler->pStack = pStack;
+    return pStack;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the profiler of a stack.
+ *
+ *  \return The profiler or NULL if the stack uses another allocator.
+ */
+//*****************************************************************************
+AllocProfiler *AllocProfiler::FromStack(LuaStack pStack)
+{
+    void *ud = NULL;
+    if (GcMonitor::GetAllocf(pStack, &ud) != Alloc)
+        return NULL;
+    return (AllocProfiler *)ud;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  The allocator of profiled stacks.
+ */
+//*****************************************************************************
+void *AllocProfiler::Alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    return ((AllocProfiler *)ud)->Realloc(ptr, osize, nsize);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a profiler sampling at the default rate.
+ */
+//*****************************************************************************
+AllocProfiler::AllocProfiler() :
+    pStack(NULL),
+    pStateBlock(NULL),
+    running(true),
+    sampleBytes(DEFAULT_SAMPLE_BYTES),
+    bytesUntilSample(DEFAULT_SAMPLE_BYTES),
+    seed(time(NULL)),
+    liveBytes(0),
+    allocatedBytes(0),
+    numAllocs(0),
+    clearedBytes(0),
+    clearedAllocs(0),
+    generation(0)
+{
+    AllocSite unknown;
+    unknown.function = "[unknown]";
+    sites.push_back(unknown);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+AllocProfiler::~AllocProfiler()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts sampling or changes the sampling rate.
+ *
+ *  \param  bytes   Bytes allocated between samples (<= 0 for the
+ *                  default).
+ */
+//*****************************************************************************
+void AllocProfiler::Start(int bytes)
+{
+    sampleBytes = bytes > 0 ? bytes : DEFAULT_SAMPLE_BYTES;
+    running     = true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops sampling.  Samples taken so far are kept.
+ */
+//*****************************************************************************
+void AllocProfiler::Stop()
+{
+    running = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards all samples and the allocation totals.  The live
+ *  bytes of the stack are left alone as they are still in use.
+ */
+//*****************************************************************************
+void AllocProfiler::Clear()
+{
+    SMutexLock allocLock(allocMutex);
+
+    generation++;
+    clearedBytes    = allocatedBytes;
+    clearedAllocs   = numAllocs;
+
+    for (std::vector<AllocSite>::iterator iter = sites.begin(); iter != sites.end(); ++iter)
+    {
+        iter->samples   = 0;
+        iter->bytes     = 0;
+        iter->allocs    = 0;
+        iter->liveBytes = 0;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Allocates, resizes or frees a block as lua_Alloc does.
+ *
+ *  The site of a sampled allocation is looked up before the realloc as
+ *  lua may be growing its own stack or call info array.
+ */
+//*****************************************************************************
+void *AllocProfiler::Realloc(void *ptr, size_t osize, size_t nsize)
+{
+    // lua 5.1 passes 0 as the old size of new blocks
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (ptr != NULL)
+        {
+            liveBytes -= osize;
+            if (!blocks.empty())
+                ForgetBlock(ptr);
+        }
+        free(ptr);
+
+        // lua_close frees the state last
+        if (ptr != NULL && ptr == pStateBlock && pStack != NULL)
+            delete this;
+        return NULL;
+    }
+
+    size_t      grown   = nsize > osize ? nsize - osize : 0;
+    long long   weight  = grown > 0 && running ? SampleWeight(grown) : 0;
+    int         siteId  = weight > 0 ? GetSiteId() : UNKNOWN_SITE;
+
+    void *newPtr = realloc(ptr, nsize);
+    if (newPtr == NULL)
+        return NULL;
+
+    if (pStateBlock == NULL)
+        pStateBlock = newPtr;
+
+    liveBytes       += (long long)nsize - (long long)osize;
+    allocatedBytes  += grown;
+    if (ptr == NULL)
+        numAllocs++;
+
+    if (ptr != NULL && ptr != newPtr && !blocks.empty())
+        MoveBlock(ptr, newPtr);
+
+    if (weight > 0)
+        RecordSample(newPtr, siteId, weight, grown);
+
+    return newPtr;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts down the bytes till the next sample.
+ *
+ *  Intervals are jittered around sampleBytes so allocation patterns that
+ *  repeat with the same period are not always (or never) sampled.
+ *
+ *  \return The bytes the allocation stands for or 0 if it is not
+ *  sampled.
+ */
+//*****************************************************************************
+long long AllocProfiler::SampleWeight(size_t size)
+{
+    bytesUntilSample -= size;
+    if (bytesUntilSample > 0)
+        return 0;
+
+    int         bytes   = sampleBytes;
+    long long   weight  = 0;
+    while (bytesUntilSample <= 0)
+    {
+        bytesUntilSample    += bytes / 2 + rand_r(&seed) % bytes;
+        weight              += bytes;
+    }
+    return weight;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the site of the innermost lua frame.
+ *
+ *  Allocations made by C functions are charged to the lua line that
+ *  called them.  Allocations in coroutines are charged to the line that
+ *  resumed them as only the main thread of the stack is known.
+ */
+//*****************************************************************************
+int AllocProfiler::GetSiteId()
+{
+    lua_Debug ar;
+    for (int level = 0;pStack != NULL && lua_getstack(pStack, level, &ar) != 0;level++)
+    {
+        if (lua_getinfo(pStack, "Sl", &ar) == 0)
+            break ;
+
+        if (ar.what == NULL || strcmp(ar.what, "C") == 0 || ar.currentline <= 0)
+            continue ;
+
+        std::pair<int, int> key(sources.GetSourceId(sourceCache, ar.source), ar.currentline);
+        std::map<std::pair<int, int>, int>::iterator iter = siteIds.find(key);
+        if (iter != siteIds.end())
+            return iter->second;
+
+        lua_getinfo(pStack, "n", &ar);
+
+        AllocSite site;
+        site.fileId         = key.first;
+        site.line           = key.second;
+        site.linedefined    = ar.linedefined;
+
+        std::ostringstream function;
+        if (strcmp(ar.what, "main") == 0)
+            function << sources.GetFileName(site.fileId) << ":main";
+        else
+            function << (ar.name != NULL ? ar.name : "?")
+                     << " (" << sources.GetFileName(site.fileId) << ":" << ar.linedefined << ")";
+        site.function = function.str();
+
+        SMutexLock allocLock(allocMutex);
+        sites.push_back(site);
+        siteIds[key] = sites.size() - 1;
+        return sites.size() - 1;
+    }
+    return UNKNOWN_SITE;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Charges a sampled block to a site.
+ *
+ *  A sampled block that grows again stays charged to its first site.
+ */
+//*****************************************************************************
+void AllocProfiler::RecordSample(void *ptr, int siteId, long long weight, size_t size)
+{
+    SMutexLock allocLock(allocMutex);
+
+    std::map<void *, SampledBlock>::iterator iter = blocks.find(ptr);
+    if (iter != blocks.end() && iter->second.generation == generation)
+    {
+        siteId = iter->second.siteId;
+        iter->second.weight += weight;
+    }
+    else
+    {
+        SampledBlock block;
+        block.siteId        = siteId;
+        block.weight        = weight;
+        block.generation    = generation;
+        blocks[ptr]         = block;
+    }
+
+    AllocSite &site = sites[siteId];
+    site.samples++;
+    site.bytes      += weight;
+    site.allocs     += ((double)weight) / size;
+    site.liveBytes  += weight;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets a freed block, taking it off the live bytes of its
+ *  site if it was sampled since the last Clear.
+ */
+//*****************************************************************************
+void AllocProfiler::ForgetBlock(void *ptr)
+{
+    std::map<void *, SampledBlock>::iterator iter = blocks.find(ptr);
+    if (iter == blocks.end())
+        return ;
+
+    if (iter->second.generation == generation)
+    {
+        SMutexLock allocLock(allocMutex);
+        sites[iter->second.siteId].liveBytes -= iter->second.weight;
+    }
+    blocks.erase(iter);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Follows a sampled block moved by a realloc.
+ */
+//*****************************************************************************
+void AllocProfiler::MoveBlock(void *oldPtr, void *newPtr)
+{
+    std::map<void *, SampledBlock>::iterator iter = blocks.find(oldPtr);
+    if (iter == blocks.end())
+        return ;
+
+    SampledBlock block = iter->second;
+    blocks.erase(iter);
+    blocks[newPtr] = block;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Adds the sites of each function together.  Must be called
+ *  with the lock held.
+ */
+//*****************************************************************************
+void AllocProfiler::GetFunctionTotals(FunctionTotals &totals)
+{
+    for (std::vector<AllocSite>::iterator iter = sites.begin(); iter != sites.end(); ++iter)
+    {
+        if (iter->samples == 0)
+            continue ;
+
+        AllocSite &total = totals[std::pair<int, int>(iter->fileId, iter->linedefined)];
+        total.fileId        = iter->fileId;
+        total.linedefined   = iter->linedefined;
+        total.function      = iter->function;
+        total.samples       += iter->samples;
+        total.bytes         += iter->bytes;
+        total.allocs        += iter->allocs;
+        total.liveBytes     += iter->liveBytes;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the label of a site.
+ */
+//*****************************************************************************
+std::string AllocProfiler::GetSiteName(const AllocSite &site)
+{
+    if (site.fileId < 0)
+        return site.function;
+
+    std::ostringstream name;
+    name << sources.GetFileName(site.fileId) << ":" << site.line;
+    return name.str();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the functions and sites with the most live bytes as
+ *  plain text tables.
+ */
+//*****************************************************************************
+void AllocProfiler::Write(std::ostream &output)
+{
+    SMutexLock allocLock(allocMutex);
+
+    FunctionTotals functionTotals;
+    GetFunctionTotals(functionTotals);
+
+    std::vector<AllocSite> functions;
+    for (FunctionTotals::iterator iter = functionTotals.begin(); iter != functionTotals.end(); ++iter)
+        functions.push_back(iter->second);
+    std::sort(functions.begin(), functions.end(), MoreLiveBytes<AllocSite>);
+
+    std::vector<AllocSite> sampled;
+    for (std::vector<AllocSite>::iterator iter = sites.begin(); iter != sites.end(); ++iter)
+    {
+        if (iter->samples > 0)
+            sampled.push_back(*iter);
+    }
+    std::sort(sampled.begin(), sampled.end(), MoreLiveBytes<AllocSite>);
+
+    output << "Live bytes: " << liveBytes
+           << ", allocated since last clear: " << (allocatedBytes - clearedBytes)
+           << " bytes in " << (numAllocs - clearedAllocs) << " allocations\n";
+    output << "Sampling every " << sampleBytes << " bytes"
+           << (running ? "" : " (stopped)") << "\n\n";
+
+    output << "Functions:\n";
+    output << std::setw(14) << "Live Bytes" << std::setw(14) << "Alloc Bytes"
+           << std::setw(12) << "Allocs" << "  Function\n";
+    for (std::vector<AllocSite>::iterator iter = functions.begin(); iter != functions.end(); ++iter)
+    {
+        output << std::setw(14) << iter->liveBytes << std::setw(14) << iter->bytes
+               << std::setw(12) << (long long)iter->allocs << "  " << iter->function << "\n";
+    }
+
+    output << "\nSites:\n";
+    output << std::setw(14) << "Live Bytes" << std::setw(14) << "Alloc Bytes"
+           << std::setw(12) << "Allocs" << "  Site\n";
+    for (std::vector<AllocSite>::iterator iter = sampled.begin(); iter != sampled.end(); ++iter)
+    {
+        output << std::setw(14) << iter->liveBytes << std::setw(14) << iter->bytes
+               << std::setw(12) << (long long)iter->allocs << "  " << GetSiteName(*iter)
+               << " in " << iter->function << "\n";
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the sites and functions onto a lua stack.
+ *
+ *  The report is a table with the exact totals ("live", "allocated",
+ *  "allocations"), the sampling rate ("sampleBytes"), whether sampling is
+ *  on ("running") and lists of the sampled "sites" and "functions", each
+ *  entry having estimated "bytes", "allocs" and "live" bytes.
+ */
+//*****************************************************************************
+void AllocProfiler::PushReport(LuaStack pOutput)
+{
+    SMutexLock allocLock(allocMutex);
+
+    lua_newtable(pOutput);
+
+    lua_pushnumber(pOutput, liveBytes);
+    lua_setfield(pOutput, -2, "live");
+
+    lua_pushnumber(pOutput, allocatedBytes - clearedBytes);
+    lua_setfield(pOutput, -2, "allocated");
+
+    lua_pushnumber(pOutput, numAllocs - clearedAllocs);
+    lua_setfield(pOutput, -2, "allocations");
+
+    lua_pushinteger(pOutput, sampleBytes);
+    lua_setfield(pOutput, -2, "sampleBytes");
+
+    lua_pushboolean(pOutput, running);
+    lua_setfield(pOutput, -2, "running");
+
+    int index = 1;
+    lua_newtable(pOutput);
+    for (std::vector<AllocSite>::iterator iter = sites.begin(); iter != sites.end(); ++iter)
+    {
+        if (iter->samples == 0)
+            continue ;
+
+        lua_newtable(pOutput);
+
+        lua_pushstring(pOutput, GetSiteName(*iter).c_str());
+        lua_setfield(pOutput, -2, "site");
+
+        lua_pushstring(pOutput, iter->function.c_str());
+        lua_setfield(pOutput, -2, "func");
+
+        lua_pushnumber(pOutput, iter->bytes);
+        lua_setfield(pOutput, -2, "bytes");
+
+        lua_pushnumber(pOutput, iter->allocs);
+        lua_setfield(pOutput, -2, "allocs");
+
+        lua_pushnumber(pOutput, iter->liveBytes);
+        lua_setfield(pOutput, -2, "live");
+
+        lua_rawseti(pOutput, -2, index++);
+    }
+    lua_setfield(pOutput, -2, "sites");
+
+    FunctionTotals functionTotals;
+    GetFunctionTotals(functionTotals);
+
+    index = 1;
+    lua_newtable(pOutput);
+    for (FunctionTotals::iterator iter = functionTotals.begin(); iter != functionTotals.end(); ++iter)
+    {
+        lua_newtable(pOutput);
+
+        lua_pushstring(pOutput, iter->second.function.c_str());
+        lua_setfield(pOutput, -2, "name");
+
+        lua_pushnumber(pOutput, iter->second.bytes);
+        lua_setfield(pOutput, -2, "bytes");
+
+        lua_pushnumber(pOutput, iter->second.allocs);
+        lua_setfield(pOutput, -2, "allocs");
+
+        lua_pushnumber(pOutput, iter->second.liveBytes);
+        lua_setfield(pOutput, -2, "live");
+
+        lua_rawseti(pOutput, -2, index++);
+    }
+    lua_setfield(pOutput, -2, "functions");
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,215 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   AllocProfiler.h
+ *
+ *  \brief  Sampling allocation profiler installed as the lua allocator.
+ *
+ *****************************************************************************/
+
+#ifndef _ALLOC_PROFILER_H_
+#define _ALLOC_PROFILER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include "lpfwddefs.h"
+#include "halley.h"
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  AllocProfiler
+ *
+ *  \brief  Counts the memory allocated by a lua stack per call site.
+ *
+ *  Stacks created with NewState use Alloc as their lua_Alloc, with the
+ *  profiler as its user data.  Every allocation updates exact totals,
+ *  but only about one allocation every "sampleBytes" bytes is charged to
+ *  the lua line (file id and line of the innermost lua frame) that made
+ *  it, so the cost of walking the stack stays bounded.  Each sample
+ *  stands for the bytes allocated since the previous one.
+ *
+ *  Sampled blocks are remembered till they are freed, which gives the
+ *  live heap of each site as well as its churn.  Blocks sampled before a
+ *  Clear are forgotten without being charged.
+ *
+ *  The profiler lives as long as its stack and deletes itself when lua
+ *  frees the state.  Only the thread running the stack allocates, the
+ *  mutex just keeps reports and resets from other threads consistent.
+ *
+ *****************************************************************************/
+class AllocProfiler
+{
+public:
+    //! Default number of bytes allocated between samples
+    static const int    DEFAULT_SAMPLE_BYTES    = 64 * 1024;
+
+    //! Site of allocations made with no lua function running
+    static const int    UNKNOWN_SITE            = 0;
+
+public:
+    // Creates a lua stack that allocates through a new profiler
+    static LuaStack         NewState();
+
+    // Gets the profiler of a stack (NULL if it was not created by NewState)
+    static AllocProfiler *  FromStack(LuaStack pStack);
+
+    // The lua_Alloc of profiled stacks
+    static void *           Alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    // Starts (or changes the rate of) sampling
+    void        Start(int sampleBytes);
+
+    // Stops sampling - exact totals are still kept
+    void        Stop();
+
+    // Discards all samples and the allocation totals
+    void        Clear();
+
+    // Writes a table of the sites and functions with the most live bytes
+    void        Write(std::ostream &output);
+
+    // Pushes the sites and functions onto a lua stack
+    void        PushReport(LuaStack pOutput);
+
+    //! Is sampling on?
+    bool        Running() const { return running; }
+
+    //! Bytes allocated between samples
+    int         SampleBytes() const { return sampleBytes; }
+
+protected:
+    //! Allocations charged to a lua line
+    struct AllocSite
+    {
+        AllocSite() : fileId(-1), line(0), linedefined(0), samples(0),
+                      bytes(0), allocs(0), liveBytes(0) { }
+
+        int         fileId;
+        int         line;
+        int         linedefined;
+        std::string function;
+        unsigned    samples;
+        long long   bytes;
+        double      allocs;
+        long long   liveBytes;
+    };
+
+    //! A block that was sampled and not freed yet
+    struct SampledBlock
+    {
+        int         siteId;
+        long long   weight;
+        unsigned    generation;
+    };
+
+    //! Totals of the sites of a function
+    typedef std::map<std::pair<int, int>, AllocSite>    FunctionTotals;
+
+    // ctor - only stacks made by NewState have profilers
+    AllocProfiler();
+
+    // dtor
+    virtual ~AllocProfiler();
+
+    // Allocates, resizes or frees a block
+    void *      Realloc(void *ptr, size_t osize, size_t nsize);
+
+    // Gets the bytes a new allocation stands for (0 if it is not sampled)
+    long long   SampleWeight(size_t size);
+
+    // Gets the site of the innermost lua frame
+    int         GetSiteId();
+
+    // Charges a sampled block to a site
+    void        RecordSample(void *ptr, int siteId, long long weight, size_t size);
+
+    // Forgets a freed block
+    void        ForgetBlock(void *ptr);
+
+    // Follows a block moved by a realloc
+    void        MoveBlock(void *oldPtr, void *newPtr);
+
+    // Adds the sites of each function together
+    void        GetFunctionTotals(FunctionTotals &totals);
+
+    // Gets the label of a site
+    std::string GetSiteName(const AllocSite &site);
+
+protected:
+    //! The stack being profiled (NULL till lua_newstate returns)
+    LuaStack                                pStack;
+
+    //! The block holding the lua state - freed last by lua_close
+    void *                                  pStateBlock;
+
+    //! File ids of site sources
+    SourceRegistry                          sources;
+
+    //! Cache of the chunk sources seen
+    SourceCache                             sourceCache;
+
+    //! Is sampling on?
+    volatile bool                           running;
+
+    //! Bytes allocated between samples
+    volatile int                            sampleBytes;
+
+    //! Bytes left till the next sample
+    long long                               bytesUntilSample;
+
+    //! Seed for jittering the sample interval
+    unsigned                                seed;
+
+    //! Bytes in use
+    volatile long long                      liveBytes;
+
+    //! Bytes allocated
+    volatile long long                      allocatedBytes;
+
+    //! Number of allocations
+    volatile long long                      numAllocs;
+
+    //! Bytes allocated as of the last Clear
+    long long                               clearedBytes;
+
+    //! Allocations as of the last Clear
+    long long                               clearedAllocs;
+
+    //! Sites by id
+    std::vector<AllocSite>                  sites;
+
+    //! Site ids keyed by file id and line
+    std::map<std::pair<int, int>, int>      siteIds;
+
+    //! Sampled blocks that are still live
+    std::map<void *, SampledBlock>          blocks;
+
+    //! Bumped by Clear so earlier blocks are not charged when freed
+    volatile unsigned                       generation;
+
+    //! Guards the sites against reports and resets
+    SMutex                                  allocMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
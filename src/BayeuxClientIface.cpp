@@ -45,6 +45,7 @@
 #include "BayeuxClientIface.h"
 #include "DebugContext.h"
 #include "LuaBindings.h"
+#include "LunarProbe.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -58,7 +59,7 @@ LUNARPROBE_NS_BEGIN
  */
 //*****************************************************************************
 BayeuxClientIface::BayeuxClientIface(const std::string &name, SBayeuxModule *pModule)
-    : SBayeuxChannel(name, pModule)
+    : SBayeuxChannel(name, pModule), numSubscribers(0), started(false), stopping(false)
 {
 }
 
@@ -73,6 +74,15 @@ BayeuxClientIface::BayeuxClientIface(const std::string &name, SBayeuxModule *pMo
 //*****************************************************************************
 BayeuxClientIface::~BayeuxClientIface()
 {
+    bool running;
+    {
+        SMutexLock subscribersLock(subscribersMutex);
+        running     = started;
+        stopping    = true;
+    }
+
+    if (running)
+        pthread_join(thread, NULL);
 }
 
 //*****************************************************************************
@@ -96,17 +106,169 @@ BayeuxClientIface::~BayeuxClientIface()
 //*****************************************************************************
 void BayeuxClientIface::HandleEvent(const JsonNodePtr &event, JsonNodePtr &output)
 {
+    // any event shows its client is there - unless it is leaving
+    SString clientId(event->Get<SString>("clientId", ""));
+    if (!clientId.empty())
+    {
+        if (event->Get("unsubscribe").Data() != NULL)
+            RemoveSubscriber(clientId);
+        else
+            AddSubscriber(clientId);
+    }
+
     // SString message(event->Get<SString>("command", ""));
     JsonNodePtr message = event->Get("command");
+    if (message.Data() == NULL)
+    {
+        // just a subscribe/unsubscribe
+        output = JsonNodeFactory::NullNode();
+        return ;
+    }
+
+    // the reply is converted from the lua table - it is only turned into
+    // text once, by the http writer
+    GetLuaBindings()->HandleMessage(message, output);
+}
+
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if events can be delivered to clients, ie if the channel
+ *  has been registered with a bayeux module and has subscribers.
+ */
+//*****************************************************************************
+bool BayeuxClientIface::ClientConnected()
+{
+    return pModule != NULL && numSubscribers > 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts a client as subscribed, or notes that it is still there.
+ *
+ *  The first subscriber hooks the stacks for breakpoints.
+ */
+//*****************************************************************************
+void BayeuxClientIface::AddSubscriber(const SString &clientId)
+{
+    {
+        SMutexLock subscribersLock(subscribersMutex);
+
+        time_t  now     = time(NULL);
+        bool    isNew   = subscribers.find(clientId) == subscribers.end();
+        subscribers[clientId] = now;
+        if (!isNew)
+            return ;
+
+        if (!started)
+        {
+            stopping    = false;
+            started     = pthread_create(&thread, NULL, ThreadMain, this) == 0;
+        }
+
+        numSubscribers = subscribers.size();
+        if (numSubscribers > 1)
+            return ;
+    }
+
+    // stacks can start sending events now that someone is listening
+    LunarProbe::GetInstance()->UpdateHooks();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops counting a client as subscribed.
+ */
+//*****************************************************************************
+void BayeuxClientIface::RemoveSubscriber(const SString &clientId)
+{
+    {
+        SMutexLock subscribersLock(subscribersMutex);
+        if (subscribers.erase(clientId) == 0)
+            return ;
+        numSubscribers = subscribers.size();
+        if (numSubscribers > 0)
+            return ;
+    }
+
+    LastSubscriberGone();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops counting the clients that have not been heard from within
+ *  SUBSCRIBER_TIMEOUT seconds - they went without unsubscribing.
+ */
+//*****************************************************************************
+void BayeuxClientIface::ExpireSubscribers(time_t now)
+{
+    {
+        SMutexLock subscribersLock(subscribersMutex);
+        if (subscribers.empty())
+            return ;
+
+        std::map<SString, time_t>::iterator iter = subscribers.begin();
+        while (iter != subscribers.end())
+        {
+            if (now - iter->second > SUBSCRIBER_TIMEOUT)
+                subscribers.erase(iter++);
+            else
+                ++iter;
+        }
+
+        numSubscribers = subscribers.size();
+        if (numSubscribers > 0)
+            return ;
+    }
+
+    LastSubscriberGone();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes the hooks and resumes paused contexts once the last
+ *  subscriber has gone, as when a tcp client disconnects.
+ */
+//*****************************************************************************
+void BayeuxClientIface::LastSubscriberGone()
+{
+    // nobody is listening any more so remove the hooks
+    LunarProbe::GetInstance()->UpdateHooks();
 
-    std::string result;
-    GetLuaBindings()->HandleMessage(message, result);
+    ContextRegistry::Reader reader(debugContexts);
+    for (DebugContextMap::const_iterator iter = reader.Contexts().begin();
+         iter != reader.Contexts().end(); ++iter)
+    {
+        DebugContext *ctx = iter->second;
+        if (ctx != NULL)
+            ctx->Resume();
+    }
+}
 
-    DefaultJsonInputStream<std::string::const_iterator> instream(result.begin(), result.end());
-    DefaultJsonBuilder jbuilder;
-    output = jbuilder.Build(&instream);
+//*****************************************************************************
+/*!
+ *  \brief  Entry point of the expiry thread.
+ */
+//*****************************************************************************
+void *BayeuxClientIface::ThreadMain(void *pArg)
+{
+    ((BayeuxClientIface *)pArg)->Run();
+    return NULL;
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Expires subscribers every EXPIRY_INTERVAL seconds till stopped.
+ */
+//*****************************************************************************
+void BayeuxClientIface::Run()
+{
+    while (!stopping)
+    {
+        usleep(EXPIRY_INTERVAL * 1000000);
+        ExpireSubscribers(time(NULL));
+    }
+}
 
 //*****************************************************************************
 /*!
@@ -125,10 +287,8 @@ void BayeuxClientIface::HandleEvent(const JsonNodePtr &event, JsonNodePtr &outpu
 //*****************************************************************************
 int BayeuxClientIface::SendMessage(const char *data, unsigned datasize)
 {
-    std::cerr << "Here Sending Message: " << pModule << std::endl;
-    if (pModule != NULL)
+    if (ClientConnected())
     {
-        std::cerr << "Sending Message: " << data << std::endl;
         SMutexLock socketWriteLock(socketWriteMutex);
         JsonNodePtr value = JsonNodeFactory::StringNode(SString(data, datasize));
         pModule->DeliverEvent(this, value);
@@ -27,6 +27,9 @@
 #ifndef _BAYEUX_CLIENT_IFACE_H_
 #define _BAYEUX_CLIENT_IFACE_H_
 
+#include <map>
+#include <time.h>
+#include <pthread.h>
 #include "ClientIface.h"
 #include "halley.h"
 
@@ -37,9 +40,24 @@ LUNARPROBE_NS_BEGIN
  *  \class  BayeuxClientIface
  *
  *  \brief  A bayeux (comet) implementation of the debugger.
+ *
+ *  A client is counted as subscribed once an event from its clientId
+ *  reaches the channel (clients announce themselves with a "subscribe"
+ *  event right after subscribing and send a "heartbeat" event every few
+ *  seconds after that) and till it sends an "unsubscribe" event or
+ *  nothing has been heard from it for SUBSCRIBER_TIMEOUT seconds (its
+ *  browser crashed or its network went).  Stacks are only hooked for
+ *  breakpoints while someone is subscribed, as with a tcp client.
  *****************************************************************************/
 class BayeuxClientIface : public ClientIface, public SBayeuxChannel
 {
+public:
+    //! Seconds a subscriber is kept without hearing from it
+    static const int    SUBSCRIBER_TIMEOUT  = 30;
+
+    //! Seconds between checks for subscribers that have timed out
+    static const int    EXPIRY_INTERVAL     = 1;
+
 public:
     // Constructor
     BayeuxClientIface(const std::string &name, SBayeuxModule *pMod_ = NULL);
@@ -50,12 +68,52 @@ public:
     // Sends a message to the client
     virtual int     SendMessage(const char *data, unsigned datasize);
 
+    // Tells if any client is subscribed to the channel
+    virtual bool    ClientConnected();
+
     //! Handles an event.
     virtual void HandleEvent(const JsonNodePtr &event, JsonNodePtr &output);
 
+    // Counts a client as subscribed
+    void            AddSubscriber(const SString &clientId);
+
+    // Stops counting a client as subscribed
+    void            RemoveSubscriber(const SString &clientId);
+
+    // Stops counting clients not heard from within SUBSCRIBER_TIMEOUT
+    void            ExpireSubscribers(time_t now);
+
+private:
+    // Removes the hooks and resumes the contexts once nobody is subscribed
+    void            LastSubscriberGone();
+
+    // Entry point of the expiry thread
+    static void *   ThreadMain(void *pArg);
+
+    // Expires subscribers every EXPIRY_INTERVAL seconds till stopped
+    void            Run();
+
 private:
     //! Write lock on the socket
     SMutex              socketWriteMutex;
+
+    //! Ids of the clients subscribed and when each was last heard from
+    std::map<SString, time_t>   subscribers;
+
+    //! Number of subscribers (read without the lock by the hooks)
+    volatile int        numSubscribers;
+
+    //! Guards the subscribers
+    SMutex              subscribersMutex;
+
+    //! The expiry thread (started with the first subscriber)
+    pthread_t           thread;
+
+    //! Has the thread been started?
+    bool                started;
+
+    //! Set to ask the thread to finish
+    volatile bool       stopping;
 };
 
 LUNARPROBE_NS_END
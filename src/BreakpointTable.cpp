@@ -0,0 +1,577 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   BreakpointTable.cpp
+ *
+ *  \brief  Implementation of the native breakpoint index.
+ */
+//*****************************************************************************
+
+#include <string.h>
+#include <sched.h>
+
+#include "BreakpointTable.h"
+
+LUNARPROBE_NS_BEGIN
+
+const unsigned BITS_PER_WORD    = sizeof(unsigned) * 8;
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if a breakpoint stops on a given hit.
+ *
+ *  \param  hit The number of the hit (the first hit is 1).
+ */
+//*****************************************************************************
+bool BreakpointOptions::StopsAtHit(unsigned hit) const
+{
+    switch (hitMode)
+    {
+        case HIT_EQUALS:    return hit == hitCount;
+        case HIT_MULTIPLE:  return hitCount == 0 || (hit % hitCount) == 0;
+        case HIT_AFTER:     return hit > hitCount;
+        default:            return true;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Parses the name of a hit mode.
+ *
+ *  \return false if the name is not one of "always", "equals",
+ *  "multiple" or "after".
+ */
+//*****************************************************************************
+bool BreakpointOptions::ParseHitMode(const char *name, HitMode &mode)
+{
+    if (name == NULL || strcmp(name, "always") == 0)
+        mode = HIT_ALWAYS;
+    else if (strcmp(name, "equals") == 0)
+        mode = HIT_EQUALS;
+    else if (strcmp(name, "multiple") == 0)
+        mode = HIT_MULTIPLE;
+    else if (strcmp(name, "after") == 0)
+        mode = HIT_AFTER;
+    else
+        return false;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Enters the current epoch.
+ *
+ *  If a writer flips the epoch between reading it and registering, the
+ *  registration is undone and retried so a writer never misses a reader.
+ */
+//*****************************************************************************
+BreakpointTable::Reader::Reader(const BreakpointTable &tab) : table(tab)
+{
+    for (;;)
+    {
+        epoch = table.currentEpoch;
+        __sync_fetch_and_add(&table.numReaders[epoch & 1], 1);
+        if (epoch == table.currentEpoch)
+            break ;
+        __sync_fetch_and_sub(&table.numReaders[epoch & 1], 1);
+    }
+    pBreakpoints = table.pCurrent;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Leaves the epoch entered by the reader.
+ */
+//*****************************************************************************
+BreakpointTable::Reader::~Reader()
+{
+    __sync_fetch_and_sub(&table.numReaders[epoch & 1], 1);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty breakpoint table.
+ */
+//*****************************************************************************
+BreakpointTable::BreakpointTable() :
+    pCurrent(new BreakpointSet()),
+    currentEpoch(0),
+    numLineBreakpoints(0),
+    numFunctionBreakpoints(0),
+    numLineOptions(0),
+    generation(0)
+{
+    numReaders[0] = numReaders[1] = 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+BreakpointTable::~BreakpointTable()
+{
+    for (LineRecordMap::iterator iter = pCurrent->lineRecords.begin();
+         iter != pCurrent->lineRecords.end(); ++iter)
+    {
+        delete iter->second;
+    }
+    for (FunctionRecordMap::iterator iter = pCurrent->functionRecords.begin();
+         iter != pCurrent->functionRecords.end(); ++iter)
+    {
+        delete iter->second;
+    }
+    delete pCurrent;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Adds a breakpoint at a given file and line.
+ *
+ *  Setting a breakpoint that already exists replaces its options.
+ *
+ *  \return true if the breakpoint was added, false if it already existed.
+ */
+//*****************************************************************************
+bool BreakpointTable::SetLineBreakpoint(int fileId, int linenum, const BreakpointOptions &options)
+{
+    if (fileId < 0 || linenum < 0)
+        return false;
+
+    SMutexLock tableLock(tableMutex);
+
+    std::pair<int, int>     key(fileId, linenum);
+    LineRecordMap::iterator iter = pCurrent->lineRecords.find(key);
+
+    // only the options of an existing breakpoint are looked at
+    if (iter != pCurrent->lineRecords.end() && iter->second->options == options)
+        return false;
+
+    std::vector<BreakpointRecord *> retired;
+    BreakpointSet *pNewBreakpoints = new BreakpointSet(*pCurrent);
+    bool added = iter == pCurrent->lineRecords.end();
+
+    if (added)
+    {
+        if (fileId >= (int)pNewBreakpoints->lineBitmaps.size())
+            pNewBreakpoints->lineBitmaps.resize(fileId + 1);
+
+        LineBitmap &bitmap  = pNewBreakpoints->lineBitmaps[fileId];
+        unsigned word       = linenum / BITS_PER_WORD;
+
+        if (word >= bitmap.size())
+            bitmap.resize(word + 1, 0);
+
+        bitmap[word] |= 1u << (linenum % BITS_PER_WORD);
+        numLineBreakpoints++;
+        if (!options.IsPlain())
+            numLineOptions++;
+
+        pNewBreakpoints->lineRecords[key] = new BreakpointRecord("", options);
+    }
+    else
+    {
+        SetOptions(pNewBreakpoints->lineRecords[key], options, true, retired);
+    }
+
+    Publish(pNewBreakpoints, retired);
+
+    return added;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes a breakpoint at a given file and line.
+ *
+ *  \return true if the breakpoint was removed, false if it did not exist.
+ */
+//*****************************************************************************
+bool BreakpointTable::ClearLineBreakpoint(int fileId, int linenum)
+{
+    if (fileId < 0 || linenum < 0)
+        return false;
+
+    SMutexLock tableLock(tableMutex);
+
+    std::pair<int, int>     key(fileId, linenum);
+    LineRecordMap::iterator iter = pCurrent->lineRecords.find(key);
+    if (iter == pCurrent->lineRecords.end())
+        return false;
+
+    std::vector<BreakpointRecord *> retired(1, iter->second);
+    BreakpointSet *pNewBreakpoints = new BreakpointSet(*pCurrent);
+
+    pNewBreakpoints->lineBitmaps[fileId][linenum / BITS_PER_WORD] &= ~(1u << (linenum % BITS_PER_WORD));
+    pNewBreakpoints->lineRecords.erase(key);
+
+    numLineBreakpoints--;
+    if (!iter->second->options.IsPlain())
+        numLineOptions--;
+
+    Publish(pNewBreakpoints, retired);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Adds a breakpoint on entry to a named function.
+ *
+ *  Setting a breakpoint that already exists replaces its options.
+ */
+//*****************************************************************************
+bool BreakpointTable::SetFunctionBreakpoint(const char *funcname, const BreakpointOptions &options)
+{
+    if (funcname == NULL)
+        return false;
+
+    SMutexLock tableLock(tableMutex);
+
+    BreakpointRecord *pRecord = FindFunction(*pCurrent, funcname);
+    if (pRecord != NULL && pRecord->options == options)
+        return false;
+
+    std::vector<BreakpointRecord *> retired;
+    BreakpointSet *pNewBreakpoints = new BreakpointSet(*pCurrent);
+    bool added = pRecord == NULL;
+
+    if (added)
+    {
+        pRecord = new BreakpointRecord(funcname, options);
+        numFunctionBreakpoints++;
+    }
+    else
+    {
+        // the key is the name of the record so it goes with the record
+        pNewBreakpoints->functionRecords.erase(pRecord->name.c_str());
+        SetOptions(pRecord, options, false, retired);
+    }
+    pNewBreakpoints->functionRecords[pRecord->name.c_str()] = pRecord;
+
+    Publish(pNewBreakpoints, retired);
+    return added;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes a breakpoint on a named function.
+ */
+//*****************************************************************************
+bool BreakpointTable::ClearFunctionBreakpoint(const char *funcname)
+{
+    if (funcname == NULL)
+        return false;
+
+    SMutexLock tableLock(tableMutex);
+
+    BreakpointRecord *pRecord = FindFunction(*pCurrent, funcname);
+    if (pRecord == NULL)
+        return false;
+
+    std::vector<BreakpointRecord *> retired(1, pRecord);
+    BreakpointSet *pNewBreakpoints = new BreakpointSet(*pCurrent);
+    pNewBreakpoints->functionRecords.erase(pRecord->name.c_str());
+
+    numFunctionBreakpoints--;
+    Publish(pNewBreakpoints, retired);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Replaces the record of a breakpoint if its options change.
+ *
+ *  Records are never changed once published, so the record is replaced
+ *  (and its hits counted afresh) and the old one retired.  Called with
+ *  the table locked.
+ */
+//*****************************************************************************
+void BreakpointTable::SetOptions(BreakpointRecord *&pRecord, const BreakpointOptions &options,
+                                 bool isLine, std::vector<BreakpointRecord *> &retired)
+{
+    if (pRecord->options == options)
+        return ;
+
+    if (isLine)
+        numLineOptions += (options.IsPlain() ? 0 : 1) - (pRecord->options.IsPlain() ? 0 : 1);
+
+    retired.push_back(pRecord);
+    pRecord = new BreakpointRecord(pRecord->name, options);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes all breakpoints.
+ */
+//*****************************************************************************
+void BreakpointTable::Clear()
+{
+    SMutexLock tableLock(tableMutex);
+
+    std::vector<BreakpointRecord *> retired;
+    for (LineRecordMap::iterator iter = pCurrent->lineRecords.begin();
+         iter != pCurrent->lineRecords.end(); ++iter)
+    {
+        retired.push_back(iter->second);
+    }
+    for (FunctionRecordMap::iterator iter = pCurrent->functionRecords.begin();
+         iter != pCurrent->functionRecords.end(); ++iter)
+    {
+        retired.push_back(iter->second);
+    }
+
+    numLineBreakpoints      = 0;
+    numFunctionBreakpoints  = 0;
+    numLineOptions          = 0;
+
+    Publish(new BreakpointSet(), retired);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Publishes a new set of breakpoints.
+ *
+ *  Must be called with the tableMutex held.  Readers that started before
+ *  the epoch flip may still be using the old set (and the retired
+ *  records) so wait for them to leave before freeing them.
+ */
+//*****************************************************************************
+void BreakpointTable::Publish(BreakpointSet *pNewBreakpoints, std::vector<BreakpointRecord *> &retired)
+{
+    BreakpointSet *pOldBreakpoints = pCurrent;
+
+    pCurrent = pNewBreakpoints;
+    __sync_fetch_and_add(&generation, 1);
+
+    unsigned oldEpoch = __sync_fetch_and_add(&currentEpoch, 1);
+    while (numReaders[oldEpoch & 1] != 0)
+        sched_yield();
+
+    delete pOldBreakpoints;
+    for (std::vector<BreakpointRecord *>::iterator iter = retired.begin(); iter != retired.end(); ++iter)
+        delete *iter;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds the record of a line breakpoint.
+ *
+ *  \return NULL if the line has no breakpoint.
+ */
+//*****************************************************************************
+BreakpointTable::BreakpointRecord *BreakpointTable::FindLine(const BreakpointSet &breakpoints,
+                                                            int fileId, int linenum)
+{
+    LineRecordMap::const_iterator iter = breakpoints.lineRecords.find(std::make_pair(fileId, linenum));
+    return iter == breakpoints.lineRecords.end() ? NULL : iter->second;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds the record of a function breakpoint.
+ *
+ *  \return NULL if the function has no breakpoint.
+ */
+//*****************************************************************************
+BreakpointTable::BreakpointRecord *BreakpointTable::FindFunction(const BreakpointSet &breakpoints,
+                                                                const char *funcname)
+{
+    FunctionRecordMap::const_iterator iter = breakpoints.functionRecords.find(funcname);
+    return iter == breakpoints.functionRecords.end() ? NULL : iter->second;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if a given line has a breakpoint.
+ *
+ *  Called on every line event so returns straight away if there are no
+ *  line breakpoints.
+ */
+//*****************************************************************************
+bool BreakpointTable::IsLineBreakpoint(int fileId, int linenum) const
+{
+    if (numLineBreakpoints == 0 || fileId < 0 || linenum < 0)
+        return false;
+
+    Reader reader(*this);
+    const std::vector<LineBitmap> &lineBitmaps = reader.Breakpoints().lineBitmaps;
+
+    if (fileId >= (int)lineBitmaps.size())
+        return false;
+
+    const LineBitmap &bitmap  = lineBitmaps[fileId];
+    unsigned word             = linenum / BITS_PER_WORD;
+
+    return word < bitmap.size() &&
+           (bitmap[word] & (1u << (linenum % BITS_PER_WORD))) != 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if a given function has a breakpoint.
+ */
+//*****************************************************************************
+bool BreakpointTable::IsFunctionBreakpoint(const char *funcname) const
+{
+    if (numFunctionBreakpoints == 0 || funcname == NULL)
+        return false;
+
+    Reader reader(*this);
+    return FindFunction(reader.Breakpoints(), funcname) != NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts a hit of a breakpoint and tells if it stops.
+ *
+ *  The record stays alive while a reader is held so the hit is counted
+ *  without the lock.
+ */
+//*****************************************************************************
+bool BreakpointTable::Hit(BreakpointRecord &record)
+{
+    unsigned hit = __sync_add_and_fetch(&record.hits, 1);
+    return record.options.StopsAtHit(hit);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts a hit of a line breakpoint.
+ *
+ *  Called from the debug hook once the line has matched (and any
+ *  condition has held).
+ *
+ *  \return true if the hit stops, false if it is ignored (or the line
+ *  has no breakpoint).
+ */
+//*****************************************************************************
+bool BreakpointTable::HitLineBreakpoint(int fileId, int linenum)
+{
+    if (numLineBreakpoints == 0)
+        return false;
+
+    Reader reader(*this);
+    BreakpointRecord *pRecord = FindLine(reader.Breakpoints(), fileId, linenum);
+    return pRecord != NULL && Hit(*pRecord);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts a hit of a function breakpoint.
+ *
+ *  \return true if the hit stops, false if it is ignored (or the
+ *  function has no breakpoint).
+ */
+//*****************************************************************************
+bool BreakpointTable::HitFunctionBreakpoint(const char *funcname)
+{
+    if (numFunctionBreakpoints == 0 || funcname == NULL)
+        return false;
+
+    Reader reader(*this);
+    BreakpointRecord *pRecord = FindFunction(reader.Breakpoints(), funcname);
+    return pRecord != NULL && Hit(*pRecord);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the number of hits of a line breakpoint.
+ */
+//*****************************************************************************
+unsigned BreakpointTable::GetLineHits(int fileId, int linenum) const
+{
+    Reader reader(*this);
+    BreakpointRecord *pRecord = FindLine(reader.Breakpoints(), fileId, linenum);
+    return pRecord == NULL ? 0 : pRecord->hits;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the number of hits of a function breakpoint.
+ */
+//*****************************************************************************
+unsigned BreakpointTable::GetFunctionHits(const char *funcname) const
+{
+    if (funcname == NULL)
+        return 0;
+
+    Reader reader(*this);
+    BreakpointRecord *pRecord = FindFunction(reader.Breakpoints(), funcname);
+    return pRecord == NULL ? 0 : pRecord->hits;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the options of a line breakpoint.
+ *
+ *  \return false if the line has no breakpoint or a plain one.
+ */
+//*****************************************************************************
+bool BreakpointTable::GetLineOptions(int fileId, int linenum, BreakpointOptions &options) const
+{
+    if (numLineOptions == 0)
+        return false;
+
+    Reader reader(*this);
+    BreakpointRecord *pRecord = FindLine(reader.Breakpoints(), fileId, linenum);
+    if (pRecord == NULL || pRecord->options.IsPlain())
+        return false;
+
+    options = pRecord->options;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if any line within a range of a file has a breakpoint.
+ *
+ *  Used to find out if a function (given by its linedefined and
+ *  lastlinedefined) contains a breakpoint at all.
+ */
+//*****************************************************************************
+bool BreakpointTable::HasLineBreakpointInRange(int fileId, int firstline, int lastline) const
+{
+    if (numLineBreakpoints == 0 || fileId < 0 || lastline < 0)
+        return false;
+
+    if (firstline < 0)
+        firstline = 0;
+
+    Reader reader(*this);
+    const std::vector<LineBitmap> &lineBitmaps = reader.Breakpoints().lineBitmaps;
+
+    if (fileId >= (int)lineBitmaps.size())
+        return false;
+
+    const LineBitmap &bitmap  = lineBitmaps[fileId];
+    unsigned firstword        = firstline / BITS_PER_WORD;
+    unsigned lastword         = lastline / BITS_PER_WORD;
+
+    for (unsigned word = firstword; word <= lastword && word < bitmap.size(); word++)
+    {
+        unsigned bits = bitmap[word];
+        if (word == firstword)
+            bits &= ~0u << (firstline % BITS_PER_WORD);
+        if (word == lastword && (lastline % BITS_PER_WORD) != BITS_PER_WORD - 1)
+            bits &= ~(~0u << ((lastline % BITS_PER_WORD) + 1));
+        if (bits != 0)
+            return true;
+    }
+
+    return false;
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,300 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   BreakpointTable.h
+ *
+ *  \brief  Native index of the breakpoints set by the client so the debug
+ *  hook can reject events without entering the debugger lua stack.
+ *
+ *****************************************************************************/
+
+#ifndef _BREAKPOINT_TABLE_H_
+#define _BREAKPOINT_TABLE_H_
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! When a breakpoint stops given the number of times it has been hit
+enum HitMode
+{
+    HIT_ALWAYS,         // every hit
+    HIT_EQUALS,         // only the hitCount-th hit
+    HIT_MULTIPLE,       // every hitCount-th hit
+    HIT_AFTER           // every hit once the first hitCount are ignored
+};
+
+//*****************************************************************************
+/*!
+ *  \class  BreakpointOptions
+ *
+ *  \brief  What a breakpoint does beyond stopping every time it is hit.
+ *
+ *  Only hits for which the condition holds are counted.  A breakpoint
+ *  with a log message is a logpoint - the hits that would stop it queue
+ *  the message instead and the stack carries on.  A snapshot breakpoint
+ *  likewise carries on after capturing the frames and variables of the
+ *  stack.
+ *
+ *****************************************************************************/
+class BreakpointOptions
+{
+public:
+    BreakpointOptions(const char *cond = NULL, HitMode mode = HIT_ALWAYS, unsigned count = 0,
+                      const char *message = NULL, bool snap = false) :
+        condition(cond != NULL ? cond : ""), hitMode(mode), hitCount(count),
+        logMessage(message != NULL ? message : ""), snapshot(snap) { }
+
+    //! Does the breakpoint simply stop every time?
+    bool        IsPlain() const
+    {
+        return condition.empty() && hitMode == HIT_ALWAYS && logMessage.empty() && !snapshot;
+    }
+
+    // Tells if the breakpoint stops on a given hit (counting from 1)
+    bool        StopsAtHit(unsigned hit) const;
+
+    // Parses "always", "equals", "multiple" or "after"
+    static bool ParseHitMode(const char *name, HitMode &mode);
+
+    bool        operator==(const BreakpointOptions &another) const
+    {
+        return condition == another.condition && hitMode == another.hitMode &&
+               hitCount == another.hitCount && logMessage == another.logMessage &&
+               snapshot == another.snapshot;
+    }
+    bool        operator!=(const BreakpointOptions &another) const { return !(*this == another); }
+
+public:
+    //! Lua expression (in the scope of the line) that must be truthy for
+    //! the breakpoint to stop - empty to always stop.  Only line
+    //! breakpoints take conditions.
+    std::string condition;
+
+    //! Which hits stop
+    HitMode     hitMode;
+
+    //! The N of hitMode
+    unsigned    hitCount;
+
+    //! Message logged instead of stopping - empty to stop.  Text within
+    //! braces is a lua expression whose value is put in its place ("{{"
+    //! and "}}" are literal braces).  Only line breakpoints take messages.
+    std::string logMessage;
+
+    //! Take a snapshot (see SnapshotStore) instead of stopping.  Only
+    //! line breakpoints take snapshots.
+    bool        snapshot;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  BreakpointTable
+ *
+ *  \brief  Breakpoints keyed by file id and line number.
+ *
+ *  Files are identified by the ids handed out by the SourceRegistry, each
+ *  of which indexes a bitmap of the lines that have breakpoints.
+ *  Function breakpoints are keyed by name.  The options and hit counts of
+ *  every breakpoint are kept apart from the bitmaps and are only looked
+ *  up once a bitmap has matched.
+ *
+ *  Like the ContextRegistry the breakpoints are an epoch protected, copy
+ *  on write set: writers (the client) copy the current set under the
+ *  mutex, publish the copy and free the old one once its readers have
+ *  left.  Lookups from the debug hook never lock - they enter an epoch
+ *  and read the set they find.  Records are shared between sets
+ *  (changing the options of a breakpoint replaces its record) so their
+ *  hit counts survive unrelated changes and are bumped atomically.
+ *
+ *****************************************************************************/
+class BreakpointTable
+{
+public:
+    // ctor
+    BreakpointTable();
+
+    // dtor
+    virtual ~BreakpointTable();
+
+    // Adds a breakpoint at a given file and line (or changes its options)
+    bool    SetLineBreakpoint(int fileId, int linenum,
+                              const BreakpointOptions &options = BreakpointOptions());
+
+    // Removes a breakpoint at a given file and line
+    bool    ClearLineBreakpoint(int fileId, int linenum);
+
+    // Adds a breakpoint on entry to a named function (or changes its
+    // options)
+    bool    SetFunctionBreakpoint(const char *funcname,
+                                  const BreakpointOptions &options = BreakpointOptions());
+
+    // Removes a breakpoint on a named function
+    bool    ClearFunctionBreakpoint(const char *funcname);
+
+    // Removes all breakpoints
+    void    Clear();
+
+    // Tells if a line has a breakpoint - called from the debug hook
+    bool    IsLineBreakpoint(int fileId, int linenum) const;
+
+    // Tells if a function has a breakpoint - called from the debug hook
+    bool    IsFunctionBreakpoint(const char *funcname) const;
+
+    // Counts a hit of a line breakpoint and tells if it stops
+    bool    HitLineBreakpoint(int fileId, int linenum);
+
+    // Counts a hit of a function breakpoint and tells if it stops
+    bool    HitFunctionBreakpoint(const char *funcname);
+
+    // Gets the number of hits of a line breakpoint
+    unsigned GetLineHits(int fileId, int linenum) const;
+
+    // Gets the number of hits of a function breakpoint
+    unsigned GetFunctionHits(const char *funcname) const;
+
+    // Gets the options of a line breakpoint that is not plain
+    bool    GetLineOptions(int fileId, int linenum, BreakpointOptions &options) const;
+
+    // Tells if any line in a range of a file has a breakpoint
+    bool    HasLineBreakpointInRange(int fileId, int firstline, int lastline) const;
+
+    //! Changes every time a breakpoint is added or removed
+    unsigned Generation() const { return generation; }
+
+    //! Are there any line breakpoints at all?
+    bool    HasLineBreakpoints() const { return numLineBreakpoints > 0; }
+
+    //! Are there any function breakpoints at all?
+    bool    HasFunctionBreakpoints() const { return numFunctionBreakpoints > 0; }
+
+    //! Are there any line breakpoints that are not plain?
+    bool    HasLineOptions() const { return numLineOptions > 0; }
+
+protected:
+    typedef std::vector<unsigned>   LineBitmap;
+
+    //! Options and hits of a breakpoint - only the hits ever change
+    struct BreakpointRecord
+    {
+        BreakpointRecord(const std::string &funcname, const BreakpointOptions &opts) :
+            name(funcname), options(opts), hits(0) { }
+
+        //! Name of the function (function breakpoints only)
+        std::string         name;
+
+        BreakpointOptions   options;
+
+        //! Hits so far (atomic)
+        volatile unsigned   hits;
+    };
+
+    //! Orders names without turning them into strings
+    struct NameLess
+    {
+        bool operator()(const char *a, const char *b) const { return strcmp(a, b) < 0; }
+    };
+
+    //! Line records keyed by file id and line
+    typedef std::map<std::pair<int, int>, BreakpointRecord *>       LineRecordMap;
+
+    //! Function records keyed by their own names
+    typedef std::map<const char *, BreakpointRecord *, NameLess>    FunctionRecordMap;
+
+    //! One published (and from then on immutable) set of breakpoints
+    struct BreakpointSet
+    {
+        //! Bitmap of lines with breakpoints for each file id
+        std::vector<LineBitmap>     lineBitmaps;
+
+        //! Line breakpoints keyed by file id and line
+        LineRecordMap               lineRecords;
+
+        //! Function breakpoints keyed by name
+        FunctionRecordMap           functionRecords;
+    };
+
+    //*************************************************************************
+    /*!
+     *  \class  Reader
+     *
+     *  \brief  Keeps the current set of breakpoints alive while in scope.
+     *************************************************************************/
+    class Reader
+    {
+    public:
+        Reader(const BreakpointTable &table);
+        ~Reader();
+
+        //! The breakpoints as of when the reader was created
+        const BreakpointSet &Breakpoints() const { return *pBreakpoints; }
+
+    private:
+        const BreakpointTable & table;
+        unsigned                epoch;
+        const BreakpointSet *   pBreakpoints;
+    };
+
+    // Replaces the record of a breakpoint if its options change
+    void    SetOptions(BreakpointRecord *&pRecord, const BreakpointOptions &options,
+                       bool isLine, std::vector<BreakpointRecord *> &retired);
+
+    // Publishes a new set and frees the old one after a grace period
+    void    Publish(BreakpointSet *pNewBreakpoints, std::vector<BreakpointRecord *> &retired);
+
+    // Finds the record of a line breakpoint in a set
+    static BreakpointRecord *FindLine(const BreakpointSet &breakpoints, int fileId, int linenum);
+
+    // Finds the record of a function breakpoint in a set
+    static BreakpointRecord *FindFunction(const BreakpointSet &breakpoints, const char *funcname);
+
+    // Counts a hit of a breakpoint and tells if it stops
+    static bool Hit(BreakpointRecord &record);
+
+    //! The current (immutable) set of breakpoints
+    BreakpointSet * volatile        pCurrent;
+
+    //! Epoch readers register against - only the parity is used
+    volatile unsigned               currentEpoch;
+
+    //! Number of readers in each epoch parity
+    mutable volatile int            numReaders[2];
+
+    //! Number of line breakpoints currently set
+    volatile int                    numLineBreakpoints;
+
+    //! Number of function breakpoints currently set
+    volatile int                    numFunctionBreakpoints;
+
+    //! Number of line breakpoints that are not plain
+    volatile int                    numLineOptions;
+
+    //! Bumped on every change so callers can invalidate cached lookups
+    volatile unsigned               generation;
+
+    //! Serialises writers - readers never take it
+    SMutex                          tableMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
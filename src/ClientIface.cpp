@@ -28,6 +28,7 @@
 #include <iostream> 
 #include <string> 
 #include <sstream> 
+#include <stdio.h>
 #include <errno.h>
 #include <assert.h>
 #include <netdb.h>
@@ -41,6 +42,10 @@
 #include "ClientIface.h"
 #include "DebugContext.h"
 #include "LuaBindings.h"
+#include "LunarProbe.h"
+#include "AllocProfiler.h"
+#include "GcMonitor.h"
+#include "JsonEncoder.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -55,7 +60,7 @@ LUNARPROBE_NS_BEGIN
  *      Initial version.
  */
 //*****************************************************************************
-ClientIface::ClientIface() : pLuaBindings(NULL)
+ClientIface::ClientIface() : pLuaBindings(NULL), samplerThread(this), logpoints(this)
 {
 }
 
@@ -70,12 +75,16 @@ ClientIface::ClientIface() : pLuaBindings(NULL)
 //*****************************************************************************
 ClientIface::~ClientIface()
 {
+    // the sampler thread walks the contexts so stop it first
+    samplerThread.Stop();
+    logpoints.Stop();
+
     // remove any debug contexts that wasnt removed (via StopDebugging)
-    for (DebugContextMap::iterator iter = debugContexts.begin();iter != debugContexts.end(); ++iter)
+    std::vector<DebugContext *> remaining;
+    debugContexts.RemoveAll(remaining);
+    for (std::vector<DebugContext *>::iterator iter = remaining.begin();iter != remaining.end(); ++iter)
     {
-        DebugContext *ctx = iter->second;
-        if (ctx != NULL)
-            delete ctx;
+        delete *iter;
     }
 
     if (pLuaBindings != NULL)
@@ -88,6 +97,289 @@ int ClientIface::SendMessage(const char *data, unsigned datasize)
     return 0;
 }
 
+// Tells if a client is connected
+bool ClientIface::ClientConnected()
+{
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the hook events a context needs.
+ *
+ *  Sampling needs count events, tracing needs call and return events and
+ *  coverage needs line events while the running function has lines that
+ *  have not run, whether or not a client is connected.  Everything else
+ *  needs a client.  Function breakpoints only need call
+ *  events and all line events are only needed while a step/next/until is
+ *  in progress.  Line breakpoints on their own only need line events while
+ *  a function containing one is running (see UpdateLineGate).
+ */
+//*****************************************************************************
+int ClientIface::GetHookMask(DebugContext *pContext)
+{
+    int mask = GetHookCount(pContext) > 0 ? LUA_MASKCOUNT : 0;
+
+    if (pContext->tracing)
+        mask |= LUA_MASKCALL | LUA_MASKRET;
+
+    CoverageMap *pCoverage = pContext->pCoverage;
+    if (pCoverage != NULL && pCoverage->Running())
+    {
+        mask |= LUA_MASKCALL | LUA_MASKRET;
+        if (pCoverage->LinesNeeded())
+            mask |= LUA_MASKLINE;
+    }
+
+    if (!ClientConnected())
+        return mask;
+
+    if (breakpoints.HasFunctionBreakpoints())
+        mask |= LUA_MASKCALL;
+
+    switch (pContext->stepMode)
+    {
+        case STEP_STEP:     mask |= LUA_MASKCALL | LUA_MASKLINE; break ;
+        case STEP_NEXT:     mask |= LUA_MASKLINE; break ;
+        case STEP_UNTIL:    mask |= LUA_MASKLINE; break ;
+        case STEP_FINISH:   mask |= LUA_MASKRET; break ;
+        default: break ;
+    }
+
+    if (UsesLineGate(pContext))
+    {
+        mask |= LUA_MASKCALL | LUA_MASKRET;
+
+        // a stale gate is left open till the hook recomputes it
+        if (pContext->lineGateOpen || pContext->lineGateGeneration != breakpoints.Generation())
+            mask |= LUA_MASKLINE;
+    }
+
+    return mask;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the number of instructions between count events of a
+ *  context.
+ *
+ *  \return The count or 0 if the context needs no count events.  Samples
+ *  by interval are armed one at a time by the sampler thread so need no
+ *  count here.
+ */
+//*****************************************************************************
+int ClientIface::GetHookCount(DebugContext *pContext)
+{
+    SamplingProfiler *pSampler = pContext->pSampler;
+    if (pSampler != NULL && pSampler->Running() && pSampler->Mode() == SAMPLE_BY_COUNT)
+        return pSampler->Period();
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts sampling the stack of a context.
+ *
+ *  Restarting a sampler that is already running changes its mode and
+ *  period but keeps the samples collected so far.
+ *
+ *  \param  mode    Whether to sample by instruction count or by time.
+ *  \param  period  Instructions or milliseconds between samples (<= 0
+ *                  for the default).
+ */
+//*****************************************************************************
+bool ClientIface::StartSampling(DebugContext *pContext, SampleMode mode, int period)
+{
+    if (pContext->pSampler == NULL)
+        pContext->pSampler = new SamplingProfiler();
+
+    pContext->pSampler->Start(mode, period);
+
+    if (mode == SAMPLE_BY_INTERVAL)
+        samplerThread.Start();
+
+    LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops sampling the stack of a context.
+ */
+//*****************************************************************************
+void ClientIface::StopSampling(DebugContext *pContext)
+{
+    if (pContext->pSampler != NULL)
+    {
+        pContext->pSampler->Stop();
+        LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the samples of all contexts as folded stacks with the
+ *  name of the context as the outermost frame.
+ */
+//*****************************************************************************
+void ClientIface::WriteSamples(std::ostream &output)
+{
+    ContextRegistry::Reader reader(debugContexts);
+    const DebugContextMap &contexts = reader.Contexts();
+    for (DebugContextMap::const_iterator iter = contexts.begin(); iter != contexts.end(); ++iter)
+    {
+        DebugContext *pContext = iter->second;
+        if (pContext != NULL && pContext->pSampler != NULL)
+            pContext->pSampler->WriteFolded(output, pContext->name.empty() ? "lua" : pContext->name);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the allocation sites of all contexts whose stacks were
+ *  created with an AllocProfiler, under the name of the context.
+ */
+//*****************************************************************************
+void ClientIface::WriteAllocs(std::ostream &output)
+{
+    ContextRegistry::Reader reader(debugContexts);
+    const DebugContextMap &contexts = reader.Contexts();
+    for (DebugContextMap::const_iterator iter = contexts.begin(); iter != contexts.end(); ++iter)
+    {
+        DebugContext *pContext = iter->second;
+        AllocProfiler *pProfiler = pContext != NULL ? AllocProfiler::FromStack(pContext->pStack) : NULL;
+        if (pProfiler != NULL)
+        {
+            output << "==== " << (pContext->name.empty() ? "lua" : pContext->name)
+                   << " (" << pContext->pStack << ") ====\n\n";
+            pProfiler->Write(output);
+            output << "\n";
+        }
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the collector policy and recent cycles of all contexts
+ *  whose stacks are monitored, under the name of the context.
+ */
+//*****************************************************************************
+void ClientIface::WriteGcStats(std::ostream &output)
+{
+    ContextRegistry::Reader reader(debugContexts);
+    const DebugContextMap &contexts = reader.Contexts();
+    for (DebugContextMap::const_iterator iter = contexts.begin(); iter != contexts.end(); ++iter)
+    {
+        DebugContext *pContext = iter->second;
+        GcMonitor *pMonitor = pContext != NULL ? GcMonitor::FromStack(pContext->pStack) : NULL;
+        if (pMonitor != NULL)
+        {
+            output << "==== " << (pContext->name.empty() ? "lua" : pContext->name)
+                   << " (" << pContext->pStack << ") ====\n\n";
+            pMonitor->Write(output);
+            output << "\n";
+        }
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts tracing the calls and returns of a context.
+ *
+ *  Any call tree collected by an earlier trace of the context is
+ *  discarded.
+ */
+//*****************************************************************************
+void ClientIface::StartTracing(DebugContext *pContext)
+{
+    if (!pContext->tracing)
+        tracer.Reset(pContext->pStack);
+
+    tracer.Start();
+    pContext->tracing = true;
+    LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops tracing the calls and returns of a context.  The call
+ *  tree is kept till tracing is started again.
+ */
+//*****************************************************************************
+void ClientIface::StopTracing(DebugContext *pContext)
+{
+    pContext->tracing = false;
+    LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts recording the lines run by a context.
+ *
+ *  Lines recorded by an earlier run are kept till cleared.
+ */
+//*****************************************************************************
+void ClientIface::StartCoverage(DebugContext *pContext)
+{
+    if (pContext->pCoverage == NULL)
+    {
+        // the hook reads pCoverage without a lock so it is only published
+        // once constructed (and only once if two clients race)
+        CoverageMap *pCoverage = new CoverageMap();
+        if (!__sync_bool_compare_and_swap(&pContext->pCoverage, (CoverageMap *)NULL, pCoverage))
+            delete pCoverage;
+    }
+
+    pContext->pCoverage->Start();
+    LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops recording the lines run by a context.
+ */
+//*****************************************************************************
+void ClientIface::StopCoverage(DebugContext *pContext)
+{
+    if (pContext->pCoverage != NULL)
+    {
+        pContext->pCoverage->Stop();
+        LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets the lines run by a context so far.
+ */
+//*****************************************************************************
+void ClientIface::ClearCoverage(DebugContext *pContext)
+{
+    if (pContext->pCoverage != NULL)
+    {
+        pContext->pCoverage->Clear();
+
+        // functions that were complete need line events again
+        LunarProbe::GetInstance()->UpdateHook(pContext->pStack);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the lines run by a context.
+ *
+ *  \return false if coverage was never started for the context.
+ */
+//*****************************************************************************
+bool ClientIface::WriteCoverage(DebugContext *pContext, std::ostream &output, CoverageFormat format)
+{
+    if (pContext->pCoverage == NULL)
+        return false;
+
+    pContext->pCoverage->Write(output, format, sources, pContext->name);
+    return true;
+}
+
 //*****************************************************************************
 /*!
  *  \brief  Gets the debug contexts
@@ -97,7 +389,7 @@ int ClientIface::SendMessage(const char *data, unsigned datasize)
  *      Initial version.
  */
 //*****************************************************************************
-const DebugContextMap &ClientIface::GetContexts() const
+const ContextRegistry &ClientIface::GetContexts() const
 {
     return debugContexts;
 }
@@ -121,7 +413,7 @@ bool ClientIface::StartDebugging(LuaStack pStack, const char *name)
 
     pContext = AddDebugContext(pStack, name);
 
-    return true;
+    return pContext != NULL;
 }
 
 
@@ -136,15 +428,17 @@ bool ClientIface::StartDebugging(LuaStack pStack, const char *name)
 //*****************************************************************************
 bool ClientIface::StopDebugging(LuaStack pStack)
 {
-    DebugContextMap::iterator iter = debugContexts.find(pStack);
+    // only returns once no other thread can still be reading the context
+    DebugContext *pContext = debugContexts.Remove(pStack);
 
-    if (iter != debugContexts.end())
+    if (pContext != NULL)
     {
-        DebugContext *pContext = iter->second;
+        GetLuaBindings()->ContextRemoved(pContext);
 
-        debugContexts.erase(iter);
+        tracer.Reset(pStack);
 
-        GetLuaBindings()->ContextRemoved(pContext);
+        // put watched fields back while the stack is still ours
+        pContext->watchpoints.RemoveAll(pStack, true);
 
         delete pContext;
     }
@@ -156,6 +450,8 @@ bool ClientIface::StopDebugging(LuaStack pStack)
 /*!
  *  \brief  Gets the debug context associated with a lua_State object.
  *
+ *  Called on every hook event so this does not take any locks.
+ *
  *  \version
  *      - S Panyam  23/10/2008
  *      Initial version.
@@ -163,11 +459,7 @@ bool ClientIface::StopDebugging(LuaStack pStack)
 //*****************************************************************************
 DebugContext *ClientIface::GetDebugContext(LuaStack pStack)
 {
-    DebugContextMap::iterator iter = debugContexts.find(pStack);
-    if (iter == debugContexts.end())
-        return NULL;
-
-    return iter->second;
+    return debugContexts.Find(pStack);
 }
 
 //*****************************************************************************
@@ -187,7 +479,11 @@ DebugContext *ClientIface::GetDebugContext(LuaStack pStack)
 DebugContext *ClientIface::AddDebugContext(LuaStack pStack, const char *name)
 {
     DebugContext *pContext = new DebugContext(pStack, name);
-    debugContexts[pStack] = pContext;
+    if (!debugContexts.Add(pContext))
+    {
+        delete pContext;
+        return NULL;
+    }
 
     GetLuaBindings()->ContextAdded(pContext);
 
@@ -214,9 +510,62 @@ void ClientIface::HandleDebugHook(LuaStack pStack, LuaDebug pDebug)
         return ;
     }
 
-    // get the stack info about the curr function
-    lua_getinfo(pStack, "nSluf", pDebug);
-    lua_pop(pStack, 1);     // pop the name of the function off the stack
+    // count events only come from the sampling profiler
+    if (pDebug->event == LUA_HOOKCOUNT)
+    {
+        SamplingProfiler *pSampler = pContext->pSampler;
+        if (pSampler != NULL && pSampler->Running())
+        {
+            pSampler->Sample(pStack, sources, pContext->sourceCache);
+
+            // interval samples are armed one at a time by the sampler thread
+            if (pSampler->Mode() == SAMPLE_BY_INTERVAL)
+                LunarProbe::GetInstance()->UpdateHook(pStack);
+        }
+        return ;
+    }
+
+    // calls and returns are traced without going anywhere near LUA
+    bool haveSource = false;
+    if (pContext->tracing && pDebug->event != LUA_HOOKLINE)
+    {
+        if (pDebug->event == LUA_HOOKCALL)
+        {
+            lua_getinfo(pStack, "S", pDebug);
+            haveSource = true;
+        }
+        tracer.Record(pStack, pDebug, sources, pContext->sourceCache);
+    }
+
+    CoverageMap *pCoverage = pContext->pCoverage;
+    if (pCoverage != NULL && pCoverage->Running())
+        UpdateCoverage(pStack, pContext, pDebug, haveSource);
+
+    // profiling goes on without a client but debugging does not
+    if (!ClientConnected())
+        return ;
+
+    // tail returns have nothing to stop on and the rest only need the
+    // source info up front - names, line and upvalue counts are only
+    // fetched for the events that need them (see StopAt)
+    if (pDebug->event == LUA_HOOKTAILRET)
+    {
+        if (UsesLineGate(pContext))
+        {
+            lua_getinfo(pStack, "S", pDebug);
+            UpdateLineGate(pStack, pContext, pDebug);
+        }
+        return ;
+    }
+
+    if (pDebug->event == LUA_HOOKLINE)
+        lua_getinfo(pStack, "Sl", pDebug);
+    else if (!haveSource)
+        lua_getinfo(pStack, "S", pDebug);
+
+    // switch line events on/off for the function being entered/returned to
+    if (UsesLineGate(pContext))
+        UpdateLineGate(pStack, pContext, pDebug);
 
     // ignore non-lua functions
     if (pDebug->what == NULL || strcasecmp(pDebug->what, "lua") != 0)
@@ -226,43 +575,331 @@ void ClientIface::HandleDebugHook(LuaStack pStack, LuaDebug pDebug)
         return ;
     }
 
+    // Only call into LUA if a breakpoint or the last flow command could
+    // cause a stop here - everything else is rejected natively.
+    StepMode stepMode = pContext->stepMode;
+
     switch (pDebug->event)
     {
         case LUA_HOOKCALL:
         {
-            if (pDebug->name != NULL)
+            if (stepMode == STEP_STEP || breakpoints.HasFunctionBreakpoints())
             {
-                GetLuaBindings()->HandleBreakpoint(pContext, pDebug);
+                // resolving the name walks the caller's code so only
+                // done if a function breakpoint or a step could stop here
+                lua_getinfo(pStack, "n", pDebug);
+                if (pDebug->name != NULL)
+                {
+                    bool isBreakpoint = breakpoints.HitFunctionBreakpoint(pDebug->name);
+                    if (isBreakpoint || stepMode == STEP_STEP)
+                        StopAt(pStack, pContext, pDebug, isBreakpoint);
+                }
             }
         } break ;
         case LUA_HOOKLINE:
         {
             if (pDebug->source[0] == '@')
             {
-                GetLuaBindings()->HandleBreakpoint(pContext, pDebug);
+                int fileId          = sources.GetSourceId(pContext->sourceCache, pDebug->source);
+                bool isBreakpoint   = breakpoints.IsLineBreakpoint(fileId, pDebug->currentline);
+
+                // conditions are evaluated right here in the stack
+                if (isBreakpoint && breakpoints.HasLineOptions())
+                    isBreakpoint = pContext->conditions.ShouldStop(pStack, pDebug, fileId, breakpoints,
+                                                                   this, pContext);
+
+                // only the hits a condition holds for are counted
+                if (isBreakpoint)
+                    isBreakpoint = breakpoints.HitLineBreakpoint(fileId, pDebug->currentline);
+
+                // logpoints and snapshot breakpoints carry on once they
+                // have queued their message or taken their snapshot
+                if (isBreakpoint && breakpoints.HasLineOptions())
+                {
+                    bool logged     = pContext->conditions.Log(pStack, pDebug, fileId, breakpoints,
+                                                               logpoints, pContext);
+                    bool snapshot   = pContext->conditions.Snapshot(pStack, pDebug, fileId, breakpoints,
+                                                                    snapshots, pContext);
+                    if (logged || snapshot)
+                        isBreakpoint = false;
+                }
+                if (isBreakpoint            ||
+                    stepMode == STEP_STEP   ||
+                    stepMode == STEP_NEXT   ||
+                    (stepMode == STEP_UNTIL && pContext->stepLine == pDebug->currentline &&
+                     (pContext->stepFileId < 0 || pContext->stepFileId == fileId)))
+                {
+                    StopAt(pStack, pContext, pDebug, isBreakpoint);
+                }
             }
         } break ;
         case LUA_HOOKRET:
         {
-            GetLuaBindings()->HandleBreakpoint(pContext, pDebug);
+            if (stepMode == STEP_FINISH)
+                StopAt(pStack, pContext, pDebug, false);
+        } break ;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Hands an event that may stop the context over to LUA.
+ *
+ *  The hook only fetches the debug info needed to decide whether to stop,
+ *  so the remaining fields sent to LUA (name, current line and number of
+ *  upvalues) are filled in here.
+ */
+//*****************************************************************************
+void ClientIface::StopAt(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug, bool isBreakpoint)
+{
+    lua_getinfo(pStack, pDebug->event == LUA_HOOKCALL ? "lu" : "nlu", pDebug);
+
+    GetLuaBindings()->HandleBreakpoint(pContext, pDebug, isBreakpoint);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Called by a watched table when a watched field is written.
+ *
+ *  Runs in the metamethod on the thread writing the field - the writer is
+ *  the frame above it.  A "log" watch queues the old and new values as a
+ *  logpoint message would, a "break" watch pauses the context just like
+ *  a breakpoint on the line doing the write (with the id of the watch
+ *  passed on so the client can tell them apart).
+ *
+ *  A "break" watch is logged instead when the context is already paused
+ *  (the write comes from an eval or a condition run by the debugger,
+ *  which must not pause the thread that would resume it) or when no
+ *  client is connected to resume it.
+ *
+ *  \param  oldIndex    Index of the value before the write.
+ *  \param  newIndex    Index of the value written.
+ */
+//*****************************************************************************
+void ClientIface::HitWatchpoint(LuaStack pStack, DebugContext *pContext, Watchpoint &watchpoint,
+                                int oldIndex, int newIndex)
+{
+    __sync_add_and_fetch(&watchpoint.hits, 1);
+
+    lua_Debug ar;
+    memset(&ar, 0, sizeof(ar));
+    if (!lua_getstack(pStack, 1, &ar) && !lua_getstack(pStack, 0, &ar))
+        return ;
+    lua_getinfo(pStack, "nSlu", &ar);
+
+    if (watchpoint.action == WATCH_LOG || !pContext->running || !ClientConnected())
+    {
+        std::string text = watchpoint.key + ": ";
+        LuaUtils::AppendValue(pStack, oldIndex, text);
+        text += " -> ";
+        LuaUtils::AppendValue(pStack, newIndex, text);
+
+        int fileId = sources.GetSourceId(pContext->sourceCache, ar.source);
+        logpoints.Push(pContext, fileId, ar.currentline, text);
+    }
+    else
+    {
+        // paused just as a breakpoint on the writing line would be
+        ar.event = LUA_HOOKLINE;
+        GetLuaBindings()->HandleBreakpoint(pContext, &ar, true, watchpoint.id);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells the client that a breakpoint condition did not compile or
+ *  raised an error.
+ *
+ *  Runs in the hook of the context that hit the breakpoint (which then
+ *  stops as if the condition held), so the event is built natively rather
+ *  than through the debugger lua stack.
+ */
+//*****************************************************************************
+void ClientIface::SendConditionError(DebugContext *pContext, int fileId, int line,
+                                     const std::string &condition, const std::string &error)
+{
+    if (!ClientConnected())
+        return ;
+
+    char header[96];
+    snprintf(header, sizeof(header),
+             "{\"type\": \"Event\", \"event\": \"ConditionError\", \"data\": {\"context\": \"%p\", \"file\": ",
+             pContext);
+
+    std::string message = header;
+    std::string file    = sources.GetFileName(fileId);
+    JsonEncoder::EncodeString(message, file.data(), file.size());
+
+    char position[32];
+    snprintf(position, sizeof(position), ", \"line\": %d, \"condition\": ", line);
+    message += position;
+    JsonEncoder::EncodeString(message, condition.data(), condition.size());
+
+    message += ", \"error\": ";
+    JsonEncoder::EncodeString(message, error.data(), error.size());
+    message += "}}";
+
+    SendMessage(message.c_str(), message.size());
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if line events of a context are switched on and off per
+ *  function.
+ *
+ *  This is the case when there are line breakpoints but no flow command
+ *  that needs every line.
+ */
+//*****************************************************************************
+bool ClientIface::UsesLineGate(DebugContext *pContext)
+{
+    StepMode stepMode = pContext->stepMode;
+    return breakpoints.HasLineBreakpoints() &&
+           stepMode != STEP_STEP && stepMode != STEP_NEXT && stepMode != STEP_UNTIL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Switches line events on or off depending on whether the
+ *  function that is running contains a breakpoint.
+ *
+ *  Called on call events (the callee becomes the running function) and
+ *  return events (the caller becomes the running function again).  The
+ *  caller is looked up on return rather than kept on a shadow stack so
+ *  that frames unwound by errors cannot leave the gate out of sync.
+ */
+//*****************************************************************************
+void ClientIface::UpdateLineGate(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug)
+{
+    unsigned    generation  = breakpoints.Generation();
+    bool        stale       = pContext->lineGateGeneration != generation;
+    bool        gateOpen    = pContext->lineGateOpen;
+
+    if (stale)
+    {
+        // breakpoints have changed since the gate was last computed
+        pContext->lineGateCache.clear();
+        pContext->lineGateGeneration = generation;
+        gateOpen = FunctionHasBreakpoints(pContext, pDebug);
+    }
+
+    switch (pDebug->event)
+    {
+        case LUA_HOOKCALL:
+        {
+            // C functions run no lines so keep the caller's gate
+            if (strcmp(pDebug->what, "C") != 0)
+                gateOpen = FunctionHasBreakpoints(pContext, pDebug);
+        } break ;
+        case LUA_HOOKRET:
+        case LUA_HOOKTAILRET:
+        {
+            lua_Debug caller;
+            gateOpen = lua_getstack(pStack, 1, &caller) != 0    &&
+                       lua_getinfo(pStack, "S", &caller) != 0   &&
+                       FunctionHasBreakpoints(pContext, &caller);
         } break ;
-        case LUA_HOOKCOUNT:
+    }
+
+    if (stale || gateOpen != pContext->lineGateOpen)
+    {
+        pContext->lineGateOpen = gateOpen;
+        LunarProbe::GetInstance()->UpdateHook(pStack);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if a function has any line breakpoints.
+ *
+ *  Functions are identified by their file and the line they are defined
+ *  on (which identifies the function prototype regardless of how many
+ *  closures are made from it).  Results are cached per context until the
+ *  breakpoints change.
+ *
+ *  \param  pDebug  Debug info of the function with at least the "S"
+ *                  fields filled in.
+ */
+//*****************************************************************************
+bool ClientIface::FunctionHasBreakpoints(DebugContext *pContext, LuaDebug pDebug)
+{
+    if (pDebug->what == NULL || strcasecmp(pDebug->what, "lua") != 0 ||
+        pDebug->source == NULL || pDebug->source[0] != '@')
+    {
+        return false;
+    }
+
+    int fileId = sources.GetSourceId(pContext->sourceCache, pDebug->source);
+
+    std::pair<int, int> key(fileId, pDebug->linedefined);
+    std::map<std::pair<int, int>, bool>::iterator iter = pContext->lineGateCache.find(key);
+    if (iter != pContext->lineGateCache.end())
+        return iter->second;
+
+    bool result = breakpoints.HasLineBreakpointInRange(fileId,
+                                                       pDebug->linedefined,
+                                                       pDebug->lastlinedefined);
+    pContext->lineGateCache[key] = result;
+    return result;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Records a line of the running function or makes the function
+ *  being entered/returned to the running function.
+ *
+ *  Like the line gate, the caller is looked up on return so frames
+ *  unwound by errors cannot leave the running function out of sync.
+ *  Line events are switched off while the running function has no lines
+ *  left to run.
+ *
+ *  \param  haveSource  Whether the "S" fields of pDebug are filled in -
+ *                      set if they are filled in here.
+ */
+//*****************************************************************************
+void ClientIface::UpdateCoverage(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug, bool &haveSource)
+{
+    CoverageMap *   pCoverage   = pContext->pCoverage;
+    bool            linesNeeded = pCoverage->LinesNeeded();
+
+    switch (pDebug->event)
+    {
+        case LUA_HOOKCALL:
         {
-            /*
-            std::cerr << "========================================================" << std::endl << std::endl
-                      << "LUA_HOOKCOUNT not yet handled..........." << std::endl << std::endl
-                      << "========================================================" << std::endl << std::endl;
-            */
+            if (!haveSource)
+            {
+                lua_getinfo(pStack, "S", pDebug);
+                haveSource = true;
+            }
+            pCoverage->Enter(pStack, pDebug, sources, pContext->sourceCache);
         } break ;
+        case LUA_HOOKRET:
         case LUA_HOOKTAILRET:
         {
-            // can come here with a "step", "next" or "return"
-            // leave it out for now
-            std::cerr << "========================================================" << std::endl << std::endl
-                      << "LUA_HOOKTAILRET not yet handled ..........." << std::endl << std::endl
-                      << "========================================================" << std::endl << std::endl;
+            lua_Debug caller;
+            if (lua_getstack(pStack, 1, &caller) != 0 && lua_getinfo(pStack, "S", &caller) != 0)
+                pCoverage->Enter(pStack, &caller, sources, pContext->sourceCache);
+            else
+                pCoverage->Leave();
+        } break ;
+        case LUA_HOOKLINE:
+        {
+            // the function is only looked up if it started before coverage
+            if (pCoverage->HasCurrent())
+            {
+                lua_getinfo(pStack, "l", pDebug);
+            }
+            else
+            {
+                lua_getinfo(pStack, "Sl", pDebug);
+                pCoverage->Enter(pStack, pDebug, sources, pContext->sourceCache);
+            }
+            pCoverage->Hit(pDebug->currentline);
         } break ;
     }
+
+    if (linesNeeded != pCoverage->LinesNeeded())
+        LunarProbe::GetInstance()->UpdateHook(pStack);
 }
 
 //*****************************************************************************
@@ -29,11 +29,18 @@
 
 #include <map>
 #include "LuaUtils.h"
+#include "BreakpointTable.h"
+#include "ContextRegistry.h"
+#include "SourceRegistry.h"
+#include "SamplingProfiler.h"
+#include "TracingProfiler.h"
+#include "CoverageMap.h"
+#include "LogpointQueue.h"
+#include "SnapshotStore.h"
+#include "WatchpointTable.h"
 
 LUNARPROBE_NS_BEGIN
 
-typedef std::map<LuaStack , DebugContext *> DebugContextMap;
-
 //*****************************************************************************
 /*!
  *  \class  ClientIface
@@ -60,8 +67,73 @@ public:
     //! Sends a message to the connected client
     virtual int     SendMessage(const char *data, unsigned datasize);
 
-    //! Get a list of debug contexts
-    const DebugContextMap &GetContexts() const;
+    //! Tells if a client is connected to receive events
+    virtual bool    ClientConnected();
+
+    //! Called by a watched table when a watched field is written
+    virtual void    HitWatchpoint(LuaStack pStack, DebugContext *pContext, Watchpoint &watchpoint,
+                                  int oldIndex, int newIndex);
+
+    //! Tells the client that a breakpoint condition did not compile or failed
+    virtual void    SendConditionError(DebugContext *pContext, int fileId, int line,
+                                       const std::string &condition, const std::string &error);
+
+    //! Gets the hook events a context needs given the current debug state
+    virtual int     GetHookMask(DebugContext *pContext);
+
+    //! Gets the instruction count for the count hook of a context
+    virtual int     GetHookCount(DebugContext *pContext);
+
+    //! Starts sampling the stack of a context
+    bool            StartSampling(DebugContext *pContext, SampleMode mode, int period);
+
+    //! Stops sampling the stack of a context
+    void            StopSampling(DebugContext *pContext);
+
+    //! Writes the samples of all contexts as folded stacks
+    void            WriteSamples(std::ostream &output);
+
+    //! Writes the allocation sites of all contexts with profiled allocators
+    void            WriteAllocs(std::ostream &output);
+
+    //! Writes the collector policy and recent cycles of all contexts
+    void            WriteGcStats(std::ostream &output);
+
+    //! Starts tracing the calls and returns of a context
+    void            StartTracing(DebugContext *pContext);
+
+    //! Stops tracing the calls and returns of a context
+    void            StopTracing(DebugContext *pContext);
+
+    //! Starts recording the lines run by a context
+    void            StartCoverage(DebugContext *pContext);
+
+    //! Stops recording the lines run by a context
+    void            StopCoverage(DebugContext *pContext);
+
+    //! Forgets the lines run by a context so far
+    void            ClearCoverage(DebugContext *pContext);
+
+    //! Writes the lines run by a context as an lcov or cobertura report
+    bool            WriteCoverage(DebugContext *pContext, std::ostream &output, CoverageFormat format);
+
+    //! Get the tracing profiler shared by all contexts
+    TracingProfiler &   GetTracer() { return tracer; }
+
+    //! Get the debug contexts - enumerate under a ContextRegistry::Reader
+    const ContextRegistry &GetContexts() const;
+
+    //! Get the breakpoints shared by all contexts
+    BreakpointTable &   GetBreakpoints() { return breakpoints; }
+
+    //! Get the file ids of chunk sources and client paths
+    SourceRegistry &    GetSources() { return sources; }
+
+    //! Get the queue logpoint messages are sent to the client through
+    LogpointQueue &     GetLogpoints() { return logpoints; }
+
+    //! Get the snapshots taken by snapshot breakpoints
+    SnapshotStore &     GetSnapshots() { return snapshots; }
 
 protected:
     // Generic functions
@@ -70,12 +142,46 @@ protected:
     // Get the lua bindings for the debugger
     LuaBindings *       GetLuaBindings();
 
+    // Fills in the rest of the debug info and passes a possible stop to LUA
+    void                StopAt(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug, bool isBreakpoint);
+
+    // Tells if line events of a context are switched per function
+    bool                UsesLineGate(DebugContext *pContext);
+
+    // Switches line events on or off as functions are entered and left
+    void                UpdateLineGate(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug);
+
+    // Tells if the function described by a lua_Debug has line breakpoints
+    bool                FunctionHasBreakpoints(DebugContext *pContext, LuaDebug pDebug);
+
+    // Records a line or switches line events as functions are entered
+    // and left while coverage is on
+    void                UpdateCoverage(LuaStack pStack, DebugContext *pContext, LuaDebug pDebug, bool &haveSource);
+
 protected:
     //! List of debug contexts
-    DebugContextMap   debugContexts;
+    ContextRegistry     debugContexts;
 
     //! the actual lua binding for the debugger exposed to LUA
     LuaBindings *       pLuaBindings;
+
+    //! Breakpoints checked by the hook before calling into LUA
+    BreakpointTable     breakpoints;
+
+    //! Canonical file ids that breakpoints are keyed by
+    SourceRegistry      sources;
+
+    //! Arms the hooks of contexts sampled by interval
+    SamplerThread       samplerThread;
+
+    //! Call trees of traced contexts
+    TracingProfiler     tracer;
+
+    //! Messages of logpoints waiting to be sent
+    LogpointQueue       logpoints;
+
+    //! Snapshots taken by snapshot breakpoints
+    SnapshotStore       snapshots;
 };
 
 LUNARPROBE_NS_END
@@ -0,0 +1,575 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ConditionCache.cpp
+ *
+ *  \brief  Implementation of compiled breakpoint conditions.
+ */
+//*****************************************************************************
+
+
+#include <stdio.h>
+
+#include "ConditionCache.h"
+#include "BreakpointTable.h"
+#include "LogpointQueue.h"
+#include "SnapshotStore.h"
+#include "LuaUtils.h"
+#include "ClientIface.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Quotes text as a lua string literal.
+ */
+//*****************************************************************************
+static std::string QuoteLiteral(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (size_t i = 0;i < text.size();i++)
+    {
+        unsigned char ch = text[i];
+        if (ch == '"' || ch == '\\')
+        {
+            quoted += '\\';
+            quoted += ch;
+        }
+        else if (ch < 0x20)
+        {
+            char buff[8];
+            snprintf(buff, sizeof(buff), "\\%03d", ch);
+            quoted += buff;
+        }
+        else
+        {
+            quoted += ch;
+        }
+    }
+    return quoted + "\"";
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Turns a log message template into the list of expressions
+ *  returned by its compiled function.
+ *
+ *  Literal text is quoted and "{expr}" becomes "(expr)" - braces may nest
+ *  within the expression (eg a table constructor).  "{{" and "}}" are
+ *  literal braces and so is a brace that is never closed.
+ */
+//*****************************************************************************
+static std::string MessagePieces(const std::string &message)
+{
+    std::string pieces;
+    std::string literal;
+    size_t      length = message.size();
+
+    for (size_t i = 0;i < length;)
+    {
+        char ch = message[i];
+        if ((ch == '{' || ch == '}') && i + 1 < length && message[i + 1] == ch)
+        {
+            literal += ch;
+            i += 2;
+            continue ;
+        }
+
+        size_t end = length;
+        if (ch == '{')
+        {
+            int depth = 0;
+            for (end = i;end < length;end++)
+            {
+                if (message[end] == '{')
+                    depth++;
+                else if (message[end] == '}' && --depth == 0)
+                    break ;
+            }
+        }
+
+        if (end >= length)
+        {
+            literal += ch;
+            i++;
+            continue ;
+        }
+
+        if (!literal.empty())
+        {
+            pieces += (pieces.empty() ? "" : ", ") + QuoteLiteral(literal);
+            literal.clear();
+        }
+
+        // the newline keeps a trailing comment from eating the rest
+        pieces += (pieces.empty() ? "(" : ", (") + message.substr(i + 1, end - i - 1) + "\n)";
+        i = end + 1;
+    }
+
+    if (!literal.empty() || pieces.empty())
+        pieces += (pieces.empty() ? "" : ", ") + QuoteLiteral(literal);
+
+    return pieces;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty cache.
+ */
+//*****************************************************************************
+ConditionCache::ConditionCache() : generation(~0u)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ *
+ *  The compiled functions are left to the stack (which may already be
+ *  closed) and are collected along with it.
+ */
+//*****************************************************************************
+ConditionCache::~ConditionCache()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds the entry for the current line, fetching its condition
+ *  and message from the breakpoint table the first time.
+ */
+//*****************************************************************************
+ConditionCache::CompiledCondition &ConditionCache::Lookup(LuaStack pStack, LuaDebug pDebug,
+                                                          int fileId, BreakpointTable &breakpoints)
+{
+    if (generation != breakpoints.Generation())
+    {
+        Reset(pStack);
+        generation = breakpoints.Generation();
+    }
+
+    std::pair<int, int> key(fileId, pDebug->currentline);
+    std::map<std::pair<int, int>, CompiledCondition>::iterator iter = conditions.find(key);
+    if (iter == conditions.end())
+    {
+        BreakpointOptions options;
+        breakpoints.GetLineOptions(fileId, pDebug->currentline, options);
+        iter = conditions.insert(std::make_pair(key, CompiledCondition())).first;
+        iter->second.condition  = options.condition;
+        iter->second.message    = options.logMessage;
+        iter->second.snapshot   = options.snapshot;
+    }
+
+    return iter->second;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if a line breakpoint that was hit should stop the stack.
+ *
+ *  Called from the hook on a line event once the breakpoint table has
+ *  matched the line.  Breakpoints without a condition always stop, so do
+ *  conditions that fail to compile or raise an error (after reporting
+ *  it to the client) so that a broken condition is noticed.
+ */
+//*****************************************************************************
+bool ConditionCache::ShouldStop(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                                ClientIface *pClientIface, DebugContext *pContext)
+{
+    if (!breakpoints.HasLineOptions())
+        return true;
+
+    CompiledCondition &compiled = Lookup(pStack, pDebug, fileId, breakpoints);
+    if (compiled.condition.empty())
+        return true;
+
+    compiled.conditionError.clear();
+    if (compiled.funcRef == LUA_NOREF)
+        Compile(pStack, pDebug, compiled);
+
+    int result = 1;
+    if (compiled.funcRef != LUA_REFNIL)
+    {
+        result = Evaluate(pStack, pDebug, compiled);
+        if (result < 0)
+        {
+            // a different scope on the same line (eg another function)
+            Release(pStack, compiled);
+            Compile(pStack, pDebug, compiled);
+            result = compiled.funcRef == LUA_REFNIL ? 1 : Evaluate(pStack, pDebug, compiled);
+        }
+    }
+
+    if (!compiled.conditionError.empty())
+    {
+        pClientIface->SendConditionError(pContext, fileId, pDebug->currentline,
+                                         compiled.condition, compiled.conditionError);
+    }
+
+    return result != 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Queues the message of a logpoint that was hit.
+ *
+ *  Called from the hook once the condition and hit count have decided
+ *  that the breakpoint would stop.  A logpoint queues its message instead
+ *  and the stack carries on - the message is formatted right here (so it
+ *  shows the values as they are now) and sent later by the writer of the
+ *  queue.  A message that fails to compile or raises an error logs the
+ *  error instead.
+ *
+ *  \return true if the breakpoint is a logpoint (and must not stop).
+ */
+//*****************************************************************************
+bool ConditionCache::Log(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                         LogpointQueue &queue, DebugContext *pContext)
+{
+    CompiledCondition &compiled = Lookup(pStack, pDebug, fileId, breakpoints);
+    if (compiled.message.empty())
+        return false;
+
+    if (compiled.messageRef == LUA_NOREF)
+        Compile(pStack, pDebug, compiled);
+
+    std::string text;
+    if (compiled.messageRef == LUA_REFNIL)
+    {
+        text = compiled.messageError;
+    }
+    else if (!Format(pStack, pDebug, compiled, text))
+    {
+        Release(pStack, compiled);
+        Compile(pStack, pDebug, compiled);
+        if (compiled.messageRef == LUA_REFNIL || !Format(pStack, pDebug, compiled, text))
+            text = compiled.messageError;
+    }
+
+    queue.Push(pContext, fileId, pDebug->currentline, text);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Takes a snapshot for a snapshot breakpoint that was hit.
+ *
+ *  Called from the hook once the condition and hit count have decided
+ *  that the breakpoint would stop.  Hits the store throttles still carry
+ *  on without stopping.
+ *
+ *  \return true if the breakpoint takes snapshots (and must not stop).
+ */
+//*****************************************************************************
+bool ConditionCache::Snapshot(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                              SnapshotStore &store, DebugContext *pContext)
+{
+    CompiledCondition &compiled = Lookup(pStack, pDebug, fileId, breakpoints);
+    if (!compiled.snapshot)
+        return false;
+
+    store.Capture(pStack, pContext, fileId, pDebug->currentline);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Compiles a condition in the scope of the running function.
+ *
+ *  The upvalues of the function and the locals in scope (less the
+ *  temporaries) become the parameters of the compiled function, in that
+ *  order so that locals shadow upvalues and inner locals shadow outer
+ *  ones just as they do in the function itself.  Names that are neither
+ *  are looked up in the environment of the running function.
+ *
+ *  The log message (if any) is compiled with the same parameters.
+ *
+ *  \return false if either does not compile (its reference is then
+ *  LUA_REFNIL so it is not tried again).
+ */
+//*****************************************************************************
+bool ConditionCache::Compile(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled)
+{
+    int top = lua_gettop(pStack);
+
+    lua_getinfo(pStack, "f", pDebug);
+    int funcIndex = lua_gettop(pStack);
+
+    std::string params;
+    compiled.upvalueNames.clear();
+    compiled.localNames.clear();
+    compiled.localBound.clear();
+
+    for (int i = 1;;i++)
+    {
+        const char *name = lua_getupvalue(pStack, funcIndex, i);
+        if (name == NULL)
+            break ;
+        lua_pop(pStack, 1);
+
+        compiled.upvalueNames.push_back(name);
+        params += (params.empty() ? "" : ", ") + std::string(name);
+    }
+
+    for (int i = 1;;i++)
+    {
+        const char *name = lua_getlocal(pStack, pDebug, i);
+        if (name == NULL)
+            break ;
+        lua_pop(pStack, 1);
+
+        // temporaries like "(for index)" cannot be named
+        bool bound = name[0] != '(';
+        compiled.localNames.push_back(name);
+        compiled.localBound.push_back(bound);
+        if (bound)
+            params += (params.empty() ? "" : ", ") + std::string(name);
+    }
+
+    bool        result = true;
+    std::string error;
+
+    compiled.funcRef = LUA_REFNIL;
+    if (!compiled.condition.empty())
+    {
+        // the newline keeps a trailing comment in the condition from
+        // eating the rest of the chunk
+        compiled.funcRef = CompileChunk(pStack, funcIndex, params,
+                                        "(" + compiled.condition + "\n)", error);
+        if (compiled.funcRef == LUA_REFNIL)
+        {
+            compiled.conditionError = "Cannot compile breakpoint condition: " + error;
+            result = false;
+        }
+    }
+
+    compiled.messageRef = LUA_REFNIL;
+    if (!compiled.message.empty())
+    {
+        compiled.messageRef = CompileChunk(pStack, funcIndex, params,
+                                           MessagePieces(compiled.message), error);
+        if (compiled.messageRef == LUA_REFNIL)
+        {
+            compiled.messageError = "Cannot compile log message: " + error;
+            result = false;
+        }
+    }
+
+    lua_settop(pStack, top);
+    return result;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Compiles "function(params) return body end" with the
+ *  environment of the function at funcIndex.
+ *
+ *  \return the registry reference of the function or LUA_REFNIL (with
+ *  the reason in error) if it does not compile.
+ */
+//*****************************************************************************
+int ConditionCache::CompileChunk(LuaStack pStack, int funcIndex, const std::string &params,
+                                 const std::string &body, std::string &error)
+{
+    int         top     = lua_gettop(pStack);
+    int         ref     = LUA_REFNIL;
+    std::string chunk   = "return function(" + params + ") return " + body + " end";
+
+    if (luaL_loadbuffer(pStack, chunk.c_str(), chunk.size(), "=condition") == 0)
+    {
+        lua_getfenv(pStack, funcIndex);
+        lua_setfenv(pStack, -2);
+        if (lua_pcall(pStack, 0, 1, 0) == 0)
+            ref = luaL_ref(pStack, LUA_REGISTRYINDEX);
+    }
+
+    if (ref == LUA_REFNIL)
+    {
+        const char *reason = lua_tostring(pStack, -1);
+        error = reason != NULL ? reason : "unknown error";
+    }
+
+    lua_settop(pStack, top);
+    return ref;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a compiled function followed by the values of the
+ *  upvalues and locals of the running function.
+ *
+ *  \return the number of arguments pushed, -1 if the upvalues or locals
+ *  in scope are not the ones the function was compiled with and -2 if
+ *  the stack cannot grow (the stack is left as it was for both).
+ */
+//*****************************************************************************
+int ConditionCache::PushCall(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled, int funcRef)
+{
+    int numUpvalues = compiled.upvalueNames.size();
+    int numLocals   = compiled.localNames.size();
+    int top         = lua_gettop(pStack);
+
+    if (!lua_checkstack(pStack, numUpvalues + numLocals + 3))
+        return -2;
+
+    lua_getinfo(pStack, "f", pDebug);
+    int funcIndex = lua_gettop(pStack);
+
+    lua_rawgeti(pStack, LUA_REGISTRYINDEX, funcRef);
+
+    int nargs = 0;
+    for (int i = 0;i < numUpvalues;i++, nargs++)
+    {
+        const char *name = lua_getupvalue(pStack, funcIndex, i + 1);
+        if (name == NULL || compiled.upvalueNames[i] != name)
+        {
+            lua_settop(pStack, top);
+            return -1;
+        }
+    }
+
+    for (int i = 0;i < numLocals;i++)
+    {
+        const char *name = lua_getlocal(pStack, pDebug, i + 1);
+        if (name == NULL || compiled.localNames[i] != name)
+        {
+            lua_settop(pStack, top);
+            return -1;
+        }
+
+        if (compiled.localBound[i])
+            nargs++;
+        else
+            lua_pop(pStack, 1);
+    }
+
+    // a local or upvalue that was not there when compiled could shadow a
+    // name in the condition
+    if (lua_getupvalue(pStack, funcIndex, numUpvalues + 1) != NULL ||
+        lua_getlocal(pStack, pDebug, numLocals + 1) != NULL)
+    {
+        lua_settop(pStack, top);
+        return -1;
+    }
+
+    return nargs;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Calls a compiled condition with the values of the upvalues and
+ *  locals of the running function.
+ *
+ *  \return 1 if the condition is truthy (or raised an error), 0 if not
+ *  and -1 if the upvalues or locals in scope are not the ones the
+ *  condition was compiled with.
+ */
+//*****************************************************************************
+int ConditionCache::Evaluate(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled)
+{
+    int top     = lua_gettop(pStack);
+    int nargs   = PushCall(pStack, pDebug, compiled, compiled.funcRef);
+    if (nargs < 0)
+        return nargs == -1 ? -1 : 1;
+
+    int result = 1;
+    if (lua_pcall(pStack, nargs, 1, 0) == 0)
+    {
+        result = lua_toboolean(pStack, -1) ? 1 : 0;
+    }
+    else
+    {
+        const char *error = lua_tostring(pStack, -1);
+        compiled.conditionError = std::string("Breakpoint condition failed: ") + (error ? error : "?");
+    }
+
+    lua_settop(pStack, top);
+    return result;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Calls a compiled log message and formats the values it returns.
+ *
+ *  Values are formatted by LuaUtils::AppendValue so no metamethods run
+ *  in the middle of the hook.  An error raised by an expression becomes
+ *  the text.
+ *
+ *  \return false if the upvalues or locals in scope are not the ones the
+ *  message was compiled with.
+ */
+//*****************************************************************************
+bool ConditionCache::Format(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled, std::string &text)
+{
+    int top     = lua_gettop(pStack);
+    int nargs   = PushCall(pStack, pDebug, compiled, compiled.messageRef);
+    if (nargs == -1)
+        return false;
+
+    if (nargs < 0)
+    {
+        text = "Cannot format log message: stack overflow";
+        return true;
+    }
+
+    // the function sits above the function of the frame pushed by PushCall
+    int first = top + 2;
+    if (lua_pcall(pStack, nargs, LUA_MULTRET, 0) != 0)
+    {
+        const char *error = lua_tostring(pStack, -1);
+        text = error != NULL ? error : "unknown error";
+        lua_settop(pStack, top);
+        return true;
+    }
+
+    text.clear();
+    for (int i = first, last = lua_gettop(pStack);i <= last && text.size() < LogpointQueue::MAX_TEXT;i++)
+        LuaUtils::AppendValue(pStack, i, text);
+
+    lua_settop(pStack, top);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Releases the compiled functions of an entry.
+ */
+//*****************************************************************************
+void ConditionCache::Release(LuaStack pStack, CompiledCondition &compiled)
+{
+    luaL_unref(pStack, LUA_REGISTRYINDEX, compiled.funcRef);
+    luaL_unref(pStack, LUA_REGISTRYINDEX, compiled.messageRef);
+    compiled.funcRef    = LUA_NOREF;
+    compiled.messageRef = LUA_NOREF;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Releases all compiled conditions.
+ */
+//*****************************************************************************
+void ConditionCache::Reset(LuaStack pStack)
+{
+    for (std::map<std::pair<int, int>, CompiledCondition>::iterator iter = conditions.begin();
+         iter != conditions.end(); ++iter)
+    {
+        Release(pStack, iter->second);
+    }
+    conditions.clear();
+}
+
+LUNARPROBE_NS_END
+
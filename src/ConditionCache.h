@@ -0,0 +1,164 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ConditionCache.h
+ *
+ *  \brief  Breakpoint conditions compiled into functions of the stack
+ *  being debugged.
+ *
+ *****************************************************************************/
+
+#ifndef _CONDITION_CACHE_H_
+#define _CONDITION_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "lpfwddefs.h"
+
+LUNARPROBE_NS_BEGIN
+
+class BreakpointTable;
+class LogpointQueue;
+class SnapshotStore;
+
+//*****************************************************************************
+/*!
+ *  \class  ConditionCache
+ *
+ *  \brief  Decides whether a line breakpoint that was hit should stop.
+ *
+ *  The condition of a breakpoint is compiled once on the stack being
+ *  debugged into a function whose parameters are the upvalues and the
+ *  locals in scope at the line (so "i > 10" becomes
+ *  "function(..., i) return (i > 10) end" with the environment of the
+ *  running function).  Each hit then just pushes the values of the
+ *  locals and upvalues and calls the function from within the hook - no
+ *  globals are written and nothing goes near the debugger lua stack.
+ *
+ *  The log message of a logpoint is compiled the same way into a function
+ *  returning its literal pieces and interpolated values in order
+ *  ("i is {i}" becomes "function(..., i) return "i is ", (i) end"), which
+ *  are then formatted natively.
+ *
+ *  Compiled functions are kept in the registry of the stack and dropped
+ *  when the breakpoints change.  A line reached with different locals in
+ *  scope than it was compiled with is compiled again.
+ *
+ *  Only ever used by the thread running the stack so needs no locking.
+ *
+ *****************************************************************************/
+class ConditionCache
+{
+public:
+    // ctor
+    ConditionCache();
+
+    // dtor
+    virtual ~ConditionCache();
+
+    // Tells if a line breakpoint that was hit should stop the stack
+    bool        ShouldStop(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                           ClientIface *pClientIface, DebugContext *pContext);
+
+    // Queues the message of a logpoint that was hit (false if the
+    // breakpoint has no message and should stop)
+    bool        Log(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                    LogpointQueue &queue, DebugContext *pContext);
+
+    // Takes a snapshot for a snapshot breakpoint that was hit (false if
+    // the breakpoint does not take snapshots and should stop)
+    bool        Snapshot(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints,
+                         SnapshotStore &store, DebugContext *pContext);
+
+protected:
+    //! A condition compiled for a line
+    struct CompiledCondition
+    {
+        CompiledCondition() : funcRef(LUA_NOREF), messageRef(LUA_NOREF), snapshot(false) { }
+
+        //! The condition (empty if the breakpoint is plain)
+        std::string                 condition;
+
+        //! Registry reference of the compiled function (LUA_NOREF if
+        //! not compiled yet, LUA_REFNIL if it did not compile)
+        int                         funcRef;
+
+        //! Why the condition did not compile or failed on this hit -
+        //! reported to the client
+        std::string                 conditionError;
+
+        //! The log message template (empty if not a logpoint)
+        std::string                 message;
+
+        //! Registry reference of the compiled message (as funcRef)
+        int                         messageRef;
+
+        //! Why the message did not compile - logged in its place
+        std::string                 messageError;
+
+        //! Does the breakpoint take snapshots?
+        bool                        snapshot;
+
+        //! Names of the upvalues of the function - all are passed
+        std::vector<std::string>    upvalueNames;
+
+        //! Names of the locals in scope when compiled - to detect a
+        //! change of scope
+        std::vector<std::string>    localNames;
+
+        //! Whether each local is passed (temporaries are not)
+        std::vector<bool>           localBound;
+    };
+
+    // Finds (or fetches from the table) the entry for a line
+    CompiledCondition & Lookup(LuaStack pStack, LuaDebug pDebug, int fileId, BreakpointTable &breakpoints);
+
+    // Compiles a condition and message in the scope of the running function
+    bool        Compile(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled);
+
+    // Compiles one function body with the given parameters
+    int         CompileChunk(LuaStack pStack, int funcIndex, const std::string &params,
+                             const std::string &body, std::string &error);
+
+    // Pushes a compiled function and its arguments (-1 if the scope has changed)
+    int         PushCall(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled, int funcRef);
+
+    // Calls a compiled condition (-1 if the scope has changed)
+    int         Evaluate(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled);
+
+    // Calls a compiled message and formats its values (false if the
+    // scope has changed)
+    bool        Format(LuaStack pStack, LuaDebug pDebug, CompiledCondition &compiled, std::string &text);
+
+    // Releases the compiled functions of an entry
+    void        Release(LuaStack pStack, CompiledCondition &compiled);
+
+    // Releases all compiled conditions
+    void        Reset(LuaStack pStack);
+
+protected:
+    //! Conditions keyed by file id and line
+    std::map<std::pair<int, int>, CompiledCondition>   conditions;
+
+    //! Breakpoint table generation the conditions were fetched with
+    unsigned                                            generation;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -0,0 +1,213 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ContextRegistry.cpp
+ *
+ *  \brief  Implementation of the epoch protected context registry.
+ */
+//*****************************************************************************
+
+#include <sched.h>
+#include "ContextRegistry.h"
+#include "DebugContext.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Per thread cache of the last context looked up by the hook
+static __thread const ContextRegistry * cachedRegistry      = NULL;
+static __thread LuaStack                cachedStack         = NULL;
+static __thread DebugContext *          cachedContext       = NULL;
+static __thread unsigned                cachedGeneration    = 0;
+
+//*****************************************************************************
+/*!
+ *  \brief  Enters the current epoch.
+ *
+ *  If a writer flips the epoch between reading it and registering, the
+ *  registration is undone and retried so a writer never misses a reader.
+ */
+//*****************************************************************************
+ContextRegistry::Reader::Reader(const ContextRegistry &reg) : registry(reg)
+{
+    for (;;)
+    {
+        epoch = registry.currentEpoch;
+        __sync_fetch_and_add(&registry.numReaders[epoch & 1], 1);
+        if (epoch == registry.currentEpoch)
+            break ;
+        __sync_fetch_and_sub(&registry.numReaders[epoch & 1], 1);
+    }
+    pContexts = registry.pCurrent;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Leaves the epoch entered by the reader.
+ */
+//*****************************************************************************
+ContextRegistry::Reader::~Reader()
+{
+    __sync_fetch_and_sub(&registry.numReaders[epoch & 1], 1);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty registry.
+ */
+//*****************************************************************************
+ContextRegistry::ContextRegistry() :
+    pCurrent(new DebugContextMap()),
+    currentEpoch(0),
+    generation(1)
+{
+    numReaders[0] = numReaders[1] = 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.  Contexts are owned (and deleted) by the caller.
+ */
+//*****************************************************************************
+ContextRegistry::~ContextRegistry()
+{
+    delete pCurrent;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds the context for a stack.
+ *
+ *  Called on every hook event.  Repeated lookups of the same stack from
+ *  the same thread are answered from a thread local cache that is only
+ *  trusted while no context has been added or removed.
+ */
+//*****************************************************************************
+DebugContext *ContextRegistry::Find(LuaStack pStack) const
+{
+    unsigned currGeneration = generation;
+
+    if (cachedStack == pStack && cachedRegistry == this && cachedGeneration == currGeneration)
+        return cachedContext;
+
+    DebugContext *pContext = NULL;
+    {
+        Reader reader(*this);
+        DebugContextMap::const_iterator iter = reader.Contexts().find(pStack);
+        if (iter != reader.Contexts().end())
+            pContext = iter->second;
+    }
+
+    cachedRegistry      = this;
+    cachedStack         = pStack;
+    cachedContext       = pContext;
+    cachedGeneration    = currGeneration;
+
+    return pContext;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Adds a context.
+ *
+ *  \return false if the stack of the context already has a context.
+ */
+//*****************************************************************************
+bool ContextRegistry::Add(DebugContext *pContext)
+{
+    SMutexLock writerLock(writerMutex);
+
+    if (pCurrent->find(pContext->pStack) != pCurrent->end())
+        return false;
+
+    DebugContextMap *pNewContexts = new DebugContextMap(*pCurrent);
+    (*pNewContexts)[pContext->pStack] = pContext;
+    Publish(pNewContexts);
+
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes the context of a stack.
+ *
+ *  Returns only once no reader can still be looking at the context so the
+ *  caller is free to delete it.
+ *
+ *  \return The removed context or NULL if the stack had none.
+ */
+//*****************************************************************************
+DebugContext *ContextRegistry::Remove(LuaStack pStack)
+{
+    SMutexLock writerLock(writerMutex);
+
+    DebugContextMap::iterator iter = pCurrent->find(pStack);
+    if (iter == pCurrent->end())
+        return NULL;
+
+    DebugContext *pContext = iter->second;
+
+    DebugContextMap *pNewContexts = new DebugContextMap(*pCurrent);
+    pNewContexts->erase(pStack);
+    Publish(pNewContexts);
+
+    return pContext;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes all contexts.
+ *
+ *  \param  removed     Filled with the contexts that were removed.
+ */
+//*****************************************************************************
+void ContextRegistry::RemoveAll(std::vector<DebugContext *> &removed)
+{
+    SMutexLock writerLock(writerMutex);
+
+    for (DebugContextMap::iterator iter = pCurrent->begin(); iter != pCurrent->end(); ++iter)
+    {
+        if (iter->second != NULL)
+            removed.push_back(iter->second);
+    }
+
+    Publish(new DebugContextMap());
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Publishes a new map of contexts.
+ *
+ *  Must be called with the writerMutex held.  Readers that started before
+ *  the epoch flip may still be using the old map so wait for them to
+ *  leave before freeing it.
+ */
+//*****************************************************************************
+void ContextRegistry::Publish(DebugContextMap *pNewContexts)
+{
+    DebugContextMap *pOldContexts = pCurrent;
+
+    pCurrent = pNewContexts;
+    __sync_fetch_and_add(&generation, 1);
+
+    unsigned oldEpoch = __sync_fetch_and_add(&currentEpoch, 1);
+    while (numReaders[oldEpoch & 1] != 0)
+        sched_yield();
+
+    delete pOldContexts;
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,120 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ContextRegistry.h
+ *
+ *  \brief  The set of debug contexts, readable without locks from the
+ *  debug hook and from other threads while stacks come and go.
+ *
+ *****************************************************************************/
+
+#ifndef _CONTEXT_REGISTRY_H_
+#define _CONTEXT_REGISTRY_H_
+
+#include <map>
+#include <vector>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+typedef std::map<LuaStack , DebugContext *> DebugContextMap;
+
+//*****************************************************************************
+/*!
+ *  \class  ContextRegistry
+ *
+ *  \brief  Epoch protected, copy on write map of lua stacks to contexts.
+ *
+ *  Writers (attach/detach) copy the current map, publish the copy and then
+ *  wait for all readers of the old map to leave before freeing it.
+ *  Readers only bump a counter for the current epoch.  On top of this the
+ *  debug hook keeps a per thread cache of the last looked up context that
+ *  is validated by a generation counter, so the common lookup is a couple
+ *  of compares.
+ *
+ *  A context is only guaranteed to be alive while a Reader is held.  The
+ *  hook relies on a stack only being detached by the thread running it.
+ *
+ *****************************************************************************/
+class ContextRegistry
+{
+public:
+    //*************************************************************************
+    /*!
+     *  \class  Reader
+     *
+     *  \brief  Keeps the current set of contexts alive while in scope.
+     *************************************************************************/
+    class Reader
+    {
+    public:
+        Reader(const ContextRegistry &registry);
+        ~Reader();
+
+        //! The contexts as of when the reader was created
+        const DebugContextMap &Contexts() const { return *pContexts; }
+
+    private:
+        const ContextRegistry & registry;
+        unsigned                epoch;
+        const DebugContextMap * pContexts;
+    };
+
+public:
+    // ctor
+    ContextRegistry();
+
+    // dtor
+    virtual ~ContextRegistry();
+
+    // Finds the context for a stack - lock free
+    DebugContext *  Find(LuaStack pStack) const;
+
+    // Adds a context - returns false if the stack already has one
+    bool            Add(DebugContext *pContext);
+
+    // Removes the context of a stack once no reader can still see it
+    DebugContext *  Remove(LuaStack pStack);
+
+    // Removes all contexts
+    void            RemoveAll(std::vector<DebugContext *> &removed);
+
+protected:
+    // Publishes a new map and frees the old one after a grace period
+    void            Publish(DebugContextMap *pNewContexts);
+
+protected:
+    //! The current (immutable) map of contexts
+    DebugContextMap * volatile  pCurrent;
+
+    //! Epoch readers register against - only the parity is used
+    volatile unsigned           currentEpoch;
+
+    //! Number of readers in each epoch parity
+    mutable volatile int        numReaders[2];
+
+    //! Bumped on every add/remove to invalidate per thread caches
+    volatile unsigned           generation;
+
+    //! Serialises writers
+    SMutex                      writerMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
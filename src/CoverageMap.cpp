@@ -0,0 +1,404 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   CoverageMap.cpp
+ *
+ *  \brief  Implementation of line coverage and its exports.
+ */
+//*****************************************************************************
+
+#include <string.h>
+#include <time.h>
+
+#include "CoverageMap.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Escapes a string for use in an xml attribute.
+ */
+//*****************************************************************************
+static std::string XmlEscape(const std::string &input)
+{
+    std::string output;
+    for (std::string::const_iterator iter = input.begin(); iter != input.end(); ++iter)
+    {
+        switch (*iter)
+        {
+            case '&':   output += "&amp;"; break ;
+            case '<':   output += "&lt;"; break ;
+            case '>':   output += "&gt;"; break ;
+            case '"':   output += "&quot;"; break ;
+            default:    output += *iter; break ;
+        }
+    }
+    return output;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a coverage map that is not recording.
+ */
+//*****************************************************************************
+CoverageMap::CoverageMap() :
+    pCurrent(NULL),
+    generation(0),
+    currentGeneration(0),
+    running(false)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+CoverageMap::~CoverageMap()
+{
+    for (std::map<std::pair<int, int>, FunctionCoverage *>::iterator iter = functions.begin();
+         iter != functions.end(); ++iter)
+    {
+        delete iter->second;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts recording lines.  Lines recorded earlier are kept.
+ *
+ *  Does nothing while recording.  Otherwise the running function is
+ *  marked stale rather than cleared, as the hook may be between
+ *  HasCurrent and Hit.
+ */
+//*****************************************************************************
+void CoverageMap::Start()
+{
+    if (running)
+        return ;
+
+    // the running function is not known till the next event
+    __sync_fetch_and_add(&generation, 1);
+    running = true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops recording lines.
+ */
+//*****************************************************************************
+void CoverageMap::Stop()
+{
+    running = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets all lines run so far.
+ *
+ *  Function records are kept (only their hit bitmaps are reset) as the
+ *  hook may be pointing at one of them.
+ */
+//*****************************************************************************
+void CoverageMap::Clear()
+{
+    SMutexLock coverageLock(coverageMutex);
+
+    for (std::map<std::pair<int, int>, FunctionCoverage *>::iterator iter = functions.begin();
+         iter != functions.end(); ++iter)
+    {
+        FunctionCoverage *pFunction = iter->second;
+        pFunction->hit.assign(pFunction->hit.size(), false);
+
+        int remaining = 0;
+        for (std::vector<bool>::iterator line = pFunction->executable.begin();
+             line != pFunction->executable.end(); ++line)
+        {
+            if (*line)
+                remaining++;
+        }
+        pFunction->remaining = remaining;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Makes a function the running function.
+ *
+ *  \param  pDebug  Debug info of the function with at least the "S"
+ *                  fields filled in.
+ */
+//*****************************************************************************
+void CoverageMap::Enter(LuaStack pStack, LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache)
+{
+    currentGeneration = generation;
+
+    // C functions run no lines and only file chunks can be reported
+    if (pDebug->what == NULL || strcmp(pDebug->what, "C") == 0 ||
+        pDebug->source == NULL || pDebug->source[0] != '@')
+    {
+        pCurrent = &ignored;
+        return ;
+    }
+
+    int fileId = sources.GetSourceId(cache, pDebug->source);
+
+    std::pair<int, int> key(fileId, pDebug->linedefined);
+    std::map<std::pair<int, int>, FunctionCoverage *>::iterator iter = functions.find(key);
+    if (iter != functions.end())
+        pCurrent = iter->second;
+    else
+        pCurrent = AddFunction(pStack, pDebug, fileId);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if line events are needed for the running function.
+ *
+ *  Also called from other threads (via the hook mask) so pCurrent is only
+ *  read once.
+ */
+//*****************************************************************************
+bool CoverageMap::LinesNeeded() const
+{
+    FunctionCoverage *pFunction = pCurrent;
+    return pFunction == NULL || currentGeneration != generation || pFunction->remaining > 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Records a line of the running function.
+ *
+ *  Lines already run are rejected without taking the lock.
+ */
+//*****************************************************************************
+void CoverageMap::Hit(int line)
+{
+    FunctionCoverage *  pFunction   = pCurrent;
+    if (pFunction == NULL)
+        return ;
+
+    unsigned            offset      = line - pFunction->firstLine;
+    if (offset >= pFunction->executable.size() || !pFunction->executable[offset] || pFunction->hit[offset])
+        return ;
+
+    SMutexLock coverageLock(coverageMutex);
+
+    pFunction->hit[offset] = true;
+    pFunction->remaining--;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the lines of all files.
+ *
+ *  \param  name    Name of the test (lcov) or package (cobertura).
+ */
+//*****************************************************************************
+void CoverageMap::Write(std::ostream &output, CoverageFormat format,
+                        SourceRegistry &sources, const std::string &name)
+{
+    if (format == COVERAGE_COBERTURA)
+        WriteCobertura(output, sources, name);
+    else
+        WriteLcov(output, sources, name);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates the record of a function the first time it runs.
+ *
+ *  The bitmaps cover linedefined to lastlinedefined.  Main chunks have
+ *  no such range so theirs ends at the last line they can run.
+ */
+//*****************************************************************************
+CoverageMap::FunctionCoverage *CoverageMap::AddFunction(LuaStack pStack, LuaDebug pDebug, int fileId)
+{
+    std::vector<int>    lines;
+    int                 lastActive = 0;
+
+    // pushes a table whose keys are the lines that have code
+    lua_getinfo(pStack, "L", pDebug);
+    if (lua_istable(pStack, -1))
+    {
+        lua_pushnil(pStack);
+        while (lua_next(pStack, -2) != 0)
+        {
+            int line = lua_tointeger(pStack, -2);
+            if (line > 0)
+            {
+                lines.push_back(line);
+                if (line > lastActive)
+                    lastActive = line;
+            }
+            lua_pop(pStack, 1);
+        }
+    }
+    lua_pop(pStack, 1);
+
+    FunctionCoverage *pFunction = new FunctionCoverage();
+    pFunction->fileId       = fileId;
+    pFunction->firstLine    = pDebug->linedefined > 0 ? pDebug->linedefined : 1;
+
+    int lastLine = pDebug->lastlinedefined > 0 ? pDebug->lastlinedefined : lastActive;
+    int size = lastLine >= pFunction->firstLine ? lastLine - pFunction->firstLine + 1 : 0;
+
+    pFunction->executable.resize(size, false);
+    pFunction->hit.resize(size, false);
+
+    for (std::vector<int>::iterator iter = lines.begin(); iter != lines.end(); ++iter)
+    {
+        unsigned offset = *iter - pFunction->firstLine;
+        if (offset < pFunction->executable.size() && !pFunction->executable[offset])
+        {
+            pFunction->executable[offset] = true;
+            pFunction->remaining++;
+        }
+    }
+
+    SMutexLock coverageLock(coverageMutex);
+    functions[std::pair<int, int>(fileId, pDebug->linedefined)] = pFunction;
+    return pFunction;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Merges the lines of all functions by file.
+ *
+ *  A line with code from more than one function (eg a one line closure)
+ *  counts as run if any of them ran it.  Must be called with the lock
+ *  held.
+ */
+//*****************************************************************************
+void CoverageMap::GetFileLines(std::map<int, FileLines> &files)
+{
+    for (std::map<std::pair<int, int>, FunctionCoverage *>::iterator iter = functions.begin();
+         iter != functions.end(); ++iter)
+    {
+        FunctionCoverage *  pFunction   = iter->second;
+        FileLines &         lines       = files[pFunction->fileId];
+
+        for (unsigned offset = 0;offset < pFunction->executable.size();offset++)
+        {
+            if (pFunction->executable[offset])
+            {
+                bool &hit = lines[pFunction->firstLine + offset];
+                hit = hit || pFunction->hit[offset];
+            }
+        }
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes an lcov tracefile.
+ *
+ *  Only whether a line ran is kept so hit counts are 0 or 1.
+ */
+//*****************************************************************************
+void CoverageMap::WriteLcov(std::ostream &output, SourceRegistry &sources, const std::string &name)
+{
+    SMutexLock coverageLock(coverageMutex);
+
+    std::map<int, FileLines> files;
+    GetFileLines(files);
+
+    for (std::map<int, FileLines>::iterator fiter = files.begin(); fiter != files.end(); ++fiter)
+    {
+        int numHit = 0;
+
+        output << "TN:" << name << "\n";
+        output << "SF:" << sources.GetFileName(fiter->first) << "\n";
+        for (FileLines::iterator liter = fiter->second.begin(); liter != fiter->second.end(); ++liter)
+        {
+            output << "DA:" << liter->first << "," << (liter->second ? 1 : 0) << "\n";
+            if (liter->second)
+                numHit++;
+        }
+        output << "LF:" << fiter->second.size() << "\n";
+        output << "LH:" << numHit << "\n";
+        output << "end_of_record\n";
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a cobertura report with a class per file.
+ */
+//*****************************************************************************
+void CoverageMap::WriteCobertura(std::ostream &output, SourceRegistry &sources, const std::string &name)
+{
+    SMutexLock coverageLock(coverageMutex);
+
+    std::map<int, FileLines> files;
+    GetFileLines(files);
+
+    int numLines    = 0;
+    int numHit      = 0;
+    std::map<int, int> fileHits;
+    for (std::map<int, FileLines>::iterator fiter = files.begin(); fiter != files.end(); ++fiter)
+    {
+        for (FileLines::iterator liter = fiter->second.begin(); liter != fiter->second.end(); ++liter)
+        {
+            if (liter->second)
+                fileHits[fiter->first]++;
+        }
+        numLines    += fiter->second.size();
+        numHit      += fileHits[fiter->first];
+    }
+
+    double lineRate = numLines > 0 ? ((double)numHit) / numLines : 1.0;
+
+    output << "<?xml version=\"1.0\" ?>\n";
+    output << "<!DOCTYPE coverage SYSTEM \"http://cobertura.sourceforge.net/xml/coverage-04.dtd\">\n";
+    output << "<coverage line-rate=\"" << lineRate << "\" branch-rate=\"0\" lines-covered=\"" << numHit
+           << "\" lines-valid=\"" << numLines << "\" branches-covered=\"0\" branches-valid=\"0\""
+           << " complexity=\"0\" version=\"1.9\" timestamp=\"" << time(NULL) << "000\">\n";
+    output << "  <sources/>\n";
+    output << "  <packages>\n";
+    output << "    <package name=\"" << XmlEscape(name.empty() ? "lua" : name) << "\" line-rate=\""
+           << lineRate << "\" branch-rate=\"0\" complexity=\"0\">\n";
+    output << "      <classes>\n";
+
+    for (std::map<int, FileLines>::iterator fiter = files.begin(); fiter != files.end(); ++fiter)
+    {
+        std::string fileName    = sources.GetFileName(fiter->first);
+        size_t      slash       = fileName.find_last_of('/');
+        std::string className   = slash == std::string::npos ? fileName : fileName.substr(slash + 1);
+        double      fileRate    = fiter->second.empty() ? 1.0 :
+                                    ((double)fileHits[fiter->first]) / fiter->second.size();
+
+        output << "        <class name=\"" << XmlEscape(className) << "\" filename=\"" << XmlEscape(fileName)
+               << "\" line-rate=\"" << fileRate << "\" branch-rate=\"0\" complexity=\"0\">\n";
+        output << "          <methods/>\n";
+        output << "          <lines>\n";
+        for (FileLines::iterator liter = fiter->second.begin(); liter != fiter->second.end(); ++liter)
+        {
+            output << "            <line number=\"" << liter->first << "\" hits=\""
+                   << (liter->second ? 1 : 0) << "\"/>\n";
+        }
+        output << "          </lines>\n";
+        output << "        </class>\n";
+    }
+
+    output << "      </classes>\n";
+    output << "    </package>\n";
+    output << "  </packages>\n";
+    output << "</coverage>\n";
+}
+
+LUNARPROBE_NS_END
+
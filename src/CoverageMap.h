@@ -0,0 +1,167 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   CoverageMap.h
+ *
+ *  \brief  Line coverage of a lua stack kept as per function bitmaps.
+ *
+ *****************************************************************************/
+
+#ifndef _COVERAGE_MAP_H_
+#define _COVERAGE_MAP_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include "lpfwddefs.h"
+#include "halley.h"
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Formats coverage can be exported in
+enum CoverageFormat
+{
+    COVERAGE_LCOV,          // lcov tracefile (genhtml etc)
+    COVERAGE_COBERTURA      // cobertura xml (CI servers)
+};
+
+//*****************************************************************************
+/*!
+ *  \class  CoverageMap
+ *
+ *  \brief  Records which lines of a lua stack have run.
+ *
+ *  Each function (keyed by file id and linedefined) gets a bitmap of the
+ *  lines it can run (from the "L" debug info) and a bitmap of the lines
+ *  it has run, both sized from linedefined and lastlinedefined.  Once all
+ *  of the lines of a function have run the function is complete and line
+ *  events are switched off while it runs, so covered code runs at full
+ *  speed.
+ *
+ *  Only the thread running the stack records lines, the mutex just keeps
+ *  exports and resets from other threads consistent.  pCurrent is only
+ *  ever written by that thread - Start (called from the debugger thread)
+ *  bumps a generation instead, and the running function is looked up
+ *  again by the next event that sees the new generation.
+ *
+ *****************************************************************************/
+class CoverageMap
+{
+public:
+    // ctor
+    CoverageMap();
+
+    // dtor
+    virtual ~CoverageMap();
+
+    // Starts recording lines
+    void        Start();
+
+    // Stops recording lines - recorded lines are kept
+    void        Stop();
+
+    // Forgets all lines run so far
+    void        Clear();
+
+    // Makes a function the running function
+    void        Enter(LuaStack pStack, LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache);
+
+    // Forgets the running function (eg when the outermost function returns)
+    void        Leave() { pCurrent = NULL; }
+
+    //! Is the running function known (and was it entered since the last start)?
+    bool        HasCurrent() const { return pCurrent != NULL && currentGeneration == generation; }
+
+    // Records a line of the running function
+    void        Hit(int line);
+
+    // Tells if line events are needed for the running function
+    bool        LinesNeeded() const;
+
+    //! Is coverage being recorded?
+    bool        Running() const { return running; }
+
+    // Writes the lines of all files in the given format
+    void        Write(std::ostream &output, CoverageFormat format,
+                      SourceRegistry &sources, const std::string &name = "");
+
+protected:
+    //! Lines of a function
+    struct FunctionCoverage
+    {
+        FunctionCoverage() : fileId(-1), firstLine(0), remaining(0) { }
+
+        //! File of the function
+        int                 fileId;
+
+        //! Line the bitmaps start at
+        int                 firstLine;
+
+        //! Lines the function can run
+        std::vector<bool>   executable;
+
+        //! Lines the function has run
+        std::vector<bool>   hit;
+
+        //! Number of lines yet to run
+        int                 remaining;
+    };
+
+    //! Lines of a file - line number to whether it was run
+    typedef std::map<int, bool>     FileLines;
+
+    // Creates the record of a function the first time it runs
+    FunctionCoverage *  AddFunction(LuaStack pStack, LuaDebug pDebug, int fileId);
+
+    // Merges the lines of all functions by file
+    void                GetFileLines(std::map<int, FileLines> &files);
+
+    // Writes lcov records
+    void                WriteLcov(std::ostream &output, SourceRegistry &sources, const std::string &name);
+
+    // Writes a cobertura report
+    void                WriteCobertura(std::ostream &output, SourceRegistry &sources, const std::string &name);
+
+protected:
+    //! Functions seen so far keyed by file id and linedefined
+    std::map<std::pair<int, int>, FunctionCoverage *>   functions;
+
+    //! Stands in for C functions and chunks not loaded from files
+    FunctionCoverage                    ignored;
+
+    //! The running function (NULL if not known yet)
+    FunctionCoverage * volatile         pCurrent;
+
+    //! Bumped by each start - the running function is stale once it differs
+    //! from currentGeneration
+    volatile unsigned                   generation;
+
+    //! Generation pCurrent was entered in
+    unsigned                            currentGeneration;
+
+    //! Is coverage being recorded?
+    volatile bool                       running;
+
+    //! Guards the records against exports and resets
+    SMutex                              coverageMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
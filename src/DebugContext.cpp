@@ -46,11 +46,33 @@ DebugContext::DebugContext(LuaStack luaStack, const char *n) :
     running(true),
     pStack(luaStack),
     name(n ? n : ""),
+    stepMode(STEP_NONE),
+    stepLine(-1),
+    stepFileId(-1),
+    lineGateOpen(true),
+    lineGateGeneration(~0u),
+    pSampler(NULL),
+    tracing(false),
+    pCoverage(NULL),
     pausedCond(runStateMutex),
     pDebug(NULL)
 { 
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Destroys the context and any profiling data.
+ */
+//*****************************************************************************
+DebugContext::~DebugContext()
+{
+    if (pSampler != NULL)
+        delete pSampler;
+
+    if (pCoverage != NULL)
+        delete pCoverage;
+}
+
 //*****************************************************************************
 /*!
  *  \brief  Pauses the processing of a lua stack.
@@ -101,6 +123,46 @@ bool DebugContext::Resume()
     return true;
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Pushes where the stack is paused onto a lua stack.
+ *
+ *  The table has the fields the debugger scripts give a paused context's
+ *  location so it can be reported by any of them.  The run state is held
+ *  while the debug info is copied as it is only valid while paused.
+ */
+//*****************************************************************************
+void DebugContext::PushLocation(LuaStack pOutput)
+{
+    SMutexLock mutexLock(runStateMutex);
+
+    if (running || pDebug == NULL)
+    {
+        lua_pushnil(pOutput);
+        return ;
+    }
+
+    lua_newtable(pOutput);
+    lua_pushinteger(pOutput, pDebug->event);
+    lua_setfield(pOutput, -2, "event");
+    lua_pushstring(pOutput, pDebug->name ? pDebug->name : "");
+    lua_setfield(pOutput, -2, "name");
+    lua_pushstring(pOutput, pDebug->namewhat ? pDebug->namewhat : "");
+    lua_setfield(pOutput, -2, "namewhat");
+    lua_pushstring(pOutput, pDebug->what ? pDebug->what : "");
+    lua_setfield(pOutput, -2, "what");
+    lua_pushstring(pOutput, pDebug->source ? pDebug->source : "");
+    lua_setfield(pOutput, -2, "source");
+    lua_pushinteger(pOutput, pDebug->currentline);
+    lua_setfield(pOutput, -2, "currentline");
+    lua_pushinteger(pOutput, pDebug->nups);
+    lua_setfield(pOutput, -2, "nups");
+    lua_pushinteger(pOutput, pDebug->linedefined);
+    lua_setfield(pOutput, -2, "linedefined");
+    lua_pushinteger(pOutput, pDebug->lastlinedefined);
+    lua_setfield(pOutput, -2, "lastlinedefined");
+}
+
 //*****************************************************************************
 /*!
  *  \brief  Blocks till the processing is paused.
@@ -117,6 +179,23 @@ int DebugContext::WaitWhilePaused()
     return running ? 0 : pausedCond.Wait();
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Sets the flow command (step, next etc) the context is resumed
+ *  with so the debug hook knows which events can cause a stop.
+ *
+ *  \param  mode    The flow command.
+ *  \param  line    The line to stop at for STEP_UNTIL.
+ *  \param  fileId  The file to stop in for STEP_UNTIL (-1 for any file).
+ */
+//*****************************************************************************
+void DebugContext::SetStepMode(StepMode mode, int line, int fileId)
+{
+    stepLine    = line;
+    stepFileId  = fileId;
+    stepMode    = mode;
+}
+
 //*****************************************************************************
 /*!
  *  \brief  Loads a file (only if this we are not running).
@@ -28,11 +28,27 @@
 #ifndef _DEBUGCONTEXT_H_
 #define _DEBUGCONTEXT_H_
 
+#include <map>
 #include <string>
 #include "halley.h"
+#include "SourceRegistry.h"
+#include "SamplingProfiler.h"
+#include "CoverageMap.h"
+#include "ConditionCache.h"
+#include "WatchpointTable.h"
 
 LUNARPROBE_NS_BEGIN
 
+//! The flow command (if any) a context was last resumed with
+enum StepMode
+{
+    STEP_NONE,
+    STEP_STEP,
+    STEP_NEXT,
+    STEP_UNTIL,
+    STEP_FINISH
+};
+
 //*****************************************************************************
 /*!
  *  \class  DebugContext
@@ -46,6 +62,9 @@ public:
     // ctor
     DebugContext(LuaStack luaStack, const char *name = "");
 
+    // dtor
+    virtual ~DebugContext();
+
     // Blocks while the debug context is being paused
     int         WaitWhilePaused();
 
@@ -61,6 +80,12 @@ public:
     // Gets the lua debug object.
     LuaDebug    GetDebug() { return pDebug; }
 
+    // Pushes where the stack is paused (nil if running) onto a lua stack
+    void        PushLocation(LuaStack pOutput);
+
+    // Sets the flow command the context is to be resumed with
+    void        SetStepMode(StepMode mode, int line = -1, int fileId = -1);
+
 
 public:
     //! Is the debugger for this stack currently running?
@@ -72,6 +97,46 @@ public:
     //! Name of the stack
     std::string name;
 
+    //! The last flow command - checked by the hook before calling into lua
+    volatile StepMode   stepMode;
+
+    //! Line to run "until" (only valid when stepMode is STEP_UNTIL)
+    volatile int        stepLine;
+
+    //! File to run "until" or -1 for any file
+    volatile int        stepFileId;
+
+    //! File ids of the chunks seen by the hook
+    SourceCache         sourceCache;
+
+    //! Whether line events are on because the running function has
+    //! breakpoints (only used when no flow command needs all lines)
+    bool                lineGateOpen;
+
+    //! Breakpoint table generation the line gate was computed with
+    volatile unsigned   lineGateGeneration;
+
+    //! Whether functions (keyed by file id and linedefined) contain
+    //! breakpoints - valid for lineGateGeneration only
+    std::map<std::pair<int, int>, bool>     lineGateCache;
+
+    //! The sampling profiler of this stack (NULL till profiling is first
+    //! started, then kept till the context goes away)
+    SamplingProfiler * volatile             pSampler;
+
+    //! Whether calls and returns are fed to the tracing profiler
+    volatile bool                           tracing;
+
+    //! Lines run by this stack (NULL till coverage is first started,
+    //! then kept till the context goes away)
+    CoverageMap * volatile                  pCoverage;
+
+    //! Breakpoint conditions compiled on this stack
+    ConditionCache                          conditions;
+
+    //! Watched table fields of this stack
+    WatchpointTable                         watchpoints;
+
 protected:
     SMutex          runStateMutex;
     SCondition      pausedCond;
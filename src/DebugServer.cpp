@@ -24,7 +24,9 @@
  */
 //*****************************************************************************
 
+#include <sstream>
 #include "DebugServer.h"
+#include "LunarProbe.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -47,7 +49,13 @@ HttpDebugServer::HttpDebugServer(int                    port,
     requestWriter("Writer", 0),
     bayeuxModule(&contentModule, msgBoundary),
     fileModule(&contentModule, true),
-    urlRouter(NULL)
+    urlRouter(NULL),
+    profileModule(&contentModule, pIface, &ClientIface::WriteSamples),
+    profileUrlMatch("/profile/", SContainsUrlMatcher::PREFIX_MATCH, &profileModule),
+    allocsModule(&contentModule, pIface, &ClientIface::WriteAllocs),
+    allocsUrlMatch("/allocs/", SContainsUrlMatcher::PREFIX_MATCH, &allocsModule),
+    gcModule(&contentModule, pIface, &ClientIface::WriteGcStats),
+    gcUrlMatch("/gc/", SContainsUrlMatcher::PREFIX_MATCH, &gcModule)
 {
     SetReaderStage(&requestReader);
     SetWriterStage(&requestWriter);
@@ -65,6 +73,18 @@ HttpDebugServer::HttpDebugServer(int                    port,
     pClientIface->SetBayeuxModule(&bayeuxModule);
     bayeuxModule.RegisterChannel(pClientIface);
 
+    // folded stacks of the sampling profiler
+    urlRouter.AddUrlMatch(&profileUrlMatch);
+
+    // allocation sites of stacks with profiled allocators
+    urlRouter.AddUrlMatch(&allocsUrlMatch);
+
+    // collector policies and cycles of all stacks
+    urlRouter.AddUrlMatch(&gcUrlMatch);
+
+    // stacks attached before the channel was registered had no hooks
+    LunarProbe::GetInstance()->UpdateHooks();
+
     // add more files and all that here to enable static html/js/css files
 }
 
@@ -81,5 +101,45 @@ HttpDebugServer::~HttpDebugServer()
 {
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Creates a module serving a report.
+ *
+ *  \param  writer  The ClientIface method writing the report.
+ */
+//*****************************************************************************
+ReportModule::ReportModule(SHttpModule *pNext, ClientIface *pIface, ReportWriter writer) :
+    SHttpModule(pNext),
+    pClientIface(pIface),
+    reportWriter(writer)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Responds with the report of all contexts (eg folded stacks,
+ *  one stack per line, ready to be fed to flamegraph.pl).
+ */
+//*****************************************************************************
+void ReportModule::ProcessInput(SConnection *         pConnection,
+                                SHttpHandlerData *    pHandlerData,
+                                SHttpHandlerStage *   pStage,
+                                SBodyPart *           pBodyPart)
+{
+    SHttpRequest *      pRequest    = pHandlerData->Request();
+    SHttpResponse *     pResponse   = pRequest->Response();
+    std::ostringstream  report;
+
+    if (pClientIface != NULL)
+        (pClientIface->*reportWriter)(report);
+
+    SRawBodyPart *part = pResponse->NewRawBodyPart();
+    part->SetBody(report.str());
+
+    pStage->SendEvent_OutputToModule(pConnection, pNextModule, part);
+    pStage->SendEvent_OutputToModule(pConnection, pNextModule,
+                                     pResponse->NewContFinishedPart(pNextModule));
+}
+
 LUNARPROBE_NS_END
 
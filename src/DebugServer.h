@@ -40,6 +40,34 @@
 
 LUNARPROBE_NS_BEGIN
 
+//*****************************************************************************
+/*!
+ *  \class  ReportModule
+ *
+ *  \brief  Serves a plain text report written by the client interface
+ *  (eg the samples of all contexts as folded stacks) over http.
+ *
+ *****************************************************************************/
+class ReportModule : public SHttpModule
+{
+public:
+    //! Writes a report of all contexts
+    typedef void (ClientIface::*ReportWriter)(std::ostream &output);
+
+public:
+    ReportModule(SHttpModule *pNext, ClientIface *pIface, ReportWriter writer);
+
+    //! Called to handle input data from another module
+    virtual void ProcessInput(SConnection *         pConnection,
+                              SHttpHandlerData *    pHandlerData,
+                              SHttpHandlerStage *   pStage,
+                              SBodyPart *           pBodyPart);
+
+protected:
+    ClientIface *   pClientIface;
+    ReportWriter    reportWriter;
+};
+
 class HttpDebugServer : public virtual SEvServer
 {
 public:
@@ -55,6 +83,9 @@ public:
     inline SBayeuxModule *     GetBayeuxModule()   { return &bayeuxModule; }
     inline SFileModule *       GetFileModule()     { return &fileModule; }
     inline SUrlRouter *        GetUrlRouter()      { return &urlRouter; }
+    inline ReportModule *      GetProfileModule()  { return &profileModule; }
+    inline ReportModule *      GetAllocsModule()   { return &allocsModule; }
+    inline ReportModule *      GetGcModule()       { return &gcModule; }
     inline BayeuxClientIface * GetClientIface()    { return pClientIface; }
 
 protected:
@@ -67,6 +98,12 @@ protected:
     SBayeuxModule       bayeuxModule;
     SFileModule         fileModule;
     SUrlRouter          urlRouter;
+    ReportModule        profileModule;
+    SContainsUrlMatcher profileUrlMatch;
+    ReportModule        allocsModule;
+    SContainsUrlMatcher allocsUrlMatch;
+    ReportModule        gcModule;
+    SContainsUrlMatcher gcUrlMatch;
 };
 
 LUNARPROBE_NS_END
@@ -0,0 +1,54 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   EmbeddedScripts.h
+ *
+ *  \brief  The debugger scripts compiled into the library.
+ *
+ *  EMBEDDED_SCRIPTS is defined by a source file the build generates from
+ *  the lua folder with tools/embedscripts, holding the bytecode of each
+ *  script.
+ *
+ *****************************************************************************/
+
+#ifndef _EMBEDDED_SCRIPTS_H_
+#define _EMBEDDED_SCRIPTS_H_
+
+#include <stddef.h>
+#include "lpnsdefs.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! A script compiled into the library
+struct EmbeddedScript
+{
+    //! Name the script is required with (eg "Debugger")
+    const char *            name;
+
+    //! The bytecode
+    const unsigned char *   data;
+
+    //! Size of the bytecode
+    size_t                  size;
+};
+
+//! The scripts - ends with one whose name is NULL
+extern const EmbeddedScript EMBEDDED_SCRIPTS[];
+
+LUNARPROBE_NS_END
+
+#endif
+
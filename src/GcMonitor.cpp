@@ -0,0 +1,408 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   GcMonitor.cpp
+ *
+ *  \brief  Implementation of collector policies and telemetry.
+ */
+//*****************************************************************************
+
+#include <iomanip>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "GcMonitor.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the current time in microseconds.
+ */
+//*****************************************************************************
+static inline long long NowUs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Applies the policy to a stack.
+ *
+ *  Only sets the pause and step multiplier, so it is safe to call while
+ *  another thread runs the stack.
+ */
+//*****************************************************************************
+void GcPolicy::Apply(LuaStack pStack) const
+{
+    lua_gc(pStack, LUA_GCSETPAUSE, Pause());
+    lua_gc(pStack, LUA_GCSETSTEPMUL, mode == GC_STOP_THE_WORLD ? STOP_THE_WORLD_STEPMUL :
+                                     (stepmul > 0 ? stepmul : DEFAULT_STEPMUL));
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Parses a policy given as "stw" or
+ *  "incremental[:pause[:stepmul]]".
+ *
+ *  \return false if the spec is not valid.
+ */
+//*****************************************************************************
+bool GcPolicy::Parse(const char *spec, GcPolicy &policy)
+{
+    int pause   = 0;
+    int stepmul = 0;
+
+    if (strcmp(spec, "stw") == 0)
+    {
+        policy = GcPolicy(GC_STOP_THE_WORLD);
+        return true;
+    }
+
+    if (strncmp(spec, "incremental", 11) != 0)
+        return false;
+
+    spec += 11;
+    if (*spec != 0 && sscanf(spec, ":%d:%d", &pause, &stepmul) < 1)
+        return false;
+
+    policy = GcPolicy(GC_INCREMENTAL, pause, stepmul);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts monitoring a stack and applies a policy to it.
+ *
+ *  Must be called by the thread that owns the stack, before it is shared.
+ */
+//*****************************************************************************
+GcMonitor *GcMonitor::Install(LuaStack pStack, const GcPolicy &policy)
+{
+    GcMonitor *pMonitor = new GcMonitor(pStack, policy);
+
+    pMonitor->innerAlloc = lua_getallocf(pStack, &pMonitor->innerUd);
+    lua_setallocf(pStack, Alloc, pMonitor);
+
+    policy.Apply(pStack);
+
+    lua_newtable(pStack);
+    lua_pushcfunction(pStack, OnCycleEnd);
+    lua_setfield(pStack, -2, "__gc");
+    pMonitor->sentinelMeta = luaL_ref(pStack, LUA_REGISTRYINDEX);
+
+    pMonitor->ArmSentinel(pStack);
+    return pMonitor;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the monitor of a stack.
+ */
+//*****************************************************************************
+GcMonitor *GcMonitor::FromStack(LuaStack pStack)
+{
+    void *ud = NULL;
+    if (lua_getallocf(pStack, &ud) != Alloc)
+        return NULL;
+    return (GcMonitor *)ud;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the allocator of a stack, looking through a monitor if
+ *  there is one.
+ */
+//*****************************************************************************
+lua_Alloc GcMonitor::GetAllocf(LuaStack pStack, void **ud)
+{
+    lua_Alloc allocf = lua_getallocf(pStack, ud);
+    if (allocf == Alloc)
+    {
+        GcMonitor *pMonitor = (GcMonitor *)*ud;
+        *ud = pMonitor->innerUd;
+        return pMonitor->innerAlloc;
+    }
+    return allocf;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a monitor.
+ */
+//*****************************************************************************
+GcMonitor::GcMonitor(LuaStack stack, const GcPolicy &gcPolicy) :
+    pStack(stack),
+    innerAlloc(NULL),
+    innerUd(NULL),
+    policy(gcPolicy),
+    sentinelMeta(LUA_NOREF),
+    liveBytes(0),
+    freedBytes(0),
+    freedAtCycleEnd(0),
+    threshold(0),
+    cycleStartUs(0),
+    heapAtCycleStart(0),
+    numCycles(0),
+    totalDurationUs(0),
+    maxDurationUs(0),
+    totalReclaimed(0)
+{
+    liveBytes = lua_gc(stack, LUA_GCCOUNT, 0) * 1024LL + lua_gc(stack, LUA_GCCOUNTB, 0);
+    threshold = liveBytes / 100 * policy.Pause();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+GcMonitor::~GcMonitor()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Changes the policy of the stack.  Takes full effect from the
+ *  next cycle.
+ */
+//*****************************************************************************
+void GcMonitor::SetPolicy(const GcPolicy &gcPolicy)
+{
+    SMutexLock gcLock(gcMutex);
+
+    policy = gcPolicy;
+    policy.Apply(pStack);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Counts the bytes in use and freed and passes the call on to
+ *  the allocator of the stack.
+ */
+//*****************************************************************************
+void *GcMonitor::Alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    GcMonitor * pMonitor    = (GcMonitor *)ud;
+    void *      result      = pMonitor->innerAlloc(pMonitor->innerUd, ptr, osize, nsize);
+
+    // lua 5.1 passes 0 as the old size of new blocks
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        // lua_close frees the block holding the state last (the state is
+        // at its start unless LUAI_EXTRASPACE is set)
+        if (ptr != NULL && ptr == (void *)pMonitor->pStack)
+        {
+            delete pMonitor;
+            return NULL;
+        }
+
+        pMonitor->liveBytes     -= osize;
+        pMonitor->freedBytes    += osize;
+        return NULL;
+    }
+
+    if (result == NULL)
+        return NULL;
+
+    pMonitor->liveBytes += (long long)nsize - (long long)osize;
+    if (nsize < osize)
+        pMonitor->freedBytes += osize - nsize;
+
+    // lua runs a collection step right after the allocation that crosses
+    // the threshold
+    if (pMonitor->cycleStartUs == 0 && pMonitor->liveBytes >= pMonitor->threshold)
+    {
+        pMonitor->cycleStartUs      = NowUs();
+        pMonitor->heapAtCycleStart  = pMonitor->liveBytes;
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finalizer of sentinels - records the end of a cycle and arms
+ *  the sentinel of the next one.
+ */
+//*****************************************************************************
+int GcMonitor::OnCycleEnd(LuaStack pStack)
+{
+    GcMonitor *pMonitor = *(GcMonitor **)lua_touserdata(pStack, 1);
+
+    pMonitor->EndCycle();
+
+    // finalizers may run on any thread (coroutine) of the state
+    pMonitor->ArmSentinel(pStack);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a sentinel that nothing refers to, so it is finalized
+ *  by the next cycle.
+ */
+//*****************************************************************************
+void GcMonitor::ArmSentinel(LuaStack pThread)
+{
+    GcMonitor **ppMonitor = (GcMonitor **)lua_newuserdata(pThread, sizeof(GcMonitor *));
+    *ppMonitor = this;
+
+    lua_rawgeti(pThread, LUA_REGISTRYINDEX, sentinelMeta);
+    lua_setmetatable(pThread, -2);
+    lua_pop(pThread, 1);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Records the end of a cycle and works out where lua will start
+ *  the next one.
+ */
+//*****************************************************************************
+void GcMonitor::EndCycle()
+{
+    long long   now = NowUs();
+    GcCycle     cycle;
+
+    cycle.endUs         = now;
+    cycle.durationUs    = cycleStartUs != 0 ? now - cycleStartUs : -1;
+    cycle.heapAfter     = liveBytes;
+    cycle.reclaimed     = freedBytes - freedAtCycleEnd;
+    cycle.heapBefore    = cycleStartUs != 0 ? heapAtCycleStart : liveBytes + cycle.reclaimed;
+
+    {
+        SMutexLock gcLock(gcMutex);
+
+        cycles[numCycles % MAX_CYCLES] = cycle;
+        numCycles++;
+
+        totalReclaimed += cycle.reclaimed;
+        if (cycle.durationUs >= 0)
+        {
+            totalDurationUs += cycle.durationUs;
+            if (cycle.durationUs > maxDurationUs)
+                maxDurationUs = cycle.durationUs;
+        }
+    }
+
+    freedAtCycleEnd = freedBytes;
+    cycleStartUs    = 0;
+    threshold       = liveBytes / 100 * policy.Pause();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the policy, totals and recent cycles as text.
+ */
+//*****************************************************************************
+void GcMonitor::Write(std::ostream &output)
+{
+    SMutexLock gcLock(gcMutex);
+
+    if (policy.mode == GC_STOP_THE_WORLD)
+        output << "Policy: stop the world (pause " << policy.Pause() << ")\n";
+    else
+        output << "Policy: incremental (pause " << policy.Pause() << ", stepmul "
+               << (policy.stepmul > 0 ? policy.stepmul : GcPolicy::DEFAULT_STEPMUL) << ")\n";
+
+    output << "Heap: " << liveBytes << " bytes, cycles: " << numCycles
+           << ", total: " << totalDurationUs << " us, longest: " << maxDurationUs
+           << " us, reclaimed: " << totalReclaimed << " bytes\n\n";
+
+    output << std::setw(14) << "Duration (us)" << std::setw(14) << "Heap Before"
+           << std::setw(14) << "Heap After" << std::setw(14) << "Reclaimed" << "\n";
+
+    unsigned first = numCycles > MAX_CYCLES ? numCycles - MAX_CYCLES : 0;
+    for (unsigned i = first;i < numCycles;i++)
+    {
+        const GcCycle &cycle = cycles[i % MAX_CYCLES];
+        output << std::setw(14) << cycle.durationUs << std::setw(14) << cycle.heapBefore
+               << std::setw(14) << cycle.heapAfter << std::setw(14) << cycle.reclaimed << "\n";
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the policy, totals and recent cycles onto a lua stack.
+ *
+ *  Durations are in milliseconds and sizes in bytes.
+ */
+//*****************************************************************************
+void GcMonitor::PushStats(LuaStack pOutput)
+{
+    SMutexLock gcLock(gcMutex);
+
+    lua_newtable(pOutput);
+
+    lua_pushstring(pOutput, policy.mode == GC_STOP_THE_WORLD ? "stw" : "incremental");
+    lua_setfield(pOutput, -2, "mode");
+
+    lua_pushinteger(pOutput, policy.Pause());
+    lua_setfield(pOutput, -2, "pause");
+
+    lua_pushinteger(pOutput, policy.stepmul > 0 ? policy.stepmul : GcPolicy::DEFAULT_STEPMUL);
+    lua_setfield(pOutput, -2, "stepmul");
+
+    lua_pushnumber(pOutput, liveBytes);
+    lua_setfield(pOutput, -2, "heap");
+
+    lua_pushinteger(pOutput, numCycles);
+    lua_setfield(pOutput, -2, "cycles");
+
+    lua_pushnumber(pOutput, totalDurationUs / 1000.0);
+    lua_setfield(pOutput, -2, "totalDuration");
+
+    lua_pushnumber(pOutput, maxDurationUs / 1000.0);
+    lua_setfield(pOutput, -2, "maxDuration");
+
+    lua_pushnumber(pOutput, totalReclaimed);
+    lua_setfield(pOutput, -2, "reclaimed");
+
+    int index = 1;
+    lua_newtable(pOutput);
+
+    unsigned first = numCycles > MAX_CYCLES ? numCycles - MAX_CYCLES : 0;
+    for (unsigned i = first;i < numCycles;i++)
+    {
+        const GcCycle &cycle = cycles[i % MAX_CYCLES];
+
+        lua_newtable(pOutput);
+
+        lua_pushnumber(pOutput, cycle.durationUs < 0 ? -1 : cycle.durationUs / 1000.0);
+        lua_setfield(pOutput, -2, "duration");
+
+        lua_pushnumber(pOutput, cycle.heapBefore);
+        lua_setfield(pOutput, -2, "before");
+
+        lua_pushnumber(pOutput, cycle.heapAfter);
+        lua_setfield(pOutput, -2, "after");
+
+        lua_pushnumber(pOutput, cycle.reclaimed);
+        lua_setfield(pOutput, -2, "reclaimed");
+
+        lua_rawseti(pOutput, -2, index++);
+    }
+    lua_setfield(pOutput, -2, "recent");
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,221 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   GcMonitor.h
+ *
+ *  \brief  Garbage collector policies and per cycle telemetry of stacks.
+ *
+ *****************************************************************************/
+
+#ifndef _GC_MONITOR_H_
+#define _GC_MONITOR_H_
+
+#include <ostream>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! How the collector of a stack runs
+enum GcMode
+{
+    GC_STOP_THE_WORLD,      // each cycle runs in one go (the old default)
+    GC_INCREMENTAL          // cycles are interleaved with the program
+};
+
+//*****************************************************************************
+/*!
+ *  \class  GcPolicy
+ *
+ *  \brief  The collector settings of a stack.
+ *
+ *  A pause or stepmul of 0 leaves the lua default (200) in place.
+ *  Stop-the-world collection uses a step multiplier so large that a cycle
+ *  always finishes in the step that starts it.
+ *
+ *****************************************************************************/
+class GcPolicy
+{
+public:
+    //! Step multiplier that makes every step a full cycle
+    static const int    STOP_THE_WORLD_STEPMUL  = 100000000;
+
+    //! Lua's default pause and step multiplier
+    static const int    DEFAULT_PAUSE           = 200;
+    static const int    DEFAULT_STEPMUL         = 200;
+
+public:
+    GcPolicy(GcMode m = GC_STOP_THE_WORLD, int p = 0, int s = 0) : mode(m), pause(p), stepmul(s) { }
+
+    // Applies the policy to a stack
+    void    Apply(LuaStack pStack) const;
+
+    //! The pause in effect (percent of the live heap to wait for)
+    int     Pause() const { return pause > 0 ? pause : DEFAULT_PAUSE; }
+
+    // Parses "stw" or "incremental[:pause[:stepmul]]"
+    static bool Parse(const char *spec, GcPolicy &policy);
+
+public:
+    GcMode  mode;
+    int     pause;
+    int     stepmul;
+};
+
+//! A completed collection cycle
+struct GcCycle
+{
+    //! When the cycle finished
+    long long   endUs;
+
+    //! From the allocation that started the cycle till it finished (-1
+    //! if the start was not seen, eg a collectgarbage() call)
+    long long   durationUs;
+
+    //! Bytes in use when the cycle started
+    long long   heapBefore;
+
+    //! Bytes in use when the cycle finished
+    long long   heapAfter;
+
+    //! Bytes freed during the cycle
+    long long   reclaimed;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  GcMonitor
+ *
+ *  \brief  Records the collection cycles of a stack.
+ *
+ *  The monitor wraps the allocator of the stack to keep an exact count of
+ *  the bytes in use and freed.  Lua starts a cycle once the bytes in use
+ *  reach pause percent of what was left after the previous cycle, so the
+ *  allocation crossing that line marks the start of a cycle.  The end of
+ *  a cycle is marked by the finalizer of an unreachable sentinel userdata
+ *  (which arms a new sentinel for the next cycle).  With stop-the-world
+ *  collection the duration is the pause the program saw, with incremental
+ *  collection it is the span the cycle was spread over.
+ *
+ *  The monitor is freed along with the stack.  Only the thread running the
+ *  stack updates it, the mutex keeps reports from other threads
+ *  consistent.
+ *
+ *****************************************************************************/
+class GcMonitor
+{
+public:
+    //! Number of recent cycles kept
+    static const int    MAX_CYCLES  = 64;
+
+public:
+    // Starts monitoring a stack and applies a policy to it
+    static GcMonitor *  Install(LuaStack pStack, const GcPolicy &policy);
+
+    // Gets the monitor of a stack (NULL if it is not monitored)
+    static GcMonitor *  FromStack(LuaStack pStack);
+
+    // Gets the allocator of a stack underneath any monitor
+    static lua_Alloc    GetAllocf(LuaStack pStack, void **ud);
+
+    // Changes the policy of the stack
+    void                SetPolicy(const GcPolicy &policy);
+
+    //! The policy of the stack
+    const GcPolicy &    Policy() const { return policy; }
+
+    // Writes the policy, totals and recent cycles as text
+    void                Write(std::ostream &output);
+
+    // Pushes the policy, totals and recent cycles onto a lua stack
+    void                PushStats(LuaStack pOutput);
+
+protected:
+    // ctor - monitors are only made by Install
+    GcMonitor(LuaStack pStack, const GcPolicy &policy);
+
+    // dtor
+    virtual ~GcMonitor();
+
+    // The lua_Alloc of monitored stacks
+    static void *       Alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    // The finalizer of sentinels
+    static int          OnCycleEnd(LuaStack pStack);
+
+    // Creates an unreachable sentinel collected by the next cycle
+    void                ArmSentinel(LuaStack pThread);
+
+    // Records the end of a cycle
+    void                EndCycle();
+
+protected:
+    //! The stack being monitored
+    LuaStack                pStack;
+
+    //! The allocator of the stack
+    lua_Alloc               innerAlloc;
+
+    //! User data of the allocator of the stack
+    void *                  innerUd;
+
+    //! The policy of the stack
+    GcPolicy                policy;
+
+    //! Registry reference of the sentinel metatable
+    int                     sentinelMeta;
+
+    //! Bytes in use
+    long long               liveBytes;
+
+    //! Bytes freed
+    long long               freedBytes;
+
+    //! Bytes freed when the last cycle ended
+    long long               freedAtCycleEnd;
+
+    //! Bytes in use at which the next cycle starts
+    long long               threshold;
+
+    //! When the current cycle started (0 if not started)
+    long long               cycleStartUs;
+
+    //! Bytes in use when the current cycle started
+    long long               heapAtCycleStart;
+
+    //! Recent cycles (a ring of MAX_CYCLES)
+    GcCycle                 cycles[MAX_CYCLES];
+
+    //! Number of cycles so far
+    unsigned                numCycles;
+
+    //! Sum of the durations of the cycles whose start was seen
+    long long               totalDurationUs;
+
+    //! Longest cycle
+    long long               maxDurationUs;
+
+    //! Sum of the bytes reclaimed
+    long long               totalReclaimed;
+
+    //! Guards the cycles against reports
+    SMutex                  gcMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -0,0 +1,450 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   JsonEncoder.cpp
+ *
+ *  \brief  Writes lua values as json.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "JsonEncoder.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Eight bytes of a string looked at in one go
+typedef unsigned long long  StringWord;
+
+static const StringWord WORD_ONES   = 0x0101010101010101ULL;
+static const StringWord WORD_HIGHS  = 0x8080808080808080ULL;
+
+//! Non zero if a byte of the word is 0
+static inline StringWord WordHasZero(StringWord word)
+{
+    return (word - WORD_ONES) & ~word & WORD_HIGHS;
+}
+
+//! Non zero if a byte of the word is less than n (n <= 128)
+static inline StringWord WordHasLess(StringWord word, unsigned n)
+{
+    return (word - WORD_ONES * n) & ~word & WORD_HIGHS;
+}
+
+//! Whether a character has to be escaped (as Json.Encode escapes them)
+static inline bool NeedsEscape(unsigned char ch)
+{
+    return ch < 0x20 || ch == '"' || ch == '\\' || ch == '/' || ch == 0x7f;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the number of characters at the start of a string that
+ *  need no escaping.
+ *
+ *  Strings are scanned a word at a time until a word with a character that
+ *  needs escaping (or the end) is reached, which is then found a character
+ *  at a time - so plain runs cost about an eighth of a character by
+ *  character scan.
+ */
+//*****************************************************************************
+static size_t PlainRun(const char *str, size_t length)
+{
+    size_t i = 0;
+
+    for (;i + sizeof(StringWord) <= length;i += sizeof(StringWord))
+    {
+        StringWord word;
+        memcpy(&word, str + i, sizeof(word));
+
+        if (WordHasLess(word, 0x20)                     |
+            WordHasZero(word ^ (WORD_ONES * '"'))       |
+            WordHasZero(word ^ (WORD_ONES * '\\'))      |
+            WordHasZero(word ^ (WORD_ONES * '/'))       |
+            WordHasZero(word ^ (WORD_ONES * 0x7f)))
+        {
+            break ;
+        }
+    }
+
+    while (i < length && !NeedsEscape(str[i]))
+        i++;
+
+    return i;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Constructor.
+ *
+ *  \param  depth       Depth tables nested deeper than are walked as null.
+ */
+//*****************************************************************************
+JsonWalker::JsonWalker(int depth) :
+    maxDepth(depth > 0 ? depth : DEFAULT_MAX_DEPTH)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Walks the value at an index of a stack.
+ */
+//*****************************************************************************
+void JsonWalker::Walk(LuaStack pStack, int index)
+{
+    if (index < 0 && index > LUA_REGISTRYINDEX)
+        index = lua_gettop(pStack) + index + 1;
+
+    tables.clear();
+    WalkValue(pStack, index, 0);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Walks a value.
+ *
+ *  \param  index   Index of the value (not relative to the top).
+ *  \param  depth   Number of tables the value is in.
+ */
+//*****************************************************************************
+void JsonWalker::WalkValue(LuaStack pStack, int index, int depth)
+{
+    int type = lua_type(pStack, index);
+    switch (type)
+    {
+        case LUA_TBOOLEAN:
+            OnBoolean(lua_toboolean(pStack, index) != 0);
+            break ;
+        case LUA_TNUMBER:
+        {
+            // json has no nan or infinity
+            lua_Number value = lua_tonumber(pStack, index);
+            if (value != value || value - value != 0)
+                OnNull();
+            else
+                OnNumber(value);
+        } break ;
+        case LUA_TSTRING:
+        {
+            size_t length;
+            const char *str = lua_tolstring(pStack, index, &length);
+            OnString(str, length);
+        } break ;
+        case LUA_TTABLE:
+            WalkTable(pStack, index, depth);
+            break ;
+        case LUA_TUSERDATA:
+        case LUA_TLIGHTUSERDATA:
+        case LUA_TTHREAD:
+        {
+            char buffer[64];
+            int length = snprintf(buffer, sizeof(buffer), "%s: %p",
+                                  lua_typename(pStack, type), lua_topointer(pStack, index));
+            OnString(buffer, length);
+        } break ;
+        default:
+            // nil, functions (Json.Null is one) and anything else
+            OnNull();
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the length of a table walked as a list.
+ *
+ *  A table is a list if all its keys are positive integers, unless it is
+ *  so sparse that the nulls would dwarf its values - such tables are
+ *  walked as objects keyed by the numbers instead.
+ *
+ *  \param  index   Index of the table (not relative to the top).
+ *
+ *  \return The largest key (0 if empty) or -1 if the table is an object.
+ */
+//*****************************************************************************
+int JsonWalker::ListLength(LuaStack pStack, int index)
+{
+    lua_Number  numItems    = 0;
+    lua_Number  maxKey      = 0;
+
+    lua_pushnil(pStack);
+    while (lua_next(pStack, index) != 0)
+    {
+        lua_pop(pStack, 1);
+
+        lua_Number key = lua_type(pStack, -1) == LUA_TNUMBER ? lua_tonumber(pStack, -1) : 0;
+        if (key <= 0 || floor(key) != key)
+        {
+            lua_pop(pStack, 1);
+            return -1;
+        }
+
+        numItems++;
+        if (key > maxKey)
+            maxKey = key;
+    }
+
+    return maxKey > 4 * numItems + 16 ? -1 : (int)maxKey;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Walks a table as a list (see ListLength) or an object.
+ *
+ *  Object keys that are neither strings nor numbers are left out.
+ */
+//*****************************************************************************
+void JsonWalker::WalkTable(LuaStack pStack, int index, int depth)
+{
+    const void *pTable = lua_topointer(pStack, index);
+
+    if (depth >= maxDepth || std::find(tables.begin(), tables.end(), pTable) != tables.end())
+    {
+        OnNull();
+        return ;
+    }
+
+    luaL_checkstack(pStack, 3, "Table nested too deep");
+    tables.push_back(pTable);
+
+    int listLength = ListLength(pStack, index);
+    if (listLength >= 0)
+    {
+        OnBeginList();
+
+        for (int i = 1;i <= listLength;i++)
+        {
+            lua_rawgeti(pStack, index, i);
+            WalkValue(pStack, lua_gettop(pStack), depth + 1);
+            lua_pop(pStack, 1);
+        }
+
+        OnEndList();
+    }
+    else
+    {
+        OnBeginObject();
+
+        lua_pushnil(pStack);
+        while (lua_next(pStack, index) != 0)
+        {
+            int keyType = lua_type(pStack, -2);
+            if (keyType == LUA_TSTRING)
+            {
+                size_t length;
+                const char *key = lua_tolstring(pStack, -2, &length);
+                OnKey(key, length);
+                WalkValue(pStack, lua_gettop(pStack), depth + 1);
+            }
+            else if (keyType == LUA_TNUMBER)
+            {
+                // lua_tolstring would turn the key into a string and
+                // upset lua_next
+                char buffer[32];
+                int length = snprintf(buffer, sizeof(buffer), LUA_NUMBER_FMT, lua_tonumber(pStack, -2));
+                OnKey(buffer, length);
+                WalkValue(pStack, lua_gettop(pStack), depth + 1);
+            }
+            lua_pop(pStack, 1);
+        }
+
+        OnEndObject();
+    }
+
+    tables.pop_back();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Constructor.
+ *
+ *  \param  out         Where the json is appended.
+ *  \param  depth       Depth tables nested deeper than are written as null.
+ */
+//*****************************************************************************
+JsonEncoder::JsonEncoder(std::string &out, int depth) :
+    JsonWalker(depth),
+    output(out),
+    needComma(false)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the value at an index of a stack.
+ */
+//*****************************************************************************
+void JsonEncoder::Encode(LuaStack pStack, int index)
+{
+    needComma = false;
+    Walk(pStack, index);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a string in quotes with the characters json needs escaped
+ *  escaped.
+ */
+//*****************************************************************************
+void JsonEncoder::EncodeString(std::string &output, const char *str, size_t length)
+{
+    output += '"';
+
+    while (length > 0)
+    {
+        size_t run = PlainRun(str, length);
+        output.append(str, run);
+        if (run == length)
+            break ;
+
+        unsigned char ch = str[run];
+        switch (ch)
+        {
+            case '\b':  output.append("\\b", 2);  break ;
+            case '\t':  output.append("\\t", 2);  break ;
+            case '\n':  output.append("\\n", 2);  break ;
+            case '\f':  output.append("\\f", 2);  break ;
+            case '\r':  output.append("\\r", 2);  break ;
+            case '"':   output.append("\\\"", 2); break ;
+            case '\\':  output.append("\\\\", 2); break ;
+            case '/':   output.append("\\/", 2);  break ;
+            default:
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%.4X", ch);
+                output.append(escaped, 6);
+            }
+        }
+
+        str     += run + 1;
+        length  -= run + 1;
+    }
+
+    output += '"';
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes null.
+ */
+//*****************************************************************************
+void JsonEncoder::OnNull()
+{
+    Separate();
+    output.append("null", 4);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a boolean.
+ */
+//*****************************************************************************
+void JsonEncoder::OnBoolean(bool value)
+{
+    Separate();
+    if (value)
+        output.append("true", 4);
+    else
+        output.append("false", 5);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a number as tostring would.
+ */
+//*****************************************************************************
+void JsonEncoder::OnNumber(lua_Number value)
+{
+    Separate();
+
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), LUA_NUMBER_FMT, value);
+    output.append(buffer, length);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a string.
+ */
+//*****************************************************************************
+void JsonEncoder::OnString(const char *str, size_t length)
+{
+    Separate();
+    EncodeString(output, str, length);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts a list.
+ */
+//*****************************************************************************
+void JsonEncoder::OnBeginList()
+{
+    Separate();
+    output += '[';
+    needComma = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Ends a list.
+ */
+//*****************************************************************************
+void JsonEncoder::OnEndList()
+{
+    output += ']';
+    needComma = true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts an object.
+ */
+//*****************************************************************************
+void JsonEncoder::OnBeginObject()
+{
+    Separate();
+    output += '{';
+    needComma = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes an object key - the value that follows needs no comma.
+ */
+//*****************************************************************************
+void JsonEncoder::OnKey(const char *str, size_t length)
+{
+    Separate();
+    EncodeString(output, str, length);
+    output += ':';
+    needComma = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Ends an object.
+ */
+//*****************************************************************************
+void JsonEncoder::OnEndObject()
+{
+    output += '}';
+    needComma = true;
+}
+
+LUNARPROBE_NS_END
+
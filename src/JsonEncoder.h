@@ -0,0 +1,149 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   JsonEncoder.h
+ *
+ *  \brief  Writes lua values as json.
+ *
+ *****************************************************************************/
+
+#ifndef _JSON_ENCODER_H_
+#define _JSON_ENCODER_H_
+
+#include <string>
+#include <vector>
+#include "lpfwddefs.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  JsonWalker
+ *
+ *  \brief  Walks lua values straight from the stack as json values.
+ *
+ *  The walk follows Json.Encode (lua/Json.lua):
+ *
+ *  - tables whose keys are all positive integers are lists (up to the
+ *    largest key, with nulls for the holes) - others are objects keyed by
+ *    their string and number keys,
+ *  - userdata and threads are the strings tostring gives,
+ *  - functions (Json.Null included), nan and infinities are null,
+ *
+ *  except that tables already being walked (cycles) and tables nested
+ *  deeper than the depth limit are null instead of failing.  No
+ *  metamethods are called.  Subclasses are handed the values in document
+ *  order - JsonEncoder writes them as text, LuaUtils::PopJson builds json
+ *  nodes from them.
+ *
+ *****************************************************************************/
+class JsonWalker
+{
+public:
+    //! Default depth limit
+    static const int    DEFAULT_MAX_DEPTH   = 64;
+
+public:
+    // ctor
+    JsonWalker(int maxDepth = DEFAULT_MAX_DEPTH);
+
+    // dtor
+    virtual ~JsonWalker() { }
+
+    // Walks the value at an index of a stack
+    void        Walk(LuaStack pStack, int index);
+
+    // Gets the length of a table walked as a list (-1 for objects)
+    static int  ListLength(LuaStack pStack, int index);
+
+protected:
+    //! Called for each value (and each key of an object before its value)
+    virtual void    OnNull() = 0;
+    virtual void    OnBoolean(bool value) = 0;
+    virtual void    OnNumber(lua_Number value) = 0;
+    virtual void    OnString(const char *str, size_t length) = 0;
+    virtual void    OnBeginList() = 0;
+    virtual void    OnEndList() = 0;
+    virtual void    OnBeginObject() = 0;
+    virtual void    OnKey(const char *str, size_t length) = 0;
+    virtual void    OnEndObject() = 0;
+
+    // Walks a value - depth is the number of tables it is in
+    void        WalkValue(LuaStack pStack, int index, int depth);
+
+    // Walks a table
+    void        WalkTable(LuaStack pStack, int index, int depth);
+
+protected:
+    //! Depth limit
+    int                         maxDepth;
+
+    //! Tables being walked (outermost first)
+    std::vector<const void *>   tables;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  JsonEncoder
+ *
+ *  \brief  Writes lua values as json text straight from the stack.
+ *
+ *  The output is the same as that of Json.Encode (see JsonWalker).
+ *
+ *****************************************************************************/
+class JsonEncoder : public JsonWalker
+{
+public:
+    // ctor - the json is appended to output
+    JsonEncoder(std::string &output, int maxDepth = DEFAULT_MAX_DEPTH);
+
+    // Writes the value at an index of a stack
+    void        Encode(LuaStack pStack, int index);
+
+    // Writes a string with the characters json needs escaped escaped
+    static void EncodeString(std::string &output, const char *str, size_t length);
+
+protected:
+    virtual void    OnNull();
+    virtual void    OnBoolean(bool value);
+    virtual void    OnNumber(lua_Number value);
+    virtual void    OnString(const char *str, size_t length);
+    virtual void    OnBeginList();
+    virtual void    OnEndList();
+    virtual void    OnBeginObject();
+    virtual void    OnKey(const char *str, size_t length);
+    virtual void    OnEndObject();
+
+    // Writes the comma before a value that is not the first of its table
+    void        Separate()
+    {
+        if (needComma)
+            output += ',';
+        needComma = true;
+    }
+
+protected:
+    //! Where the json goes
+    std::string &               output;
+
+    //! Is a value already written in the current table?
+    bool                        needComma;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -0,0 +1,288 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   LogpointQueue.cpp
+ *
+ *  \brief  Implementation of the logpoint message queue.
+ */
+//*****************************************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "LogpointQueue.h"
+#include "JsonEncoder.h"
+#include "ClientIface.h"
+#include "DebugContext.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets how much of a string fits in a number of bytes without
+ *  cutting a UTF-8 character in two.
+ */
+//*****************************************************************************
+static size_t Utf8Prefix(const char *str, size_t length, size_t maxLength)
+{
+    if (length <= maxLength)
+        return length;
+
+    // back up over the continuation bytes of the character being cut
+    size_t cut = maxLength;
+    while (cut > 0 && maxLength - cut < 3 && (str[cut] & 0xC0) == 0x80)
+        cut--;
+    return (str[cut] & 0xC0) == 0x80 ? maxLength : cut;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty queue.  The writer is started by Start.
+ */
+//*****************************************************************************
+LogpointQueue::LogpointQueue(ClientIface *pIface) :
+    pClientIface(pIface),
+    entries(new LogEntry[CAPACITY]),
+    enqueuePos(0),
+    dequeuePos(0),
+    dropped(0),
+    droppedReported(0),
+    started(false),
+    stopping(false)
+{
+    for (unsigned i = 0;i < CAPACITY;i++)
+        entries[i].sequence = i;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.  Stops the writer thread if it is running.
+ */
+//*****************************************************************************
+LogpointQueue::~LogpointQueue()
+{
+    Stop();
+    delete [] entries;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts the writer thread if it is not already running.
+ */
+//*****************************************************************************
+void LogpointQueue::Start()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (started)
+        return ;
+
+    stopping    = false;
+    started     = pthread_create(&thread, NULL, ThreadMain, this) == 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops the writer thread and sends whatever it left queued.
+ */
+//*****************************************************************************
+void LogpointQueue::Stop()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (!started)
+        return ;
+
+    stopping = true;
+    pthread_join(thread, NULL);
+    started = false;
+    Flush();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Queues the message of a logpoint.
+ *
+ *  A slot is claimed by moving enqueuePos on with a compare and swap.
+ *  Each slot carries the position it is next free for, so a slot that
+ *  the writer has not drained yet (the ring is full) is seen without
+ *  taking any lock.
+ *
+ *  \return false if the ring was full and the message was dropped.
+ */
+//*****************************************************************************
+bool LogpointQueue::Push(DebugContext *pContext, int fileId, int line, const std::string &text)
+{
+    unsigned    pos     = enqueuePos;
+    LogEntry *  pEntry  = NULL;
+
+    for (;;)
+    {
+        pEntry          = &entries[pos & (CAPACITY - 1)];
+        int diff        = (int)(pEntry->sequence - pos);
+
+        if (diff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1))
+                break ;
+            pos = enqueuePos;
+        }
+        else if (diff < 0)
+        {
+            __sync_add_and_fetch(&dropped, 1);
+            return false;
+        }
+        else
+        {
+            pos = enqueuePos;
+        }
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    pEntry->pContext    = pContext;
+    pEntry->fileId      = fileId;
+    pEntry->line        = line;
+    pEntry->timeMs      = now.tv_sec * 1000LL + now.tv_usec / 1000;
+    pEntry->length      = Utf8Prefix(text.data(), text.size(), MAX_TEXT);
+    memcpy(pEntry->text, text.data(), pEntry->length);
+
+    size_t nameLength   = Utf8Prefix(pContext->name.data(), pContext->name.size(), MAX_NAME - 1);
+    memcpy(pEntry->name, pContext->name.data(), nameLength);
+    pEntry->name[nameLength] = 0;
+
+    // publish the entry only once it is filled in
+    __sync_synchronize();
+    pEntry->sequence = pos + 1;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Takes the next message off the ring.
+ *
+ *  \return false if the ring is empty.
+ */
+//*****************************************************************************
+bool LogpointQueue::Pop(LogEntry &entry)
+{
+    LogEntry *pEntry = &entries[dequeuePos & (CAPACITY - 1)];
+    if ((int)(pEntry->sequence - (dequeuePos + 1)) < 0)
+        return false;
+
+    __sync_synchronize();
+    entry.pContext  = pEntry->pContext;
+    entry.fileId    = pEntry->fileId;
+    entry.line      = pEntry->line;
+    entry.timeMs    = pEntry->timeMs;
+    entry.length    = pEntry->length;
+    memcpy(entry.name, pEntry->name, MAX_NAME);
+    memcpy(entry.text, pEntry->text, pEntry->length);
+
+    // hand the slot back to the producers for the next lap
+    __sync_synchronize();
+    pEntry->sequence = dequeuePos + CAPACITY;
+    dequeuePos++;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Sends the queued messages to the client in batches.
+ *
+ *  Messages are still drained (and discarded) when no client is
+ *  connected so that stale messages are not delivered to the next one.
+ */
+//*****************************************************************************
+void LogpointQueue::Flush()
+{
+    SMutexLock flushLock(flushMutex);
+
+    bool        connected   = pClientIface->ClientConnected();
+    LogEntry    entry;
+
+    for (bool more = true;more;)
+    {
+        std::string message = "{\"type\": \"Event\", \"event\": \"LogMessages\", \"data\": {\"messages\": [";
+        int         count   = 0;
+
+        while (count < MAX_BATCH && (more = Pop(entry)))
+        {
+            if (!connected)
+                continue ;
+
+            char header[64];
+            snprintf(header, sizeof(header), "%s{\"context\": \"%p\", \"name\": ",
+                     count++ == 0 ? "" : ", ", entry.pContext);
+            message += header;
+            JsonEncoder::EncodeString(message, entry.name, strlen(entry.name));
+
+            std::string file = pClientIface->GetSources().GetFileName(entry.fileId);
+            message += ", \"file\": ";
+            JsonEncoder::EncodeString(message, file.data(), file.size());
+
+            char position[96];
+            snprintf(position, sizeof(position), ", \"line\": %d, \"time\": %lld, \"text\": ",
+                     entry.line, entry.timeMs);
+            message += position;
+            JsonEncoder::EncodeString(message, entry.text, entry.length);
+            message += '}';
+        }
+
+        unsigned newlyDropped = dropped - droppedReported;
+        if (!connected || (count == 0 && newlyDropped == 0))
+            continue ;
+
+        droppedReported += newlyDropped;
+
+        char trailer[48];
+        snprintf(trailer, sizeof(trailer), "], \"dropped\": %u}}", newlyDropped);
+        message += trailer;
+
+        pClientIface->SendMessage(message.c_str(), message.size());
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Entry point of the writer thread.
+ */
+//*****************************************************************************
+void *LogpointQueue::ThreadMain(void *pArg)
+{
+    ((LogpointQueue *)pArg)->Run();
+    return NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Flushes every FLUSH_INTERVAL ms till stopped.
+ */
+//*****************************************************************************
+void LogpointQueue::Run()
+{
+    while (!stopping)
+    {
+        usleep(FLUSH_INTERVAL * 1000);
+        Flush();
+    }
+}
+
+LUNARPROBE_NS_END
+
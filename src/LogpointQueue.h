@@ -0,0 +1,155 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   LogpointQueue.h
+ *
+ *  \brief  Bounded queue of logpoint messages delivered to the client in
+ *  batches by a background thread.
+ *
+ *****************************************************************************/
+
+#ifndef _LOGPOINT_QUEUE_H_
+#define _LOGPOINT_QUEUE_H_
+
+#include <pthread.h>
+#include <string>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  LogpointQueue
+ *
+ *  \brief  Carries the messages of logpoints from the stacks to the client.
+ *
+ *  Any number of stacks push messages into a fixed ring of CAPACITY
+ *  entries with a compare and swap per message (no locks and no
+ *  allocation), so a logpoint never blocks the thread running a stack.
+ *  When the ring is full the message is dropped and counted instead.
+ *
+ *  A writer thread drains the ring every FLUSH_INTERVAL ms and sends the
+ *  messages to the client in "LogMessages" events of up to MAX_BATCH
+ *  messages each, along with the number of messages dropped since the
+ *  last event.
+ *
+ *****************************************************************************/
+class LogpointQueue
+{
+public:
+    //! Number of messages the ring holds (a power of 2)
+    static const unsigned   CAPACITY        = 1024;
+
+    //! Longest message kept in bytes (longer ones are cut short, between
+    //! UTF-8 characters)
+    static const unsigned   MAX_TEXT        = 480;
+
+    //! Longest context name kept
+    static const unsigned   MAX_NAME        = 32;
+
+    //! Milliseconds between flushes
+    static const int        FLUSH_INTERVAL  = 50;
+
+    //! Most messages sent in one event
+    static const int        MAX_BATCH       = 256;
+
+public:
+    // ctor
+    LogpointQueue(ClientIface *pIface);
+
+    // dtor - stops the writer
+    virtual ~LogpointQueue();
+
+    // Starts the writer thread if it is not already running
+    void        Start();
+
+    // Stops the writer thread (after a last flush)
+    void        Stop();
+
+    // Queues a message - called from the debug hook
+    bool        Push(DebugContext *pContext, int fileId, int line, const std::string &text);
+
+    // Sends all queued messages to the client
+    void        Flush();
+
+    //! Messages dropped because the ring was full
+    unsigned    Dropped() const { return dropped; }
+
+protected:
+    //! A queued message
+    struct LogEntry
+    {
+        //! Position the entry is ready for (see Push)
+        volatile unsigned   sequence;
+
+        const void *        pContext;
+        char                name[MAX_NAME];
+        int                 fileId;
+        int                 line;
+        long long           timeMs;
+        unsigned            length;
+        char                text[MAX_TEXT];
+    };
+
+    // Entry point of the thread
+    static void *   ThreadMain(void *pArg);
+
+    // Flushes every FLUSH_INTERVAL ms till stopped
+    void            Run();
+
+    // Takes the next message off the ring (writer only)
+    bool            Pop(LogEntry &entry);
+
+protected:
+    //! The interface the messages are sent through
+    ClientIface *       pClientIface;
+
+    //! The ring
+    LogEntry *          entries;
+
+    //! Next position to push at
+    volatile unsigned   enqueuePos;
+
+    //! Next position to pop from (writer only)
+    unsigned            dequeuePos;
+
+    //! Messages dropped so far
+    volatile unsigned   dropped;
+
+    //! Dropped messages already reported to the client
+    unsigned            droppedReported;
+
+    //! The writer thread
+    pthread_t           thread;
+
+    //! Has the thread been started?
+    bool                started;
+
+    //! Set to ask the thread to finish
+    volatile bool       stopping;
+
+    //! Guards starting and stopping
+    SMutex              threadMutex;
+
+    //! Only one flush at a time
+    SMutex              flushMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
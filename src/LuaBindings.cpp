@@ -27,14 +27,36 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <new>
 
 #include "lpmain.h"
+#include "LuaCall.h"
+#include "JsonEncoder.h"
+#include "EmbeddedScripts.h"
 #include "halley.h"
 
 LUNARPROBE_NS_BEGIN
 
-std::string  LuaBindings::LUA_SRC_LOCATION  = "shared/libgameengine/lua/debugger/";
+std::string  LuaBindings::LUA_SRC_LOCATION  = "";
 std::string  LuaBindings::LUA_VAR_PREFIX    = "__LDB_";
+int          LuaBindings::NUM_SHARDS        = 4;
+
+const char * LuaBindings::HANDLER_NAMES[NUM_HANDLERS] =
+{
+    "ContextAdded",
+    "ContextRemoved",
+    "HandleBreakpoint",
+    "HandleMessage"
+};
+
+const char * LuaBindings::CONTROL_COMMANDS[] =
+{
+    "break",
+    "breaks",
+    "clear",
+    "clearall",
+    NULL
+};
 
 DebugContext *GetContextIfPaused(LuaStack stack)
 {
@@ -65,17 +87,17 @@ DebugContext *GetContextIfPaused(LuaStack stack)
 //*****************************************************************************
 LuaBindings::LuaBindings(ClientIface *debugger) :
     pClientIface(debugger),
-    pStack(NULL),
-    reloadRequested(true),
-    dbgStackMutex(PTHREAD_MUTEX_RECURSIVE_NP)
+    shards(NULL),
+    numShards(NUM_SHARDS > 0 ? NUM_SHARDS : 1)
 {
+    shards = new DebuggerShard[numShards];
 }
 
 //*****************************************************************************
 /*!
  *  \brief  Destructor.
  *
- *  Closes the debugger lua stack and finishes up.
+ *  Closes the debugger lua stacks and finishes up.
  *
  *  \version
  *      - S Panyam  27/10/2008
@@ -84,12 +106,16 @@ LuaBindings::LuaBindings(ClientIface *debugger) :
 //*****************************************************************************
 LuaBindings::~LuaBindings()
 {
-    // close the lua stack
-    if (pStack != NULL)
+    // close the lua stacks
+    for (int i = 0;i < numShards;i++)
     {
-        LunarProbe::GetInstance()->Detach(pStack);
-        lua_close(pStack);
+        if (shards[i].pStack != NULL)
+        {
+            LunarProbe::GetInstance()->Detach(shards[i].pStack);
+            lua_close(shards[i].pStack);
+        }
     }
+    delete [] shards;
 }
 
 //*****************************************************************************
@@ -122,46 +148,216 @@ int LuaBindings::Register(LuaStack stack)
         { "GetUpValue", LuaBindings::GetUpValue},
         { "SetLocal", LuaBindings::SetLocal},
         { "SetUpValue", LuaBindings::SetUpValue},
+        { "SetBreakpoint", LuaBindings::SetBreakpoint },
+        { "ClearBreakpoint", LuaBindings::ClearBreakpoint },
+        { "ClearBreakpoints", LuaBindings::ClearBreakpoints },
+        { "GetBreakpointHits", LuaBindings::GetBreakpointHits },
+        { "SetSnapshotLimits", LuaBindings::SetSnapshotLimits },
+        { "GetSnapshots", LuaBindings::GetSnapshots },
+        { "GetSnapshot", LuaBindings::GetSnapshot },
+        { "ClearSnapshots", LuaBindings::ClearSnapshots },
+        { "SetWatchpoint", LuaBindings::SetWatchpoint },
+        { "ClearWatchpoint", LuaBindings::ClearWatchpoint },
+        { "GetWatchpoints", LuaBindings::GetWatchpoints },
+        { "SetLastCommand", LuaBindings::SetLastCommand },
+        { "NormalizePath", LuaBindings::NormalizePath },
+        { "StartProfiler", LuaBindings::StartProfiler },
+        { "StopProfiler", LuaBindings::StopProfiler },
+        { "ClearProfile", LuaBindings::ClearProfile },
+        { "GetProfile", LuaBindings::GetProfile },
+        { "StartTracer", LuaBindings::StartTracer },
+        { "StopTracer", LuaBindings::StopTracer },
+        { "ClearTrace", LuaBindings::ClearTrace },
+        { "GetTrace", LuaBindings::GetTrace },
+        { "StartCoverage", LuaBindings::StartCoverage },
+        { "StopCoverage", LuaBindings::StopCoverage },
+        { "ClearCoverage", LuaBindings::ClearCoverage },
+        { "GetCoverage", LuaBindings::GetCoverage },
+        { "StartAllocs", LuaBindings::StartAllocs },
+        { "StopAllocs", LuaBindings::StopAllocs },
+        { "ClearAllocs", LuaBindings::ClearAllocs },
+        { "GetAllocs", LuaBindings::GetAllocs },
+        { "SetGcPolicy", LuaBindings::SetGcPolicy },
+        { "GetGcStats", LuaBindings::GetGcStats },
         { NULL, NULL }
     };
     luaL_openlib(stack, "DebugLib", lib, 0);
 
+    // the buffer EncodeJson writes to is kept (and reused) by the stack
+    void *pBuffer = lua_newuserdata(stack, sizeof(std::string));
+    new (pBuffer) std::string();
+    lua_newtable(stack);
+    lua_pushcfunction(stack, LuaBindings::FreeJsonBuffer);
+    lua_setfield(stack, -2, "__gc");
+    lua_setmetatable(stack, -2);
+    lua_pushcclosure(stack, LuaBindings::EncodeJson, 1);
+    lua_setfield(stack, -2, "EncodeJson");
+
     return 1;
 }
 
 //*****************************************************************************
 /*!
- *  \brief  Gets the lua stack instance in the debugger.  Creates one if it
+ *  \brief  Gets the shard serving a context.
+ *
+ *  Contexts are spread over the shards by address, so any thread can tell
+ *  the shard of a context (or of a client message naming its address)
+ *  without a lookup.
+ */
+//*****************************************************************************
+int LuaBindings::ShardOf(const void *pContext) const
+{
+    // the low bits are the same for every (aligned) allocation
+    unsigned long address = (unsigned long)pContext;
+    return (int)((address >> 4) % (unsigned long)numShards);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the shard serving the context a client message is about.
+ *
+ *  Messages name their context by the address string the scripts hand out
+ *  (data.context).  The ones without one, and the breakpoint commands
+ *  (whatever context they name) go to CONTROL_SHARD, which keeps the
+ *  breakpoint list of the scripts.
+ */
+//*****************************************************************************
+int LuaBindings::ShardOf(const JsonNodePtr &message) const
+{
+    if (message.Data() == NULL || message->Type() != JNT_OBJECT)
+        return CONTROL_SHARD;
+
+    SString command(message->Get<SString>("cmd", ""));
+    for (const char **ppCommand = CONTROL_COMMANDS;*ppCommand != NULL;ppCommand++)
+    {
+        if (command == *ppCommand)
+            return CONTROL_SHARD;
+    }
+
+    JsonNodePtr data = message->Get("data");
+    if (data.Data() == NULL || data->Type() != JNT_OBJECT)
+        return CONTROL_SHARD;
+
+    SString address(data->Get<SString>("context", ""));
+    void *pContext = NULL;
+    if (address.empty() || sscanf(address.c_str(), "%p", &pContext) != 1)
+        return CONTROL_SHARD;
+
+    return ShardOf(pContext);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Makes the embedded scripts requirable from a debugger stack.
+ *
+ *  Each script is loaded (undumped - no parsing) into package.preload so
+ *  require finds it before looking at package.path.
+ */
+//*****************************************************************************
+int LuaBindings::PreloadScripts(LuaStack pStack)
+{
+    lua_getglobal(pStack, "package");
+    lua_getfield(pStack, -1, "preload");
+
+    for (const EmbeddedScript *pScript = EMBEDDED_SCRIPTS;pScript->name != NULL;pScript++)
+    {
+        int retCode = luaL_loadbuffer(pStack, (const char *)pScript->data, pScript->size, pScript->name);
+        if (retCode != 0)
+        {
+            fprintf(stderr, "Cannot load embedded script '%s': %s\n", pScript->name, lua_tostring(pStack, -1));
+            lua_pop(pStack, 3);
+            return retCode;
+        }
+        lua_setfield(pStack, -2, pScript->name);
+    }
+
+    lua_pop(pStack, 2);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Runs an embedded script on a debugger stack.
+ */
+//*****************************************************************************
+int LuaBindings::RunScript(LuaStack pStack, const char *name)
+{
+    for (const EmbeddedScript *pScript = EMBEDDED_SCRIPTS;pScript->name != NULL;pScript++)
+    {
+        if (strcmp(pScript->name, name) == 0)
+            return LuaUtils::RunLuaBuffer(pStack, (const char *)pScript->data, pScript->size, name);
+    }
+
+    fprintf(stderr, "No embedded script '%s'\n", name);
+    return -1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the lua stack instance of a shard.  Creates one if it
  *  does not exist.
  *
+ *  The scripts compiled into the library are used unless LUA_SRC_LOCATION
+ *  names a folder to load them from (for working on the scripts).
+ *
  *  \version
  *      - S Panyam  12/11/2008
  *      Initial version.
  */
 //*****************************************************************************
-LuaStack LuaBindings::GetLuaStack()
+LuaStack LuaBindings::GetLuaStack(int shard)
 {
+    LuaStack &      pStack          = shards[shard].pStack;
+    volatile bool & reloadRequested = shards[shard].reloadRequested;
+    bool            embedded        = LUA_SRC_LOCATION.empty();
+
     if (reloadRequested || pStack == NULL)
     {
         if (pStack == NULL)
         {
-            pStack = LuaUtils::NewLuaStack(true, false);
-
-            // add the location of the lua files into the path!
-            std::string strLuaPackagePath
-                = std::string("package.path = package.path .. \";lua/?.lua;") + LUA_SRC_LOCATION + std::string("/?.lua\"");
+            // the debugger's own stack should never stall the process
+            pStack = LuaUtils::NewLuaStack(true, false, "", false, GcPolicy(GC_INCREMENTAL));
+            shards[shard].errorRef = LuaCall::RefErrorHandler(pStack);
+            shards[shard].pEvent   = NewEvent(pStack, shards[shard].eventRef);
 
-            if (LuaUtils::RunLuaString(pStack, strLuaPackagePath.c_str(), strLuaPackagePath.size()) == 0)
+            if (embedded)
+            {
+                if (PreloadScripts(pStack) == 0)
+                {
+                    Register(pStack);
+                }
+            }
+            else
             {
-                Register(pStack);
+                // add the location of the lua files into the path!
+                std::string strLuaPackagePath
+                    = std::string("package.path = package.path .. \";lua/?.lua;") + LUA_SRC_LOCATION + std::string("/?.lua\"");
+
+                if (LuaUtils::RunLuaString(pStack, strLuaPackagePath.c_str(), strLuaPackagePath.size()) == 0)
+                {
+                    Register(pStack);
+                }
             }
         }
 
-        std::string mainlua = LUA_SRC_LOCATION + "/Main.lua";
-        if (LuaUtils::RunLuaScript(pStack, mainlua.c_str()) == 0)
+        int retCode;
+        if (embedded)
+        {
+            retCode = RunScript(pStack, "Main");
+        }
+        else
+        {
+            std::string mainlua = LUA_SRC_LOCATION + "/Main.lua";
+            retCode = LuaUtils::RunLuaScript(pStack, mainlua.c_str());
+        }
+
+        if (retCode == 0)
         {
             reloadRequested = false;
 
+            // the scripts may have replaced the handlers
+            ResolveHandlers(shard);
+
             // now register this one for debugging!
             // we have to do it here after all the above to avoid getting 
             // infinite recursive calls.
@@ -176,6 +372,8 @@ LuaStack LuaBindings::GetLuaStack()
 /*!
  *  \brief  Called to request a reload of the lua scripts.
  *
+ *  Each shard reloads them the next time it is called into.
+ *
  *  \version
  *      - S Panyam  27/10/2008
  *      Initial version.
@@ -183,33 +381,114 @@ LuaStack LuaBindings::GetLuaStack()
 //*****************************************************************************
 void LuaBindings::RequestReload()
 {
-    reloadRequested = true;
+    for (int i = 0;i < numShards;i++)
+        shards[i].reloadRequested = true;
 }
 
 //*****************************************************************************
 /*!
- *  \brief  Calls a lua function with arbitrary parameters.
+ *  \brief  Looks the handlers of a shard up after its scripts are
+ *  (re)loaded.
  *
- *  \param  funcname    Name of the lua function to call.
- *  \param  funcsig     Signature of the funtion.
- *  \param  Input parameters followed by pointers to output result holders.
- *
- *  \version
- *      - S Panyam  04/11/2008
- *      Initial version.
+ *  The handlers are kept as registry references so the calls into a
+ *  shard need no lookups by name - the references of the previous load
+ *  are released.
  */
 //*****************************************************************************
-int LuaBindings::CallLuaFunc(const char *funcname, const char *funcsig, ...)
+void LuaBindings::ResolveHandlers(int shard)
 {
-    SMutexLock mutexLock(dbgStackMutex);
+    LuaStack pStack = shards[shard].pStack;
+
+    for (int i = 0;i < NUM_HANDLERS;i++)
+    {
+        LuaCall::Unref(pStack, shards[shard].handlerRefs[i]);
+
+        lua_getglobal(pStack, HANDLER_NAMES[i]);
+        shards[shard].handlerRefs[i] = LuaCall::Ref(pStack);
+    }
+}
 
-    va_list vl;
-    va_start(vl, funcsig);
-    int result = LuaUtils::VCallLuaFunc(GetLuaStack(), funcname, funcsig, vl);
-    va_end(vl);
-    return result;
+//*****************************************************************************
+/*!
+ *  \brief  Creates the event userdata HandleBreakpoint hands the scripts of
+ *  a debugger stack.
+ *
+ *  It is created once and kept in the registry - HandleBreakpoint only
+ *  points it at the event being handled.
+ *
+ *  \param  eventRef    Set to the registry reference of the userdata.
+ */
+//*****************************************************************************
+LuaBindings::BreakpointEvent *LuaBindings::NewEvent(LuaStack pStack, int &eventRef)
+{
+    BreakpointEvent *pEvent = (BreakpointEvent *)lua_newuserdata(pStack, sizeof(BreakpointEvent));
+    pEvent->pContext        = NULL;
+    pEvent->pDebug          = NULL;
+    pEvent->isBreakpoint    = false;
+    pEvent->watchId         = 0;
+
+    lua_newtable(pStack);
+    lua_pushcfunction(pStack, EventIndex);
+    lua_setfield(pStack, -2, "__index");
+    lua_setmetatable(pStack, -2);
+
+    eventRef = LuaCall::Ref(pStack);
+    return pEvent;
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Reads a field of the event userdata.
+ *
+ *  Strings (names and the source) are only interned in the debugger stack
+ *  when the scripts ask for them - usually only when the context pauses.
+ *  Every field is nil outside HandleBreakpoint.
+ *
+ *  \luaparam   event   -   The event userdata.
+ *  \luaparam   key     -   One of the fields of a location ("event",
+ *                          "name", "namewhat", "what", "source",
+ *                          "currentline", "nups", "linedefined",
+ *                          "lastlinedefined"), "is_breakpoint", "watch"
+ *                          or "context_name".
+ */
+//*****************************************************************************
+int LuaBindings::EventIndex(LuaStack stack)
+{
+    BreakpointEvent *   pEvent  = (BreakpointEvent *)lua_touserdata(stack, 1);
+    const char *        key     = lua_tostring(stack, 2);
+    LuaDebug            pDebug  = pEvent != NULL ? pEvent->pDebug : NULL;
+
+    if (pDebug == NULL || key == NULL)
+        lua_pushnil(stack);
+    else if (strcmp(key, "event") == 0)
+        lua_pushinteger(stack, pDebug->event);
+    else if (strcmp(key, "currentline") == 0)
+        lua_pushinteger(stack, pDebug->currentline);
+    else if (strcmp(key, "is_breakpoint") == 0)
+        lua_pushboolean(stack, pEvent->isBreakpoint);
+    else if (strcmp(key, "watch") == 0)
+        lua_pushinteger(stack, pEvent->watchId);
+    else if (strcmp(key, "name") == 0)
+        lua_pushstring(stack, pDebug->name ? pDebug->name : "");
+    else if (strcmp(key, "namewhat") == 0)
+        lua_pushstring(stack, pDebug->namewhat ? pDebug->namewhat : "");
+    else if (strcmp(key, "what") == 0)
+        lua_pushstring(stack, pDebug->what ? pDebug->what : "");
+    else if (strcmp(key, "source") == 0)
+        lua_pushstring(stack, pDebug->source ? pDebug->source : "");
+    else if (strcmp(key, "nups") == 0)
+        lua_pushinteger(stack, pDebug->nups);
+    else if (strcmp(key, "linedefined") == 0)
+        lua_pushinteger(stack, pDebug->linedefined);
+    else if (strcmp(key, "lastlinedefined") == 0)
+        lua_pushinteger(stack, pDebug->lastlinedefined);
+    else if (strcmp(key, "context_name") == 0)
+        lua_pushlstring(stack, pEvent->pContext->name.c_str(), pEvent->pContext->name.size());
+    else
+        lua_pushnil(stack);
+
+    return 1;
+}
 
 //*****************************************************************************
 /*!
@@ -224,7 +503,14 @@ int LuaBindings::CallLuaFunc(const char *funcname, const char *funcsig, ...)
 //*****************************************************************************
 void LuaBindings::ContextAdded(DebugContext *pContext)
 {
-    if (CallLuaFunc("ContextAdded", "uus", this, pContext, pContext->name.c_str()) != 0)
+    int             shard       = ShardOf(pContext);
+    SMutexLock      mutexLock(shards[shard].stackMutex);
+    LuaStack        pStack      = GetLuaStack(shard);
+    LuaCall         call(pStack, shards[shard].handlerRefs[HANDLER_CONTEXT_ADDED],
+                         shards[shard].errorRef, HANDLER_NAMES[HANDLER_CONTEXT_ADDED]);
+
+    call << this << pContext << pContext->name;
+    if (call.Run() != 0)
     {
         // request a reload so that we give the user an opportunity to fix
         // any issues that have arisen from the source file.
@@ -249,7 +535,14 @@ void LuaBindings::ContextAdded(DebugContext *pContext)
 //*****************************************************************************
 void LuaBindings::ContextRemoved(DebugContext *pContext)
 {
-    if (CallLuaFunc("ContextRemoved", "uu", this, pContext) != 0)
+    int             shard       = ShardOf(pContext);
+    SMutexLock      mutexLock(shards[shard].stackMutex);
+    LuaStack        pStack      = GetLuaStack(shard);
+    LuaCall         call(pStack, shards[shard].handlerRefs[HANDLER_CONTEXT_REMOVED],
+                         shards[shard].errorRef, HANDLER_NAMES[HANDLER_CONTEXT_REMOVED]);
+
+    call << this << pContext;
+    if (call.Run() != 0)
     {
         // request a reload so that we give the user an opportunity to fix
         // any issues that have arisen from the source file.
@@ -280,27 +573,53 @@ void LuaBindings::ContextRemoved(DebugContext *pContext)
  *  can happen in this function or anywhere else.  It must happen sometime
  *  that is all.
  *
+ *  The event is handed over as the shard's event userdata (see
+ *  EventIndex) rather than as a dozen values, so nothing is copied into
+ *  the debugger stack unless the scripts read it.
+ *
+ *  \param  isBreakpoint    Whether the native breakpoint table has a
+ *                          breakpoint for this event.  Otherwise only
+ *                          the last flow command can cause a stop.
+ *  \param  watchId         Id of the watchpoint whose field was written
+ *                          (0 if not stopping for a watchpoint).
+ *
  *  \version
  *      - S Panyam  27/10/2008
  *      Initial version.
  */
 //*****************************************************************************
-void LuaBindings::HandleBreakpoint(DebugContext *pContext, lua_Debug *pDebug)
+void LuaBindings::HandleBreakpoint(DebugContext *pContext, lua_Debug *pDebug, bool isBreakpoint, int watchId)
 {
-    int handled;
-    if (CallLuaFunc("HandleBreakpoint", "uusissssiiii>b",
-                    this, pContext, pContext->name.c_str(),
-                    pDebug->event, pDebug->name ? pDebug->name : "",
-                    pDebug->namewhat ? pDebug->namewhat : "",
-                    pDebug->what ? pDebug->what : "",
-                    pDebug->source ? pDebug->source : "",
-                    pDebug->currentline, pDebug->nups,
-                    pDebug->linedefined, pDebug->lastlinedefined, &handled) != 0)
+    bool handled    = true;
+    int  shard      = ShardOf(pContext);
+
+    // the shard is only held for the call - not while paused
     {
-        // request a reload so that we give the user an opportunity to fix
-        // any issues that have arisen from the source file.
-        RequestReload();
-        return ;
+        SMutexLock          mutexLock(shards[shard].stackMutex);
+        LuaStack            pStack  = GetLuaStack(shard);
+        BreakpointEvent *   pEvent  = shards[shard].pEvent;
+        LuaCall             call(pStack, shards[shard].handlerRefs[HANDLER_BREAKPOINT],
+                                 shards[shard].errorRef, HANDLER_NAMES[HANDLER_BREAKPOINT]);
+
+        pEvent->pContext        = pContext;
+        pEvent->pDebug          = pDebug;
+        pEvent->isBreakpoint    = isBreakpoint;
+        pEvent->watchId         = watchId;
+
+        call << this << pContext << LuaRef(shards[shard].eventRef);
+        int result = call.Run(1);
+
+        // the event is only valid during the call
+        pEvent->pDebug          = NULL;
+
+        if (result != 0)
+        {
+            // request a reload so that we give the user an opportunity to fix
+            // any issues that have arisen from the source file.
+            RequestReload();
+            return ;
+        }
+        call.Result(1, handled);
     }
 
     if (! handled)
@@ -317,6 +636,10 @@ void LuaBindings::HandleBreakpoint(DebugContext *pContext, lua_Debug *pDebug)
 /*!
  *  \brief  Called by the debugger to notify LUA to handle a client message.
  *
+ *  The message is parsed here (not by the scripts) and handled by the shard
+ *  serving the context it is about, and the reply is encoded natively and
+ *  sent back to the client.
+ *
  *  \version
  *      - S Panyam  27/10/2008
  *      Initial version.
@@ -324,16 +647,41 @@ void LuaBindings::HandleBreakpoint(DebugContext *pContext, lua_Debug *pDebug)
 //*****************************************************************************
 void LuaBindings::HandleMessage(const std::string &message)
 {
-    if (CallLuaFunc("HandleMessage", "us", this, message.c_str()) != 0)
-    {
-        // request a reload so that we give the user an opportunity to fix
-        // any issues that have arisen from the source file.
-        RequestReload();
+    DefaultJsonInputStream<std::string::const_iterator> instream(message.begin(), message.end());
+    DefaultJsonBuilder jbuilder;
+    JsonNodePtr node = jbuilder.Build(&instream);
 
-        // and send out a "failure" message
-        std::string error_msg = "{'code': -1, 'value': 'Unknown error in lua file.'}";
-        pClientIface->SendMessage(error_msg.c_str(), error_msg.size());
+    std::string reply;
+    if (node.Data() == NULL)
+    {
+        reply = "{'code': -1, 'value': 'Invalid message.'}";
+    }
+    else
+    {
+        int             shard       = ShardOf(node);
+        SMutexLock      mutexLock(shards[shard].stackMutex);
+        LuaStack        pStack      = GetLuaStack(shard);
+        LuaCall         call(pStack, shards[shard].handlerRefs[HANDLER_MESSAGE],
+                             shards[shard].errorRef, HANDLER_NAMES[HANDLER_MESSAGE]);
+
+        call << this << node.Data();
+        if (call.Run(1) == 0)
+        {
+            LuaJsonText replyText(reply);
+            call.Result(1, replyText);
+        }
+        else
+        {
+            // request a reload so that we give the user an opportunity to fix
+            // any issues that have arisen from the source file.
+            RequestReload();
+        }
     }
+
+    // and send out a "failure" message if it could not be handled
+    if (reply.empty())
+        reply = "{'code': -1, 'value': 'Unknown error in lua file.'}";
+    pClientIface->SendMessage(reply.c_str(), reply.size());
 }
 
 //*****************************************************************************
@@ -341,15 +689,28 @@ void LuaBindings::HandleMessage(const std::string &message)
  *  \brief  Called by the debugger to notify LUA to handle a client message
  *  in pure json.  
  *
+ *  The message is handled by the shard serving the context it is about.
+ *
  *  \version
  *      - S Panyam  26/06/2009
  *      Initial version.
  */
 //*****************************************************************************
-void LuaBindings::HandleMessage(const JsonNodePtr &message, std::string &output)
+void LuaBindings::HandleMessage(const JsonNodePtr &message, JsonNodePtr &output)
 {
-    output = "null";
-    if (CallLuaFunc("HandleMessage", "uj>s", this, message.Data(), &output) != 0)
+    int             shard       = ShardOf(message);
+    SMutexLock      mutexLock(shards[shard].stackMutex);
+    LuaStack        pStack      = GetLuaStack(shard);
+    LuaCall         call(pStack, shards[shard].handlerRefs[HANDLER_MESSAGE],
+                         shards[shard].errorRef, HANDLER_NAMES[HANDLER_MESSAGE]);
+
+    output = JsonNodeFactory::NullNode();
+    call << this << message.Data();
+    if (call.Run(1) == 0)
+    {
+        call.Result(1, output);
+    }
+    else
     {
         // request a reload so that we give the user an opportunity to fix
         // any issues that have arisen from the source file.
@@ -524,8 +885,12 @@ int LuaBindings::GetContexts(LuaStack stack)
 
     lua_newtable(stack);
 
-    for (DebugContextMap::const_iterator iter = pClientIface->GetContexts().begin();
-         iter != pClientIface->GetContexts().end();
+    // contexts stay alive till the reader goes out of scope
+    ContextRegistry::Reader reader(pClientIface->GetContexts());
+    const DebugContextMap &contexts = reader.Contexts();
+
+    for (DebugContextMap::const_iterator iter = contexts.begin();
+         iter != contexts.end();
          ++iter)
     {
         DebugContext *pContext = iter->second;
@@ -543,6 +908,10 @@ int LuaBindings::GetContexts(LuaStack stack)
             lua_pushboolean(stack, pContext->running);
             lua_setfield(stack, -2, "running");
 
+            // the scripts of other shards know nothing of it
+            pContext->PushLocation(stack);
+            lua_setfield(stack, -2, "location");
+
             lua_settable(stack, -3);
         }
     }
@@ -550,6 +919,807 @@ int LuaBindings::GetContexts(LuaStack stack)
     return 1;   // the table
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Adds a breakpoint to the native breakpoint table.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *  \luaparam   filename    -   Source of a line breakpoint (or nil).
+ *  \luaparam   linenum     -   Line of a line breakpoint (or nil).
+ *  \luaparam   funcname    -   Name of the function for a function
+ *                              breakpoint (or nil for line breakpoints).
+ *  \luaparam   condition   -   Expression that must be truthy for a line
+ *                              breakpoint to stop (or nil to always stop).
+ *  \luaparam   hitmode     -   "equals", "multiple" or "after" to only
+ *                              stop on the hitcount-th hit, every
+ *                              hitcount-th hit or once hitcount hits have
+ *                              been ignored (or nil to stop on every hit).
+ *  \luaparam   hitcount    -   The N of hitmode.
+ *  \luaparam   logmessage  -   Message (with "{expr}" values) logged
+ *                              instead of stopping a line breakpoint (or
+ *                              nil to stop).
+ *  \luaparam   snapshot    -   true to take a snapshot instead of stopping
+ *                              a line breakpoint.
+ *
+ *  \return true if the breakpoint was set, false if the hit mode is not
+ *  known.
+ */
+//*****************************************************************************
+int LuaBindings::SetBreakpoint(LuaStack stack)
+{
+    LuaBindings *       pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    BreakpointTable &   breakpoints     = pLuaBindings->pClientIface->GetBreakpoints();
+    HitMode             hitMode         = HIT_ALWAYS;
+
+    if (!BreakpointOptions::ParseHitMode(lua_tostring(stack, 6), hitMode))
+    {
+        lua_pushboolean(stack, false);
+        return 1;
+    }
+
+    unsigned hitCount = lua_isnumber(stack, 7) ? (unsigned)lua_tointeger(stack, 7) : 0;
+
+    if (lua_isstring(stack, 4))
+    {
+        breakpoints.SetFunctionBreakpoint(lua_tostring(stack, 4), BreakpointOptions(NULL, hitMode, hitCount));
+    }
+    else if (lua_isstring(stack, 2))
+    {
+        const char *logMessage = lua_isstring(stack, 8) ? lua_tostring(stack, 8) : NULL;
+        int fileId = pLuaBindings->pClientIface->GetSources().GetFileId(lua_tostring(stack, 2));
+        breakpoints.SetLineBreakpoint(fileId, lua_tointeger(stack, 3),
+                                      BreakpointOptions(lua_isstring(stack, 5) ? lua_tostring(stack, 5) : NULL,
+                                                        hitMode, hitCount, logMessage,
+                                                        lua_toboolean(stack, 9) != 0));
+
+        // the writer only runs once there is something to write
+        if (logMessage != NULL && logMessage[0] != 0)
+            pLuaBindings->pClientIface->GetLogpoints().Start();
+    }
+
+    // stacks may need call or line events now
+    LunarProbe::GetInstance()->UpdateHooks();
+
+    lua_pushboolean(stack, true);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the number of times a breakpoint has been hit.
+ *
+ *  Hits a condition did not hold for are not counted, ignored hits are.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *  \luaparam   filename    -   Source of a line breakpoint (or nil).
+ *  \luaparam   linenum     -   Line of a line breakpoint (or nil).
+ *  \luaparam   funcname    -   Name of the function for a function
+ *                              breakpoint (or nil for line breakpoints).
+ */
+//*****************************************************************************
+int LuaBindings::GetBreakpointHits(LuaStack stack)
+{
+    LuaBindings *       pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    BreakpointTable &   breakpoints     = pLuaBindings->pClientIface->GetBreakpoints();
+    unsigned            hits            = 0;
+
+    if (lua_isstring(stack, 4))
+    {
+        hits = breakpoints.GetFunctionHits(lua_tostring(stack, 4));
+    }
+    else if (lua_isstring(stack, 2))
+    {
+        int fileId = pLuaBindings->pClientIface->GetSources().GetFileId(lua_tostring(stack, 2));
+        hits = breakpoints.GetLineHits(fileId, lua_tointeger(stack, 3));
+    }
+
+    lua_pushnumber(stack, hits);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Changes the limits of snapshots taken by snapshot breakpoints.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *  \luaparam   frames      -   Frames captured (or nil for the default).
+ *  \luaparam   depth       -   Levels tables are expanded to (or nil).
+ *  \luaparam   budget      -   Bytes a snapshot may take (or nil).
+ *  \luaparam   interval    -   Least ms between two snapshots of a
+ *                              breakpoint (or nil).
+ */
+//*****************************************************************************
+int LuaBindings::SetSnapshotLimits(LuaStack stack)
+{
+    LuaBindings *   pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+
+    pLuaBindings->pClientIface->GetSnapshots().SetLimits(lua_isnumber(stack, 2) ? lua_tointeger(stack, 2) : 0,
+                                                        lua_isnumber(stack, 3) ? lua_tointeger(stack, 3) : 0,
+                                                        lua_isnumber(stack, 4) ? lua_tointeger(stack, 4) : 0,
+                                                        lua_isnumber(stack, 5) ? lua_tointeger(stack, 5) : 0);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets a summary of the snapshots kept.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *
+ *  \return a table with the "snapshots" (see SnapshotStore::PushSnapshots).
+ */
+//*****************************************************************************
+int LuaBindings::GetSnapshots(LuaStack stack)
+{
+    LuaBindings *   pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    ClientIface *   pClientIface    = pLuaBindings->pClientIface;
+
+    pClientIface->GetSnapshots().PushSnapshots(stack, pClientIface->GetSources());
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the frames and variables of a snapshot.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *  \luaparam   id          -   Id of the snapshot.
+ *
+ *  \return the snapshot or nil if it is not (or no longer) kept.
+ */
+//*****************************************************************************
+int LuaBindings::GetSnapshot(LuaStack stack)
+{
+    LuaBindings *   pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    ClientIface *   pClientIface    = pLuaBindings->pClientIface;
+
+    if (!pClientIface->GetSnapshots().PushSnapshot(stack, lua_tointeger(stack, 2), pClientIface->GetSources()))
+        lua_pushnil(stack);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets all snapshots.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ */
+//*****************************************************************************
+int LuaBindings::ClearSnapshots(LuaStack stack)
+{
+    LuaBindings *   pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+
+    pLuaBindings->pClientIface->GetSnapshots().Clear();
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Watches a table field of a paused context.
+ *
+ *  \luaparam   context -   The (paused) context the table belongs to.
+ *  \luaparam   table   -   Expression giving the table, evaluated in the
+ *                          global scope like "eval" (or nil for the
+ *                          globals themselves).
+ *  \luaparam   key     -   Key of the field (a string or number).
+ *  \luaparam   mode    -   "break" to pause when the field is written or
+ *                          "log" to log the old and new values.
+ *
+ *  \return (0, id) if the field is watched, otherwise (-1, error message).
+ */
+//*****************************************************************************
+int LuaBindings::SetWatchpoint(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = GetContextIfPaused(stack);
+    if (pDebugContext != NULL)
+    {
+        LuaStack    pTarget = pDebugContext->pStack;
+        const char *table   = lua_tostring(stack, 2);
+        const char *mode    = lua_tostring(stack, 4);
+        int         top     = lua_gettop(pTarget);
+
+        if (table == NULL || table[0] == 0)
+        {
+            lua_pushvalue(pTarget, LUA_GLOBALSINDEX);
+        }
+        else
+        {
+            std::string chunk = std::string("return ") + table;
+            if (luaL_loadbuffer(pTarget, chunk.c_str(), chunk.size(), "=watch") != 0 ||
+                lua_pcall(pTarget, 0, 1, 0) != 0)
+            {
+                lua_pushinteger(stack, -1);
+                lua_pushstring(stack, lua_tostring(pTarget, -1));
+                lua_settop(pTarget, top);
+                return 2;
+            }
+        }
+
+        if (lua_type(stack, 3) == LUA_TNUMBER)
+            lua_pushnumber(pTarget, lua_tonumber(stack, 3));
+        else
+            lua_pushstring(pTarget, lua_tostring(stack, 3));
+
+        WatchAction action = mode != NULL && strcmp(mode, "log") == 0 ? WATCH_LOG : WATCH_BREAK;
+        std::string error;
+        int id = pDebugContext->watchpoints.Add(pTarget, -2, -1, table, action, error);
+        lua_settop(pTarget, top);
+
+        if (id < 0)
+        {
+            lua_pushinteger(stack, -1);
+            lua_pushstring(stack, error.c_str());
+        }
+        else
+        {
+            if (action == WATCH_LOG)
+                LunarProbe::GetInstance()->GetClientIface()->GetLogpoints().Start();
+
+            lua_pushinteger(stack, 0);
+            lua_pushinteger(stack, id);
+        }
+    }
+
+    return 2;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops watching a table field.
+ *
+ *  The field is put back at once if the context is paused, otherwise the
+ *  next time the context accesses it.
+ *
+ *  \luaparam   context -   The context the watch belongs to.
+ *  \luaparam   id      -   Id of the watchpoint.
+ *
+ *  \return false if there is no such watchpoint.
+ */
+//*****************************************************************************
+int LuaBindings::ClearWatchpoint(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+
+    lua_pushboolean(stack, pDebugContext->watchpoints.Remove(pDebugContext->pStack, lua_tointeger(stack, 2),
+                                                             !pDebugContext->running));
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the watched fields of a context.
+ *
+ *  \luaparam   context -   The context whose watches are wanted.
+ *
+ *  \return a list of the watchpoints (see WatchpointTable::PushWatchpoints).
+ */
+//*****************************************************************************
+int LuaBindings::GetWatchpoints(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+
+    pDebugContext->watchpoints.PushWatchpoints(stack);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes a breakpoint from the native breakpoint table.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ *  \luaparam   filename    -   Source of a line breakpoint (or nil).
+ *  \luaparam   linenum     -   Line of a line breakpoint (or nil).
+ *  \luaparam   funcname    -   Name of the function for a function
+ *                              breakpoint (or nil for line breakpoints).
+ */
+//*****************************************************************************
+int LuaBindings::ClearBreakpoint(LuaStack stack)
+{
+    LuaBindings *       pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    BreakpointTable &   breakpoints     = pLuaBindings->pClientIface->GetBreakpoints();
+
+    if (lua_isstring(stack, 4))
+    {
+        breakpoints.ClearFunctionBreakpoint(lua_tostring(stack, 4));
+    }
+    else if (lua_isstring(stack, 2))
+    {
+        int fileId = pLuaBindings->pClientIface->GetSources().GetFileId(lua_tostring(stack, 2));
+        breakpoints.ClearLineBreakpoint(fileId, lua_tointeger(stack, 3));
+    }
+
+    LunarProbe::GetInstance()->UpdateHooks();
+
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes all breakpoints from the native breakpoint table.
+ *
+ *  \luaparam   debugger    -   The lua debugger owning the breakpoints.
+ */
+//*****************************************************************************
+int LuaBindings::ClearBreakpoints(LuaStack stack)
+{
+    LuaBindings *   pLuaBindings    = (LuaBindings *)lua_touserdata(stack, 1);
+    pLuaBindings->pClientIface->GetBreakpoints().Clear();
+    LunarProbe::GetInstance()->UpdateHooks();
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Sets the flow command a context is to be resumed with.
+ *
+ *  \luaparam   context     -   The context being controlled.
+ *  \luaparam   cmd_type    -   "step", "next", "until", "finish" or nil
+ *                              to clear the last command.
+ *  \luaparam   line        -   Line to run until for "until".
+ *  \luaparam   file        -   File (chunk name or path) to run until
+ *                              for "until" - any file if nil.
+ */
+//*****************************************************************************
+int LuaBindings::SetLastCommand(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    const char *    cmd_type        = lua_tostring(stack, 2);
+    StepMode        mode            = STEP_NONE;
+
+    if (cmd_type == NULL)
+        mode = STEP_NONE;
+    else if (strcmp(cmd_type, "step") == 0)
+        mode = STEP_STEP;
+    else if (strcmp(cmd_type, "next") == 0)
+        mode = STEP_NEXT;
+    else if (strcmp(cmd_type, "until") == 0)
+        mode = STEP_UNTIL;
+    else if (strcmp(cmd_type, "finish") == 0)
+        mode = STEP_FINISH;
+
+    int fileId = -1;
+    if (lua_isstring(stack, 4))
+        fileId = LunarProbe::GetInstance()->GetClientIface()->GetSources().GetFileId(lua_tostring(stack, 4));
+
+    pDebugContext->SetStepMode(mode, lua_isnumber(stack, 3) ? lua_tointeger(stack, 3) : -1, fileId);
+
+    // only this stack needs its events changed
+    LunarProbe::GetInstance()->UpdateHook(pDebugContext->pStack);
+
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the canonical form of a path (or chunk name) that
+ *  breakpoints are matched with.
+ *
+ *  \luaparam   path    -   The path to normalize.
+ */
+//*****************************************************************************
+int LuaBindings::NormalizePath(LuaStack stack)
+{
+    const char *path = luaL_checkstring(stack, 1);
+    lua_pushstring(stack, SourceRegistry::NormalizePath(path).c_str());
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts the sampling profiler of a context.
+ *
+ *  \luaparam   context     -   The context to be profiled.
+ *  \luaparam   mode        -   "count" to sample every period instructions
+ *                              or "interval" to sample every period
+ *                              milliseconds.
+ *  \luaparam   period      -   Instructions or milliseconds between
+ *                              samples (or nil for the default).
+ */
+//*****************************************************************************
+int LuaBindings::StartProfiler(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    const char *    mode            = lua_tostring(stack, 2);
+    int             period          = lua_isnumber(stack, 3) ? lua_tointeger(stack, 3) : 0;
+
+    LunarProbe::GetInstance()->GetClientIface()->StartSampling(pDebugContext,
+            mode != NULL && strcmp(mode, "interval") == 0 ? SAMPLE_BY_INTERVAL : SAMPLE_BY_COUNT,
+            period);
+
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops the sampling profiler of a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ */
+//*****************************************************************************
+int LuaBindings::StopProfiler(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->StopSampling(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards the samples collected for a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ */
+//*****************************************************************************
+int LuaBindings::ClearProfile(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    if (pDebugContext->pSampler != NULL)
+        pDebugContext->pSampler->Clear();
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the samples collected for a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ *
+ *  \return A table with the samples as folded stacks ("folded"), the
+ *  number of samples taken ("samples") and dropped ("dropped") and whether
+ *  the profiler is still running ("running").
+ */
+//*****************************************************************************
+int LuaBindings::GetProfile(LuaStack stack)
+{
+    DebugContext *      pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    SamplingProfiler *  pSampler        = pDebugContext->pSampler;
+    std::ostringstream  folded;
+
+    if (pSampler != NULL)
+        pSampler->WriteFolded(folded);
+
+    lua_newtable(stack);
+
+    lua_pushstring(stack, folded.str().c_str());
+    lua_setfield(stack, -2, "folded");
+
+    lua_pushinteger(stack, pSampler == NULL ? 0 : pSampler->NumSamples());
+    lua_setfield(stack, -2, "samples");
+
+    lua_pushinteger(stack, pSampler == NULL ? 0 : pSampler->NumDropped());
+    lua_setfield(stack, -2, "dropped");
+
+    lua_pushboolean(stack, pSampler != NULL && pSampler->Running());
+    lua_setfield(stack, -2, "running");
+
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts tracing the calls and returns of a context.
+ *
+ *  \luaparam   context     -   The context to be traced.
+ */
+//*****************************************************************************
+int LuaBindings::StartTracer(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->StartTracing(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops tracing the calls and returns of a context.
+ *
+ *  \luaparam   context     -   The context being traced.
+ */
+//*****************************************************************************
+int LuaBindings::StopTracer(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->StopTracing(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards the call tree collected for a context.
+ *
+ *  \luaparam   context     -   The context being traced.
+ */
+//*****************************************************************************
+int LuaBindings::ClearTrace(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->GetTracer().Reset(pDebugContext->pStack);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the call tree collected for a context.
+ *
+ *  \luaparam   context     -   The context being traced.
+ *
+ *  \return A table with the call tree ("tree"), the totals of each
+ *  function ("functions"), the number of events dropped ("dropped") and
+ *  whether tracing is still on ("running").  Each node of the tree and
+ *  each function has a "name", a number of "calls" and "inclusive" and
+ *  "exclusive" times in milliseconds.
+ */
+//*****************************************************************************
+int LuaBindings::GetTrace(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+
+    LunarProbe::GetInstance()->GetClientIface()->GetTracer().PushReport(stack, pDebugContext->pStack);
+
+    lua_pushboolean(stack, pDebugContext->tracing);
+    lua_setfield(stack, -2, "running");
+
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts recording the lines run by a context.
+ *
+ *  \luaparam   context     -   The context to be covered.
+ */
+//*****************************************************************************
+int LuaBindings::StartCoverage(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->StartCoverage(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops recording the lines run by a context.
+ *
+ *  \luaparam   context     -   The context being covered.
+ */
+//*****************************************************************************
+int LuaBindings::StopCoverage(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->StopCoverage(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets the lines run by a context so far.
+ *
+ *  \luaparam   context     -   The context being covered.
+ */
+//*****************************************************************************
+int LuaBindings::ClearCoverage(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    LunarProbe::GetInstance()->GetClientIface()->ClearCoverage(pDebugContext);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the lines run by a context.
+ *
+ *  \luaparam   context     -   The context being covered.
+ *  \luaparam   format      -   "lcov" (default) or "cobertura".
+ *
+ *  \return The report as a string (empty if coverage was never started).
+ */
+//*****************************************************************************
+int LuaBindings::GetCoverage(LuaStack stack)
+{
+    DebugContext *      pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    const char *        format          = lua_tostring(stack, 2);
+    std::ostringstream  report;
+
+    LunarProbe::GetInstance()->GetClientIface()->WriteCoverage(pDebugContext, report,
+            format != NULL && strcmp(format, "cobertura") == 0 ? COVERAGE_COBERTURA : COVERAGE_LCOV);
+
+    lua_pushstring(stack, report.str().c_str());
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts sampling the allocations of a context.
+ *
+ *  \luaparam   context     -   The context to be profiled.
+ *  \luaparam   bytes       -   Bytes allocated between samples (or nil
+ *                              for the default).
+ *
+ *  \return false if the stack of the context was not created with a
+ *  profiled allocator, true otherwise.
+ */
+//*****************************************************************************
+int LuaBindings::StartAllocs(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    AllocProfiler * pProfiler       = AllocProfiler::FromStack(pDebugContext->pStack);
+
+    if (pProfiler != NULL)
+        pProfiler->Start(lua_isnumber(stack, 2) ? lua_tointeger(stack, 2) : 0);
+
+    lua_pushboolean(stack, pProfiler != NULL);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops sampling the allocations of a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ *
+ *  \return false if the stack of the context was not created with a
+ *  profiled allocator, true otherwise.
+ */
+//*****************************************************************************
+int LuaBindings::StopAllocs(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    AllocProfiler * pProfiler       = AllocProfiler::FromStack(pDebugContext->pStack);
+
+    if (pProfiler != NULL)
+        pProfiler->Stop();
+
+    lua_pushboolean(stack, pProfiler != NULL);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards the allocation samples of a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ *
+ *  \return false if the stack of the context was not created with a
+ *  profiled allocator, true otherwise.
+ */
+//*****************************************************************************
+int LuaBindings::ClearAllocs(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    AllocProfiler * pProfiler       = AllocProfiler::FromStack(pDebugContext->pStack);
+
+    if (pProfiler != NULL)
+        pProfiler->Clear();
+
+    lua_pushboolean(stack, pProfiler != NULL);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the allocation sites of a context.
+ *
+ *  \luaparam   context     -   The context being profiled.
+ *
+ *  \return nil if the stack of the context was not created with a
+ *  profiled allocator, otherwise a table with the totals, the sampled
+ *  "sites" and the "functions" they are in (see
+ *  AllocProfiler::PushReport).
+ */
+//*****************************************************************************
+int LuaBindings::GetAllocs(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    AllocProfiler * pProfiler       = AllocProfiler::FromStack(pDebugContext->pStack);
+
+    if (pProfiler != NULL)
+        pProfiler->PushReport(stack);
+    else
+        lua_pushnil(stack);
+
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Changes the collector policy of a context.
+ *
+ *  \luaparam   context     -   The context whose policy is changed.
+ *  \luaparam   mode        -   "stw" or "incremental".
+ *  \luaparam   pause       -   The collector pause (or nil for the
+ *                              default).
+ *  \luaparam   stepmul     -   The step multiplier of incremental
+ *                              collection (or nil for the default).
+ *
+ *  \return false if the stack of the context was not created by
+ *  LuaUtils::NewLuaStack, true otherwise.
+ */
+//*****************************************************************************
+int LuaBindings::SetGcPolicy(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    const char *    mode            = lua_tostring(stack, 2);
+    GcMonitor *     pMonitor        = GcMonitor::FromStack(pDebugContext->pStack);
+
+    if (pMonitor != NULL)
+    {
+        pMonitor->SetPolicy(GcPolicy(mode != NULL && strcmp(mode, "incremental") == 0 ?
+                                        GC_INCREMENTAL : GC_STOP_THE_WORLD,
+                                     lua_isnumber(stack, 3) ? lua_tointeger(stack, 3) : 0,
+                                     lua_isnumber(stack, 4) ? lua_tointeger(stack, 4) : 0));
+    }
+
+    lua_pushboolean(stack, pMonitor != NULL);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the collector policy and recent cycles of a context.
+ *
+ *  \luaparam   context     -   The context whose stats are wanted.
+ *
+ *  \return nil if the stack of the context was not created by
+ *  LuaUtils::NewLuaStack, otherwise a table with the policy, totals and
+ *  "recent" cycles (see GcMonitor::PushStats).
+ */
+//*****************************************************************************
+int LuaBindings::GetGcStats(LuaStack stack)
+{
+    DebugContext *  pDebugContext   = (DebugContext *)lua_touserdata(stack, 1);
+    GcMonitor *     pMonitor        = GcMonitor::FromStack(pDebugContext->pStack);
+
+    if (pMonitor != NULL)
+        pMonitor->PushStats(stack);
+    else
+        lua_pushnil(stack);
+
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Encodes a value as json (see JsonEncoder).
+ *
+ *  \luaparam   value       -   The value to encode.
+ *  \luaparam   maxdepth    -   Optional depth beyond which tables are
+ *                              written as null.
+ *
+ *  \return The json string.
+ */
+//*****************************************************************************
+int LuaBindings::EncodeJson(LuaStack stack)
+{
+    static const size_t MAX_KEPT_CAPACITY = 1 << 20;
+
+    std::string *   pBuffer     = (std::string *)lua_touserdata(stack, lua_upvalueindex(1));
+    int             maxDepth    = lua_isnumber(stack, 2) ? lua_tointeger(stack, 2) : JsonEncoder::DEFAULT_MAX_DEPTH;
+
+    // clear keeps the capacity from the previous messages
+    pBuffer->clear();
+    JsonEncoder(*pBuffer, maxDepth).Encode(stack, 1);
+    lua_pushlstring(stack, pBuffer->data(), pBuffer->size());
+
+    // but not that of an unusually large one
+    if (pBuffer->capacity() > MAX_KEPT_CAPACITY)
+        std::string().swap(*pBuffer);
+
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destroys the buffer of EncodeJson when its stack is closed.
+ */
+//*****************************************************************************
+int LuaBindings::FreeJsonBuffer(LuaStack stack)
+{
+    typedef std::string String;
+
+    String *pBuffer = (String *)lua_touserdata(stack, 1);
+    pBuffer->~String();
+    return 0;
+}
 
 //*****************************************************************************
 /*!
@@ -38,12 +38,22 @@ LUNARPROBE_NS_BEGIN
  *
  *  \brief  Lua bindings for the debugger.
  *
+ *  The debugger scripts run in NUM_SHARDS lua stacks of their own, each
+ *  serving the contexts whose address hashes to it, so the hooks of
+ *  contexts in different shards never wait on one another.  Breakpoints
+ *  and the rest of the state shared by all contexts live in native tables
+ *  (BreakpointTable etc) that every shard sees.  The scripts' own list of
+ *  breakpoints is owned by CONTROL_SHARD: the commands in CONTROL_COMMANDS
+ *  and messages that name no context always go there, and a reset
+ *  reloads every shard.
+ *
  *****************************************************************************/
 class LuaBindings
 {
 public:
     // The folder where all the lua files are - modified by 
-    // the embedding program
+    // the embedding program.  When empty (the default) the scripts
+    // compiled into the library are used instead.
     static std::string  LUA_SRC_LOCATION;
 
     // The prefix to be used on all global variables that the debugger
@@ -51,6 +61,10 @@ public:
     // soon as debugging is stopped).
     static std::string  LUA_VAR_PREFIX;
 
+    // The number of debugger lua stacks the contexts are spread over -
+    // modified by the embedding program before the debugger is started.
+    static int          NUM_SHARDS;
+
 public:
     // ctor
     LuaBindings(ClientIface *pClientIface);
@@ -65,14 +79,14 @@ public:
     virtual void ContextRemoved(DebugContext *pContext);
 
     // Called by the debugger to tell LUA to handle a break point.
-    virtual void HandleBreakpoint(DebugContext *pContext, LuaDebug pDebug);
+    virtual void HandleBreakpoint(DebugContext *pContext, LuaDebug pDebug, bool isBreakpoint, int watchId = 0);
 
     // Called by the debugger to notify LUA to handle a client message
     virtual void HandleMessage(const std::string &message);
 
     // Called by the debugger to notify LUA to handle a client message in
     // unstringified json format 
-    virtual void HandleMessage(const JsonNodePtr &message, std::string &output);
+    virtual void HandleMessage(const JsonNodePtr &message, JsonNodePtr &output);
 
     // Requests a reload of the scripts.
     void RequestReload();
@@ -119,25 +133,207 @@ public: // Lua methods - called from LUA
     // Get the list of contexts being debugged
     static int GetContexts(LuaStack stack);
 
+    // Adds a breakpoint to the native breakpoint table
+    static int SetBreakpoint(LuaStack stack);
+
+    // Removes a breakpoint from the native breakpoint table
+    static int ClearBreakpoint(LuaStack stack);
+
+    // Removes all breakpoints from the native breakpoint table
+    static int ClearBreakpoints(LuaStack stack);
+
+    // Gets the number of times a breakpoint has been hit
+    static int GetBreakpointHits(LuaStack stack);
+
+    // Changes the limits of snapshots taken by snapshot breakpoints
+    static int SetSnapshotLimits(LuaStack stack);
+
+    // Gets a summary of the snapshots kept
+    static int GetSnapshots(LuaStack stack);
+
+    // Gets the frames and variables of a snapshot
+    static int GetSnapshot(LuaStack stack);
+
+    // Forgets all snapshots
+    static int ClearSnapshots(LuaStack stack);
+
+    // Watches a table field of a paused context
+    static int SetWatchpoint(LuaStack stack);
+
+    // Stops watching a table field
+    static int ClearWatchpoint(LuaStack stack);
+
+    // Gets the watched fields of a context
+    static int GetWatchpoints(LuaStack stack);
+
+    // Sets the flow command a context is to be resumed with
+    static int SetLastCommand(LuaStack stack);
+
+    // Gets the canonical form of a path breakpoints are matched with
+    static int NormalizePath(LuaStack stack);
+
+    // Starts the sampling profiler of a context
+    static int StartProfiler(LuaStack stack);
+
+    // Stops the sampling profiler of a context
+    static int StopProfiler(LuaStack stack);
+
+    // Discards the samples of a context
+    static int ClearProfile(LuaStack stack);
+
+    // Gets the samples of a context as folded stacks
+    static int GetProfile(LuaStack stack);
+
+    // Starts tracing the calls of a context
+    static int StartTracer(LuaStack stack);
+
+    // Stops tracing the calls of a context
+    static int StopTracer(LuaStack stack);
+
+    // Discards the call tree of a context
+    static int ClearTrace(LuaStack stack);
+
+    // Gets the call tree and function totals of a context
+    static int GetTrace(LuaStack stack);
+
+    // Starts recording the lines run by a context
+    static int StartCoverage(LuaStack stack);
+
+    // Stops recording the lines run by a context
+    static int StopCoverage(LuaStack stack);
+
+    // Forgets the lines run by a context
+    static int ClearCoverage(LuaStack stack);
+
+    // Gets the lines run by a context as an lcov or cobertura report
+    static int GetCoverage(LuaStack stack);
+
+    // Starts sampling the allocations of a context
+    static int StartAllocs(LuaStack stack);
+
+    // Stops sampling the allocations of a context
+    static int StopAllocs(LuaStack stack);
+
+    // Discards the allocation samples of a context
+    static int ClearAllocs(LuaStack stack);
+
+    // Gets the allocation sites of a context
+    static int GetAllocs(LuaStack stack);
+
+    // Changes the collector policy of a context
+    static int SetGcPolicy(LuaStack stack);
+
+    // Gets the collector policy and recent cycles of a context
+    static int GetGcStats(LuaStack stack);
+
+    // Encodes a value as json
+    static int EncodeJson(LuaStack stack);
+
 protected:
-    // Gets the lua stack instance
-    LuaStack    GetLuaStack();
+    //! The functions of the debugger scripts called by the debugger
+    enum ScriptHandler
+    {
+        HANDLER_CONTEXT_ADDED,
+        HANDLER_CONTEXT_REMOVED,
+        HANDLER_BREAKPOINT,
+        HANDLER_MESSAGE,
+        NUM_HANDLERS
+    };
+
+    //! Global names of the handlers
+    static const char * HANDLER_NAMES[NUM_HANDLERS];
+
+    //! Shard that owns the state of the scripts not tied to a context
+    static const int    CONTROL_SHARD = 0;
+
+    //! Commands always handled by CONTROL_SHARD (NULL terminated)
+    static const char * CONTROL_COMMANDS[];
+
+    //! The event HandleBreakpoint hands the scripts - a userdata (one per
+    //! shard) whose fields are only pushed when the scripts read them
+    struct BreakpointEvent
+    {
+        //! Context the event is for
+        DebugContext *  pContext;
+
+        //! The event (NULL outside HandleBreakpoint)
+        LuaDebug        pDebug;
+
+        //! Whether the native breakpoint table has a breakpoint for it
+        bool            isBreakpoint;
+
+        //! Id of the watchpoint written (0 if none)
+        int             watchId;
+    };
+
+    //! A debugger lua stack and the contexts it serves
+    struct DebuggerShard
+    {
+        DebuggerShard() : pStack(NULL), reloadRequested(true), errorRef(LUA_NOREF),
+                          pEvent(NULL), eventRef(LUA_NOREF),
+                          stackMutex(PTHREAD_MUTEX_RECURSIVE_NP)
+        {
+            for (int i = 0;i < NUM_HANDLERS;i++)
+                handlerRefs[i] = LUA_NOREF;
+        }
+
+        //! The debugger lua stack - for running the debugger
+        LuaStack        pStack;
 
-    // Calls the function on the debugger lua files.
-    int         CallLuaFunc(const char *funcname, const char *funcsig, ...);
+        //! Whether a reload has been requested or not.
+        volatile bool   reloadRequested;
+
+        //! Registry references of the handlers (as of the last load)
+        int             handlerRefs[NUM_HANDLERS];
+
+        //! Registry reference of the error handler of the calls
+        int             errorRef;
+
+        //! The event userdata and its registry reference
+        BreakpointEvent *   pEvent;
+        int                 eventRef;
+
+        //! Mutex for the debugger lua stack
+        SMutex          stackMutex;
+    };
+
+    // Gets the shard serving a context
+    int         ShardOf(const void *pContext) const;
+
+    // Gets the shard serving the context a client message is about
+    int         ShardOf(const JsonNodePtr &message) const;
+
+    // Gets the lua stack instance of a shard
+    LuaStack    GetLuaStack(int shard);
+
+    // Looks the handlers of a shard up after its scripts are (re)loaded
+    void        ResolveHandlers(int shard);
+
+    // Creates the event userdata of a debugger stack
+    static BreakpointEvent *    NewEvent(LuaStack pStack, int &eventRef);
+
+    // Reads a field of the event userdata
+    static int  EventIndex(LuaStack stack);
+
+    // Makes the embedded scripts requirable from a debugger stack
+    static int  PreloadScripts(LuaStack pStack);
+
+    // Runs an embedded script on a debugger stack
+    static int  RunScript(LuaStack pStack, const char *name);
+
+    // Destroys the output buffer of EncodeJson
+    static int  FreeJsonBuffer(LuaStack stack);
 
 protected:
     //! The actual debugger object we will be seving.
-    ClientIface *  pClientIface;
-
-    //! The debugger lua stack - for running the debugger
-    LuaStack    pStack;
+    ClientIface *   pClientIface;
 
-    //! Whether a reload has been requested or not.
-    bool        reloadRequested;
+    //! The debugger lua stacks - shard 0 also handles the client messages
+    //! not meant for a particular context (breakpoints, files etc)
+    DebuggerShard * shards;
 
-    // Mutex for the debugger lua stack
-    SMutex      dbgStackMutex;
+    //! Number of shards
+    int             numShards;
 };
 
 LUNARPROBE_NS_END
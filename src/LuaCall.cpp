@@ -0,0 +1,145 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   LuaCall.cpp
+ *
+ *  \brief  Typed calls of lua functions held in the registry.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include "LuaCall.h"
+
+LUNARPROBE_NS_BEGIN
+
+// in LuaUtils.cpp
+int traceback(lua_State *L);
+void LuaError(lua_State *stack, const char *fmt, ...);
+
+//*****************************************************************************
+/*!
+ *  \brief  Constructor.
+ *
+ *  Pushes the error handler and the function - the arguments follow.
+ *
+ *  \param  funcRef     Registry reference of the function (see Ref).
+ *  \param  errorRef    Registry reference of the error handler (see
+ *                      RefErrorHandler) or LUA_NOREF to push a new one.
+ *  \param  funcName    Name of the function for errors.
+ */
+//*****************************************************************************
+LuaCall::LuaCall(LuaStack stack, int funcRef, int errorRef, const char *funcName) :
+    pStack(stack),
+    name(funcName),
+    top(lua_gettop(stack)),
+    errorIndex(0),
+    numArgs(0),
+    numResults(0)
+{
+    luaL_checkstack(pStack, 2, "No room for a call");
+
+    if (errorRef == LUA_NOREF || errorRef == LUA_REFNIL)
+        lua_pushcfunction(pStack, traceback);
+    else
+        lua_rawgeti(pStack, LUA_REGISTRYINDEX, errorRef);
+    errorIndex = lua_gettop(pStack);
+
+    lua_rawgeti(pStack, LUA_REGISTRYINDEX, funcRef);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ *
+ *  Pops the error handler, the results (or error) and anything else the
+ *  call left on the stack.
+ */
+//*****************************************************************************
+LuaCall::~LuaCall()
+{
+    lua_settop(pStack, top);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Calls the function with the arguments added.
+ *
+ *  \param  nresults    Number of results to keep for Result.
+ *
+ *  \return 0 if the call succeeded, otherwise the lua error code (or -1
+ *  if the function does not exist).
+ */
+//*****************************************************************************
+int LuaCall::Run(int nresults)
+{
+    if (!lua_isfunction(pStack, errorIndex + 1))
+    {
+        fprintf(stderr, "Stack %p - No function '%s'.\n", pStack, name);
+        return -1;
+    }
+
+    int result = lua_pcall(pStack, numArgs, nresults, errorIndex);
+    if (result != 0)
+    {
+        LuaError(pStack, "Error running function '%s'", name);
+    }
+    else
+    {
+        numResults = nresults;
+    }
+    return result;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Keeps the function at the top of a stack in the registry.
+ *
+ *  The function is popped.
+ *
+ *  \return The reference to call it with (LUA_REFNIL if it was nil).
+ */
+//*****************************************************************************
+int LuaCall::Ref(LuaStack pStack)
+{
+    return luaL_ref(pStack, LUA_REGISTRYINDEX);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Keeps the error handler calls are made with (which adds a
+ *  traceback to errors) in the registry.
+ */
+//*****************************************************************************
+int LuaCall::RefErrorHandler(LuaStack pStack)
+{
+    lua_pushcfunction(pStack, traceback);
+    return Ref(pStack);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Releases a reference and resets it to LUA_NOREF.
+ */
+//*****************************************************************************
+void LuaCall::Unref(LuaStack pStack, int &ref)
+{
+    if (ref != LUA_NOREF && ref != LUA_REFNIL)
+        luaL_unref(pStack, LUA_REGISTRYINDEX, ref);
+    ref = LUA_NOREF;
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,249 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   LuaCall.h
+ *
+ *  \brief  Typed calls of lua functions held in the registry.
+ *
+ *****************************************************************************/
+
+#ifndef _LUA_CALL_H_
+#define _LUA_CALL_H_
+
+#include <stdio.h>
+#include <string>
+#include "LuaUtils.h"
+#include "JsonEncoder.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  LuaArg
+ *
+ *  \brief  How values of a type are pushed onto and read off a lua stack.
+ *
+ *  Pointers without a specialisation are passed as light userdata.
+ *
+ *****************************************************************************/
+template <typename T> struct LuaArg;
+
+template <> struct LuaArg<int>
+{
+    static void Push(LuaStack L, int value)     { lua_pushinteger(L, value); }
+    static bool To(LuaStack L, int index, int &value)
+    {
+        if (!lua_isnumber(L, index))
+            return false;
+        value = static_cast<int>(lua_tonumber(L, index));
+        return true;
+    }
+};
+
+template <> struct LuaArg<double>
+{
+    static void Push(LuaStack L, double value)  { lua_pushnumber(L, value); }
+    static bool To(LuaStack L, int index, double &value)
+    {
+        if (!lua_isnumber(L, index))
+            return false;
+        value = lua_tonumber(L, index);
+        return true;
+    }
+};
+
+template <> struct LuaArg<bool>
+{
+    static void Push(LuaStack L, bool value)    { lua_pushboolean(L, value); }
+    static bool To(LuaStack L, int index, bool &value)
+    {
+        // numbers are accepted as well (as CallLuaFunc always has)
+        if (lua_isboolean(L, index))
+            value = lua_toboolean(L, index) != 0;
+        else if (lua_isnumber(L, index))
+            value = lua_tonumber(L, index) != 0;
+        else
+            return false;
+        return true;
+    }
+};
+
+template <> struct LuaArg<std::string>
+{
+    static void Push(LuaStack L, const std::string &value) { lua_pushlstring(L, value.c_str(), value.size()); }
+    static bool To(LuaStack L, int index, std::string &value)
+    {
+        size_t length;
+        if (!lua_isstring(L, index))
+            return false;
+        const char *str = lua_tolstring(L, index, &length);
+        value.assign(str, length);
+        return true;
+    }
+};
+
+template <> struct LuaArg<const char *>
+{
+    static void Push(LuaStack L, const char *value) { lua_pushstring(L, value); }
+};
+
+template <> struct LuaArg<char *>
+{
+    static void Push(LuaStack L, const char *value) { lua_pushstring(L, value); }
+};
+
+template <> struct LuaArg<const JsonNode *>
+{
+    static void Push(LuaStack L, const JsonNode *value) { LuaUtils::PushJson(L, value); }
+};
+
+template <> struct LuaArg<JsonNode *>
+{
+    static void Push(LuaStack L, const JsonNode *value) { LuaUtils::PushJson(L, value); }
+};
+
+template <> struct LuaArg<JsonNodePtr>
+{
+    static void Push(LuaStack L, const JsonNodePtr &value) { LuaUtils::PushJson(L, value); }
+    static bool To(LuaStack L, int index, JsonNodePtr &value)
+    {
+        lua_pushvalue(L, index);
+        LuaUtils::PopJson(L, value);
+        return true;
+    }
+};
+
+//! A result read as json text (see JsonEncoder)
+struct LuaJsonText
+{
+    explicit LuaJsonText(std::string &t) : text(t) { }
+
+    std::string &   text;
+};
+
+template <> struct LuaArg<LuaJsonText>
+{
+    static bool To(LuaStack L, int index, LuaJsonText &value)
+    {
+        value.text.clear();
+        JsonEncoder(value.text).Encode(L, index);
+        return true;
+    }
+};
+
+template <typename T> struct LuaArg<T *>
+{
+    static void Push(LuaStack L, T *value)      { lua_pushlightuserdata(L, (void *)value); }
+};
+
+//! A value kept in the registry - passed as the value itself
+struct LuaRef
+{
+    explicit LuaRef(int r) : ref(r) { }
+
+    int     ref;
+};
+
+template <> struct LuaArg<LuaRef>
+{
+    static void Push(LuaStack L, const LuaRef &value) { lua_rawgeti(L, LUA_REGISTRYINDEX, value.ref); }
+};
+
+//*****************************************************************************
+/*!
+ *  \class  LuaCall
+ *
+ *  \brief  A call of a lua function held in the registry.
+ *
+ *  The arguments are streamed in with << and converted by LuaArg for
+ *  their static type, so nothing is looked up or parsed at run time:
+ *
+ *      LuaCall call(pStack, funcRef, errorRef, "HandleBreakpoint");
+ *      call << pContext << pDebug->currentline;
+ *      if (call.Run(1) == 0)
+ *          call.Result(1, handled);
+ *
+ *  The stack is restored to how it was found when the call goes out of
+ *  scope.
+ *
+ *****************************************************************************/
+class LuaCall
+{
+public:
+    // ctor
+    LuaCall(LuaStack pStack, int funcRef, int errorRef, const char *name);
+
+    // dtor
+    ~LuaCall();
+
+    // Adds an argument
+    template <typename T>
+    LuaCall &   operator<<(const T &value)
+    {
+        luaL_checkstack(pStack, 1, "Too many arguments");
+        LuaArg<T>::Push(pStack, value);
+        numArgs++;
+        return *this;
+    }
+
+    // Calls the function with the arguments added
+    int         Run(int numResults = 0);
+
+    // Gets a result (1 is the first) of a successful call
+    template <typename T>
+    bool        Result(int index, T &value) const
+    {
+        if (index < 1 || index > numResults || !LuaArg<T>::To(pStack, errorIndex + index, value))
+        {
+            fprintf(stderr, "Stack %p - Wrong type of result %d of '%s'.\n", pStack, index, name);
+            return false;
+        }
+        return true;
+    }
+
+    // Keeps the function at the top of a stack in the registry
+    static int  Ref(LuaStack pStack);
+
+    // Keeps the error handler all calls are made with in the registry
+    static int  RefErrorHandler(LuaStack pStack);
+
+    // Releases a reference
+    static void Unref(LuaStack pStack, int &ref);
+
+protected:
+    //! Stack the function is called on
+    LuaStack        pStack;
+
+    //! Name of the function (for errors)
+    const char *    name;
+
+    //! Top of the stack before the call
+    int             top;
+
+    //! Index of the error handler (the function is above it)
+    int             errorIndex;
+
+    //! Arguments added so far
+    int             numArgs;
+
+    //! Results of the call
+    int             numResults;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -24,7 +24,12 @@
  *
  *****************************************************************************/
 
+#include <limits.h>
+#include <stdio.h>
+#include <vector>
 #include "lpmain.h"
+#include "JsonEncoder.h"
+#include "ValueSerializer.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -73,20 +78,26 @@ void LuaError(lua_State *stack, const char *fmt, ...)
  *  \brief  convinience function creating a new lua stack and opening the
  *          standard libraries
  *
+ *  \param  profileAllocs   Whether the stack allocates through an
+ *                          AllocProfiler.
+ *  \param  gcPolicy        How the collector of the stack runs - the
+ *                          default is stop-the-world.  Collection cycles
+ *                          are recorded by a GcMonitor.
+ *
  *  \version
  *      - S Panyam  04/11/2008
  *      Initial version.
  */
 //*****************************************************************************
-LuaStack LuaUtils::NewLuaStack(bool openlibs, bool debug, const char *name)
+LuaStack LuaUtils::NewLuaStack(bool openlibs, bool debug, const char *name, bool profileAllocs,
+                               const GcPolicy &gcPolicy)
 {
-    LuaStack new_stack = lua_open();
+    LuaStack new_stack = profileAllocs ? AllocProfiler::NewState() : lua_open();
 
     if (openlibs)
         luaL_openlibs(new_stack);
 
-    // Force lua garbage collector to be non incremental
-    lua_gc(new_stack, LUA_GCSETSTEPMUL, 100000000);
+    GcMonitor::Install(new_stack, gcPolicy);
 
     if (debug)
         LunarProbe::GetInstance()->Attach(new_stack, name);
@@ -162,6 +173,41 @@ int LuaUtils::RunLuaString(lua_State *L, const char *lua_str, int len)
     return retCode;
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Runs a chunk held in memory on a specific stack.
+ *
+ *  Unlike RunLuaString the chunk can be bytecode (as lua_dump writes it)
+ *  and is never printed - errors are reported with its name.
+ *
+ *  \param  L       The stack on which the chunk is to be executed.
+ *  \param  buffer  The source or bytecode of the chunk.
+ *  \param  size    Size of the chunk.
+ *  \param  name    Name of the chunk.
+ */
+//*****************************************************************************
+int LuaUtils::RunLuaBuffer(lua_State *L, const char *buffer, size_t size, const char *name)
+{
+    int retCode;
+
+    lua_pushcfunction(L, traceback);
+    int errorFunc   = lua_gettop(L);
+
+    if ((retCode = luaL_loadbuffer(L, buffer, size, name)) != 0)
+    {
+        LuaError(L, "Error Loading Chunk '%s'", name);
+    }
+    else if ((retCode = lua_pcall(L, 0, LUA_MULTRET, errorFunc)) != 0)
+    {
+        LuaError(L, "Error Executing Chunk: '%s'\n", name);
+    }
+
+    // Remove the error function
+    lua_remove(L, errorFunc);
+
+    return retCode;
+}
+
 //*****************************************************************************
 /*!
  *  \brief  Wrapper to push a json node smart ptr.
@@ -228,10 +274,90 @@ void LuaUtils::PushJson(lua_State  *L, const JsonNode *node)
     }
 }
 
+//*****************************************************************************
+/*!
+ *  \class  JsonNodeBuilder
+ *
+ *  \brief  Builds the json node of a value as JsonEncoder would write it.
+ *
+ *  The walk (cycles, depth, lists and objects) is JsonWalker's - only the
+ *  nodes are made here.
+ *
+ *****************************************************************************/
+class JsonNodeBuilder : public JsonWalker
+{
+public:
+    JsonNodeBuilder(JsonNodePtr &out) : output(out) { }
+
+protected:
+    virtual void    OnNull()                    { Add(JsonNodeFactory::NullNode()); }
+    virtual void    OnBoolean(bool value)       { Add(JsonNodeFactory::BoolNode(value)); }
+
+    virtual void    OnNumber(lua_Number value)
+    {
+        if (value >= INT_MIN && value <= INT_MAX && value == (int)value)
+            Add(JsonNodeFactory::IntNode((int)value));
+        else
+            Add(JsonNodeFactory::DoubleNode(value));
+    }
+
+    virtual void    OnString(const char *str, size_t length)
+    {
+        Add(JsonNodeFactory::StringNode(SString(str, length)));
+    }
+
+    virtual void    OnBeginList()
+    {
+        JsonListNode *pList = JsonNodeFactory::ListNode();
+        Add(pList);
+        containers.push_back(Container(pList, NULL));
+    }
+
+    virtual void    OnBeginObject()
+    {
+        JsonObjectNode *pObject = JsonNodeFactory::ObjectNode();
+        Add(pObject);
+        containers.push_back(Container(NULL, pObject));
+    }
+
+    virtual void    OnKey(const char *str, size_t length)   { key.assign(str, length); }
+    virtual void    OnEndList()                             { containers.pop_back(); }
+    virtual void    OnEndObject()                           { containers.pop_back(); }
+
+    //! Puts a node in the table being built (or makes it the result)
+    void            Add(const JsonNodePtr &node)
+    {
+        if (containers.empty())
+            output = node;
+        else if (containers.back().first != NULL)
+            containers.back().first->Add(node);
+        else
+            containers.back().second->Set(key, node);
+    }
+
+protected:
+    //! A list or an object being filled
+    typedef std::pair<JsonListNode *, JsonObjectNode *> Container;
+
+    //! Where the node goes
+    JsonNodePtr &           output;
+
+    //! Tables being built (innermost last) - owned by their parents
+    std::vector<Container>  containers;
+
+    //! Key of the next value of the object being built
+    SString                 key;
+};
+
 //*****************************************************************************
 /*!
  *  \brief  Converts the top most item on the stack into a json node.
  *
+ *  Tables are walked directly (by the same JsonWalker as DebugLib.EncodeJson)
+ *  so nothing is encoded as text on the way and the node is the same as
+ *  what DebugLib.EncodeJson would write.  The item
+ *  is popped.
+ *
  *  \param  L       Stack from which the json node is pulled.
  *  \param  input   The node to be saved as.
  *
@@ -242,6 +368,8 @@ void LuaUtils::PushJson(lua_State  *L, const JsonNode *node)
 //*****************************************************************************
 void LuaUtils::PopJson(lua_State  *L, JsonNodePtr &output)
 {
+    JsonNodeBuilder(output).Walk(L, -1);
+    lua_pop(L, 1);
 }
 
 //*****************************************************************************
@@ -418,6 +546,8 @@ int LuaUtils::CallLuaFunc(lua_State *L, const char *funcname, const char *funcsi
  *  \param  varname     Name to assign to the value on the second stack, if
  *                      the value is being copied as a key in table.
  *
+ *  The copy is bounded by the default budgets of ValueSerializer.
+ *
  *  \version
  *      - S Panyam  04/11/2008
  *      Initial version.
@@ -429,114 +559,44 @@ bool LuaUtils::TransferValueToStack(LuaStack    inStack,
                                     int         levels,
                                     const char *varname)
 {
-    if (levels < 0)
-        return false;
-
-    // convert relative to absolute indexing if necessary
-    if (ntop < 0)
-        ntop = (lua_gettop(inStack) + 1 + ntop);
-
-    lua_newtable(outStack);
-
-    // push variable name
-    if (varname != NULL)
-    {
-        lua_pushstring(outStack, varname);
-        lua_setfield(outStack, -2, "name");
-    }
-
-    // push the variable type
-    int top_type = lua_type(inStack, ntop);
-    lua_pushstring(outStack, lua_typename(inStack, top_type));
-    lua_setfield(outStack, -2, "type");
+    return ValueSerializer(inStack, outStack).Transfer(ntop, levels, varname);
+}
 
-    // finally push the value
-    if (lua_isnil(inStack, ntop))
-    {
-        lua_pushnil(outStack);
-        lua_setfield(outStack, -2, "value");
-    }
-    else if (lua_isboolean(inStack, ntop))
-    {
-        lua_pushboolean(outStack, lua_toboolean(inStack, ntop));
-        lua_setfield(outStack, -2, "value");
-    }
-    else if (lua_isnumber(inStack, ntop))
-    {
-        lua_pushnumber(outStack, lua_tonumber(inStack, ntop));
-        lua_setfield(outStack, -2, "value");
-    }
-    else if (lua_isstring(inStack, ntop))
-    {
-        lua_pushstring(outStack, lua_tostring(inStack, ntop));
-        lua_setfield(outStack, -2, "value");
-    }
-    else if (lua_islightuserdata(inStack, ntop))
+//*****************************************************************************
+/*!
+ *  \brief  Appends a value to a string as text.
+ *
+ *  Strings and numbers are appended as they are and other values as
+ *  "type: address" - no __tostring metamethods are called since they
+ *  could run arbitrary code (or be slow) in the middle of a hook.
+ */
+//*****************************************************************************
+void LuaUtils::AppendValue(LuaStack stack, int index, std::string &output)
+{
+    int type = lua_type(stack, index);
+    if (type == LUA_TSTRING || type == LUA_TNUMBER)
     {
-        lua_pushlightuserdata(outStack, lua_touserdata(inStack, ntop));
-        lua_setfield(outStack, -2, "value");
+        // lua_tolstring turns numbers into strings in place so copy first
+        lua_pushvalue(stack, index);
+        size_t      length;
+        const char *value = lua_tolstring(stack, -1, &length);
+        output.append(value, length);
+        lua_pop(stack, 1);
     }
-    else if (lua_isuserdata(inStack, ntop)  ||
-             lua_iscfunction(inStack, ntop) ||
-             lua_isfunction(inStack, ntop)  ||
-             lua_isthread(inStack, ntop))
+    else if (type == LUA_TBOOLEAN)
     {
-        lua_pushfstring(outStack, "%p", lua_topointer(inStack, ntop));
-        lua_setfield(outStack, -2, "value");
+        output += lua_toboolean(stack, index) ? "true" : "false";
     }
-    else if (lua_istable(inStack, ntop))
+    else if (type == LUA_TNIL || type == LUA_TNONE)
     {
-        if (levels == 0)
-        {
-            lua_pushboolean(outStack, true);
-            lua_setfield(outStack, -2, "raw");
-
-            // whether to send only a summary!
-            lua_pushfstring(outStack, "%p", lua_topointer(inStack, ntop));
-        }
-        else
-        {
-            lua_newtable(outStack);
-
-            int index = 1;
-
-            lua_pushnil(inStack);
-            while (lua_next(inStack, ntop) != 0)
-            {
-                // printf("%s - %s\n", lua_typename(inStack, lua_type(inStack, -2)), lua_typename(inStack, lua_type(inStack, -1)));
-
-                int newtop      = lua_gettop(inStack);
-                int keyindex    = newtop - 1;
-                int valindex    = newtop;
-
-                lua_pushinteger(outStack, index++);
-                lua_newtable(outStack);
-
-                // uses 'key' at index top-1 and 'value' at index top
-                if (LuaUtils::TransferValueToStack(inStack, outStack, keyindex, 0))
-                {
-                    lua_setfield(outStack, -2, "key");
-
-                    if (LuaUtils::TransferValueToStack(inStack, outStack, valindex, levels - 1))
-                        lua_setfield(outStack, -2, "value");
-                }
-
-                lua_settable(outStack, -3);
-
-                // remove 'value', keeps 'key' for next iteration
-                lua_pop(inStack, 1);
-            }
-        }
-
-        lua_setfield(outStack, -2, "value");
+        output += "nil";
     }
     else
     {
-        lua_pushstring(outStack, "Unknown type.");
-        lua_setfield(outStack, -2, "value");
+        char buff[64];
+        snprintf(buff, sizeof(buff), "%s: %p", lua_typename(stack, type), lua_topointer(stack, index));
+        output += buff;
     }
-
-    return true;
 }
 
 LUNARPROBE_NS_END
@@ -32,6 +32,7 @@
 #include "lpfwddefs.h"
 
 #include "halley.h"
+#include "GcMonitor.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -46,7 +47,8 @@ class LuaUtils
 {
 public:
     // Create a new lua state
-    static LuaStack NewLuaStack(bool openlibs, bool debug, const char *name = "");
+    static LuaStack NewLuaStack(bool openlibs, bool debug, const char *name = "", bool profileAllocs = false,
+                                const GcPolicy &gcPolicy = GcPolicy());
 
     // Print errors for lua functions
     // static void LuaError(LuaStack stack, const char *fmt, ...);
@@ -57,6 +59,9 @@ public:
     // Runs a raw lua string.
     static int RunLuaString(LuaStack stack, const char *lua_str, int len = -1);
 
+    // Runs a chunk (source or bytecode) held in memory
+    static int RunLuaBuffer(LuaStack stack, const char *buffer, size_t size, const char *name);
+
     // calls an arbitrary lua function
     static int CallLuaFunc(LuaStack stack, const char *funcname, const char *funcsig, ...);
     static int VCallLuaFunc(LuaStack stack, const char *funcname, const char *funcsig, va_list ap);
@@ -68,6 +73,9 @@ public:
                                      int           levels = 1,
                                      const char *  varname = NULL);
 
+    // Appends a value as text without calling any metamethods
+    static void AppendValue(LuaStack stack, int index, std::string &output);
+
     // Push a json node within a smart ptr onto the stack
     static void PushJson(lua_State  *L, const JsonNodePtr &node);
 
@@ -26,12 +26,11 @@
 
 #include "LunarProbe.h"
 #include "ClientIface.h"
+#include "DebugContext.h"
 
 LUNARPROBE_NS_BEGIN
 
 std::auto_ptr< ClientIface > LunarProbe::pClientIface;
-const int HookMask     = LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE /* | LUA_MASKCOUNT */;
-const int HookCount    = 10000;
 
 //*****************************************************************************
 /*!
@@ -128,7 +127,7 @@ int LunarProbe::Attach(LuaStack pStack, const char *name)
 {
     if (GetClientIface() != NULL)
         GetClientIface()->StartDebugging(pStack, name);
-    return lua_sethook(pStack, HookFunction, HookMask, HookCount);
+    return UpdateHook(pStack);
 }
 
 //*****************************************************************************
@@ -147,5 +146,69 @@ int LunarProbe::Detach(LuaStack pStack)
     return lua_sethook(pStack, NULL, 0, 0);
 }
 
+//*****************************************************************************
+/*!
+ *  \brief  Reinstalls the hook of a stack being debugged.
+ *
+ *  The mask is recomputed from the current debug state (client connected,
+ *  breakpoints set, flow commands in progress) so that a stack only pays
+ *  for the events that can actually cause a stop.  If no events are
+ *  needed the hook is removed altogether.
+ */
+//*****************************************************************************
+int LunarProbe::UpdateHook(LuaStack pStack)
+{
+    ClientIface *   pIface      = GetClientIface();
+    DebugContext *  pContext    = pIface == NULL ? NULL : pIface->GetDebugContext(pStack);
+    int             mask        = pContext == NULL ? 0 : pIface->GetHookMask(pContext);
+
+    if (mask == 0)
+        return lua_sethook(pStack, NULL, 0, 0);
+
+    return lua_sethook(pStack, HookFunction, mask, (mask & LUA_MASKCOUNT) ? pIface->GetHookCount(pContext) : 0);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Arms a count hook of a single instruction on a stack so that
+ *  it is sampled on its own thread as soon as it runs again.
+ *
+ *  The hook restores the normal mask (see UpdateHook) once the sample has
+ *  been taken.
+ */
+//*****************************************************************************
+int LunarProbe::RequestSample(LuaStack pStack)
+{
+    ClientIface *   pIface      = GetClientIface();
+    DebugContext *  pContext    = pIface == NULL ? NULL : pIface->GetDebugContext(pStack);
+
+    if (pContext == NULL)
+        return 0;
+
+    return lua_sethook(pStack, HookFunction, pIface->GetHookMask(pContext) | LUA_MASKCOUNT, 1);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Reinstalls the hooks of all stacks being debugged.
+ *
+ *  lua_sethook only sets a few fields on the lua_State so it is safe to
+ *  call this from a thread other than the one running the stack.
+ */
+//*****************************************************************************
+void LunarProbe::UpdateHooks()
+{
+    ClientIface *pIface = GetClientIface();
+    if (pIface == NULL)
+        return ;
+
+    ContextRegistry::Reader reader(pIface->GetContexts());
+    const DebugContextMap &contexts = reader.Contexts();
+    for (DebugContextMap::const_iterator iter = contexts.begin(); iter != contexts.end(); ++iter)
+    {
+        UpdateHook(iter->first);
+    }
+}
+
 LUNARPROBE_NS_END
 
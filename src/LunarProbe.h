@@ -51,6 +51,15 @@ public:
     // Stops debugging of a lua stack
     int Detach(LuaStack lua_stack);
 
+    // Reinstalls the hook of a stack with only the events it needs
+    int UpdateHook(LuaStack lua_stack);
+
+    // Reinstalls the hooks of all stacks being debugged
+    void UpdateHooks();
+
+    // Arms a count hook that samples a stack on its next instruction
+    int RequestSample(LuaStack lua_stack);
+
     static LunarProbe *GetInstance();
 
     // gets the debugger instance.
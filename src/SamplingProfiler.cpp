@@ -0,0 +1,389 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SamplingProfiler.cpp
+ *
+ *  \brief  Implementation of the sampling profiler and its sampler thread.
+ */
+//*****************************************************************************
+
+#include <sstream>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "SamplingProfiler.h"
+#include "ClientIface.h"
+#include "DebugContext.h"
+#include "LunarProbe.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Slots looked at before a sample is dropped
+const int MAX_PROBES            = 64;
+
+//! Frame standing in for the outer frames of stacks deeper than MAX_DEPTH
+const int TRUNCATED_FRAME       = 0;
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a profiler that is not sampling.
+ */
+//*****************************************************************************
+SamplingProfiler::SamplingProfiler() :
+    running(false),
+    mode(SAMPLE_BY_COUNT),
+    period(DEFAULT_COUNT),
+    nextSampleUs(0),
+    numSamples(0),
+    numDropped(0)
+{
+    frameLabels.push_back("[truncated]");
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+SamplingProfiler::~SamplingProfiler()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts sampling.
+ *
+ *  \param  mode    Whether samples are taken by instruction count or time.
+ *  \param  period  Instructions or milliseconds between samples (<= 0
+ *                  for the default).
+ */
+//*****************************************************************************
+void SamplingProfiler::Start(SampleMode newMode, int newPeriod)
+{
+    SMutexLock profileLock(profileMutex);
+
+    if (stacks.empty())
+        stacks.resize(MAX_STACKS);
+
+    if (newPeriod <= 0)
+        newPeriod = newMode == SAMPLE_BY_COUNT ? DEFAULT_COUNT : DEFAULT_INTERVAL;
+
+    mode            = newMode;
+    period          = newPeriod;
+    nextSampleUs    = 0;
+    running         = true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops sampling.  Samples collected so far are kept.
+ */
+//*****************************************************************************
+void SamplingProfiler::Stop()
+{
+    running = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards all samples and frames collected so far.
+ */
+//*****************************************************************************
+void SamplingProfiler::Clear()
+{
+    SMutexLock profileLock(profileMutex);
+
+    for (std::vector<StackEntry>::iterator iter = stacks.begin(); iter != stacks.end(); ++iter)
+        iter->count = 0;
+
+    luaFrames.clear();
+    namedFrames.clear();
+    frameLabels.resize(TRUNCATED_FRAME + 1);
+    numSamples  = 0;
+    numDropped  = 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Records the stack of the coroutine the hook was called on.
+ *
+ *  Called from the debug hook (on count events) so never calls into lua
+ *  beyond walking the stack.
+ */
+//*****************************************************************************
+void SamplingProfiler::Sample(LuaStack pStack, SourceRegistry &sources, SourceCache &cache)
+{
+    SMutexLock profileLock(profileMutex);
+
+    if (!running || stacks.empty())
+        return ;
+
+    // frames[0] is the innermost frame
+    int         frames[MAX_DEPTH];
+    int         depth = 0;
+    lua_Debug   ar;
+
+    while (depth < MAX_DEPTH && lua_getstack(pStack, depth, &ar) != 0)
+    {
+        lua_getinfo(pStack, "Sn", &ar);
+        frames[depth++] = GetFrameId(&ar, sources, cache);
+    }
+
+    if (depth == 0)
+        return ;
+
+    if (depth == MAX_DEPTH && lua_getstack(pStack, MAX_DEPTH, &ar) != 0)
+        frames[MAX_DEPTH - 1] = TRUNCATED_FRAME;
+
+    unsigned hash = 2166136261u;
+    for (int i = 0;i < depth;i++)
+        hash = (hash ^ (unsigned)frames[i]) * 16777619u;
+
+    for (int probe = 0;probe < MAX_PROBES;probe++)
+    {
+        StackEntry &entry = stacks[(hash + probe) % MAX_STACKS];
+        if (entry.count == 0)
+        {
+            entry.hash  = hash;
+            entry.depth = depth;
+            entry.count = 1;
+            memcpy(entry.frames, frames, depth * sizeof(int));
+            numSamples++;
+            return ;
+        }
+        else if (entry.hash == hash && entry.depth == depth &&
+                 memcmp(entry.frames, frames, depth * sizeof(int)) == 0)
+        {
+            entry.count++;
+            numSamples++;
+            return ;
+        }
+    }
+
+    numDropped++;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Tells if an interval sample is due and if so schedules the
+ *  next one.  Only called by the sampler thread.
+ *
+ *  \param  nowUs   The current time in microseconds.
+ */
+//*****************************************************************************
+bool SamplingProfiler::SampleDue(long long nowUs)
+{
+    if (!running || mode != SAMPLE_BY_INTERVAL || nowUs < nextSampleUs)
+        return false;
+
+    nextSampleUs = nowUs + period * 1000LL;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the samples as folded stacks.
+ *
+ *  Each line holds the frames of a stack from the outermost to the
+ *  innermost separated by ';' followed by the number of samples, which is
+ *  what flamegraph.pl and most flame graph viewers take as input.
+ *
+ *  \param  output  Stream to write to.
+ *  \param  root    If not empty an extra outermost frame for every stack
+ *                  (eg the name of the context).
+ */
+//*****************************************************************************
+void SamplingProfiler::WriteFolded(std::ostream &output, const std::string &root)
+{
+    SMutexLock profileLock(profileMutex);
+
+    for (std::vector<StackEntry>::iterator iter = stacks.begin(); iter != stacks.end(); ++iter)
+    {
+        if (iter->count == 0)
+            continue ;
+
+        if (!root.empty())
+            output << root << ";";
+
+        for (int i = iter->depth - 1;i >= 0;i--)
+        {
+            output << frameLabels[iter->frames[i]];
+            if (i > 0)
+                output << ";";
+        }
+
+        output << " " << iter->count << "\n";
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of the frame described by a lua_Debug.
+ *
+ *  Lua functions are keyed by their file and linedefined so every closure
+ *  of a function shares a frame and the label is only built the first
+ *  time a function is seen.
+ *
+ *  \param  pDebug  Debug info with the "S" and "n" fields filled in.
+ */
+//*****************************************************************************
+int SamplingProfiler::GetFrameId(LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache)
+{
+    const char *name = pDebug->name != NULL ? pDebug->name : "?";
+
+    if (pDebug->what != NULL && strcmp(pDebug->what, "C") == 0)
+        return InternFrame(std::string(name) + " [C]");
+
+    int fileId = sources.GetSourceId(cache, pDebug->source);
+
+    std::pair<int, int> key(fileId, pDebug->linedefined);
+    std::map<std::pair<int, int>, int>::iterator iter = luaFrames.find(key);
+    if (iter != luaFrames.end())
+        return iter->second;
+
+    std::ostringstream label;
+    if (pDebug->what != NULL && strcmp(pDebug->what, "main") == 0)
+        label << sources.GetFileName(fileId) << ":main";
+    else
+        label << name << " (" << sources.GetFileName(fileId) << ":" << pDebug->linedefined << ")";
+
+    // ';' separates frames in the folded format
+    std::string frameLabel = label.str();
+    for (std::string::iterator ch = frameLabel.begin(); ch != frameLabel.end(); ++ch)
+    {
+        if (*ch == ';' || *ch == '\n')
+            *ch = ':';
+    }
+
+    int frameId = frameLabels.size();
+    frameLabels.push_back(frameLabel);
+    luaFrames[key] = frameId;
+    return frameId;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of a frame by its label.
+ */
+//*****************************************************************************
+int SamplingProfiler::InternFrame(const std::string &label)
+{
+    std::map<std::string, int>::iterator iter = namedFrames.find(label);
+    if (iter != namedFrames.end())
+        return iter->second;
+
+    int frameId = frameLabels.size();
+    frameLabels.push_back(label);
+    namedFrames[label] = frameId;
+    return frameId;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a sampler thread (not yet started).
+ */
+//*****************************************************************************
+SamplerThread::SamplerThread(ClientIface *pIface) :
+    pClientIface(pIface),
+    started(false),
+    stopping(false)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.  Stops the thread if it is running.
+ */
+//*****************************************************************************
+SamplerThread::~SamplerThread()
+{
+    Stop();
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts the thread if it is not already running.
+ */
+//*****************************************************************************
+void SamplerThread::Start()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (started)
+        return ;
+
+    stopping    = false;
+    started     = pthread_create(&thread, NULL, ThreadMain, this) == 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops the thread and waits for it to finish.
+ */
+//*****************************************************************************
+void SamplerThread::Stop()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (!started)
+        return ;
+
+    stopping = true;
+    pthread_join(thread, NULL);
+    started = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Entry point of the thread.
+ */
+//*****************************************************************************
+void *SamplerThread::ThreadMain(void *pArg)
+{
+    ((SamplerThread *)pArg)->Run();
+    return NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Ticks every millisecond and arms a single instruction count
+ *  hook on every stack that is due an interval sample.
+ */
+//*****************************************************************************
+void SamplerThread::Run()
+{
+    while (!stopping)
+    {
+        usleep(1000);
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long long nowUs = now.tv_sec * 1000000LL + now.tv_usec;
+
+        ContextRegistry::Reader reader(pClientIface->GetContexts());
+        const DebugContextMap &contexts = reader.Contexts();
+        for (DebugContextMap::const_iterator iter = contexts.begin(); iter != contexts.end(); ++iter)
+        {
+            SamplingProfiler *pSampler = iter->second == NULL ? NULL : iter->second->pSampler;
+            if (pSampler != NULL && pSampler->SampleDue(nowUs))
+                LunarProbe::GetInstance()->RequestSample(iter->first);
+        }
+    }
+}
+
+LUNARPROBE_NS_END
+
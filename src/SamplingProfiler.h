@@ -0,0 +1,219 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SamplingProfiler.h
+ *
+ *  \brief  Sampling CPU profiler driven by lua count hooks.
+ *
+ *****************************************************************************/
+
+#ifndef _SAMPLING_PROFILER_H_
+#define _SAMPLING_PROFILER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <pthread.h>
+#include "lpfwddefs.h"
+#include "halley.h"
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! When a sampling profiler takes its samples
+enum SampleMode
+{
+    SAMPLE_BY_COUNT,        // every "period" VM instructions
+    SAMPLE_BY_INTERVAL      // every "period" milliseconds
+};
+
+//*****************************************************************************
+/*!
+ *  \class  SamplingProfiler
+ *
+ *  \brief  Aggregates sampled lua call stacks of a single context.
+ *
+ *  Each sample walks the stack of the running coroutine and bumps the
+ *  count of that stack in a fixed size open addressed table, so memory
+ *  does not grow with the length of a run.  Frames are interned as small
+ *  ids (lua functions by file id and linedefined, C functions by name).
+ *  Samples that find the table full are only counted as dropped.
+ *
+ *  Only the thread running the context samples, the mutex just keeps
+ *  exports and resets from other threads consistent.
+ *
+ *****************************************************************************/
+class SamplingProfiler
+{
+public:
+    //! Deeper stacks keep their innermost frames
+    static const int    MAX_DEPTH           = 32;
+
+    //! Number of distinct stacks that can be recorded
+    static const int    MAX_STACKS          = 2048;
+
+    //! Default number of instructions between samples
+    static const int    DEFAULT_COUNT       = 10000;
+
+    //! Default number of milliseconds between samples
+    static const int    DEFAULT_INTERVAL    = 10;
+
+public:
+    // ctor
+    SamplingProfiler();
+
+    // dtor
+    virtual ~SamplingProfiler();
+
+    // Starts (or restarts with a new mode) sampling
+    void        Start(SampleMode mode, int period);
+
+    // Stops sampling - collected samples are kept
+    void        Stop();
+
+    // Discards all collected samples
+    void        Clear();
+
+    // Records the stack the hook was called on
+    void        Sample(LuaStack pStack, SourceRegistry &sources, SourceCache &cache);
+
+    // Tells if an interval sample is due - called by the sampler thread
+    bool        SampleDue(long long nowUs);
+
+    // Writes the samples in the folded format used by flame graph tools
+    void        WriteFolded(std::ostream &output, const std::string &root = "");
+
+    //! Is sampling on?
+    bool        Running() const { return running; }
+
+    //! How samples are taken
+    SampleMode  Mode() const { return mode; }
+
+    //! Instructions or milliseconds between samples
+    int         Period() const { return period; }
+
+    //! Number of samples recorded
+    unsigned    NumSamples() const { return numSamples; }
+
+    //! Number of samples lost to a full table
+    unsigned    NumDropped() const { return numDropped; }
+
+protected:
+    //! A distinct stack and the number of times it was seen
+    struct StackEntry
+    {
+        unsigned    hash;
+        unsigned    count;
+        int         depth;
+        int         frames[MAX_DEPTH];
+    };
+
+    // Gets the id of the frame described by a lua_Debug
+    int         GetFrameId(LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache);
+
+    // Gets the id of a frame label
+    int         InternFrame(const std::string &label);
+
+protected:
+    //! The stack table (allocated on the first start)
+    std::vector<StackEntry>                 stacks;
+
+    //! Ids of lua frames keyed by file id and linedefined
+    std::map<std::pair<int, int>, int>      luaFrames;
+
+    //! Ids of frames keyed by their label (C functions)
+    std::map<std::string, int>              namedFrames;
+
+    //! Frame labels by id
+    std::vector<std::string>                frameLabels;
+
+    //! Is sampling on?
+    volatile bool                           running;
+
+    //! How samples are taken
+    volatile SampleMode                     mode;
+
+    //! Instructions or milliseconds between samples
+    volatile int                            period;
+
+    //! When the next interval sample is due
+    long long                               nextSampleUs;
+
+    //! Number of samples recorded
+    unsigned                                numSamples;
+
+    //! Number of samples lost to a full table
+    unsigned                                numDropped;
+
+    //! Guards the tables against exports and resets
+    SMutex                                  profileMutex;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  SamplerThread
+ *
+ *  \brief  Requests samples from contexts profiled by interval.
+ *
+ *  A lua stack cannot safely be walked from another thread, so when a
+ *  sample is due the thread only arms a count hook of one instruction on
+ *  the stack and the sample is taken by the hook on the stack's own thread.
+ *
+ *****************************************************************************/
+class SamplerThread
+{
+public:
+    // ctor
+    SamplerThread(ClientIface *pIface);
+
+    // dtor - stops the thread
+    virtual ~SamplerThread();
+
+    // Starts the thread if it is not already running
+    void            Start();
+
+    // Stops the thread and waits for it to finish
+    void            Stop();
+
+protected:
+    // Entry point of the thread
+    static void *   ThreadMain(void *pArg);
+
+    // Arms the hooks of contexts that are due a sample
+    void            Run();
+
+protected:
+    //! The interface whose contexts are sampled
+    ClientIface *   pClientIface;
+
+    //! The thread
+    pthread_t       thread;
+
+    //! Has the thread been started?
+    bool            started;
+
+    //! Set to ask the thread to finish
+    volatile bool   stopping;
+
+    //! Guards starting and stopping
+    SMutex          threadMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
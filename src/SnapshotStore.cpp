@@ -0,0 +1,639 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SnapshotStore.cpp
+ *
+ *  \brief  Implementation of snapshots taken by snapshot breakpoints.
+ */
+//*****************************************************************************
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "SnapshotStore.h"
+#include "DebugContext.h"
+
+LUNARPROBE_NS_BEGIN
+
+// Tags of the encoded values
+static const char  TAG_NIL     = 'n';
+static const char  TAG_BOOLEAN = 'b';
+static const char  TAG_NUMBER  = 'd';
+static const char  TAG_STRING  = 's';
+static const char  TAG_TABLE   = 't';      // expanded table
+static const char  TAG_RAW     = 'r';      // table too deep to expand
+static const char  TAG_OTHER   = 'o';      // functions, userdata and threads
+
+//*****************************************************************************
+/*!
+ *  \class  SnapshotWriter
+ *
+ *  \brief  Encodes the frames of a stack into a snapshot buffer.
+ *
+ *  Counts are written as placeholders and patched once known so that
+ *  reaching the budget part way through a list leaves a buffer that still
+ *  decodes.
+ *
+ *****************************************************************************/
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(LuaStack pS, int b) : pStack(pS), budget(b), truncated(false) { }
+
+    // Writes the top maxFrames frames with their locals and upvalues
+    void        WriteFrames(int maxFrames, int depth);
+
+    // Writes the value at an (absolute) index of the stack
+    void        WriteValue(int index, int depth);
+
+    //! Has the budget been reached?
+    bool        Full()
+    {
+        if (data.size() >= (size_t)budget)
+            truncated = true;
+        return truncated;
+    }
+
+protected:
+    void        WriteU32(unsigned value) { data.append((const char *)&value, sizeof(value)); }
+    void        WriteDouble(double value) { data.append((const char *)&value, sizeof(value)); }
+    void        WritePointer(const void *value) { data.append((const char *)&value, sizeof(value)); }
+
+    void        WriteString(const char *value, size_t length)
+    {
+        if (length > SnapshotStore::MAX_STRING)
+            length = SnapshotStore::MAX_STRING;
+        WriteU32(length);
+        data.append(value, length);
+    }
+
+    void        WriteString(const char *value) { WriteString(value, value != NULL ? strlen(value) : 0); }
+
+    //! Writes a count to be patched later
+    size_t      Reserve() { WriteU32(0); return data.size() - sizeof(unsigned); }
+
+    void        Patch(size_t offset, unsigned value) { memcpy(&data[offset], &value, sizeof(value)); }
+
+public:
+    LuaStack    pStack;
+    int         budget;
+    bool        truncated;
+    std::string data;
+};
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes the top maxFrames frames of the stack.
+ *
+ *  Each frame is its source, current line, name and kind followed by its
+ *  locals (temporaries too, as LuaBindings::GetLocals lists them) and the
+ *  upvalues of its function, each as a name and a value.
+ */
+//*****************************************************************************
+void SnapshotWriter::WriteFrames(int maxFrames, int depth)
+{
+    size_t      framesAt    = Reserve();
+    unsigned    numFrames   = 0;
+    lua_Debug   ar;
+
+    for (int level = 0;level < maxFrames && !Full() && lua_getstack(pStack, level, &ar);level++)
+    {
+        lua_getinfo(pStack, "Snlf", &ar);
+        int funcIndex = lua_gettop(pStack);
+
+        WriteString(ar.short_src);
+        WriteU32(ar.currentline);
+        WriteString(ar.name);
+        WriteString(ar.what);
+
+        size_t      localsAt    = Reserve();
+        unsigned    numLocals   = 0;
+        for (int i = 1;!Full();i++, numLocals++)
+        {
+            const char *name = lua_getlocal(pStack, &ar, i);
+            if (name == NULL)
+                break ;
+
+            WriteString(name);
+            WriteValue(lua_gettop(pStack), depth);
+            lua_pop(pStack, 1);
+        }
+        Patch(localsAt, numLocals);
+
+        size_t      upvaluesAt  = Reserve();
+        unsigned    numUpvalues = 0;
+        for (int i = 1;!Full();i++, numUpvalues++)
+        {
+            const char *name = lua_getupvalue(pStack, funcIndex, i);
+            if (name == NULL)
+                break ;
+
+            WriteString(name);
+            WriteValue(lua_gettop(pStack), depth);
+            lua_pop(pStack, 1);
+        }
+        Patch(upvaluesAt, numUpvalues);
+
+        // pop the function
+        lua_pop(pStack, 1);
+        numFrames++;
+    }
+
+    Patch(framesAt, numFrames);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Writes a value, expanding tables depth levels deep.
+ *
+ *  Only raw accesses are made (no metamethods run) and strings are cut
+ *  short at MAX_STRING bytes.
+ */
+//*****************************************************************************
+void SnapshotWriter::WriteValue(int index, int depth)
+{
+    int type = lua_type(pStack, index);
+    switch (type)
+    {
+        case LUA_TNIL:
+        {
+            data += TAG_NIL;
+        } break ;
+        case LUA_TBOOLEAN:
+        {
+            data += TAG_BOOLEAN;
+            data += (char)(lua_toboolean(pStack, index) ? 1 : 0);
+        } break ;
+        case LUA_TNUMBER:
+        {
+            data += TAG_NUMBER;
+            WriteDouble(lua_tonumber(pStack, index));
+        } break ;
+        case LUA_TSTRING:
+        {
+            size_t      length;
+            const char *value = lua_tolstring(pStack, index, &length);
+            data += TAG_STRING;
+            WriteString(value, length);
+        } break ;
+        case LUA_TTABLE:
+        {
+            if (depth <= 0 || Full() || !lua_checkstack(pStack, 4))
+            {
+                data += TAG_RAW;
+                WritePointer(lua_topointer(pStack, index));
+                break ;
+            }
+
+            data += TAG_TABLE;
+            WritePointer(lua_topointer(pStack, index));
+
+            size_t      countAt = Reserve();
+            unsigned    count   = 0;
+
+            lua_pushnil(pStack);
+            while (lua_next(pStack, index) != 0)
+            {
+                if (Full())
+                {
+                    lua_pop(pStack, 2);
+                    break ;
+                }
+
+                int top = lua_gettop(pStack);
+                WriteValue(top - 1, 0);
+                WriteValue(top, depth - 1);
+                count++;
+
+                // remove the value, keep the key for the next iteration
+                lua_pop(pStack, 1);
+            }
+            Patch(countAt, count);
+        } break ;
+        default:
+        {
+            data += TAG_OTHER;
+            data += (char)type;
+            WritePointer(lua_topointer(pStack, index));
+        }
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \class  SnapshotReader
+ *
+ *  \brief  Decodes a snapshot buffer into lua tables.
+ *
+ *****************************************************************************/
+class SnapshotReader
+{
+public:
+    SnapshotReader(const std::string &d) : data(d), pos(0) { }
+
+    // Pushes the list of frames
+    void        PushFrames(LuaStack pOutput);
+
+    // Pushes a value as LuaUtils::TransferValueToStack would
+    void        PushValue(LuaStack pOutput, const std::string *pName);
+
+protected:
+    unsigned    ReadU32() { unsigned value; Read(&value, sizeof(value)); return value; }
+    double      ReadDouble() { double value; Read(&value, sizeof(value)); return value; }
+    const void *ReadPointer() { const void *value; Read(&value, sizeof(value)); return value; }
+    char        ReadChar() { char value = 0; Read(&value, 1); return value; }
+
+    std::string ReadString()
+    {
+        unsigned    length = ReadU32();
+        std::string value(data, pos, length);
+        pos += value.size();
+        return value;
+    }
+
+    void        Read(void *pValue, size_t size)
+    {
+        if (pos + size <= data.size())
+            memcpy(pValue, data.data() + pos, size);
+        else
+            memset(pValue, 0, size);
+        pos += size;
+    }
+
+    // Pushes a list of names and values
+    void        PushVariables(LuaStack pOutput);
+
+protected:
+    const std::string & data;
+    size_t              pos;
+};
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the frames as a list of tables with the source, line,
+ *  name, kind, locals and upvalues of each.
+ */
+//*****************************************************************************
+void SnapshotReader::PushFrames(LuaStack pOutput)
+{
+    lua_newtable(pOutput);
+
+    unsigned numFrames = ReadU32();
+    for (unsigned i = 0;i < numFrames;i++)
+    {
+        lua_newtable(pOutput);
+
+        std::string source = ReadString();
+        lua_pushlstring(pOutput, source.c_str(), source.size());
+        lua_setfield(pOutput, -2, "source");
+
+        lua_pushinteger(pOutput, (int)ReadU32());
+        lua_setfield(pOutput, -2, "line");
+
+        std::string name = ReadString();
+        lua_pushlstring(pOutput, name.c_str(), name.size());
+        lua_setfield(pOutput, -2, "name");
+
+        std::string what = ReadString();
+        lua_pushlstring(pOutput, what.c_str(), what.size());
+        lua_setfield(pOutput, -2, "what");
+
+        PushVariables(pOutput);
+        lua_setfield(pOutput, -2, "locals");
+
+        PushVariables(pOutput);
+        lua_setfield(pOutput, -2, "upvalues");
+
+        lua_rawseti(pOutput, -2, i + 1);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a list of named values.
+ */
+//*****************************************************************************
+void SnapshotReader::PushVariables(LuaStack pOutput)
+{
+    lua_newtable(pOutput);
+
+    unsigned count = ReadU32();
+    for (unsigned i = 0;i < count;i++)
+    {
+        std::string name = ReadString();
+        PushValue(pOutput, &name);
+        lua_rawseti(pOutput, -2, i + 1);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a value as a table with its type and value (and name),
+ *  in the same shape as LuaUtils::TransferValueToStack so clients can
+ *  show snapshot values the way they show paused ones.
+ */
+//*****************************************************************************
+void SnapshotReader::PushValue(LuaStack pOutput, const std::string *pName)
+{
+    lua_checkstack(pOutput, 6);
+    lua_newtable(pOutput);
+
+    if (pName != NULL)
+    {
+        lua_pushlstring(pOutput, pName->c_str(), pName->size());
+        lua_setfield(pOutput, -2, "name");
+    }
+
+    char tag = ReadChar();
+    switch (tag)
+    {
+        case TAG_BOOLEAN:
+        {
+            lua_pushstring(pOutput, "boolean");
+            lua_setfield(pOutput, -2, "type");
+            lua_pushboolean(pOutput, ReadChar() != 0);
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        case TAG_NUMBER:
+        {
+            lua_pushstring(pOutput, "number");
+            lua_setfield(pOutput, -2, "type");
+            lua_pushnumber(pOutput, ReadDouble());
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        case TAG_STRING:
+        {
+            std::string value = ReadString();
+            lua_pushstring(pOutput, "string");
+            lua_setfield(pOutput, -2, "type");
+            lua_pushlstring(pOutput, value.c_str(), value.size());
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        case TAG_RAW:
+        {
+            lua_pushstring(pOutput, "table");
+            lua_setfield(pOutput, -2, "type");
+            lua_pushboolean(pOutput, true);
+            lua_setfield(pOutput, -2, "raw");
+            lua_pushfstring(pOutput, "%p", ReadPointer());
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        case TAG_TABLE:
+        {
+            lua_pushstring(pOutput, "table");
+            lua_setfield(pOutput, -2, "type");
+            ReadPointer();
+
+            lua_newtable(pOutput);
+            unsigned count = ReadU32();
+            for (unsigned i = 0;i < count;i++)
+            {
+                lua_newtable(pOutput);
+                PushValue(pOutput, NULL);
+                lua_setfield(pOutput, -2, "key");
+                PushValue(pOutput, NULL);
+                lua_setfield(pOutput, -2, "value");
+                lua_rawseti(pOutput, -2, i + 1);
+            }
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        case TAG_OTHER:
+        {
+            lua_pushstring(pOutput, lua_typename(pOutput, ReadChar()));
+            lua_setfield(pOutput, -2, "type");
+            lua_pushfstring(pOutput, "%p", ReadPointer());
+            lua_setfield(pOutput, -2, "value");
+        } break ;
+        default:
+        {
+            lua_pushstring(pOutput, "nil");
+            lua_setfield(pOutput, -2, "type");
+        }
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty store with the default limits.
+ */
+//*****************************************************************************
+SnapshotStore::SnapshotStore() :
+    numSnapshots(0),
+    numThrottled(0),
+    frames(DEFAULT_FRAMES),
+    depth(DEFAULT_DEPTH),
+    budget(DEFAULT_BUDGET),
+    interval(DEFAULT_INTERVAL)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+SnapshotStore::~SnapshotStore()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Changes the limits of snapshots taken from now on.
+ *
+ *  \param  f   Frames captured.
+ *  \param  d   Levels tables are expanded to.
+ *  \param  b   Bytes a snapshot may take.
+ *  \param  i   Least ms between snapshots of a breakpoint.
+ */
+//*****************************************************************************
+void SnapshotStore::SetLimits(int f, int d, int b, int i)
+{
+    SMutexLock snapshotLock(snapshotMutex);
+
+    frames      = f > 0 ? f : DEFAULT_FRAMES;
+    depth       = d > 0 ? d : DEFAULT_DEPTH;
+    budget      = b > 0 ? b : DEFAULT_BUDGET;
+    interval    = i > 0 ? i : DEFAULT_INTERVAL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Takes a snapshot of a stack at a breakpoint.
+ *
+ *  Called from the hook.  The lock is only held to check the rate and to
+ *  store the finished buffer - the stack is walked without it.
+ *
+ *  \return false if the breakpoint was snapshot too recently.
+ */
+//*****************************************************************************
+bool SnapshotStore::Capture(LuaStack pStack, DebugContext *pContext, int fileId, int line)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long long nowMs = now.tv_sec * 1000LL + now.tv_usec / 1000;
+
+    int maxFrames, maxDepth, maxBudget;
+    {
+        SMutexLock snapshotLock(snapshotMutex);
+
+        long long &last = lastTaken[std::make_pair(fileId, line)];
+        if (last != 0 && nowMs - last < interval)
+        {
+            numThrottled++;
+            return false;
+        }
+
+        last        = nowMs;
+        maxFrames   = frames;
+        maxDepth    = depth;
+        maxBudget   = budget;
+    }
+
+    int top = lua_gettop(pStack);
+    SnapshotWriter writer(pStack, maxBudget);
+    writer.WriteFrames(maxFrames, maxDepth);
+    lua_settop(pStack, top);
+
+    SMutexLock snapshotLock(snapshotMutex);
+
+    Snapshot &snapshot  = snapshots[numSnapshots % CAPACITY];
+    snapshot.id         = ++numSnapshots;
+    snapshot.pContext   = pContext;
+    snapshot.name       = pContext->name;
+    snapshot.fileId     = fileId;
+    snapshot.line       = line;
+    snapshot.timeMs     = nowMs;
+    snapshot.truncated  = writer.truncated;
+    snapshot.data.swap(writer.data);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the fields a summary and a full snapshot share.
+ */
+//*****************************************************************************
+void SnapshotStore::PushHeader(LuaStack pOutput, const Snapshot &snapshot, SourceRegistry &sources)
+{
+    lua_pushinteger(pOutput, snapshot.id);
+    lua_setfield(pOutput, -2, "id");
+
+    lua_pushfstring(pOutput, "%p", snapshot.pContext);
+    lua_setfield(pOutput, -2, "context");
+
+    lua_pushstring(pOutput, snapshot.name.c_str());
+    lua_setfield(pOutput, -2, "name");
+
+    lua_pushstring(pOutput, sources.GetFileName(snapshot.fileId).c_str());
+    lua_setfield(pOutput, -2, "file");
+
+    lua_pushinteger(pOutput, snapshot.line);
+    lua_setfield(pOutput, -2, "line");
+
+    lua_pushnumber(pOutput, (lua_Number)snapshot.timeMs);
+    lua_setfield(pOutput, -2, "time");
+
+    lua_pushinteger(pOutput, snapshot.data.size());
+    lua_setfield(pOutput, -2, "size");
+
+    lua_pushboolean(pOutput, snapshot.truncated);
+    lua_setfield(pOutput, -2, "truncated");
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a table with a summary of each snapshot kept (oldest
+ *  first) as "snapshots" along with the "taken" and "throttled" totals.
+ */
+//*****************************************************************************
+void SnapshotStore::PushSnapshots(LuaStack pOutput, SourceRegistry &sources)
+{
+    SMutexLock snapshotLock(snapshotMutex);
+
+    lua_newtable(pOutput);
+
+    lua_pushinteger(pOutput, numSnapshots);
+    lua_setfield(pOutput, -2, "taken");
+
+    lua_pushinteger(pOutput, numThrottled);
+    lua_setfield(pOutput, -2, "throttled");
+
+    int index = 1;
+    lua_newtable(pOutput);
+
+    unsigned first = numSnapshots > CAPACITY ? numSnapshots - CAPACITY : 0;
+    for (unsigned i = first;i < numSnapshots;i++)
+    {
+        const Snapshot &snapshot = snapshots[i % CAPACITY];
+        if (snapshot.id == 0)
+            continue ;
+
+        lua_newtable(pOutput);
+        PushHeader(pOutput, snapshot, sources);
+        lua_rawseti(pOutput, -2, index++);
+    }
+
+    lua_setfield(pOutput, -2, "snapshots");
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a snapshot with its "frames".
+ *
+ *  \return false (and pushes nothing) if there is no such snapshot or it
+ *  has been overwritten by newer ones.
+ */
+//*****************************************************************************
+bool SnapshotStore::PushSnapshot(LuaStack pOutput, unsigned id, SourceRegistry &sources)
+{
+    Snapshot snapshot;
+    {
+        SMutexLock snapshotLock(snapshotMutex);
+
+        if (id == 0 || snapshots[(id - 1) % CAPACITY].id != id)
+            return false;
+
+        // decode a copy so the hook is not held up
+        snapshot = snapshots[(id - 1) % CAPACITY];
+    }
+
+    lua_newtable(pOutput);
+    PushHeader(pOutput, snapshot, sources);
+
+    SnapshotReader reader(snapshot.data);
+    reader.PushFrames(pOutput);
+    lua_setfield(pOutput, -2, "frames");
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Forgets all snapshots (and when breakpoints were last snapshot).
+ */
+//*****************************************************************************
+void SnapshotStore::Clear()
+{
+    SMutexLock snapshotLock(snapshotMutex);
+
+    for (unsigned i = 0;i < CAPACITY;i++)
+        snapshots[i] = Snapshot();
+
+    lastTaken.clear();
+    numThrottled = 0;
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,141 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SnapshotStore.h
+ *
+ *  \brief  Frames and variables captured by snapshot breakpoints without
+ *  stopping the stack.
+ *
+ *****************************************************************************/
+
+#ifndef _SNAPSHOT_STORE_H_
+#define _SNAPSHOT_STORE_H_
+
+#include <map>
+#include <string>
+#include "lpfwddefs.h"
+#include "halley.h"
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  SnapshotStore
+ *
+ *  \brief  The last CAPACITY snapshots taken by snapshot breakpoints.
+ *
+ *  A snapshot holds the top "frames" frames of the stack with the locals
+ *  and upvalues of each, tables expanded "depth" levels deep (as
+ *  LuaUtils::TransferValueToStack does).  It is written by the hook into
+ *  a compact binary buffer and stops growing once the buffer reaches
+ *  "budget" bytes, so a hit costs about as much as copying the buffer -
+ *  the lua tables the client sees are only built when a snapshot is
+ *  fetched.
+ *
+ *  A breakpoint is snapshot at most once every "interval" ms - the other
+ *  hits carry on without taking one and are counted as throttled.
+ *
+ *****************************************************************************/
+class SnapshotStore
+{
+public:
+    //! Number of snapshots kept
+    static const unsigned   CAPACITY            = 64;
+
+    //! Default limits
+    static const int        DEFAULT_FRAMES      = 5;
+    static const int        DEFAULT_DEPTH       = 2;
+    static const int        DEFAULT_BUDGET      = 16384;
+    static const int        DEFAULT_INTERVAL    = 1000;
+
+    //! Longest string value kept (longer ones are cut short)
+    static const unsigned   MAX_STRING          = 256;
+
+public:
+    // ctor
+    SnapshotStore();
+
+    // dtor
+    virtual ~SnapshotStore();
+
+    // Changes the limits - values <= 0 restore the defaults
+    void        SetLimits(int frames, int depth, int budget, int interval);
+
+    // Takes a snapshot of a stack at a breakpoint - called from the hook
+    bool        Capture(LuaStack pStack, DebugContext *pContext, int fileId, int line);
+
+    // Pushes a summary of each snapshot kept onto a lua stack
+    void        PushSnapshots(LuaStack pOutput, SourceRegistry &sources);
+
+    // Pushes the frames and variables of a snapshot onto a lua stack
+    bool        PushSnapshot(LuaStack pOutput, unsigned id, SourceRegistry &sources);
+
+    // Forgets all snapshots
+    void        Clear();
+
+protected:
+    //! A snapshot
+    struct Snapshot
+    {
+        Snapshot() : id(0), pContext(NULL), fileId(-1), line(-1), timeMs(0), truncated(false) { }
+
+        //! Id of the snapshot (0 if the slot is empty)
+        unsigned        id;
+
+        const void *    pContext;
+        std::string     name;
+        int             fileId;
+        int             line;
+        long long       timeMs;
+
+        //! Was the budget reached?
+        bool            truncated;
+
+        //! The encoded frames
+        std::string     data;
+    };
+
+    // Pushes the fields a summary and a full snapshot share
+    void        PushHeader(LuaStack pOutput, const Snapshot &snapshot, SourceRegistry &sources);
+
+protected:
+    //! The snapshots - the one with id N is at (N - 1) % CAPACITY
+    Snapshot            snapshots[CAPACITY];
+
+    //! Snapshots taken so far
+    unsigned            numSnapshots;
+
+    //! Hits skipped because their breakpoint was snapshot too recently
+    unsigned            numThrottled;
+
+    //! When each breakpoint was last snapshot, keyed by file id and line
+    std::map<std::pair<int, int>, long long>    lastTaken;
+
+    //! The limits
+    int                 frames;
+    int                 depth;
+    int                 budget;
+    int                 interval;
+
+    //! Guards everything above
+    SMutex              snapshotMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -0,0 +1,220 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SourceRegistry.cpp
+ *
+ *  \brief  Implementation of source interning and path normalization.
+ */
+//*****************************************************************************
+
+#include <limits.h>
+#include <unistd.h>
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty registry.
+ */
+//*****************************************************************************
+SourceRegistry::SourceRegistry()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ */
+//*****************************************************************************
+SourceRegistry::~SourceRegistry()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of a chunk source.
+ *
+ *  Called on hook events so a chunk that has been seen before is answered
+ *  from the cache without normalizing or locking.
+ *
+ *  \param  cache   Cache of the context the event is for.
+ *  \param  source  The source as in lua_Debug::source.
+ *
+ *  \return The file id or -1 if source is NULL.
+ */
+//*****************************************************************************
+int SourceRegistry::GetSourceId(SourceCache &cache, const char *source)
+{
+    if (source == NULL)
+        return -1;
+
+    SourceCache::SourceIdMap::value_type *pEntry = cache.lastEntry;
+    if (pEntry == NULL || pEntry->first != source)
+    {
+        SourceCache::SourceIdMap::iterator iter = cache.sourceIds.find(source);
+        if (iter == cache.sourceIds.end())
+            iter = cache.sourceIds.insert(std::make_pair(source, std::make_pair(std::string(), -1))).first;
+        pEntry = cache.lastEntry = &(*iter);
+    }
+
+    // a collected chunk's memory may have been reused by another chunk
+    if (pEntry->second.second < 0 || pEntry->second.first != source)
+    {
+        pEntry->second.first    = source;
+        pEntry->second.second   = GetSourceId(source);
+    }
+
+    return pEntry->second.second;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of a chunk source without a cache.
+ */
+//*****************************************************************************
+int SourceRegistry::GetSourceId(const char *source)
+{
+    if (source == NULL)
+        return -1;
+
+    return Intern(Normalize(source));
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of a file path as given by a client.
+ */
+//*****************************************************************************
+int SourceRegistry::GetFileId(const char *path)
+{
+    if (path == NULL)
+        return -1;
+
+    return Intern(NormalizePath(path));
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the canonical name of a file id.
+ *
+ *  \return The name or an empty string if the id is not known.
+ */
+//*****************************************************************************
+std::string SourceRegistry::GetFileName(int fileId)
+{
+    SMutexLock registryLock(registryMutex);
+
+    if (fileId < 0 || fileId >= (int)fileNames.size())
+        return "";
+
+    return fileNames[fileId];
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Interns a canonical name.
+ */
+//*****************************************************************************
+int SourceRegistry::Intern(const std::string &canonical)
+{
+    SMutexLock registryLock(registryMutex);
+
+    std::map<std::string, int>::iterator iter = fileIds.find(canonical);
+    if (iter != fileIds.end())
+        return iter->second;
+
+    int fileId = fileNames.size();
+    fileIds[canonical] = fileId;
+    fileNames.push_back(canonical);
+    return fileId;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the canonical name of a chunk source.
+ *
+ *  Sources of chunks loaded from files ("@path") are normalized as paths,
+ *  everything else (strings and "=name" chunks) is kept as is.
+ */
+//*****************************************************************************
+std::string SourceRegistry::Normalize(const char *source)
+{
+    if (source[0] == '@')
+        return NormalizePath(source);
+
+    return source;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the canonical form of a path.
+ *
+ *  A leading "@" (as sent by clients that echo chunk names back) is
+ *  dropped, relative paths are made absolute against the current
+ *  directory and "." / ".." components and duplicate slashes are removed.
+ *  Symbolic links are not resolved as the files may not be local.
+ */
+//*****************************************************************************
+std::string SourceRegistry::NormalizePath(const char *path)
+{
+    if (path[0] == '@')
+        path++;
+
+    std::string fullpath;
+    if (path[0] != '/')
+    {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) != NULL)
+            fullpath = cwd;
+        fullpath += "/";
+    }
+    fullpath += path;
+
+    std::vector<std::string> components;
+    std::string::size_type start = 0;
+    while (start <= fullpath.size())
+    {
+        std::string::size_type end = fullpath.find('/', start);
+        if (end == std::string::npos)
+            end = fullpath.size();
+
+        std::string component = fullpath.substr(start, end - start);
+        if (component == "..")
+        {
+            if (!components.empty())
+                components.pop_back();
+        }
+        else if (!component.empty() && component != ".")
+        {
+            components.push_back(component);
+        }
+
+        start = end + 1;
+    }
+
+    std::string result;
+    for (std::vector<std::string>::iterator iter = components.begin(); iter != components.end(); ++iter)
+    {
+        result += "/";
+        result += *iter;
+    }
+
+    return result.empty() ? "/" : result;
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,121 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   SourceRegistry.h
+ *
+ *  \brief  Interning of chunk names and client paths into file ids.
+ *
+ *****************************************************************************/
+
+#ifndef _SOURCE_REGISTRY_H_
+#define _SOURCE_REGISTRY_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  SourceCache
+ *
+ *  \brief  Per context cache of chunk source pointers to file ids.
+ *
+ *  Lua keeps the source of a function alive while the function runs, so
+ *  the same pointer is seen on every event in a chunk.  Pointers of
+ *  collected chunks may be reused, so a cached entry is only trusted if
+ *  the string it points to still matches.  Only ever used by the thread
+ *  running the context so needs no locking.
+ *
+ *****************************************************************************/
+class SourceCache
+{
+public:
+    SourceCache() : lastEntry(NULL) { }
+
+protected:
+    friend class SourceRegistry;
+
+    typedef std::map<const char *, std::pair<std::string, int> > SourceIdMap;
+
+    //! All sources looked up so far
+    SourceIdMap             sourceIds;
+
+    //! The entry of the last source looked up
+    SourceIdMap::value_type *lastEntry;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  SourceRegistry
+ *
+ *  \brief  Maps chunk names and client paths to canonical file ids.
+ *
+ *  "@./scripts/foo.lua", "@scripts/foo.lua" and "/cwd/scripts/foo.lua"
+ *  all map to the same id so breakpoints, coverage and profiles can refer
+ *  to files by a small integer regardless of how a chunk was loaded or
+ *  how the client names it.  Ids are never reused.
+ *
+ *****************************************************************************/
+class SourceRegistry
+{
+public:
+    // ctor
+    SourceRegistry();
+
+    // dtor
+    virtual ~SourceRegistry();
+
+    // Gets the id of a chunk source (as in lua_Debug::source)
+    int                 GetSourceId(SourceCache &cache, const char *source);
+
+    // Gets the id of a chunk source without a cache
+    int                 GetSourceId(const char *source);
+
+    // Gets the id of a file path as given by a client
+    int                 GetFileId(const char *path);
+
+    // Gets the canonical name of a file id
+    std::string         GetFileName(int fileId);
+
+    // Gets the canonical name of a chunk source
+    static std::string  Normalize(const char *source);
+
+    // Gets the canonical (absolute, without "." or "..") form of a path
+    static std::string  NormalizePath(const char *path);
+
+protected:
+    // Interns a canonical name
+    int                 Intern(const std::string &canonical);
+
+protected:
+    //! Ids of canonical names
+    std::map<std::string, int>  fileIds;
+
+    //! Canonical names by id
+    std::vector<std::string>    fileNames;
+
+    //! Guards the tables - only taken on a cache miss
+    SMutex                      registryMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -45,6 +45,7 @@
 #include "TcpClientIface.h"
 #include "DebugContext.h"
 #include "LuaBindings.h"
+#include "LunarProbe.h"
 
 LUNARPROBE_NS_BEGIN
 
@@ -78,6 +79,9 @@ TcpClientIface::~TcpClientIface()
 /*!
  *  \brief  Handle debug connections.
  *
+ *  Each message is a json string - it is parsed (and replied to) by
+ *  LuaBindings::HandleMessage.
+ *
  *  \version
  *      - S Panyam  17/07/2009
  *      Initial version.
@@ -90,6 +94,9 @@ void TcpClientIface::HandleConnection(int sock)
 
     clientSocket = sock;
 
+    // stacks can start sending events now that someone is listening
+    LunarProbe::GetInstance()->UpdateHooks();
+
     // reload lua scripts at the start of each connection
     // GetLuaBindings()->RequestReload();
 
@@ -98,38 +105,36 @@ void TcpClientIface::HandleConnection(int sock)
         GetLuaBindings()->HandleMessage(message);
     }
 
+    // nobody is listening any more so remove the hooks
+    clientSocket = -1;
+    LunarProbe::GetInstance()->UpdateHooks();
+
     // and go through all paused contexts and
     // resume them!!
-    for (DebugContextMap::iterator iter = debugContexts.begin();
-         iter != debugContexts.end(); ++iter)
     {
-        DebugContext *ctx = iter->second;
-        if (ctx != NULL)
-            ctx->Resume();
+        ContextRegistry::Reader reader(debugContexts);
+        for (DebugContextMap::const_iterator iter = reader.Contexts().begin();
+             iter != reader.Contexts().end(); ++iter)
+        {
+            DebugContext *ctx = iter->second;
+            if (ctx != NULL)
+                ctx->Resume();
+        }
     }
 
-    SServer::HandleConnection(clientSocket);
+    SServer::HandleConnection(sock);
 }
 
 //*****************************************************************************
 /*!
- *  \brief  Called by the liblua (actually via LunarProbe::HookFunction)
- *  when a breakpoint is hit.
- *
- *  \version
- *      - S Panyam  27/10/2008
- *      Initial version.
+ *  \brief  Tells if a client is connected.
  */
 //*****************************************************************************
-void TcpClientIface::HandleDebugHook(LuaStack pStack, LuaDebug pDebug)
+bool TcpClientIface::ClientConnected()
 {
-    if (clientSocket < 0)
-        return ;
-
-    ClientIface::HandleDebugHook(pStack, pDebug);
+    return clientSocket >= 0;
 }
 
-
 //*****************************************************************************
 /*!
  *  \brief  Reads a string from the socket.  
@@ -170,24 +175,22 @@ bool TcpClientIface::ReadString(std::string &result)
                      (((paramsizebuff[2]) & 0xff) << 16) |
                      (((paramsizebuff[3]) & 0xff) << 24));
 
-        std::ostringstream strstream;
+        result.clear();
         while (paramsize > MAX_PARAM_SIZE)
         {
             if (recv(clientSocket, param, MAX_PARAM_SIZE, MSG_WAITALL) <= 0)
                 return false;
-            param[MAX_PARAM_SIZE] = 0;
-            strstream << param;
+            result.append(param, MAX_PARAM_SIZE);
+            paramsize -= MAX_PARAM_SIZE;
         }
 
         if (paramsize > 0)
         {
             if (recv(clientSocket, param, paramsize, MSG_WAITALL) <= 0)
                 return false;
-            param[paramsize] = 0;
-            strstream << param;
+            result.append(param, paramsize);
         }
 
-        result = strstream.str();
         return true;
     }
     return false;
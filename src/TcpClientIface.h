@@ -48,12 +48,12 @@ public:
                 TcpClientIface(int port = LUA_DEBUG_PORT);
     virtual     ~TcpClientIface();
 
-    // OVerridden to check client status
-    virtual void    HandleDebugHook(LuaStack pStack, LuaDebug pDebug);
-
     // Sends a message to the connected client
     virtual int     SendMessage(const char *data, unsigned datasize);
 
+    // Tells if a client is connected
+    virtual bool    ClientConnected();
+
 protected:
     // handles connections
     virtual     void        HandleConnection(int clientSocket);
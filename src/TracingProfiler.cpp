@@ -0,0 +1,562 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   TracingProfiler.cpp
+ *
+ *  \brief  Implementation of the tracing profiler and its buffers.
+ */
+//*****************************************************************************
+
+#include <sstream>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TracingProfiler.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! The buffer of the current thread and the profiler it belongs to
+static __thread const TracingProfiler * bufferOwner     = NULL;
+static __thread TraceBuffer *           threadBuffer    = NULL;
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets a monotonic timestamp in nanoseconds.
+ */
+//*****************************************************************************
+static inline long long NowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Adds an event to the buffer.
+ *
+ *  \return false if the buffer was full and the event was dropped.
+ */
+//*****************************************************************************
+bool TraceBuffer::Push(const TraceEvent &event)
+{
+    unsigned currHead = head;
+    if (currHead - tail >= CAPACITY)
+    {
+        dropped++;
+        return false;
+    }
+
+    events[currHead % CAPACITY] = event;
+
+    // the event must be visible before the collector sees the new head
+    __sync_synchronize();
+    head = currHead + 1;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Removes the oldest event from the buffer.
+ *
+ *  \return false if the buffer was empty.
+ */
+//*****************************************************************************
+bool TraceBuffer::Pop(TraceEvent &event)
+{
+    unsigned currTail = tail;
+    if (currTail == head)
+        return false;
+
+    __sync_synchronize();
+    event = events[currTail % CAPACITY];
+
+    // the slot must be read before the producer can reuse it
+    __sync_synchronize();
+    tail = currTail + 1;
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Deletes a call tree node and everything below it.
+ */
+//*****************************************************************************
+TracingProfiler::CallNode::~CallNode()
+{
+    for (std::map<int, CallNode *>::iterator iter = children.begin(); iter != children.end(); ++iter)
+        delete iter->second;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates a profiler.  The collector is started on demand.
+ */
+//*****************************************************************************
+TracingProfiler::TracingProfiler() :
+    pBuffers(NULL),
+    started(false),
+    stopping(false)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.  Stops the collector and frees all buffers.
+ */
+//*****************************************************************************
+TracingProfiler::~TracingProfiler()
+{
+    Stop();
+
+    for (std::map<LuaStack, StackTrace *>::iterator iter = traces.begin(); iter != traces.end(); ++iter)
+        delete iter->second;
+
+    while (pBuffers != NULL)
+    {
+        TraceBuffer *pBuffer = pBuffers;
+        pBuffers = pBuffer->pNext;
+        delete pBuffer;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Records a call or return.
+ *
+ *  Called from the debug hook so only looks up the function (for calls)
+ *  and writes to the buffer of the calling thread.
+ *
+ *  \param  pDebug  Debug info of the event with the "S" fields filled in
+ *                  for call events.
+ */
+//*****************************************************************************
+void TracingProfiler::Record(LuaStack pStack, LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache)
+{
+    TraceBuffer *   pBuffer = GetThreadBuffer();
+    TraceEvent      event;
+
+    event.pStack        = pStack;
+    event.functionId    = -1;
+
+    // lua 5.1 fills in the (otherwise private) index of the active call
+    // info for hook events, which is the call depth
+    event.depth         = pDebug->i_ci;
+
+    switch (pDebug->event)
+    {
+        case LUA_HOOKCALL:
+        {
+            event.type          = TRACE_CALL;
+            event.functionId    = GetFunctionId(pBuffer, pStack, pDebug, sources, cache);
+        } break ;
+        case LUA_HOOKRET:       event.type = TRACE_RETURN; break ;
+        case LUA_HOOKTAILRET:   event.type = TRACE_TAILRETURN; break ;
+        default: return ;
+    }
+
+    // taken after the lookup so it is not charged to the callee
+    event.timeNs = NowNs();
+
+    pBuffer->Push(event);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Starts the collector thread if it is not already running.
+ */
+//*****************************************************************************
+void TracingProfiler::Start()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (started)
+        return ;
+
+    stopping    = false;
+    started     = pthread_create(&thread, NULL, ThreadMain, this) == 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops the collector thread and waits for it to finish.
+ */
+//*****************************************************************************
+void TracingProfiler::Stop()
+{
+    SMutexLock threadLock(threadMutex);
+
+    if (!started)
+        return ;
+
+    stopping = true;
+    pthread_join(thread, NULL);
+    started = false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Discards the call tree and open frames of a stack.
+ */
+//*****************************************************************************
+void TracingProfiler::Reset(LuaStack pStack)
+{
+    // events still in the buffers belong to the trace being discarded
+    Collect();
+
+    SMutexLock collectLock(collectMutex);
+
+    std::map<LuaStack, StackTrace *>::iterator iter = traces.find(pStack);
+    if (iter != traces.end())
+    {
+        delete iter->second;
+        traces.erase(iter);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Replays the events in all buffers.
+ */
+//*****************************************************************************
+void TracingProfiler::Collect()
+{
+    SMutexLock collectLock(collectMutex);
+
+    TraceEvent event;
+    for (TraceBuffer *pBuffer = pBuffers; pBuffer != NULL; pBuffer = pBuffer->pNext)
+    {
+        while (pBuffer->Pop(event))
+            Process(event);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a report of a stack onto a lua stack.
+ *
+ *  The report is a table with the call tree ("tree"), the totals of each
+ *  function ("functions") and the number of events dropped so far
+ *  ("dropped").  Times are in milliseconds.
+ *
+ *  \param  pOutput The stack to push the report onto.
+ *  \param  pStack  The stack whose report is wanted.
+ */
+//*****************************************************************************
+void TracingProfiler::PushReport(LuaStack pOutput, LuaStack pStack)
+{
+    Collect();
+
+    SMutexLock collectLock(collectMutex);
+    SMutexLock functionLock(functionMutex);
+
+    std::map<LuaStack, StackTrace *>::iterator iter = traces.find(pStack);
+    StackTrace *pTrace = iter == traces.end() ? NULL : iter->second;
+
+    lua_newtable(pOutput);
+
+    lua_newtable(pOutput);
+    if (pTrace != NULL)
+    {
+        int index = 1;
+        for (std::map<int, FunctionTotals>::iterator titer = pTrace->totals.begin();
+             titer != pTrace->totals.end(); ++titer)
+        {
+            lua_newtable(pOutput);
+
+            lua_pushstring(pOutput, functionNames[titer->first].c_str());
+            lua_setfield(pOutput, -2, "name");
+
+            lua_pushinteger(pOutput, titer->second.calls);
+            lua_setfield(pOutput, -2, "calls");
+
+            lua_pushnumber(pOutput, titer->second.inclusiveNs / 1000000.0);
+            lua_setfield(pOutput, -2, "inclusive");
+
+            lua_pushnumber(pOutput, titer->second.exclusiveNs / 1000000.0);
+            lua_setfield(pOutput, -2, "exclusive");
+
+            lua_rawseti(pOutput, -2, index++);
+        }
+    }
+    lua_setfield(pOutput, -2, "functions");
+
+    if (pTrace != NULL)
+    {
+        PushNode(pOutput, &pTrace->root, 0);
+        lua_setfield(pOutput, -2, "tree");
+    }
+
+    unsigned dropped = 0;
+    for (TraceBuffer *pBuffer = pBuffers; pBuffer != NULL; pBuffer = pBuffer->pNext)
+        dropped += pBuffer->Dropped();
+
+    lua_pushinteger(pOutput, dropped);
+    lua_setfield(pOutput, -2, "dropped");
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the buffer of the calling thread, creating it the first
+ *  time a thread records an event.
+ */
+//*****************************************************************************
+TraceBuffer *TracingProfiler::GetThreadBuffer()
+{
+    if (bufferOwner == this)
+        return threadBuffer;
+
+    TraceBuffer *pBuffer = new TraceBuffer();
+    do
+    {
+        pBuffer->pNext = pBuffers;
+    } while (!__sync_bool_compare_and_swap(&pBuffers, pBuffer->pNext, pBuffer));
+
+    bufferOwner     = this;
+    threadBuffer    = pBuffer;
+    return pBuffer;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the id of the function being called.
+ *
+ *  Lua functions are keyed by file id and linedefined and C functions by
+ *  the function itself.  The thread's cache answers repeat calls, the
+ *  name is only resolved the first time any thread sees a function.
+ */
+//*****************************************************************************
+int TracingProfiler::GetFunctionId(TraceBuffer *pBuffer, LuaStack pStack, LuaDebug pDebug,
+                                   SourceRegistry &sources, SourceCache &cache)
+{
+    if (pDebug->what != NULL && strcmp(pDebug->what, "C") == 0)
+    {
+        lua_getinfo(pStack, "f", pDebug);
+        const void *pFunction = lua_topointer(pStack, -1);
+        lua_pop(pStack, 1);
+
+        std::map<const void *, int>::iterator iter = pBuffer->cFunctions.find(pFunction);
+        if (iter != pBuffer->cFunctions.end())
+            return iter->second;
+
+        lua_getinfo(pStack, "n", pDebug);
+
+        SMutexLock functionLock(functionMutex);
+
+        int functionId;
+        iter = cFunctions.find(pFunction);
+        if (iter != cFunctions.end())
+        {
+            functionId = iter->second;
+        }
+        else
+        {
+            functionId = functionNames.size();
+            functionNames.push_back(std::string(pDebug->name != NULL ? pDebug->name : "?") + " [C]");
+            cFunctions[pFunction] = functionId;
+        }
+
+        pBuffer->cFunctions[pFunction] = functionId;
+        return functionId;
+    }
+
+    std::pair<int, int> key(sources.GetSourceId(cache, pDebug->source), pDebug->linedefined);
+
+    std::map<std::pair<int, int>, int>::iterator iter = pBuffer->luaFunctions.find(key);
+    if (iter != pBuffer->luaFunctions.end())
+        return iter->second;
+
+    lua_getinfo(pStack, "n", pDebug);
+
+    SMutexLock functionLock(functionMutex);
+
+    int functionId;
+    iter = luaFunctions.find(key);
+    if (iter != luaFunctions.end())
+    {
+        functionId = iter->second;
+    }
+    else
+    {
+        std::ostringstream name;
+        if (pDebug->what != NULL && strcmp(pDebug->what, "main") == 0)
+            name << sources.GetFileName(key.first) << ":main";
+        else
+            name << (pDebug->name != NULL ? pDebug->name : "?")
+                 << " (" << sources.GetFileName(key.first) << ":" << key.second << ")";
+
+        functionId = functionNames.size();
+        functionNames.push_back(name.str());
+        luaFunctions[key] = functionId;
+    }
+
+    pBuffer->luaFunctions[key] = functionId;
+    return functionId;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Replays an event against the shadow stack of its lua stack.
+ */
+//*****************************************************************************
+void TracingProfiler::Process(const TraceEvent &event)
+{
+    StackTrace *&pTrace = traces[event.pStack];
+    if (pTrace == NULL)
+        pTrace = new StackTrace();
+
+    std::vector<OpenFrame> &frames = pTrace->frames;
+
+    switch (event.type)
+    {
+        case TRACE_CALL:
+        {
+            // frames deeper than the callee were unwound by an error (a
+            // tail called function reports the depth of its callees)
+            while (!frames.empty() && frames.back().depth > event.depth)
+                CloseFrame(pTrace, event.timeNs);
+
+            CallNode *  pParent = frames.empty() ? &pTrace->root : frames.back().pNode;
+            CallNode *& pNode   = pParent->children[event.functionId];
+            if (pNode == NULL)
+                pNode = new CallNode(event.functionId);
+
+            FunctionTotals &totals = pTrace->totals[event.functionId];
+            totals.calls++;
+            totals.active++;
+            pNode->calls++;
+
+            OpenFrame frame;
+            frame.pNode     = pNode;
+            frame.depth     = event.depth;
+            frame.startNs   = event.timeNs;
+            frame.childNs   = 0;
+            frames.push_back(frame);
+        } break ;
+        case TRACE_RETURN:
+        {
+            // a tail called function is one deeper than it returns from
+            while (!frames.empty() && frames.back().depth > event.depth + 1)
+                CloseFrame(pTrace, event.timeNs);
+
+            // frames entered before tracing started are not on the stack
+            if (!frames.empty() && frames.back().depth >= event.depth)
+                CloseFrame(pTrace, event.timeNs);
+        } break ;
+        case TRACE_TAILRETURN:
+        {
+            // one for each frame replaced by a tail call
+            if (!frames.empty())
+                CloseFrame(pTrace, event.timeNs);
+        } break ;
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Closes the innermost frame of a stack and charges its time.
+ *
+ *  A function only adds to its inclusive total when its outermost
+ *  activation closes so recursion is not counted more than once.
+ */
+//*****************************************************************************
+void TracingProfiler::CloseFrame(StackTrace *pTrace, long long timeNs)
+{
+    OpenFrame   frame   = pTrace->frames.back();
+    long long   elapsed = timeNs - frame.startNs;
+
+    pTrace->frames.pop_back();
+
+    frame.pNode->inclusiveNs += elapsed;
+    frame.pNode->exclusiveNs += elapsed - frame.childNs;
+
+    FunctionTotals &totals = pTrace->totals[frame.pNode->functionId];
+    totals.exclusiveNs += elapsed - frame.childNs;
+    if (--totals.active == 0)
+        totals.inclusiveNs += elapsed;
+
+    if (!pTrace->frames.empty())
+        pTrace->frames.back().childNs += elapsed;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a call tree node onto a lua stack.
+ *
+ *  Levels below MAX_REPORT_DEPTH are left out so deep recursion cannot
+ *  exhaust the C or lua stack.
+ */
+//*****************************************************************************
+void TracingProfiler::PushNode(LuaStack pOutput, const CallNode *pNode, int level)
+{
+    luaL_checkstack(pOutput, 4, "call tree too deep");
+
+    lua_newtable(pOutput);
+
+    lua_pushstring(pOutput, pNode->functionId < 0 ? "[root]" : functionNames[pNode->functionId].c_str());
+    lua_setfield(pOutput, -2, "name");
+
+    lua_pushinteger(pOutput, pNode->calls);
+    lua_setfield(pOutput, -2, "calls");
+
+    lua_pushnumber(pOutput, pNode->inclusiveNs / 1000000.0);
+    lua_setfield(pOutput, -2, "inclusive");
+
+    lua_pushnumber(pOutput, pNode->exclusiveNs / 1000000.0);
+    lua_setfield(pOutput, -2, "exclusive");
+
+    if (level < MAX_REPORT_DEPTH && !pNode->children.empty())
+    {
+        int index = 1;
+        lua_newtable(pOutput);
+        for (std::map<int, CallNode *>::const_iterator iter = pNode->children.begin();
+             iter != pNode->children.end(); ++iter)
+        {
+            PushNode(pOutput, iter->second, level + 1);
+            lua_rawseti(pOutput, -2, index++);
+        }
+        lua_setfield(pOutput, -2, "children");
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Entry point of the collector thread.
+ */
+//*****************************************************************************
+void *TracingProfiler::ThreadMain(void *pArg)
+{
+    ((TracingProfiler *)pArg)->Run();
+    return NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Drains the buffers every COLLECT_INTERVAL ms till stopped.
+ */
+//*****************************************************************************
+void TracingProfiler::Run()
+{
+    while (!stopping)
+    {
+        usleep(COLLECT_INTERVAL * 1000);
+        Collect();
+    }
+}
+
+LUNARPROBE_NS_END
+
@@ -0,0 +1,265 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   TracingProfiler.h
+ *
+ *  \brief  Instrumenting profiler built on call and return hooks.
+ *
+ *****************************************************************************/
+
+#ifndef _TRACING_PROFILER_H_
+#define _TRACING_PROFILER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "lpfwddefs.h"
+#include "halley.h"
+#include "SourceRegistry.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Kinds of events recorded by the tracing profiler
+enum TraceEventType
+{
+    TRACE_CALL,
+    TRACE_RETURN,
+    TRACE_TAILRETURN
+};
+
+//! A call or return as recorded by the hook
+struct TraceEvent
+{
+    long long   timeNs;
+    LuaStack    pStack;
+    int         functionId;
+    int         depth;
+    int         type;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  TraceBuffer
+ *
+ *  \brief  Single producer/single consumer ring of trace events.
+ *
+ *  Each OS thread that runs a traced stack gets its own buffer so the hook
+ *  (the producer) never waits on another thread.  The collector thread is
+ *  the only consumer.  Events are dropped (and counted) if the collector
+ *  falls behind.
+ *
+ *****************************************************************************/
+class TraceBuffer
+{
+public:
+    //! Number of events a buffer holds
+    static const unsigned   CAPACITY = 32768;
+
+public:
+    TraceBuffer() : pNext(NULL), head(0), tail(0), dropped(0) { }
+
+    // Adds an event - only called by the thread owning the buffer
+    bool    Push(const TraceEvent &event);
+
+    // Removes the oldest event - only called by the collector
+    bool    Pop(TraceEvent &event);
+
+    //! Number of events dropped because the buffer was full
+    unsigned Dropped() const { return dropped; }
+
+public:
+    //! Next buffer in the list of all buffers
+    TraceBuffer *                           pNext;
+
+    //! Function ids of lua functions seen by this thread
+    std::map<std::pair<int, int>, int>      luaFunctions;
+
+    //! Function ids of C functions seen by this thread
+    std::map<const void *, int>             cFunctions;
+
+protected:
+    //! Index of the next event to write
+    volatile unsigned                       head;
+
+    //! Index of the next event to read
+    volatile unsigned                       tail;
+
+    //! Number of events dropped because the buffer was full
+    volatile unsigned                       dropped;
+
+    //! The events
+    TraceEvent                              events[CAPACITY];
+};
+
+//*****************************************************************************
+/*!
+ *  \class  TracingProfiler
+ *
+ *  \brief  Builds call trees with call counts and inclusive/exclusive
+ *  times from the calls and returns of traced stacks.
+ *
+ *  The hook only timestamps events and writes them to the buffer of its
+ *  own thread.  Function ids are looked up in a per thread cache, so the
+ *  function table lock is only taken the first time a thread sees a
+ *  function.  A collector thread drains the buffers and replays the events
+ *  against a shadow stack per lua stack.
+ *
+ *  Tail calls get a call event but no return of their own.  When the tail
+ *  called function returns there is a return event for it followed by a
+ *  tail return for each frame the tail calls replaced, so those frames are
+ *  closed in the right order.  Frames unwound by errors get no events at
+ *  all, so every event carries the call depth lua reports and frames
+ *  deeper than that are closed when an outer frame returns.
+ *
+ *****************************************************************************/
+class TracingProfiler
+{
+public:
+    //! Deepest level of the call tree that is reported
+    static const int    MAX_REPORT_DEPTH    = 64;
+
+    //! Milliseconds between drains of the buffers
+    static const int    COLLECT_INTERVAL    = 10;
+
+public:
+    // ctor
+    TracingProfiler();
+
+    // dtor
+    virtual ~TracingProfiler();
+
+    // Records a call/return event - called from the debug hook
+    void            Record(LuaStack pStack, LuaDebug pDebug, SourceRegistry &sources, SourceCache &cache);
+
+    // Starts the collector thread if it is not already running
+    void            Start();
+
+    // Stops the collector thread
+    void            Stop();
+
+    // Discards the call tree of a stack
+    void            Reset(LuaStack pStack);
+
+    // Replays all events recorded so far
+    void            Collect();
+
+    // Pushes the call tree and function totals of a stack onto a lua stack
+    void            PushReport(LuaStack pOutput, LuaStack pStack);
+
+protected:
+    //! A node of the call tree
+    struct CallNode
+    {
+        CallNode(int id = -1) : functionId(id), calls(0), inclusiveNs(0), exclusiveNs(0) { }
+        ~CallNode();
+
+        int                         functionId;
+        unsigned                    calls;
+        long long                   inclusiveNs;
+        long long                   exclusiveNs;
+        std::map<int, CallNode *>   children;
+    };
+
+    //! Totals of a function over all the places it was called from
+    struct FunctionTotals
+    {
+        FunctionTotals() : calls(0), active(0), inclusiveNs(0), exclusiveNs(0) { }
+
+        unsigned                    calls;
+        int                         active;
+        long long                   inclusiveNs;
+        long long                   exclusiveNs;
+    };
+
+    //! A frame on the shadow stack
+    struct OpenFrame
+    {
+        CallNode *                  pNode;
+        int                         depth;
+        long long                   startNs;
+        long long                   childNs;
+    };
+
+    //! Everything collected for a stack
+    struct StackTrace
+    {
+        CallNode                        root;
+        std::vector<OpenFrame>          frames;
+        std::map<int, FunctionTotals>   totals;
+    };
+
+    // Gets the buffer of the calling thread
+    TraceBuffer *   GetThreadBuffer();
+
+    // Gets the id of the function called
+    int             GetFunctionId(TraceBuffer *pBuffer, LuaStack pStack, LuaDebug pDebug,
+                                  SourceRegistry &sources, SourceCache &cache);
+
+    // Replays an event
+    void            Process(const TraceEvent &event);
+
+    // Pops the innermost frame of a stack
+    void            CloseFrame(StackTrace *pTrace, long long timeNs);
+
+    // Pushes a call tree node (and its children) onto a lua stack
+    void            PushNode(LuaStack pOutput, const CallNode *pNode, int level);
+
+    // Entry point of the collector thread
+    static void *   ThreadMain(void *pArg);
+
+    // Drains the buffers till stopped
+    void            Run();
+
+protected:
+    //! All thread buffers (only ever added to)
+    TraceBuffer * volatile              pBuffers;
+
+    //! Collected data per stack
+    std::map<LuaStack, StackTrace *>    traces;
+
+    //! Guards the collected data
+    SMutex                              collectMutex;
+
+    //! Ids of lua functions keyed by file id and linedefined
+    std::map<std::pair<int, int>, int>  luaFunctions;
+
+    //! Ids of C functions keyed by the function
+    std::map<const void *, int>         cFunctions;
+
+    //! Function names by id
+    std::vector<std::string>            functionNames;
+
+    //! Guards the function tables - only taken on a thread cache miss
+    SMutex                              functionMutex;
+
+    //! The collector thread
+    pthread_t                           thread;
+
+    //! Has the collector been started?
+    bool                                started;
+
+    //! Set to ask the collector to finish
+    volatile bool                       stopping;
+
+    //! Guards starting and stopping the collector
+    SMutex                              threadMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
@@ -0,0 +1,243 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ValueSerializer.cpp
+ *
+ *  \brief  Copies values of a stack being debugged to a debugger stack.
+ *
+ *****************************************************************************/
+
+#include <string.h>
+#include <algorithm>
+#include "ValueSerializer.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! Bytes a node is counted as besides its strings (about what its json
+//! takes)
+static const int NODE_BYTES = 32;
+
+//*****************************************************************************
+/*!
+ *  \brief  Constructor.
+ *
+ *  \param  inStack     Stack the values are read from.
+ *  \param  outStack    Stack the copies are pushed onto.
+ *  \param  entries     Most table entries written by a call.
+ *  \param  stringBytes Most bytes of a string written (longer ones are cut).
+ *  \param  bytes       About how many bytes a call writes at most.
+ */
+//*****************************************************************************
+ValueSerializer::ValueSerializer(LuaStack in, LuaStack out, int entries, int stringBytes, int bytes) :
+    inStack(in),
+    outStack(out),
+    maxEntries(entries > 0 ? entries : DEFAULT_MAX_ENTRIES),
+    maxString(stringBytes > 0 ? stringBytes : DEFAULT_MAX_STRING),
+    maxBytes(bytes > 0 ? bytes : DEFAULT_MAX_BYTES),
+    numEntries(0),
+    numBytes(0)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the copy of a value onto the output stack.
+ *
+ *  \param  index   Index of the value on the input stack.
+ *  \param  levels  How many levels of tables to expand (0 writes tables
+ *                  as raw).
+ *  \param  name    Name of the value (if any).
+ *
+ *  \return false (with nothing pushed) if levels is negative.
+ */
+//*****************************************************************************
+bool ValueSerializer::Transfer(int index, int levels, const char *name)
+{
+    if (levels < 0)
+        return false;
+
+    if (index < 0 && index > LUA_REGISTRYINDEX)
+        index = lua_gettop(inStack) + index + 1;
+
+    int inTop = lua_gettop(inStack);
+
+    numEntries  = 0;
+    numBytes    = 0;
+    frames.clear();
+    visited.clear();
+
+    luaL_checkstack(inStack, 3, "No room to copy a value");
+    luaL_checkstack(outStack, 3, "No room to copy a value");
+
+    lua_pushvalue(inStack, index);
+    if (PushNode(lua_gettop(inStack), std::min(levels, MAX_LEVELS), name))
+    {
+        Frame root = { lua_gettop(inStack), std::min(levels, MAX_LEVELS), 0 };
+        frames.push_back(root);
+        lua_newtable(outStack);
+        lua_pushnil(inStack);
+    }
+
+    // The input stack holds each table being expanded with its current
+    // key above it, the output stack holds (below the list of each table
+    // being expanded) its node and the entry the node is the value of.
+    while (!frames.empty())
+    {
+        Frame & frame       = frames.back();
+        bool    truncated   = Exhausted();
+
+        if (truncated)
+            lua_pop(inStack, 1);
+
+        if (truncated || lua_next(inStack, frame.tableIndex) == 0)
+        {
+            // list into its node
+            lua_setfield(outStack, -2, "value");
+            if (truncated)
+            {
+                lua_pushboolean(outStack, true);
+                lua_setfield(outStack, -2, "truncated");
+            }
+
+            // the table (the key has gone)
+            lua_pop(inStack, 1);
+            frames.pop_back();
+
+            if (!frames.empty())
+            {
+                // node into its entry and the entry into the parent list
+                lua_setfield(outStack, -2, "value");
+                lua_rawseti(outStack, -2, ++frames.back().numItems);
+            }
+            continue ;
+        }
+
+        // key at -2, value at -1
+        int valueIndex = lua_gettop(inStack);
+        numEntries++;
+
+        luaL_checkstack(inStack, 3, "Value nested too deep");
+        luaL_checkstack(outStack, 4, "Value nested too deep");
+
+        lua_createtable(outStack, 0, 2);
+        PushNode(valueIndex - 1, 0, NULL);
+        lua_setfield(outStack, -2, "key");
+
+        if (PushNode(valueIndex, frame.levels - 1, NULL))
+        {
+            Frame child = { valueIndex, frame.levels - 1, 0 };
+            frames.push_back(child);
+            lua_newtable(outStack);
+            lua_pushnil(inStack);
+        }
+        else
+        {
+            lua_setfield(outStack, -2, "value");
+            lua_rawseti(outStack, -2, ++frame.numItems);
+
+            // keeps the key for lua_next
+            lua_pop(inStack, 1);
+        }
+    }
+
+    lua_settop(inStack, inTop);
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the node (name, type and value) of a value.
+ *
+ *  \return true if the value is a table to be expanded - its node is then
+ *  pushed without a value.
+ */
+//*****************************************************************************
+bool ValueSerializer::PushNode(int index, int levels, const char *name)
+{
+    // sized for the fields nearly every node has so they are set without
+    // rehashing
+    lua_createtable(outStack, 0, name != NULL ? 3 : 2);
+    numBytes += NODE_BYTES;
+
+    if (name != NULL)
+    {
+        lua_pushstring(outStack, name);
+        lua_setfield(outStack, -2, "name");
+        numBytes += strlen(name);
+    }
+
+    int type = lua_type(inStack, index);
+    lua_pushstring(outStack, lua_typename(inStack, type));
+    lua_setfield(outStack, -2, "type");
+
+    switch (type)
+    {
+        case LUA_TNIL:
+            return false;
+        case LUA_TBOOLEAN:
+            lua_pushboolean(outStack, lua_toboolean(inStack, index));
+            break ;
+        case LUA_TNUMBER:
+            lua_pushnumber(outStack, lua_tonumber(inStack, index));
+            break ;
+        case LUA_TSTRING:
+        {
+            size_t      length;
+            const char *value   = lua_tolstring(inStack, index, &length);
+            size_t      kept    = std::min(length, (size_t)maxString);
+
+            if (kept < length)
+            {
+                lua_pushboolean(outStack, true);
+                lua_setfield(outStack, -2, "truncated");
+                lua_pushnumber(outStack, length);
+                lua_setfield(outStack, -2, "length");
+            }
+
+            lua_pushlstring(outStack, value, kept);
+            numBytes += kept;
+        } break ;
+        case LUA_TLIGHTUSERDATA:
+            lua_pushlightuserdata(outStack, lua_touserdata(inStack, index));
+            break ;
+        case LUA_TTABLE:
+        {
+            const void *pTable = lua_topointer(inStack, index);
+            if (levels > 0)
+            {
+                if (visited.insert(pTable).second)
+                    return true;
+
+                // expanded already (or being expanded - a cycle)
+                lua_pushboolean(outStack, true);
+                lua_setfield(outStack, -2, "seen");
+            }
+
+            lua_pushboolean(outStack, true);
+            lua_setfield(outStack, -2, "raw");
+            lua_pushfstring(outStack, "%p", pTable);
+        } break ;
+        default:
+            // userdata, functions and threads
+            lua_pushfstring(outStack, "%p", lua_topointer(inStack, index));
+    }
+
+    lua_setfield(outStack, -2, "value");
+    return false;
+}
+
+LUNARPROBE_NS_END
+
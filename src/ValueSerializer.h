@@ -0,0 +1,123 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   ValueSerializer.h
+ *
+ *  \brief  Copies values of a stack being debugged to a debugger stack.
+ *
+ *****************************************************************************/
+
+#ifndef _VALUE_SERIALIZER_H_
+#define _VALUE_SERIALIZER_H_
+
+#include <set>
+#include <vector>
+#include "lpfwddefs.h"
+
+LUNARPROBE_NS_BEGIN
+
+//*****************************************************************************
+/*!
+ *  \class  ValueSerializer
+ *
+ *  \brief  Copies a value from one stack to another as the tables the
+ *  debugger scripts hand clients:
+ *
+ *      {name = ..., type = "table", value = {{key = {...}, value = {...}}, ...}}
+ *
+ *  Tables are walked with an explicit stack of frames (no recursion), each
+ *  table is expanded at most once (later references to it are written as
+ *  raw with "seen" set) and every call has a budget of entries, string
+ *  bytes and total bytes.  Whatever a budget cuts short is marked with
+ *  "truncated" (and strings with their full "length"), so a huge table
+ *  costs no more than its first maxEntries entries.
+ *
+ *  The copy is still a tree of lua tables - every entry costs a {key,
+ *  value} table and two node tables on the output stack, as the scripts
+ *  (and the Bayeux replies built from them) expect that shape.  The
+ *  budgets bound how many of those are built per call, not the cost of
+ *  each: a call makes at most about 3 * maxEntries tables and copies at
+ *  most about maxBytes bytes of strings.
+ *
+ *****************************************************************************/
+class ValueSerializer
+{
+public:
+    //! Default budgets of a call
+    static const int    DEFAULT_MAX_ENTRIES = 1000;
+    static const int    DEFAULT_MAX_STRING  = 1024;
+    static const int    DEFAULT_MAX_BYTES   = 65536;
+
+    //! Deepest tables are ever expanded
+    static const int    MAX_LEVELS          = 32;
+
+public:
+    // ctor - budgets <= 0 get the defaults
+    ValueSerializer(LuaStack inStack, LuaStack outStack,
+                    int maxEntries  = DEFAULT_MAX_ENTRIES,
+                    int maxString   = DEFAULT_MAX_STRING,
+                    int maxBytes    = DEFAULT_MAX_BYTES);
+
+    // Pushes the copy of a value onto the output stack
+    bool        Transfer(int index, int levels, const char *name = NULL);
+
+protected:
+    // Pushes the node of a value - true if it is a table to be expanded
+    bool        PushNode(int index, int levels, const char *name);
+
+    // Whether the entry or byte budget has been used up
+    bool        Exhausted() const { return numEntries >= maxEntries || numBytes >= maxBytes; }
+
+protected:
+    //! A table being expanded
+    struct Frame
+    {
+        //! Index of the table on the input stack (its key is above it)
+        int     tableIndex;
+
+        //! Levels left below the table
+        int     levels;
+
+        //! Entries written to its list so far
+        int     numItems;
+    };
+
+    //! Stack the values are read from
+    LuaStack            inStack;
+
+    //! Stack the copies are pushed onto
+    LuaStack            outStack;
+
+    //! Budgets
+    int                 maxEntries;
+    int                 maxString;
+    int                 maxBytes;
+
+    //! What has been used of the budgets
+    int                 numEntries;
+    int                 numBytes;
+
+    //! Tables being expanded (innermost last)
+    std::vector<Frame>  frames;
+
+    //! Tables expanded so far
+    std::set<const void *>  visited;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
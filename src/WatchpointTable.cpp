@@ -0,0 +1,824 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   WatchpointTable.cpp
+ *
+ *  \brief  Implementation of data watchpoints.
+ */
+//*****************************************************************************
+
+#include <vector>
+
+#include "WatchpointTable.h"
+#include "LuaUtils.h"
+#include "LunarProbe.h"
+#include "ClientIface.h"
+#include "DebugContext.h"
+
+LUNARPROBE_NS_BEGIN
+
+const char *WatchpointTable::WATCH_KEY = "__LDB_watch";
+const char *WatchpointTable::WATCH_BASE_KEY = "__LDB_watch_base";
+
+//*****************************************************************************
+/*!
+ *  \brief  Creates an empty table.
+ */
+//*****************************************************************************
+WatchpointTable::WatchpointTable() : nextId(1)
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Destructor.
+ *
+ *  Watched fields are put back by RemoveAll (from StopDebugging) - by now
+ *  the stack may already be closed.  Any left behind are put back by the
+ *  handlers once they no longer find the context.
+ */
+//*****************************************************************************
+WatchpointTable::~WatchpointTable()
+{
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Watches a field of a table.
+ *
+ *  \param  pStack      The (paused) stack the table belongs to.
+ *  \param  tableIndex  Index of the table on pStack.
+ *  \param  keyIndex    Index of the key of the field on pStack.
+ *  \param  table       Expression the table was found with (for listing).
+ *  \param  action      What a write of the field does.
+ *  \param  error       Why the field cannot be watched.
+ *
+ *  \return the id of the watchpoint or -1 on error.
+ */
+//*****************************************************************************
+int WatchpointTable::Add(LuaStack pStack, int tableIndex, int keyIndex, const char *table,
+                         WatchAction action, std::string &error)
+{
+    int top = lua_gettop(pStack);
+    if (tableIndex < 0)
+        tableIndex = top + 1 + tableIndex;
+    if (keyIndex < 0)
+        keyIndex = top + 1 + keyIndex;
+
+    if (!lua_istable(pStack, tableIndex))
+    {
+        error = "Value is not a table.";
+        return -1;
+    }
+
+    if (lua_isnil(pStack, keyIndex) ||
+        (lua_type(pStack, keyIndex) == LUA_TNUMBER && lua_tonumber(pStack, keyIndex) != lua_tonumber(pStack, keyIndex)))
+    {
+        error = "Invalid key.";
+        return -1;
+    }
+
+    if (!lua_checkstack(pStack, 12))
+    {
+        error = "Stack overflow.";
+        return -1;
+    }
+
+    SMutexLock watchLock(watchMutex);
+
+    int id = -1;
+    for (int i = 0;i < MAX_WATCHPOINTS && id < 0;i++)
+    {
+        if (watchpoints[(nextId + i) % MAX_WATCHPOINTS].id == 0)
+            id = nextId + i;
+    }
+
+    if (id < 0)
+    {
+        error = "Too many watchpoints.";
+        return -1;
+    }
+
+    PushState(pStack, tableIndex);
+    int stateIndex = lua_gettop(pStack);
+
+    lua_getfield(pStack, stateIndex, "keys");
+    lua_pushvalue(pStack, keyIndex);
+    lua_rawget(pStack, -2);
+    if (!lua_isnil(pStack, -1))
+    {
+        if (Find(lua_tointeger(pStack, -1)) != NULL)
+        {
+            error = "Field is already watched.";
+            lua_settop(pStack, top);
+            return -1;
+        }
+
+        // a watch that was removed while running and not put back yet
+        Restore(pStack, tableIndex, keyIndex, stateIndex);
+        lua_settop(pStack, top);
+        PushState(pStack, tableIndex);
+        lua_getfield(pStack, stateIndex, "keys");
+    }
+    else
+    {
+        lua_pop(pStack, 1);
+    }
+    int keysIndex = lua_gettop(pStack);
+
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushinteger(pStack, id);
+    lua_rawset(pStack, keysIndex);
+
+    // move the field into the shadow table
+    lua_getfield(pStack, stateIndex, "values");
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushvalue(pStack, keyIndex);
+    lua_rawget(pStack, tableIndex);
+    lua_rawset(pStack, -3);
+
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushnil(pStack);
+    lua_rawset(pStack, tableIndex);
+
+    // remember the table and key so the watch can be removed by id
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_KEY);
+    if (lua_isnil(pStack, -1))
+    {
+        lua_pop(pStack, 1);
+        lua_newtable(pStack);
+        lua_pushvalue(pStack, -1);
+        lua_setfield(pStack, LUA_REGISTRYINDEX, WATCH_KEY);
+    }
+
+    lua_newtable(pStack);
+    lua_pushvalue(pStack, tableIndex);
+    lua_rawseti(pStack, -2, 1);
+    lua_pushvalue(pStack, keyIndex);
+    lua_rawseti(pStack, -2, 2);
+    lua_rawseti(pStack, -2, id);
+
+    // so that setmetatable keeps the watch and getmetatable does not see it
+    WrapBaseFunctions(pStack);
+
+    Watchpoint &watchpoint = watchpoints[id % MAX_WATCHPOINTS];
+    watchpoint.action   = action;
+    watchpoint.table    = table != NULL ? table : "";
+    watchpoint.key.clear();
+    LuaUtils::AppendValue(pStack, keyIndex, watchpoint.key);
+    watchpoint.hits     = 0;
+
+    // publish the watchpoint only once it is filled in
+    __sync_synchronize();
+    watchpoint.id       = id;
+    nextId              = id + 1;
+
+    lua_settop(pStack, top);
+    return id;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops watching a field.
+ *
+ *  \param  paused  Whether the stack is paused - the field is then put
+ *                  back at once, otherwise on its next access.
+ *
+ *  \return false if there is no such watchpoint.
+ */
+//*****************************************************************************
+bool WatchpointTable::Remove(LuaStack pStack, int id, bool paused)
+{
+    SMutexLock watchLock(watchMutex);
+
+    if (id <= 0 || watchpoints[id % MAX_WATCHPOINTS].id != id)
+        return false;
+
+    watchpoints[id % MAX_WATCHPOINTS].id = 0;
+
+    if (paused)
+        RestoreById(pStack, id);
+
+    return true;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Stops watching all fields.
+ *
+ *  \param  paused  Whether the stack is paused (or otherwise not running
+ *                  on another thread) so the fields can be put back now.
+ */
+//*****************************************************************************
+void WatchpointTable::RemoveAll(LuaStack pStack, bool paused)
+{
+    SMutexLock watchLock(watchMutex);
+
+    for (int i = 0;i < MAX_WATCHPOINTS;i++)
+        watchpoints[i].id = 0;
+
+    if (!paused)
+        return ;
+
+    // includes watches removed earlier but not put back yet
+    std::vector<int> ids;
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_KEY);
+    if (lua_istable(pStack, -1))
+    {
+        lua_pushnil(pStack);
+        while (lua_next(pStack, -2) != 0)
+        {
+            ids.push_back(lua_tointeger(pStack, -2));
+            lua_pop(pStack, 1);
+        }
+    }
+    lua_pop(pStack, 1);
+
+    for (std::vector<int>::iterator iter = ids.begin();iter != ids.end();++iter)
+        RestoreById(pStack, *iter);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds a watchpoint that has not been removed.
+ */
+//*****************************************************************************
+Watchpoint *WatchpointTable::Find(int id)
+{
+    Watchpoint *pWatchpoint = &watchpoints[id % MAX_WATCHPOINTS];
+    return id > 0 && pWatchpoint->id == id ? pWatchpoint : NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes a list of the watchpoints with the id, table, key, mode
+ *  and hits of each.
+ */
+//*****************************************************************************
+void WatchpointTable::PushWatchpoints(LuaStack pOutput)
+{
+    SMutexLock watchLock(watchMutex);
+
+    int index = 1;
+    lua_newtable(pOutput);
+
+    for (int i = 0;i < MAX_WATCHPOINTS;i++)
+    {
+        const Watchpoint &watchpoint = watchpoints[i];
+        if (watchpoint.id == 0)
+            continue ;
+
+        lua_newtable(pOutput);
+
+        lua_pushinteger(pOutput, watchpoint.id);
+        lua_setfield(pOutput, -2, "id");
+
+        lua_pushstring(pOutput, watchpoint.table.empty() ? "_G" : watchpoint.table.c_str());
+        lua_setfield(pOutput, -2, "table");
+
+        lua_pushstring(pOutput, watchpoint.key.c_str());
+        lua_setfield(pOutput, -2, "key");
+
+        lua_pushstring(pOutput, watchpoint.action == WATCH_LOG ? "log" : "break");
+        lua_setfield(pOutput, -2, "mode");
+
+        lua_pushinteger(pOutput, watchpoint.hits);
+        lua_setfield(pOutput, -2, "hits");
+
+        lua_rawseti(pOutput, -2, index++);
+    }
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the watch state of a table.
+ *
+ *  The first watch on a table gives it a copy of its metatable with the
+ *  watch handlers and the state in it (see SetWatchMetatable).  The state
+ *  holds the ids of the watched "keys", the "values" of the watched
+ *  fields, the original "meta"table (or false) and the "stack" the
+ *  watches belong to.
+ */
+//*****************************************************************************
+void WatchpointTable::PushState(LuaStack pStack, int tableIndex)
+{
+    bool hasMeta = lua_getmetatable(pStack, tableIndex) != 0;
+    int  metaIndex = lua_gettop(pStack);
+    if (hasMeta)
+    {
+        lua_getfield(pStack, metaIndex, WATCH_KEY);
+        if (lua_istable(pStack, -1))
+        {
+            lua_remove(pStack, metaIndex);
+            return ;
+        }
+        lua_pop(pStack, 1);
+    }
+
+    lua_newtable(pStack);
+    int stateIndex = lua_gettop(pStack);
+
+    lua_newtable(pStack);
+    lua_setfield(pStack, stateIndex, "keys");
+
+    lua_newtable(pStack);
+    lua_setfield(pStack, stateIndex, "values");
+
+    if (hasMeta)
+        lua_pushvalue(pStack, metaIndex);
+    else
+        lua_pushboolean(pStack, false);
+    lua_setfield(pStack, stateIndex, "meta");
+
+    lua_pushlightuserdata(pStack, pStack);
+    lua_setfield(pStack, stateIndex, "stack");
+
+    SetWatchMetatable(pStack, tableIndex, stateIndex);
+
+    // leave just the state
+    if (hasMeta)
+        lua_remove(pStack, metaIndex);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gives a watched table a copy of the "meta"table of its state
+ *  with the watch handlers and the state in it.
+ *
+ *  The table gets a metatable of its own as the original may be shared by
+ *  other tables.
+ */
+//*****************************************************************************
+void WatchpointTable::SetWatchMetatable(LuaStack pStack, int tableIndex, int stateIndex)
+{
+    lua_newtable(pStack);
+    int newMetaIndex = lua_gettop(pStack);
+
+    lua_getfield(pStack, stateIndex, "meta");
+    if (lua_istable(pStack, -1))
+    {
+        lua_pushnil(pStack);
+        while (lua_next(pStack, -2) != 0)
+        {
+            lua_pushvalue(pStack, -2);
+            lua_insert(pStack, -2);
+            lua_rawset(pStack, newMetaIndex);
+        }
+    }
+    lua_pop(pStack, 1);
+
+    lua_pushvalue(pStack, stateIndex);
+    lua_pushcclosure(pStack, IndexHandler, 1);
+    lua_setfield(pStack, newMetaIndex, "__index");
+
+    lua_pushvalue(pStack, stateIndex);
+    lua_pushcclosure(pStack, NewIndexHandler, 1);
+    lua_setfield(pStack, newMetaIndex, "__newindex");
+
+    lua_pushvalue(pStack, stateIndex);
+    lua_setfield(pStack, newMetaIndex, WATCH_KEY);
+
+    lua_setmetatable(pStack, tableIndex);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Replaces the base getmetatable and setmetatable of a stack with
+ *  versions that see through the metatables of watched tables.
+ *
+ *  The originals are kept in the registry (under WATCH_BASE_KEY) and put
+ *  back once the last watch is gone (see UnwrapBaseFunctions).
+ */
+//*****************************************************************************
+void WatchpointTable::WrapBaseFunctions(LuaStack pStack)
+{
+    static const char *     names[]     = { "getmetatable", "setmetatable" };
+    static lua_CFunction    handlers[]  = { GetMetatableHandler, SetMetatableHandler };
+
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_BASE_KEY);
+    bool wrapped = !lua_isnil(pStack, -1);
+    lua_pop(pStack, 1);
+    if (wrapped)
+        return ;
+
+    lua_newtable(pStack);
+    for (int i = 0;i < 2;i++)
+    {
+        lua_getglobal(pStack, names[i]);
+        if (lua_isfunction(pStack, -1))
+        {
+            lua_pushvalue(pStack, -1);
+            lua_setfield(pStack, -3, names[i]);
+            lua_pushcclosure(pStack, handlers[i], 1);
+            lua_setglobal(pStack, names[i]);
+        }
+        else
+        {
+            lua_pop(pStack, 1);
+        }
+    }
+    lua_setfield(pStack, LUA_REGISTRYINDEX, WATCH_BASE_KEY);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Puts back the base functions replaced by WrapBaseFunctions.
+ *
+ *  Functions the stack has replaced since are left alone.
+ */
+//*****************************************************************************
+void WatchpointTable::UnwrapBaseFunctions(LuaStack pStack)
+{
+    static const char *     names[]     = { "getmetatable", "setmetatable" };
+    static lua_CFunction    handlers[]  = { GetMetatableHandler, SetMetatableHandler };
+
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_BASE_KEY);
+    if (lua_istable(pStack, -1))
+    {
+        for (int i = 0;i < 2;i++)
+        {
+            lua_getglobal(pStack, names[i]);
+            bool ours = lua_tocfunction(pStack, -1) == handlers[i];
+            lua_pop(pStack, 1);
+
+            lua_getfield(pStack, -1, names[i]);
+            if (ours && !lua_isnil(pStack, -1))
+                lua_setglobal(pStack, names[i]);
+            else
+                lua_pop(pStack, 1);
+        }
+
+        lua_pushnil(pStack);
+        lua_setfield(pStack, LUA_REGISTRYINDEX, WATCH_BASE_KEY);
+    }
+    lua_pop(pStack, 1);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Pushes the watch state of a watched table (nothing if the
+ *  value is not a watched table).
+ *
+ *  \return true if the state was pushed.
+ */
+//*****************************************************************************
+bool WatchpointTable::PushWatchedState(LuaStack pStack, int index)
+{
+    if (!lua_istable(pStack, index) || !lua_getmetatable(pStack, index))
+        return false;
+
+    lua_getfield(pStack, -1, WATCH_KEY);
+    lua_remove(pStack, -2);
+    if (lua_istable(pStack, -1))
+        return true;
+
+    lua_pop(pStack, 1);
+    return false;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  getmetatable while fields are watched - (object).
+ *
+ *  Watched tables answer with their original metatable (or its
+ *  __metatable field) rather than the copy holding the watch handlers.
+ */
+//*****************************************************************************
+int WatchpointTable::GetMetatableHandler(LuaStack pStack)
+{
+    if (!PushWatchedState(pStack, 1))
+    {
+        int nargs = lua_gettop(pStack);
+        lua_pushvalue(pStack, lua_upvalueindex(1));
+        lua_insert(pStack, 1);
+        lua_call(pStack, nargs, LUA_MULTRET);
+        return lua_gettop(pStack);
+    }
+
+    lua_getfield(pStack, -1, "meta");
+    if (!lua_istable(pStack, -1))
+    {
+        lua_pushnil(pStack);
+        return 1;
+    }
+
+    lua_getfield(pStack, -1, "__metatable");
+    if (lua_isnil(pStack, -1))
+        lua_pop(pStack, 1);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  setmetatable while fields are watched - (table, metatable).
+ *
+ *  A watched table keeps its watches: the new metatable becomes the
+ *  original of its state and the table gets a copy of it with the watch
+ *  handlers, so the watched values stay where the handlers find them.
+ */
+//*****************************************************************************
+int WatchpointTable::SetMetatableHandler(LuaStack pStack)
+{
+    if (!PushWatchedState(pStack, 1))
+    {
+        int nargs = lua_gettop(pStack);
+        lua_pushvalue(pStack, lua_upvalueindex(1));
+        lua_insert(pStack, 1);
+        lua_call(pStack, nargs, LUA_MULTRET);
+        return lua_gettop(pStack);
+    }
+
+    int stateIndex  = lua_gettop(pStack);
+    int type        = lua_type(pStack, 2);
+    luaL_argcheck(pStack, type == LUA_TNIL || type == LUA_TTABLE, 2, "nil or table expected");
+
+    lua_getfield(pStack, stateIndex, "meta");
+    if (lua_istable(pStack, -1))
+    {
+        lua_getfield(pStack, -1, "__metatable");
+        if (!lua_isnil(pStack, -1))
+            return luaL_error(pStack, "cannot change a protected metatable");
+        lua_pop(pStack, 1);
+    }
+    lua_pop(pStack, 1);
+
+    if (type == LUA_TTABLE)
+        lua_pushvalue(pStack, 2);
+    else
+        lua_pushboolean(pStack, false);
+    lua_setfield(pStack, stateIndex, "meta");
+
+    SetWatchMetatable(pStack, 1, stateIndex);
+
+    lua_pushvalue(pStack, 1);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Puts a watched field back into its table.
+ *
+ *  Once the last watched field of a table is back the table gets its
+ *  original metatable back.
+ */
+//*****************************************************************************
+void WatchpointTable::Restore(LuaStack pStack, int tableIndex, int keyIndex, int stateIndex)
+{
+    int top = lua_gettop(pStack);
+
+    lua_getfield(pStack, stateIndex, "keys");
+    int keysIndex = lua_gettop(pStack);
+
+    lua_getfield(pStack, stateIndex, "values");
+    int valuesIndex = lua_gettop(pStack);
+
+    // forget the id
+    lua_pushvalue(pStack, keyIndex);
+    lua_rawget(pStack, keysIndex);
+    int id = lua_tointeger(pStack, -1);
+    lua_pop(pStack, 1);
+
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_KEY);
+    if (lua_istable(pStack, -1))
+    {
+        lua_pushnil(pStack);
+        lua_rawseti(pStack, -2, id);
+
+        lua_pushnil(pStack);
+        if (lua_next(pStack, -2) == 0)
+            UnwrapBaseFunctions(pStack);
+        else
+            lua_pop(pStack, 2);
+    }
+    lua_pop(pStack, 1);
+
+    // move the value back
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushvalue(pStack, keyIndex);
+    lua_rawget(pStack, valuesIndex);
+    lua_rawset(pStack, tableIndex);
+
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushnil(pStack);
+    lua_rawset(pStack, keysIndex);
+
+    lua_pushvalue(pStack, keyIndex);
+    lua_pushnil(pStack);
+    lua_rawset(pStack, valuesIndex);
+
+    lua_pushnil(pStack);
+    if (lua_next(pStack, keysIndex) == 0)
+    {
+        lua_getfield(pStack, stateIndex, "meta");
+        if (!lua_istable(pStack, -1))
+        {
+            lua_pop(pStack, 1);
+            lua_pushnil(pStack);
+        }
+        lua_setmetatable(pStack, tableIndex);
+    }
+
+    lua_settop(pStack, top);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Puts the field of a watchpoint back given its id.
+ */
+//*****************************************************************************
+void WatchpointTable::RestoreById(LuaStack pStack, int id)
+{
+    int top = lua_gettop(pStack);
+
+    lua_getfield(pStack, LUA_REGISTRYINDEX, WATCH_KEY);
+    if (lua_istable(pStack, -1))
+    {
+        lua_rawgeti(pStack, -1, id);
+        if (lua_istable(pStack, -1))
+        {
+            int entryIndex = lua_gettop(pStack);
+
+            lua_rawgeti(pStack, entryIndex, 1);
+            int tableIndex = lua_gettop(pStack);
+            lua_rawgeti(pStack, entryIndex, 2);
+            int keyIndex = lua_gettop(pStack);
+
+            if (lua_getmetatable(pStack, tableIndex))
+            {
+                lua_getfield(pStack, -1, WATCH_KEY);
+                if (lua_istable(pStack, -1))
+                    Restore(pStack, tableIndex, keyIndex, lua_gettop(pStack));
+            }
+        }
+    }
+
+    lua_settop(pStack, top);
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Finds the context and watchpoint a watched field belongs to.
+ *
+ *  \return NULL if the watch has been removed or the stack is no longer
+ *  debugged (the field should then be put back).
+ */
+//*****************************************************************************
+Watchpoint *WatchpointTable::Lookup(LuaStack pStack, int stateIndex, int id, DebugContext *&pContext)
+{
+    lua_getfield(pStack, stateIndex, "stack");
+    LuaStack pOwner = (LuaStack)lua_touserdata(pStack, -1);
+    lua_pop(pStack, 1);
+
+    ClientIface *pClientIface = LunarProbe::GetInstance()->GetClientIface();
+    pContext = pClientIface != NULL ? pClientIface->GetDebugContext(pOwner) : NULL;
+
+    return pContext != NULL ? pContext->watchpoints.Find(id) : NULL;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  __index of watched tables - (table, key).
+ *
+ *  Watched fields are read from the shadow table, others are passed on
+ *  to the __index of the original metatable.
+ */
+//*****************************************************************************
+int WatchpointTable::IndexHandler(LuaStack pStack)
+{
+    int stateIndex = lua_upvalueindex(1);
+
+    lua_settop(pStack, 2);
+    lua_getfield(pStack, stateIndex, "keys");
+    lua_pushvalue(pStack, 2);
+    lua_rawget(pStack, 3);
+
+    if (!lua_isnil(pStack, 4))
+    {
+        DebugContext *pContext;
+        if (Lookup(pStack, stateIndex, lua_tointeger(pStack, 4), pContext) != NULL)
+        {
+            lua_getfield(pStack, stateIndex, "values");
+            lua_pushvalue(pStack, 2);
+            lua_rawget(pStack, -2);
+            return 1;
+        }
+
+        Restore(pStack, 1, 2, stateIndex);
+        lua_settop(pStack, 2);
+        lua_gettable(pStack, 1);
+        return 1;
+    }
+
+    lua_getfield(pStack, stateIndex, "meta");
+    if (lua_istable(pStack, -1))
+    {
+        lua_getfield(pStack, -1, "__index");
+        if (lua_isfunction(pStack, -1))
+        {
+            lua_pushvalue(pStack, 1);
+            lua_pushvalue(pStack, 2);
+            lua_call(pStack, 2, 1);
+            return 1;
+        }
+        else if (!lua_isnil(pStack, -1))
+        {
+            lua_pushvalue(pStack, 2);
+            lua_gettable(pStack, -2);
+            return 1;
+        }
+    }
+
+    lua_pushnil(pStack);
+    return 1;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  __newindex of watched tables - (table, key, value).
+ *
+ *  Writes of watched fields go to the shadow table and are reported to
+ *  the client interface, others are passed on to the __newindex of the
+ *  original metatable.
+ */
+//*****************************************************************************
+int WatchpointTable::NewIndexHandler(LuaStack pStack)
+{
+    int stateIndex = lua_upvalueindex(1);
+
+    lua_settop(pStack, 3);
+    lua_getfield(pStack, stateIndex, "keys");
+    lua_pushvalue(pStack, 2);
+    lua_rawget(pStack, 4);
+
+    if (!lua_isnil(pStack, 5))
+    {
+        DebugContext *  pContext;
+        Watchpoint *    pWatchpoint = Lookup(pStack, stateIndex, lua_tointeger(pStack, 5), pContext);
+        if (pWatchpoint == NULL)
+        {
+            Restore(pStack, 1, 2, stateIndex);
+            lua_settop(pStack, 3);
+            lua_settable(pStack, 1);
+            return 0;
+        }
+
+        lua_getfield(pStack, stateIndex, "values");
+        int valuesIndex = lua_gettop(pStack);
+
+        lua_pushvalue(pStack, 2);
+        lua_rawget(pStack, valuesIndex);
+        int oldIndex = lua_gettop(pStack);
+
+        lua_pushvalue(pStack, 2);
+        lua_pushvalue(pStack, 3);
+        lua_rawset(pStack, valuesIndex);
+
+        if (pContext->pStack == pStack)
+        {
+            ClientIface *pClientIface = LunarProbe::GetInstance()->GetClientIface();
+            pClientIface->HitWatchpoint(pStack, pContext, *pWatchpoint, oldIndex, 3);
+        }
+        return 0;
+    }
+
+    lua_getfield(pStack, stateIndex, "meta");
+    if (lua_istable(pStack, -1))
+    {
+        lua_getfield(pStack, -1, "__newindex");
+        if (lua_isfunction(pStack, -1))
+        {
+            lua_pushvalue(pStack, 1);
+            lua_pushvalue(pStack, 2);
+            lua_pushvalue(pStack, 3);
+            lua_call(pStack, 3, 0);
+            return 0;
+        }
+        else if (!lua_isnil(pStack, -1))
+        {
+            lua_pushvalue(pStack, 2);
+            lua_pushvalue(pStack, 3);
+            lua_settable(pStack, -3);
+            return 0;
+        }
+    }
+
+    lua_settop(pStack, 3);
+    lua_rawset(pStack, 1);
+    return 0;
+}
+
+LUNARPROBE_NS_END
+
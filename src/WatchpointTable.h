@@ -0,0 +1,188 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   WatchpointTable.h
+ *
+ *  \brief  Data watchpoints on table fields of a stack.
+ *
+ *****************************************************************************/
+
+#ifndef _WATCHPOINT_TABLE_H_
+#define _WATCHPOINT_TABLE_H_
+
+#include <string>
+#include "lpfwddefs.h"
+#include "halley.h"
+
+LUNARPROBE_NS_BEGIN
+
+//! What happens when a watched field is written
+enum WatchAction
+{
+    WATCH_BREAK,        // pause the stack as a breakpoint would
+    WATCH_LOG           // log the old and new values and carry on
+};
+
+//*****************************************************************************
+/*!
+ *  \class  Watchpoint
+ *
+ *  \brief  A watched field.
+ *
+ *****************************************************************************/
+class Watchpoint
+{
+public:
+    Watchpoint() : id(0), action(WATCH_BREAK), hits(0) { }
+
+public:
+    //! Id of the watchpoint (0 if the slot is free)
+    volatile int        id;
+
+    //! What a write does
+    WatchAction         action;
+
+    //! Expression the table was found with (empty for the globals)
+    std::string         table;
+
+    //! The key of the field as text
+    std::string         key;
+
+    //! Writes so far
+    volatile unsigned   hits;
+};
+
+//*****************************************************************************
+/*!
+ *  \class  WatchpointTable
+ *
+ *  \brief  The watched fields of a stack.
+ *
+ *  Watching a field moves it out of its table into a shadow table and
+ *  gives the table a metatable of its own (a copy of the one it had, if
+ *  any) whose __index and __newindex handlers serve the field from the
+ *  shadow table.  Every write of the field then reaches __newindex so it
+ *  can be reported, while accesses of other fields are passed on to the
+ *  original metatable and untouched fields cost nothing at all.  No hooks
+ *  are involved.
+ *
+ *  Since the field is no longer in the table itself, next and pairs do not
+ *  see it while it is watched (lua 5.1 has no __pairs).
+ *
+ *  While any field is watched the base getmetatable and setmetatable of
+ *  the stack are wrapped so the copy stays out of sight: getmetatable of
+ *  a watched table returns the original (so getmetatable(t) == Class
+ *  still holds) and setmetatable makes the new metatable the original,
+ *  giving the table a copy of it that keeps the watches.  Code holding
+ *  on to the base functions from before the first watch, rawequal on
+ *  metatables and debug.getmetatable still see the copy.
+ *
+ *  Watches can only be added while the stack is paused (the stack is
+ *  changed from the debugger thread).  A watch removed while the stack is
+ *  running is only marked as such and the field is put back the next
+ *  time the stack accesses it, by the stack's own thread.
+ *
+ *  Writes from other threads (coroutines) of the stack are not reported,
+ *  just as the hook does not stop in them.
+ *
+ *****************************************************************************/
+class WatchpointTable
+{
+public:
+    //! Most watches a stack can have
+    static const int    MAX_WATCHPOINTS = 32;
+
+    //! Registry and metatable field holding the watch state
+    static const char * WATCH_KEY;
+
+    //! Registry field holding the base functions wrapped while watching
+    static const char * WATCH_BASE_KEY;
+
+public:
+    // ctor
+    WatchpointTable();
+
+    // dtor
+    virtual ~WatchpointTable();
+
+    // Watches a field of a table of a paused stack
+    int             Add(LuaStack pStack, int tableIndex, int keyIndex, const char *table,
+                        WatchAction action, std::string &error);
+
+    // Stops watching a field
+    bool            Remove(LuaStack pStack, int id, bool paused);
+
+    // Stops watching all fields
+    void            RemoveAll(LuaStack pStack, bool paused);
+
+    // Finds a watchpoint that has not been removed - takes no locks
+    Watchpoint *    Find(int id);
+
+    // Pushes a list of the watchpoints onto a lua stack
+    void            PushWatchpoints(LuaStack pOutput);
+
+protected:
+    // Pushes the watch state of a table, installing the metatable if needed
+    static void     PushState(LuaStack pStack, int tableIndex);
+
+    // Gives a watched table a copy of its metatable with the handlers
+    static void     SetWatchMetatable(LuaStack pStack, int tableIndex, int stateIndex);
+
+    // Wraps getmetatable and setmetatable while fields are watched
+    static void     WrapBaseFunctions(LuaStack pStack);
+
+    // Puts back the functions wrapped by WrapBaseFunctions
+    static void     UnwrapBaseFunctions(LuaStack pStack);
+
+    // Pushes the watch state of a value if it is a watched table
+    static bool     PushWatchedState(LuaStack pStack, int index);
+
+    // getmetatable while fields are watched
+    static int      GetMetatableHandler(LuaStack pStack);
+
+    // setmetatable while fields are watched
+    static int      SetMetatableHandler(LuaStack pStack);
+
+    // Puts a watched field back into its table
+    static void     Restore(LuaStack pStack, int tableIndex, int keyIndex, int stateIndex);
+
+    // Puts the field of a watchpoint back given its id (stack paused)
+    static void     RestoreById(LuaStack pStack, int id);
+
+    // Finds the context and watchpoint a watched field belongs to
+    static Watchpoint * Lookup(LuaStack pStack, int stateIndex, int id, DebugContext *&pContext);
+
+    // __index of watched tables
+    static int      IndexHandler(LuaStack pStack);
+
+    // __newindex of watched tables
+    static int      NewIndexHandler(LuaStack pStack);
+
+protected:
+    //! The watchpoints - the one with id N is at N % MAX_WATCHPOINTS
+    Watchpoint          watchpoints[MAX_WATCHPOINTS];
+
+    //! Id the next watchpoint is tried with
+    int                 nextId;
+
+    //! Guards adding and removing
+    SMutex              watchMutex;
+};
+
+LUNARPROBE_NS_END
+
+#endif
+
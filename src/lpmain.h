@@ -35,6 +35,7 @@
 #include "ClientIface.h"
 #include "TcpClientIface.h"
 #include "BayeuxClientIface.h"
+#include "AllocProfiler.h"
 
 #endif
 
@@ -0,0 +1,133 @@
+/*****************************************************************************/
+/*!
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************
+ *
+ *  \file   embedscripts.cpp
+ *
+ *  \brief  Build tool compiling the debugger scripts to bytecode and
+ *  writing them out as a source file defining EMBEDDED_SCRIPTS (see
+ *  EmbeddedScripts.h).
+ *
+ *  Usage: embedscripts <output.cpp> <script.lua> ...
+ *
+ *  It is linked with the same lua archive as the library so the bytecode
+ *  always matches the lua that loads it.  Each script is embedded under
+ *  the name it is required with (its file name without the ".lua").
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  lua_dump writer appending the bytecode to a string.
+ */
+//*****************************************************************************
+static int WriteBytecode(lua_State *L, const void *data, size_t size, void *output)
+{
+    ((std::string *)output)->append((const char *)data, size);
+    return 0;
+}
+
+//*****************************************************************************
+/*!
+ *  \brief  Gets the name a script is required with.
+ */
+//*****************************************************************************
+static std::string ScriptName(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    std::string name(base != NULL ? base + 1 : path);
+
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".lua") == 0)
+        name.erase(name.size() - 4);
+
+    return name;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <output.cpp> <script.lua> ...\n", argv[0]);
+        return 1;
+    }
+
+    lua_State *L = luaL_newstate();
+    std::vector<std::string> names;
+    std::vector<std::string> chunks;
+
+    for (int i = 2;i < argc;i++)
+    {
+        if (luaL_loadfile(L, argv[i]) != 0)
+        {
+            fprintf(stderr, "%s\n", lua_tostring(L, -1));
+            lua_close(L);
+            return 1;
+        }
+
+        std::string bytecode;
+        lua_dump(L, WriteBytecode, &bytecode);
+        lua_pop(L, 1);
+
+        names.push_back(ScriptName(argv[i]));
+        chunks.push_back(bytecode);
+    }
+    lua_close(L);
+
+    FILE *output = fopen(argv[1], "w");
+    if (output == NULL)
+    {
+        fprintf(stderr, "Cannot open file: %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(output, "// Generated by embedscripts - do not edit.\n\n");
+    fprintf(output, "#include \"EmbeddedScripts.h\"\n\n");
+    fprintf(output, "LUNARPROBE_NS_BEGIN\n\n");
+
+    for (unsigned i = 0;i < chunks.size();i++)
+    {
+        fprintf(output, "// %s\nstatic const unsigned char SCRIPT_%u[] =\n{", names[i].c_str(), i);
+        for (unsigned j = 0;j < chunks[i].size();j++)
+        {
+            fprintf(output, "%s0x%02x,", (j % 16) == 0 ? "\n    " : " ",
+                    (unsigned char)chunks[i][j]);
+        }
+        fprintf(output, "\n};\n\n");
+    }
+
+    fprintf(output, "const EmbeddedScript EMBEDDED_SCRIPTS[] =\n{\n");
+    for (unsigned i = 0;i < chunks.size();i++)
+    {
+        fprintf(output, "    { \"%s\", SCRIPT_%u, sizeof(SCRIPT_%u) },\n",
+                names[i].c_str(), i, i);
+    }
+    fprintf(output, "    { NULL, NULL, 0 }\n};\n\n");
+    fprintf(output, "LUNARPROBE_NS_END\n");
+
+    fclose(output);
+    return 0;
+}
+
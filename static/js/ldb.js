@@ -4,6 +4,10 @@ var numEvents       = -1;
 var channelStarted  = false;
 var msgCounter      = 0;
 
+// ms between heartbeats - the debugger drops clients it has not heard
+// from for 30 seconds
+var HEARTBEAT_MS    = 10000;
+
 /**
  * Handshaking is the first part of connecting to a bayeux channel.
  * With a handshake, the server will return a clientId, to identify a
@@ -26,6 +30,8 @@ function DoHandshake()
             clientId = result['clientId'];
 
             SubscribeToChannel("/ldb");
+            AnnounceOnChannel("/ldb", "subscribe");
+            setInterval(function() { AnnounceOnChannel("/ldb", "heartbeat"); }, HEARTBEAT_MS);
             /*
             SubscribeToChannel("/channel1");
             SubscribeToChannel("/channel2");
@@ -60,6 +66,22 @@ function SubscribeToChannel(channel)
     MakeAjaxRequest("POST", "/bayeux/", ChannelEventHandler, datastr, true);
 }
 
+/**
+ * Tells the debugger on a channel that this client is listening
+ * ("subscribe"), is still there ("heartbeat") or has gone
+ * ("unsubscribe") - stacks only stop at breakpoints while a client is
+ * listening.
+ */
+function AnnounceOnChannel(channel, what)
+{
+    var data = {'channel': channel,
+                'clientId': clientId};
+    data[what] = true;
+
+    var datastr = JSON.encode(data);
+    MakeAjaxRequest("POST", "/bayeux/", function(request) { }, datastr, false);
+}
+
 /**
  * Handles events sent by the server on a channel that we are subscribed to
  * (using the SubscribeToChannel method above).
@@ -88,3 +110,9 @@ function IsConnected()
     return clientId != null;
 }
 
+// let the debugger know when the page goes away
+window.onunload = function()
+{
+    if (IsConnected())
+        AnnounceOnChannel("/ldb", "unsubscribe");
+}
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include "test.h"
 
 bool processOpenCommand(const char *);
@@ -11,12 +13,14 @@ bool processStacksCommand(const char *);
 bool processLoadCommand(const char *);
 bool processAttachCommand(const char *);
 bool processDetachCommand(const char *);
+bool processCoverageCommand(const char *);
+bool processGcCommand(const char *);
 bool processQuitCommand(const char *);
 
 // Names of the commands
 const char *CMD_NAMES[] =
 {
-    "open", "close", "stacks", "stack", "load", "attach", "detach", "quit"
+    "open", "close", "stacks", "stack", "load", "attach", "detach", "coverage", "gc", "quit"
 };
 
 // The functions to handle the commands
@@ -29,6 +33,8 @@ bool (*CMD_FUNCTIONS[])(const char *) =
     processLoadCommand,
     processAttachCommand,
     processDetachCommand,
+    processCoverageCommand,
+    processGcCommand,
     processQuitCommand,
 };
 
@@ -170,6 +176,85 @@ bool processDetachCommand(const char *args)
     return true;
 }
 
+// Controls line coverage of a particular stack
+bool processCoverageCommand(const char *args)
+{
+    std::istringstream  input(args);
+    std::string         indexArg, action, path;
+
+    input >> indexArg >> action >> path;
+
+    int index = argToUint(indexArg.c_str());
+    if (index < 0 || index >= ((int)luaStacks.size()) ||
+        (action != "start" && action != "stop" && action != "clear" &&
+         action != "lcov" && action != "cobertura"))
+    {
+        fprintf(stderr, "\nUsage: coverage <stack_index> start|stop|clear|lcov [file]|cobertura [file]\n\n");
+        return true;
+    }
+
+    NamedLuaStack *pNamedStack  = luaStacks[index];
+    if (!pNamedStack->debugging)
+    {
+        fprintf(stderr, "\nStack %d is not attached.\n\n", index);
+        return true;
+    }
+
+    ClientIface *pIface = GetLPInstance()->GetClientIface();
+    if (action == "start")
+    {
+        pIface->StartCoverage(pNamedStack->pContext);
+    }
+    else if (action == "stop")
+    {
+        pIface->StopCoverage(pNamedStack->pContext);
+    }
+    else if (action == "clear")
+    {
+        pIface->ClearCoverage(pNamedStack->pContext);
+    }
+    else
+    {
+        CoverageFormat format = action == "cobertura" ? COVERAGE_COBERTURA : COVERAGE_LCOV;
+        if (path.empty())
+        {
+            pIface->WriteCoverage(pNamedStack->pContext, std::cout, format);
+        }
+        else
+        {
+            std::ofstream output(path.c_str());
+            if (!output)
+                fprintf(stderr, "\nCannot open file: %s\n\n", path.c_str());
+            else
+                pIface->WriteCoverage(pNamedStack->pContext, output, format);
+        }
+    }
+    return true;
+}
+
+// Prints the collector policy and recent cycles of a particular stack
+bool processGcCommand(const char *args)
+{
+    int index = argToUint(args);
+    if (index < 0 || index >= ((int)luaStacks.size()))
+    {
+        fprintf(stderr, "\nUsage: gc      <stack_index>\n\n");
+        return true;
+    }
+
+    GcMonitor *pMonitor = GcMonitor::FromStack(luaStacks[index]->pStack);
+    if (pMonitor == NULL)
+    {
+        fprintf(stderr, "\nStack %d is not monitored.\n\n", index);
+        return true;
+    }
+
+    std::cout << std::endl;
+    pMonitor->Write(std::cout);
+    std::cout << std::endl;
+    return true;
+}
+
 // Quits the debugger test harness
 bool processQuitCommand(const char *args)
 {
@@ -12,6 +12,8 @@ enum
     CMD_LOAD,
     CMD_ATTACH,
     CMD_DETACH,
+    CMD_COVERAGE,
+    CMD_GC,
     CMD_QUIT,
     CMD_COUNT
 };
@@ -22,6 +22,12 @@ int                             currStack   = -1;
 // The list of stacks that have been created
 std::vector<NamedLuaStack *>    luaStacks;
 
+// Whether new stacks allocate through an AllocProfiler
+bool                            profileAllocs   = false;
+
+// The collector policy of new stacks
+GcPolicy                        gcPolicy;
+
 class MyBayeuxChannel : public virtual SBayeuxChannel, public virtual SServer
 {
 public:
@@ -93,8 +99,12 @@ void prog_usage()
 {
     puts("\nUsage: options <optional preample files>");
     puts("    Options: \n");
-    puts("      -l | --lua      -   Specify folder containing the lua files.  Default: ./lua");
+    puts("      -l | --lua      -   Load the lua files from a folder instead of the ones built into the library.");
     puts("      -s | --static   -   Specify folder containing the static files (for http).  Default: ./static");
+    puts("      -a | --allocs   -   Profile the allocations of the stacks opened.  See /allocs/ (http).");
+    puts("      -g | --gc       -   Collector policy of the stacks opened: stw or incremental[:pause[:stepmul]].");
+    puts("                          Default: stw.  See /gc/ (http).");
+    puts("      -d | --shards   -   Number of debugger lua stacks the contexts are spread over.  Default: 4");
     puts("");
 }
 
@@ -107,6 +117,11 @@ void command_usage()
     puts("    stacks            -   Prints the list of stacks currently opened.");
     puts("    attach <index>    -   Enables debugging of the index-th lua stack.");
     puts("    detach <index>    -   Disables debugging of the index-th lua stack.");
+    puts("    coverage <index> start|stop|clear");
+    puts("                      -   Controls line coverage of the index-th lua stack.");
+    puts("    coverage <index> lcov|cobertura [file]");
+    puts("                      -   Writes the coverage of the index-th lua stack.");
+    puts("    gc <index>        -   Prints the collector policy and recent cycles of the index-th lua stack.");
     puts("    quit              -   Quites the test harness.");
     puts("    -----             -   Switch between cmd and lua mode - same as Ctrl-D.");
     puts("");
@@ -137,7 +152,7 @@ NamedLuaStack *GetLuaStack(const std::string &name, bool add)
         stack               = new NamedLuaStack();
         stack->debugging    = false;
         stack->name         = name;
-        stack->pStack       = LuaUtils::NewLuaStack(true, true, name.c_str());
+        stack->pStack       = LuaUtils::NewLuaStack(true, true, name.c_str(), profileAllocs, gcPolicy);
         stack->pContext     = NULL;
 
         luaStacks.push_back(stack);
@@ -257,6 +272,9 @@ void InitLunarProbe(std::string staticPath)
                     "<p>"
                     "<h2><a href='/ldb/index.html'>Lua Debugger</a></h2>"
                     "<br><h2><a href='/files/'>FileSystem</a></h2>"
+                    "<br><h2><a href='/profile/'>Profile (folded stacks)</a></h2>"
+                    "<br><h2><a href='/allocs/'>Allocations</a></h2>"
+                    "<br><h2><a href='/gc/'>Garbage Collection</a></h2>"
                     ;
             SString body    = "<hr><center>"    + links + "</center><hr>";
 
@@ -326,7 +344,7 @@ int main(int argc, char *argv[])
     char pathBuff[1024];
     char inputBuff[1024];
     char *command;
-    const char *luaPath = "./lua/";
+    const char *luaPath = NULL;
     const char *staticPath = "./static/";
     bool running = true;
     SLogger logger;
@@ -354,13 +372,40 @@ int main(int argc, char *argv[])
         {
             staticPath = argv[++argCounter];
         }
+        else if (strcmp(argv[argCounter], "--allocs") == 0 ||
+                 strcmp(argv[argCounter], "-allocs") == 0     ||
+                 strcmp(argv[argCounter], "-a") == 0)
+        {
+            profileAllocs = true;
+        }
+        else if (strcmp(argv[argCounter], "--gc") == 0 ||
+                 strcmp(argv[argCounter], "-gc") == 0     ||
+                 strcmp(argv[argCounter], "-g") == 0)
+        {
+            if (argCounter + 1 >= argc || !GcPolicy::Parse(argv[++argCounter], gcPolicy))
+            {
+                prog_usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argCounter], "--shards") == 0 ||
+                 strcmp(argv[argCounter], "-shards") == 0     ||
+                 strcmp(argv[argCounter], "-d") == 0)
+        {
+            if (argCounter + 1 >= argc || (LuaBindings::NUM_SHARDS = atoi(argv[++argCounter])) <= 0)
+            {
+                prog_usage();
+                return 1;
+            }
+        }
         else
         {
             break ;
         }
     }
 
-    LuaBindings::LUA_SRC_LOCATION = realpath(luaPath, pathBuff);
+    if (luaPath != NULL)
+        LuaBindings::LUA_SRC_LOCATION = realpath(luaPath, pathBuff);
 
     InitLunarProbe(realpath(staticPath, pathBuff));
 